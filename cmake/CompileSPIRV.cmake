@@ -0,0 +1,64 @@
+# Compile GLSL shaders to SPIR-V for the Vulkan renderer
+#
+# Sources are put together the same way the GL renderer does at runtime:
+# version header, VULKAN and the given defines, sandbox.shad, then the shader.
+# The stage comes from the extension, and the output is named after the shader
+# and its defines in order, e.g. body.frag.IS_TERRAIN.HAS_ATMO.spv
+#
+# compile_spirv(<outputs> <shader folder> <output folder> <shader> [defines...])
+# appends the SPIR-V file to the list <outputs>
+#
+# Needs glslangValidator, from the Vulkan SDK or the PATH
+
+if (CMAKE_SCRIPT_MODE_FILE)
+	# Build step, run with cmake -P
+	file(READ "${SHADER_FOLDER}/sandbox.shad" SANDBOX)
+	file(READ "${SHADER_FOLDER}/${SHADER}" SOURCE)
+	set(HEADER "#version 450 core\n#define VULKAN\n")
+	string(REPLACE "," ";" DEFINES "${DEFINES}")
+	foreach(DEFINE ${DEFINES})
+		set(HEADER "${HEADER}#define ${DEFINE}\n")
+	endforeach()
+	get_filename_component(STAGE "${SHADER}" EXT)
+	string(SUBSTRING "${STAGE}" 1 -1 STAGE)
+	file(WRITE "${OUTPUT}.glsl" "${HEADER}${SANDBOX}\n${SOURCE}")
+	execute_process(
+		COMMAND "${GLSLANG_VALIDATOR}" -V -S ${STAGE} -o "${OUTPUT}" "${OUTPUT}.glsl"
+		RESULT_VARIABLE RESULT
+		OUTPUT_VARIABLE LOG
+		ERROR_VARIABLE LOG)
+	file(REMOVE "${OUTPUT}.glsl")
+	if (NOT RESULT EQUAL 0)
+		message(FATAL_ERROR "Can't compile ${SHADER} : ${LOG}")
+	endif()
+	return()
+endif()
+
+find_program(GLSLANG_VALIDATOR glslangValidator HINTS
+	"$ENV{VULKAN_SDK}/bin"
+	"$ENV{VULKAN_SDK}/Bin")
+if (NOT GLSLANG_VALIDATOR)
+	message(FATAL_ERROR "glslangValidator not found, needed to build the Vulkan shaders")
+endif()
+
+set(COMPILE_SPIRV_SCRIPT ${CMAKE_CURRENT_LIST_FILE})
+
+function(compile_spirv OUTPUTS SHADER_FOLDER OUTPUT_FOLDER SHADER)
+	set(NAME ${SHADER})
+	foreach(DEFINE ${ARGN})
+		set(NAME "${NAME}.${DEFINE}")
+	endforeach()
+	string(REPLACE ";" "," DEFINES "${ARGN}")
+	set(OUTPUT "${OUTPUT_FOLDER}/${NAME}.spv")
+	add_custom_command(OUTPUT ${OUTPUT}
+		COMMAND ${CMAKE_COMMAND}
+			-DGLSLANG_VALIDATOR=${GLSLANG_VALIDATOR}
+			-DSHADER_FOLDER=${SHADER_FOLDER}
+			-DSHADER=${SHADER}
+			-DDEFINES=${DEFINES}
+			-DOUTPUT=${OUTPUT}
+			-P ${COMPILE_SPIRV_SCRIPT}
+		DEPENDS ${SHADER_FOLDER}/${SHADER} ${SHADER_FOLDER}/sandbox.shad
+		COMMENT "Compiling ${NAME}.spv")
+	set(${OUTPUTS} ${${OUTPUTS}} ${OUTPUT} PARENT_SCOPE)
+endfunction()
@@ -65,7 +65,9 @@ public:
     using vector = std::vector<std::shared_ptr<shaun> >;
     using iterator = vector::iterator;
     using const_iterator = vector::const_iterator;
-    
+
+    friend class parser;
+
     list();
     list(const list& l);
     list(const shaun& s);
@@ -260,6 +262,7 @@ public:
     using const_iterator = map::const_iterator;
 
     friend class sweeper;
+    friend class parser;
 
     object();
     object(const object& obj);
@@ -8,6 +8,22 @@ layout (binding = 0, std140) uniform sceneDynamicUBO
 	SceneUBO sceneUBO;
 };
 
+#if defined(MULTI_DRAW)
+layout (location = 4) flat in int passDrawId;
+
+// Same names as the bound resources of single draws
+#define planetUBO planetUBOs[passDrawId]
+#define diffuse sampler2D(bodyTextures[passDrawId].diffuseHandle)
+#define cloud sampler2D(bodyTextures[passDrawId].cloudHandle)
+#define night sampler2D(bodyTextures[passDrawId].nightHandle)
+#define specular sampler2D(bodyTextures[passDrawId].specularHandle)
+#define atmo sampler2D(bodyTextures[passDrawId].atmoHandle)
+#define ringOcclusion sampler1D(bodyTextures[passDrawId].ringOcclusionHandle)
+#define diffuseResidency sampler2D(bodyTextures[passDrawId].diffuseResidencyHandle)
+#define cloudResidency sampler2D(bodyTextures[passDrawId].cloudResidencyHandle)
+#define nightResidency sampler2D(bodyTextures[passDrawId].nightResidencyHandle)
+#define specularResidency sampler2D(bodyTextures[passDrawId].specularResidencyHandle)
+#else
 layout (binding = 1, std140) uniform planetDynamicUBO
 {
 	PlanetUBO planetUBO;
@@ -18,8 +34,6 @@ layout (binding = 3) uniform sampler2D cloud;
 layout (binding = 4) uniform sampler2D night;
 layout (binding = 5) uniform sampler2D specular;
 
-layout (location = 0) out vec4 outColor;
-
 #if defined(HAS_ATMO)
 layout (binding = 6) uniform sampler2D atmo;
 #endif
@@ -28,9 +42,64 @@ layout (binding = 6) uniform sampler2D atmo;
 layout (binding = 7) uniform sampler1D ringOcclusion;
 #endif
 
+#if defined(SPARSE_FEEDBACK)
+// Finest resident level of each texture
+layout (binding = 8) uniform sampler2D diffuseResidency;
+layout (binding = 9) uniform sampler2D cloudResidency;
+layout (binding = 10) uniform sampler2D nightResidency;
+layout (binding = 11) uniform sampler2D specularResidency;
+#endif
+#endif
+
+layout (location = 0) out vec4 outColor;
+
+#if defined(SPARSE_FEEDBACK)
+
+const ivec2 FEEDBACK_SIZE = ivec2(128, 64);
+
+// Finest level needed, for each cell of the uv plane of each body
+layout (binding = 3, std430) buffer feedbackBuffer
+{
+	uint feedback[];
+};
+
+vec4 sampleSparse(sampler2D tex, sampler2D residency, vec2 uv)
+{
+	// Scale derivatives so that no uncommitted level is sampled
+	float minLod = texture(residency, uv).r*255.0;
+	float lod = textureQueryLod(tex, uv).y;
+	float s = exp2(max(0.0, minLod-lod));
+	return textureGrad(tex, uv, dFdx(uv)*s, dFdy(uv)*s);
+}
+
+void writeFeedback(vec2 uv)
+{
+	// Texture width where one texel covers one pixel
+	vec2 dx = dFdx(uv)*vec2(1.0, 0.5);
+	vec2 dy = dFdy(uv)*vec2(1.0, 0.5);
+	float want = -log2(max(max(length(dx), length(dy)), 1e-9));
+
+	// One pixel out of 16 is enough
+	ivec2 pix = ivec2(gl_FragCoord.xy);
+	if (planetUBO.feedbackSlot < 0 || ((pix.x|pix.y)&3) != 0) return;
+	ivec2 cell = clamp(ivec2(fract(uv)*FEEDBACK_SIZE), ivec2(0), FEEDBACK_SIZE-1);
+	uint index = uint(planetUBO.feedbackSlot*FEEDBACK_SIZE.x*FEEDBACK_SIZE.y+
+		cell.y*FEEDBACK_SIZE.x+cell.x);
+	atomicMax(feedback[index], uint(clamp(ceil(want), 0.0, 30.0))+1);
+}
+
+#define SAMPLE(tex, residency, uv) sampleSparse(tex, residency, uv)
+#else
+#define SAMPLE(tex, residency, uv) texture(tex, uv)
+#endif
+
 void main()
 {
-	vec3 day = texture(diffuse, passUv).rgb;
+#if defined(SPARSE_FEEDBACK)
+	writeFeedback(passUv);
+#endif
+
+	vec3 day = SAMPLE(diffuse, diffuseResidency, passUv).rgb;
 
 	// Light calculations
 	vec3 normal = normalize(passNormal);
@@ -41,8 +110,16 @@ void main()
 
 	float lambert = clamp(max(dot(lightDir, normal), sceneUBO.ambientColor),0,1);
 
+	// Features a body doesn't have are compiled out (see HAS_* defines)
+#if defined(HAS_CLOUDS)
+	float cloudTex = SAMPLE(cloud, cloudResidency, passUv+vec2(planetUBO.cloudDisp, 0)).r;
+#else
+	const float cloudTex = 0.0;
+#endif
+
+#if defined(HAS_SPECULAR)
 	// Specular calculation
-	float spec = texture(specular, passUv).r;
+	float spec = SAMPLE(specular, specularResidency, passUv).r;
 	vec3 H = normalize(lightDir + viewDir);
 	float NdotH = clamp(dot(normal, H), 0, 1);
 
@@ -52,13 +129,19 @@ void main()
 	float specIntensity0 = hardness0 < 1 ? 0 : pow(NdotH, hardness0);
 	float specIntensity1 = hardness1 < 1 ? 0 : pow(NdotH, hardness1);
 	float specIntensity = mix(specIntensity0, specIntensity1, spec);
+	float k = mix(specIntensity, 0, cloudTex);
+#else
+	const vec3 specColor = vec3(0);
+	const float k = 0.0;
+#endif
 
-	// Clouds & night
-	float nightTex = texture(night, passUv).r * planetUBO.nightIntensity;
-	float cloudTex = texture(cloud, passUv+vec2(planetUBO.cloudDisp, 0)).r;
-
+#if defined(HAS_NIGHT)
+	float nightTex = SAMPLE(night, nightResidency, passUv).r * planetUBO.nightIntensity;
 	vec3 nightFinal = vec3(nightTex*clamp(-lambert*10+0.2,0,1)*(1-cloudTex));
-	float k = mix(specIntensity, 0, cloudTex);
+#else
+	const vec3 nightFinal = vec3(0);
+#endif
+
 	vec3 dayWithClouds = mix(day, vec3(cloudTex), cloudTex);
 
 #if !defined(IS_STAR)
@@ -1,14 +1,52 @@
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec2 inUv;
-layout(location = 2) in vec3 inNormal;
+layout(location = 2) in vec2 inNormal;
 
 layout(location = 0) out vec3 passPosition;
 layout(location = 1) out vec2 passUv;
 layout(location = 2) out vec3 passNormal;
+#if defined(MULTI_DRAW)
+layout(location = 4) flat out int passDrawId;
+#endif
+
+#if defined(IS_TERRAIN)
+#if defined(MULTI_DRAW)
+#define planetUBO planetUBOs[gl_BaseInstanceARB]
+#else
+layout (binding = 1, std140) uniform planetDynamicUBO
+{
+	PlanetUBO planetUBO;
+};
+#endif
+
+/// Patches of the bodies drawn this frame (samplers and buffers share
+/// bindings in Vulkan, 6 is the atmosphere table)
+#if defined(VULKAN)
+layout (binding = 13, std430) readonly buffer terrainBuffer
+#else
+layout (binding = 6, std430) readonly buffer terrainBuffer
+#endif
+{
+	TerrainPatch patches[];
+};
+#endif
 
 void main(void)
 {
+#if defined(IS_TERRAIN)
+	// Grid point of patch projected on the sphere
+	vec4 terrainPatch = patches[planetUBO.firstPatch + INSTANCE_ID].originSize;
+	mat3 face = CUBE_FACES[int(terrainPatch.w)];
+	vec3 center = normalize(face*vec3(terrainPatch.xy + 0.5*terrainPatch.z, 1.0));
+	passPosition = normalize(face*vec3(terrainPatch.xy + inPosition.xy*terrainPatch.z, 1.0));
+	passUv = sphereUv(passPosition, sphereUv(center, 0.5).x);
+	passNormal = passPosition;
+#else
 	passPosition = inPosition;
 	passUv = inUv;
-	passNormal = inNormal;
+	passNormal = octDecode(inNormal);
+#endif
+#if defined(MULTI_DRAW)
+	passDrawId = gl_BaseInstanceARB;
+#endif
 }
\ No newline at end of file
@@ -9,5 +9,5 @@ const vec2 pos[3] = {vec2(-1,-1),vec2(3,-1),vec2(-1,3)};
 
 void main()
 {
-	gl_Position = vec4(pos[gl_VertexID],0,1);
+	gl_Position = vec4(pos[VERTEX_ID],0,1);
 }
\ No newline at end of file
@@ -1,9 +1,13 @@
 layout (location = 0) in vec2 passUv;
 
+#if defined(IS_MINOR_BODY) || defined(IS_CULLED_FLARE)
+layout (location = 1) in vec3 passColor;
+#else
 layout (binding = 0, std140) uniform planetDynamicUBO
 {
 	PlanetUBO planetUBO;
 };
+#endif
 
 layout (binding = 1) uniform sampler2D flareTex;
 
@@ -11,7 +15,12 @@ layout (location = 0) out vec4 outColor;
 
 void main()
 {
+#if defined(IS_MINOR_BODY) || defined(IS_CULLED_FLARE)
+	vec3 color = passColor;
+#else
+	vec3 color = planetUBO.flareColor.rgb;
+#endif
 	outColor = vec4(vec3(sRGBToLinear(
-		texture(flareTex, passUv).r)*planetUBO.flareColor.rgb)
+		texture(flareTex, passUv).r)*color)
 		,1.0);
-}
\ No newline at end of file
+}
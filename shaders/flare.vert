@@ -8,15 +8,80 @@ out gl_PerVertex
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec2 inUv;
 
+#if defined(IS_MINOR_BODY)
+layout (binding = 0, std140) uniform sceneDynamicUBO
+{
+	SceneUBO sceneUBO;
+};
+
+layout (binding = 1, std140) uniform minorBodyDynamicUBO
+{
+	MinorBodyUBO minorBodyUBO;
+};
+
+layout (binding = 1, std430) readonly buffer minorBodyPositions
+{
+	vec4 positions[];
+};
+
+layout (location = 1) out vec3 passColor;
+
+/// Below this brightness the flare isn't rasterized at all
+const float MIN_BRIGHTNESS = 1e-4;
+#elif defined(IS_CULLED_FLARE)
+layout (binding = 2, std430) readonly buffer flareInstances
+{
+	FlareInstance instances[];
+};
+
+layout (location = 1) out vec3 passColor;
+#else
 layout (binding = 0, std140) uniform planetDynamicUBO
 {
 	PlanetUBO planetUBO;
 };
 
+/// Written by sun_occlusion.comp
+layout (binding = 3, std430) readonly buffer sunVisibilityBuffer
+{
+	float sunVisibility;
+};
+#endif
+
 layout (location = 0) out vec2 passUv;
 
 void main()
 {
 	passUv = inUv;
-	gl_Position = planetUBO.flareMat*vec4(inPosition, 1);
-}
\ No newline at end of file
+#if defined(IS_MINOR_BODY)
+	vec4 body = positions[INSTANCE_ID];
+	vec3 bodyPos = minorBodyUBO.parentPos.xyz + body.xyz;
+	vec4 clip = sceneUBO.projMat*sceneUBO.viewMat*vec4(bodyPos, 1.0);
+
+	// Same brightness as entity flares, the light being at the origin
+	float dist = length(bodyPos);
+	vec3 lightToBody = minorBodyUBO.parentWorldPos.xyz + body.xyz;
+	float phaseAngle = acos(clamp(dot(normalize(lightToBody), bodyPos/dist), -1.0, 1.0));
+	float phase = (1-phaseAngle/PI)*cos(phaseAngle) + (1/PI)*sin(phaseAngle);
+	float cutDist = dist*0.00008;
+	float brightness = clamp(20.0*body.w*body.w*phase/(cutDist*cutDist), 0.0, 10.0);
+	passColor = brightness*minorBodyUBO.color.rgb;
+
+	if (clip.w <= 0 || brightness < MIN_BRIGHTNESS)
+	{
+		// Outside of clip volume
+		gl_Position = vec4(2.0, 2.0, 2.0, 1.0);
+		return;
+	}
+	gl_Position = vec4(
+		clip.xy/clip.w + inPosition.xy*minorBodyUBO.flareSize, 0.999, 1.0);
+#elif defined(IS_CULLED_FLARE)
+	// Visible flares written by flare_cull.comp
+	FlareInstance flare = instances[INSTANCE_ID];
+	passColor = flare.color.rgb;
+	gl_Position = vec4(flare.position.xy + inPosition.xy*flare.position.zw, 0.999, 1.0);
+#else
+	// Sun flare, shrinks as the sun gets occluded
+	gl_Position = planetUBO.flareMat*vec4(sunVisibility*inPosition, 1);
+#endif
+}
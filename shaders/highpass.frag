@@ -18,7 +18,8 @@ void main()
 	const int SAMPLES = textureSamples(hdr);
 	const float SAMPLES_MUL = 1.0/float(SAMPLES);
 
-	const ivec2 coord = ivec2(gl_FragCoord.xy);
+	// Bloom is full size even when the HDR pass isn't
+	const ivec2 coord = ivec2(gl_FragCoord.xy*sceneUBO.renderScale);
 
 	vec3 sum = vec3(0);
 	for (int i=0;i<SAMPLES;++i)
@@ -12,14 +12,12 @@ vec3 reinhard(vec3 color)
 	return color/(vec3(1)+color);
 }
 
-void main()
+/// Tonemaps each sample of a HDR pixel and averages them
+vec3 resolve(ivec2 coord)
 {
 	const int SAMPLES = textureSamples(hdr);
 	const float SAMPLES_MUL = 1.0/float(SAMPLES);
 
-	ivec2 coord = ivec2(gl_FragCoord.xy);
-	vec2 texCoord = coord/vec2(textureSize(hdr));
-
 	vec3 sum = vec3(0);
 	for (int i=0;i<SAMPLES;++i)
 	{
@@ -27,8 +25,34 @@ void main()
 		// tonemap
 		sum += reinhard(color);
 	}
+	return sum*SAMPLES_MUL;
+}
+
+void main()
+{
+	ivec2 coord = ivec2(gl_FragCoord.xy);
+	vec2 texCoord = coord/vec2(textureSize(hdr));
+
+	vec3 finalColor;
+	if (sceneUBO.renderScale == vec2(1))
+	{
+		finalColor = resolve(coord);
+	}
+	else
+	{
+		// Bilinear upscale of the part rendered to by the HDR pass
+		const ivec2 maxCoord = ivec2(vec2(textureSize(hdr))*sceneUBO.renderScale+0.5)-1;
+		const vec2 pos = gl_FragCoord.xy*sceneUBO.renderScale-0.5;
+		const ivec2 base = ivec2(floor(pos));
+		const vec2 f = pos-vec2(base);
+		const ivec2 c0 = clamp(base, ivec2(0), maxCoord);
+		const ivec2 c1 = clamp(base+1, ivec2(0), maxCoord);
+		finalColor = mix(
+			mix(resolve(ivec2(c0.x, c0.y)), resolve(ivec2(c1.x, c0.y)), f.x),
+			mix(resolve(ivec2(c0.x, c1.y)), resolve(ivec2(c1.x, c1.y)), f.x),
+			f.y);
+	}
 	vec3 bloom = texture(bloom, texCoord).rgb;
-	vec3 finalColor = sum*SAMPLES_MUL;
 #if defined(USE_BLOOM)
 	finalColor += bloom;
 #endif
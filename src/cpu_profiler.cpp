@@ -0,0 +1,132 @@
+#include "cpu_profiler.hpp"
+
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+using namespace std;
+
+/// Events kept per thread
+static const size_t THREAD_EVENTS = 16384;
+
+namespace
+{
+struct Event
+{
+	const char *name;
+	uint64_t start;
+	uint64_t end;
+};
+
+/// Events of a thread, written by that thread only
+struct ThreadEvents
+{
+	string name;
+	/// Number of events written since the start, the last ones are in events
+	atomic<uint64_t> count{0};
+	vector<Event> events = vector<Event>(THREAD_EVENTS);
+	/// Running timers
+	vector<pair<const char*, uint64_t>> running;
+};
+
+/// Rings of all threads, kept after threads end so that they can be exported
+struct Registry
+{
+	mutex mtx;
+	vector<unique_ptr<ThreadEvents>> threads;
+};
+
+Registry &getRegistry()
+{
+	static Registry registry;
+	return registry;
+}
+
+ThreadEvents &getThreadEvents()
+{
+	thread_local ThreadEvents *events = nullptr;
+	if (!events)
+	{
+		Registry &registry = getRegistry();
+		lock_guard<mutex> lk(registry.mtx);
+		registry.threads.emplace_back(new ThreadEvents());
+		events = registry.threads.back().get();
+		events->name = "Thread "+to_string(registry.threads.size());
+	}
+	return *events;
+}
+}
+
+CPUProfiler::Scope::Scope(const char *name)
+{
+	begin(name);
+}
+
+CPUProfiler::Scope::~Scope()
+{
+	end();
+}
+
+void CPUProfiler::begin(const char *name)
+{
+	getThreadEvents().running.push_back({name, now()});
+}
+
+void CPUProfiler::end()
+{
+	ThreadEvents &t = getThreadEvents();
+	const auto timer = t.running.back();
+	t.running.pop_back();
+	const uint64_t count = t.count.load(memory_order_relaxed);
+	t.events[count%THREAD_EVENTS] = {timer.first, timer.second, now()};
+	t.count.store(count+1, memory_order_release);
+}
+
+uint64_t CPUProfiler::now()
+{
+	return chrono::duration_cast<chrono::nanoseconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void CPUProfiler::setThreadName(const string &name)
+{
+	ThreadEvents &t = getThreadEvents();
+	lock_guard<mutex> lk(getRegistry().mtx);
+	t.name = name;
+}
+
+void CPUProfiler::writeTraceEvents(ostream &out, const uint64_t since)
+{
+	Registry &registry = getRegistry();
+	lock_guard<mutex> lk(registry.mtx);
+	for (size_t tid=0;tid<registry.threads.size();++tid)
+	{
+		const ThreadEvents &t = *registry.threads[tid];
+		// GPU events are on thread 0
+		out << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": " << tid+1
+			<< ", \"args\": {\"name\": \"" << t.name << "\"}}";
+
+		// Copy first, then drop events the thread may have overwritten meanwhile
+		const uint64_t end = t.count.load(memory_order_acquire);
+		const uint64_t begin = (end>THREAD_EVENTS)?end-THREAD_EVENTS:0;
+		vector<Event> events;
+		events.reserve(end-begin);
+		for (uint64_t i=begin;i<end;++i) events.push_back(t.events[i%THREAD_EVENTS]);
+		// The copy must be done before the count is read again
+		atomic_thread_fence(memory_order_acquire);
+		const uint64_t newEnd = t.count.load(memory_order_relaxed);
+		// Event newEnd may be being written, in the slot of newEnd-THREAD_EVENTS
+		const uint64_t overwritten = (newEnd+1>THREAD_EVENTS)?newEnd+1-THREAD_EVENTS:0;
+
+		for (uint64_t i=std::max(begin, overwritten);i<end;++i)
+		{
+			const Event &e = events[i-begin];
+			if (e.end < since) continue;
+			out << ",\n  {\"name\": \"" << e.name
+				<< "\", \"cat\": \"cpu\", \"ph\": \"X\", \"pid\": 0, \"tid\": " << tid+1
+				<< ", \"ts\": " << ((int64_t)e.start-(int64_t)since)/1000.0 << ", \"dur\": " << (e.end-e.start)/1000.0 << "}";
+		}
+	}
+}
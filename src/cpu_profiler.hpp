@@ -0,0 +1,47 @@
+#pragma once
+
+#include <string>
+#include <ostream>
+#include <cstdint>
+
+/**
+ * Measures time intervals on the CPU, on any thread
+ *
+ * Each thread records its scopes into its own ring of events, written without
+ * locks and overwritten once full, so that timing the hot paths costs two
+ * clock reads. Rings are only locked to be registered, the first time a
+ * thread records, and while exporting. Times are on a monotonic clock shared
+ * with the GPU profilers once converted, so both end up in the same trace.
+ */
+class CPUProfiler
+{
+public:
+	/// Measures the time until destruction
+	class Scope
+	{
+	public:
+		/// @param name name of label, must outlive the profiler (string literal)
+		explicit Scope(const char *name);
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+		~Scope();
+	};
+
+	/** Starts a timer on the calling thread, nested in its timers still running
+	 * @param name name of label, must outlive the profiler (string literal)
+	 */
+	static void begin(const char *name);
+	/// Stops the last timer started on the calling thread
+	static void end();
+	/// Returns the current time in ns
+	static uint64_t now();
+	/// Names the calling thread in traces
+	static void setThreadName(const std::string &name);
+	/**
+	 * Writes events of all threads ending after a time as Chrome trace
+	 * events, each one preceded by a comma
+	 * @param out stream to write to
+	 * @param since time in ns, origin of event times
+	 */
+	static void writeTraceEvents(std::ostream &out, uint64_t since);
+};
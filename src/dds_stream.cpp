@@ -1,9 +1,8 @@
 #include "dds_stream.hpp"
 
 #include "gl_util.hpp"
-
-#include <SHAUN/sweeper.hpp>
-#include <SHAUN/parser.hpp>
+#include "cpu_profiler.hpp"
+#include "texture_info.hpp"
 
 #include <iostream>
 #include <fstream>
@@ -11,16 +10,21 @@
 #include <cmath>
 #include <limits>
 
+#include <glm/gtc/constants.hpp>
+
 using namespace std;
 
-void DDSStreamer::init(bool asynchronous, int pageSize, int numPages, int maxSize)
+void DDSStreamer::init(bool asynchronous, size_t stagingSize, int maxSize,
+	int threads, size_t budget, bool sparse)
 {
 	_asynchronous = asynchronous;
+	_budget = budget;
+	_rateStart = chrono::steady_clock::now();
+	// Tiles are streamed on demand, needs asynchronous loading
+	_sparse = sparse && asynchronous && GLEW_ARB_sparse_texture;
 	_maxSize = (maxSize>0)?maxSize:numeric_limits<int>::max();
 
-	_pageSize = pageSize;
-	_numPages = numPages;
-	int pboSize = pageSize*numPages;
+	const size_t pboSize = stagingSize;
 	glCreateBuffers(1, &_pbo);
 	GLbitfield storageFlags = GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT;
 #ifdef USE_COHERENT_MAPPING
@@ -34,35 +38,79 @@ void DDSStreamer::init(bool asynchronous, int pageSize, int numPages, int maxSiz
 	_pboPtr = glMapNamedBufferRange(
 		_pbo, 0, pboSize, mapFlags);
 
-	_usedPages.resize(numPages, false);
-	_pageFences.resize(numPages);
+	// Offsets aligned for mapped range flushes
+	const size_t alignment = 256;
+	_staging = RingAllocator(pboSize, alignment);
 
 	// Don't need threading if synchronous
 	if (!_asynchronous) return;
 
-	_t = thread([this]{
-		while (true)
+	if (threads <= 0)
+	{
+		// Leave some cores to rendering
+		threads = std::min(std::max((int)thread::hardware_concurrency()/2, 1), 8);
+	}
+
+	for (int i=0;i<threads;++i)
+		_loadInfoQueues.emplace_back(new WorkerQueue());
+	for (int i=0;i<threads;++i)
+		_threads.emplace_back(&DDSStreamer::work, this, i);
+}
+
+void DDSStreamer::work(const int worker)
+{
+	CPUProfiler::setThreadName("DDS loader "+to_string(worker));
+	while (true)
+	{
+		LoadInfo info{};
+		if (!popJob(worker, info))
 		{
-			LoadInfo info{};
-			{
-				unique_lock<mutex> lk(_mtx);
-				_cond.wait(lk, [this]{ return _killThread || !_loadInfoQueue.empty();});
-				if (_killThread) return;
-				info = _loadInfoQueue[0];
-				_loadInfoQueue.erase(_loadInfoQueue.begin());
-			}
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [this]{ return _killThread || _queuedJobs > 0;});
+			if (_killThread) return;
+			continue;
+		}
 
-			// Use this to simulate slow load times (debug purposes)
-			//this_thread::sleep_for(chrono::milliseconds(200));
+		// Use this to simulate slow load times (debug purposes)
+		//this_thread::sleep_for(chrono::milliseconds(200));
 
-			LoadData data = load(info);
+		CPUProfiler::Scope scope("Tile load");
+		LoadData data = load(info);
 
-			{
-				lock_guard<mutex> lk(_dataMtx);
-				_loadData.push_back(data);
-			}
+		{
+			lock_guard<mutex> lk(_dataMtx);
+			_loadData.push_back(data);
 		}
-	});
+	}
+}
+
+bool DDSStreamer::popJob(const int worker, LoadInfo &info)
+{
+	const int queues = _loadInfoQueues.size();
+	// Own queue first, then steal from the others
+	for (int i=0;i<queues;++i)
+	{
+		WorkerQueue &queue = *_loadInfoQueues[(worker+i)%queues];
+		lock_guard<mutex> lk(queue.mtx);
+		if (queue.heap.empty()) continue;
+		pop_heap(queue.heap.begin(), queue.heap.end());
+		info = queue.heap.back();
+		queue.heap.pop_back();
+		{
+			lock_guard<mutex> lk(_mtx);
+			--_queuedJobs;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool DDSStreamer::LoadInfo::operator<(const LoadInfo &info) const
+{
+	if (priority != info.priority) return priority < info.priority;
+	// Same priority : first created first
+	if (handle != info.handle) return handle > info.handle;
+	return tileId > info.tileId;
 }
 
 DDSStreamer::~DDSStreamer()
@@ -73,156 +121,212 @@ DDSStreamer::~DDSStreamer()
 		glDeleteBuffers(1, &_pbo);
 	}
 
-	if (_t.joinable())
+	if (!_threads.empty())
 	{
 		{
 			lock_guard<mutex> lk(_mtx);
 			_killThread = true;
 		}
-		_cond.notify_one();
-		_t.join();
+		_cond.notify_all();
+		for (auto &t : _threads)
+			t.join();
 	}
 }
 
-struct TexInfo
+void DDSStreamer::setTileBounds(LoadInfo &info, const int tileWidth) const
 {
-	int size = 0;
-	int levels = 0;
-	string prefix = "";
-	string separator = "";
-	string suffix = "";
-	bool rowColumnOrder = false;
-};
+	// Equirectangular mapping, u along longitude, v from north to south pole
+	const float pi = glm::pi<float>();
+	const float size = tileWidth/(float)info.levelWidth;
+	const float u = info.offsetX/(float)info.levelWidth + size*0.5f;
+	const float v = 2*info.offsetY/(float)info.levelWidth + size;
+	const float theta = 2*pi*u;
+	const float phi = pi*(0.5f-v);
+	info.direction = glm::vec3(cos(phi)*cos(theta), cos(phi)*sin(theta), sin(phi));
+	// Half diagonal (longitude span 2*pi*size, latitude span 2*pi*size)
+	info.angularRadius = std::min(pi, pi*size*sqrt(2.f));
+}
 
-TexInfo parseInfoFile(const string &filename, int maxSize)
+float DDSStreamer::computePriority(const LoadInfo &info) const
 {
-	try
-	{
-		shaun::object obj = shaun::parse_file(filename);
-		shaun::sweeper swp(obj);
+	auto it = _importance.find(info.handle);
+	// Unknown view: coarsest first
+	if (it == _importance.end()) return info.level;
 
-		TexInfo info{};
-		info.size = swp("size").value<shaun::number>();
-		info.levels = swp("levels").value<shaun::number>();
-		string prefix = swp("prefix").value<shaun::string>();
-		string separator = swp("separator").value<shaun::string>();
-		string suffix = swp("suffix").value<shaun::string>();
-		info.prefix = prefix;
-		info.separator = separator;
-		info.suffix = suffix;
-		info.rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
+	const Importance &imp = it->second;
 
-		int maxRows = maxSize/(info.size*2);
-		int maxLevel = (int)floor(log2(maxRows))+1;
-		info.levels = max(1,min(info.levels, maxLevel));
-		return info;
-	} 
-	catch (shaun::parse_error &e)
-	{
-		cout << e << endl;
-		return {};
-	}
-}
+	// Closest angle between the tile and the view direction
+	const float angle = acos(glm::clamp(glm::dot(info.direction, imp.viewDir), -1.f, 1.f));
+	const float facing = cos(std::max(0.f, angle-info.angularRadius));
 
-int DDSStreamer::getPageSpan(int size)
-{
-	return ((size-1)/_pageSize)+1;
+	// Half the circumference shows on the screen diameter, anything with
+	// more than twice the displayed texel density can wait
+	const float usefulWidth = 2*glm::pi<float>()*imp.screenSize;
+	const bool useful = info.levelWidth <= usefulWidth*2;
+	const int tier = (!useful)?0:((facing <= 0)?1:2);
+
+	// By tier, then coarsest first, then most facing
+	return tier*100 + info.level*2 + facing;
 }
 
-DDSStreamer::Handle DDSStreamer::createTex(const string &filename)
+bool DDSStreamer::openSource(const string &filename, TexSource &src)
 {
-	// Get info file
-	TexInfo info = parseInfoFile(filename + "/info.sn", _maxSize);
+	src.filename = filename;
+
+	// Tile archive if it has been packed, info file otherwise
+	const string archiveFile = filename + ".rtex";
+	if (ifstream(archiveFile))
+	{
+		try
+		{
+			src.archive = make_shared<TileArchive>(archiveFile);
+		}
+		catch (const runtime_error &e)
+		{
+			cerr << e.what() << endl;
+			return false;
+		}
+		src.size = src.archive->getTileSize();
+		src.levels = clampLevels(src.archive->getLevels(), src.size, _maxSize);
+	}
+	else
+	{
+		TexInfo info = parseInfoFile(filename + "/info.sn", _maxSize);
+		src.size = info.size;
+		src.levels = info.levels;
+		src.prefix = info.prefix;
+		src.separator = info.separator;
+		src.suffix = info.suffix;
+		src.rowColumnOrder = info.rowColumnOrder;
+	}
 
 	// Check if file exists or is valid
-	if (info.levels == 0) return 0;
+	if (src.levels == 0) return false;
 
-	const string tailFile = "/level0/" + info.prefix + "0" + info.separator + "0" + info.suffix;
+	// Tail loader, the only file opened here; all tiles share its format
+	src.format = src.archive?src.archive->getFormat():
+		DDSLoader(getTileFilename(src, 0, 0, 0)).getFormat();
 
-	// Tail loader
-	DDSLoader tailLoader = DDSLoader(filename+tailFile);
+	// Tiles go through the staging buffer in one piece
+	const size_t tileSize = DDSLoader::computeImageSize(src.format, src.size, src.size);
+	if (tileSize > _staging.getMaxSize())
+	{
+		cerr << "Can't stream " << filename << " : tiles of " << tileSize <<
+			" bytes don't fit in the " << _staging.getCapacity() <<
+			" bytes staging buffer" << endl;
+		return false;
+	}
 
 	// Storage params
-	const int width = min(_maxSize,info.size<<(info.levels-1));
-	const int height = width/2;
-	const GLenum format = DDSFormatToGL(tailLoader.getFormat());
-	const int mipNumber = mipmapCount(width);
-
-	// Gen jobs
-	vector<LoadInfo> jobs;
+	src.width = min(_maxSize,src.size<<(src.levels-1));
+	src.height = src.width/2;
+	src.mipNumber = mipmapCount(src.width);
+	return true;
+}
 
-	// Gen texture & sampler
-	const Handle h = genHandle();
-	GLuint texId;
-	glCreateTextures(GL_TEXTURE_2D, 1, &texId);
-	glTextureStorage2D(texId, mipNumber, format, width, height);
+string DDSStreamer::getTileFilename(const TexSource &src, 
+	const int level, const int x, const int y)
+{
+	return src.filename + "/level" + to_string(level) + "/" +
+		src.prefix+
+		to_string(src.rowColumnOrder?y:x)+
+		src.separator+
+		to_string(src.rowColumnOrder?x:y)+
+		src.suffix;
+}
 
-	_texs.insert(make_pair(h, StreamTexture(texId)));
+vector<DDSStreamer::LoadInfo> DDSStreamer::genJobs(const Handle h, 
+	const TexSource &src, const int minLevel, const int maxLevel)
+{
+	vector<LoadInfo> jobs;
 
 	// Unique for each tile
 	int tileId = 0;
 
 	// Tail mipmaps (level0)
-	const int tailMipsFile = mipmapCount(info.size);
-	const int tailMips = mipmapCount(min(_maxSize, info.size));
+	const string tailFile = getTileFilename(src, 0, 0, 0);
+	const int tailMipsFile = mipmapCount(src.size);
+	const int tailMips = mipmapCount(min(_maxSize, src.size));
 	const int skipMips = tailMipsFile-tailMips;
 	for (int i=tailMips-1;i>=0;--i)
 	{
 		LoadInfo tailInfo{};
 		tailInfo.handle = h;
-		tailInfo.loader = tailLoader;
+		tailInfo.filename = tailFile;
+		tailInfo.archive = src.archive;
 		tailInfo.fileLevel = i+skipMips;
 		tailInfo.offsetX = 0;
 		tailInfo.offsetY = 0;
-		tailInfo.level = info.levels-1+i;
-		tailInfo.imageSize = tailLoader.getImageSize(tailInfo.fileLevel);
+		tailInfo.level = src.levels-1+i;
+		if (tailInfo.level >= maxLevel || tailInfo.level < minLevel) continue;
+		// Tail file is size x size/2
+		tailInfo.imageSize = DDSLoader::computeImageSize(src.format, 
+			std::max(1, src.size>>tailInfo.fileLevel), 
+			std::max(1, (src.size/2)>>tailInfo.fileLevel));
 		tailInfo.tileId = tileId;
+		tailInfo.levelWidth = std::max(1, src.width>>tailInfo.level);
+		// Covers the whole sphere
+		tailInfo.direction = glm::vec3(0,0,1);
+		tailInfo.angularRadius = glm::pi<float>();
+		tailInfo.priority = computePriority(tailInfo);
 		jobs.push_back(tailInfo);
 		tileId += 1;
 	}
 
-	for (int i=1;i<info.levels;++i)
+	for (int i=1;i<src.levels;++i)
 	{
-		const string levelFolder = filename + "/level" + to_string(i) + "/";
 		const int rows = 1<<(i-1);
 		const int columns = 2*rows;
-		const int level = info.levels-i-1;
+		const int level = src.levels-i-1;
+		if (level >= maxLevel || level < minLevel) continue;
 
 		for (int x=0;x<columns;++x)
 		{
 			for (int y=0;y<rows;++y)
 			{
-				const string ddsFile = 
-					info.prefix+
-					to_string(info.rowColumnOrder?y:x)+
-					info.separator+
-					to_string(info.rowColumnOrder?x:y)+
-					info.suffix;
-				const string fullFilename = levelFolder+ddsFile;
-				const DDSLoader loader(fullFilename);
-				const int fileLevel = 0;
-				const int imageSize = loader.getImageSize(fileLevel);
-
-				LoadInfo loadInfo{};
-				loadInfo.handle = h;
-				loadInfo.loader = std::move(loader);
-				loadInfo.fileLevel = fileLevel;
-				loadInfo.offsetX = x*info.size;
-				loadInfo.offsetY = y*info.size;
-				loadInfo.level = level;
-				loadInfo.imageSize = imageSize;
+				LoadInfo loadInfo = genTileJob(h, src, i, x, y);
 				loadInfo.tileId = tileId;
 				jobs.push_back(loadInfo);
 				tileId += 1;
 			}
 		}
 	}
+	return jobs;
+}
+
+DDSStreamer::LoadInfo DDSStreamer::genTileJob(const Handle h, 
+	const TexSource &src, const int i, const int x, const int y)
+{
+	const int level = src.levels-i-1;
+	LoadInfo loadInfo{};
+	loadInfo.handle = h;
+	loadInfo.filename = getTileFilename(src, i, x, y);
+	loadInfo.archive = src.archive;
+	loadInfo.archiveTile = TileArchive::getTileIndex(i, x, y);
+	loadInfo.fileLevel = 0;
+	loadInfo.offsetX = x*src.size;
+	loadInfo.offsetY = y*src.size;
+	loadInfo.level = level;
+	loadInfo.imageSize = 
+		DDSLoader::computeImageSize(src.format, src.size, src.size);
+	loadInfo.levelWidth = src.width>>level;
+	setTileBounds(loadInfo, src.size);
+	loadInfo.priority = computePriority(loadInfo);
+	return loadInfo;
+}
 
-	_tileUpdated.insert(make_pair(h, vector<bool>(tileId, false)));
+void DDSStreamer::submitJobs(const Handle h, const vector<LoadInfo> &jobs)
+{
+	_tileUpdated[h] = vector<bool>(jobs.size(), false);
 
 	if (_asynchronous)
 	{
-		_loadInfoWaiting.insert(_loadInfoWaiting.end(), jobs.begin(), jobs.end());
+		const auto now = chrono::steady_clock::now();
+		for (auto info : jobs)
+		{
+			info.requestTime = now;
+			_loadInfoWaiting.push_back(info);
+		}
 	}
 	else
 	{
@@ -230,23 +334,430 @@ DDSStreamer::Handle DDSStreamer::createTex(const string &filename)
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
 		for (auto info : jobs)
 		{
-			while (info.pageOffset == -1)
+			info.requestTime = chrono::steady_clock::now();
+			while (!acquireRange(info))
 			{
-				auto fencesSignaled = areFencesSignaled();
-				info.pageOffset = acquirePages(getPageSpan(info.imageSize), fencesSignaled);
+				// Wait for the GL to be done with older uploads
+				submitBatch();
+				retireBatches(true);
 			}
 			LoadData d =  load(info);
 			updateTile(d);
-			releasePages(info.pageOffset, getPageSpan(info.imageSize));
 		}
 		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		submitBatch();
+		_tileUpdated.erase(h);
+		_texLastBatch.erase(h);
 		_texs[h].setComplete();
+		_texs[h].setView(0);
+		++_generation;
 	}
+}
+
+DDSStreamer::Handle DDSStreamer::createTex(const string &filename)
+{
+	// Released texture still resident
+	for (auto &p : _residency)
+	{
+		if (p.second.released && p.second.source.filename == filename)
+		{
+			reviveTex(p.first);
+			return p.first;
+		}
+	}
+
+	TexSource src;
+	if (!openSource(filename, src)) return 0;
+	src.sparse = canBeSparse(src);
+
+	// Gen texture & sampler
+	const Handle h = genHandle();
+	GLuint texId;
+	glCreateTextures(GL_TEXTURE_2D, 1, &texId);
+	if (src.sparse)
+	{
+		glTextureParameteri(texId, GL_TEXTURE_SPARSE_ARB, GL_TRUE);
+		glTextureParameteri(texId, GL_VIRTUAL_PAGE_SIZE_INDEX_ARB, 0);
+	}
+	glTextureStorage2D(texId, src.mipNumber, DDSFormatToGL(src.format), 
+		src.width, src.height);
+
+	_texs.insert(make_pair(h, StreamTexture(texId)));
+	Residency residency{};
+	residency.source = src;
+	residency.lastUsed = _frame;
+
+	const int tailLevel = src.levels-1;
+	if (src.sparse)
+	{
+		// Tail is always resident
+		for (int l=tailLevel;l<src.mipNumber;++l)
+		{
+			commitPages(texId, l, 0, 0, 
+				std::max(1, src.width>>l), std::max(1, src.height>>l), true);
+		}
+		const int tileCount = TileArchive::getTileCount(src.levels);
+		residency.tiles.resize(tileCount, TileState::UNCOMMITTED);
+		residency.tileLastUsed.resize(tileCount, 0);
+
+		// One texel per finest tile
+		const int columns = 1<<tailLevel;
+		const int rows = std::max(1, columns/2);
+		residency.residencyMap.resize(columns*rows, tailLevel);
+		glCreateTextures(GL_TEXTURE_2D, 1, &residency.residencyTex);
+		glTextureStorage2D(residency.residencyTex, 1, GL_R8, columns, rows);
+		glTextureParameteri(residency.residencyTex, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTextureParameteri(residency.residencyTex, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTextureParameteri(residency.residencyTex, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTextureParameteri(residency.residencyTex, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		residency.residencyChanged = true;
+	}
+	_residency.insert(make_pair(h, residency));
+
+	// Sparse textures only get their tail now
+	submitJobs(h, genJobs(h, src, src.sparse?tailLevel:0, src.mipNumber));
 
 	return h;
 }
 
+void DDSStreamer::reviveTex(const Handle h)
+{
+	Residency &r = _residency[h];
+	r.released = false;
+	r.lastUsed = _frame;
+	// Sparse tiles come back with feedback
+	if (r.residentLevel == 0 || r.source.sparse) return;
+
+	// Get back full storage and only stream the levels that were dropped,
+	// sampling a view of the resident ones in the meantime (texture state 
+	// is left untouched so bindless handles stay valid)
+	const int resident = r.residentLevel;
+	setResidentLevel(h, 0);
+	GLuint view;
+	glGenTextures(1, &view);
+	glTextureView(view, GL_TEXTURE_2D, _texs[h].getTextureId(), 
+		DDSFormatToGL(r.source.format), resident, r.source.mipNumber-resident, 0, 1);
+	_texs[h].setView(view);
+	submitJobs(h, genJobs(h, r.source, 0, resident));
+}
 
+void DDSStreamer::setResidentLevel(const Handle h, const int level)
+{
+	Residency &r = _residency[h];
+	const TexSource &src = r.source;
+	StreamTexture &tex = _texs[h];
+
+	GLuint texId;
+	glCreateTextures(GL_TEXTURE_2D, 1, &texId);
+	glTextureStorage2D(texId, src.mipNumber-level, DDSFormatToGL(src.format), 
+		std::max(1, src.width>>level), std::max(1, src.height>>level));
+
+	// Copy levels resident in both textures
+	for (int l=std::max(level, r.residentLevel);l<src.mipNumber;++l)
+	{
+		glCopyImageSubData(
+			tex.getTextureId(), GL_TEXTURE_2D, l-r.residentLevel, 0, 0, 0,
+			texId, GL_TEXTURE_2D, l-level, 0, 0, 0,
+			std::max(1, src.width>>l), std::max(1, src.height>>l), 1);
+	}
+
+	StreamTexture newTex(texId);
+	if (tex.isComplete()) newTex.setComplete();
+	tex = std::move(newTex);
+	r.residentLevel = level;
+	++_generation;
+}
+
+size_t DDSStreamer::getResidentSize(const Residency &r)
+{
+	size_t size = 0;
+	if (r.source.sparse)
+	{
+		// Committed tiles and tail
+		const size_t tileSize = DDSLoader::computeImageSize(
+			r.source.format, r.source.size, r.source.size);
+		for (const TileState state : r.tiles)
+			if (state != TileState::UNCOMMITTED) size += tileSize;
+		for (int l=r.source.levels-1;l<r.source.mipNumber;++l)
+			size += getLevelSize(r.source, l);
+		return size;
+	}
+	for (int l=r.residentLevel;l<r.source.mipNumber;++l)
+		size += getLevelSize(r.source, l);
+	return size;
+}
+
+size_t DDSStreamer::getLevelSize(const TexSource &src, const int level)
+{
+	return DDSLoader::computeImageSize(src.format, 
+		std::max(1, src.width>>level), std::max(1, src.height>>level));
+}
+
+void DDSStreamer::evictTextures()
+{
+	if (_budget == 0) return;
+
+	size_t total = 0;
+	for (const auto &p : _residency) total += getResidentSize(p.second);
+
+	while (total > _budget)
+	{
+		// Least recently released texture
+		auto lru = _residency.end();
+		for (auto it=_residency.begin();it!=_residency.end();++it)
+		{
+			if (it->second.released && 
+				(lru == _residency.end() || it->second.lastUsed < lru->second.lastUsed))
+				lru = it;
+		}
+		// Textures in use are never evicted
+		if (lru == _residency.end()) break;
+
+		const Handle h = lru->first;
+		Residency &r = lru->second;
+
+		if (r.source.sparse)
+		{
+			// Decommit all tiles but the tail
+			total -= getResidentSize(r);
+			updateSparseTiles(h, r, true);
+			total += getResidentSize(r);
+			if (total > _budget)
+			{
+				total -= getResidentSize(r);
+				eraseTex(h);
+			}
+			continue;
+		}
+
+		// Drop finest levels down to the tail
+		const int tailLevel = r.source.levels-1;
+		int level = r.residentLevel;
+		while (total > _budget && level < tailLevel)
+		{
+			total -= getLevelSize(r.source, level);
+			++level;
+		}
+		if (level != r.residentLevel) setResidentLevel(h, level);
+
+		if (total > _budget)
+		{
+			// Not enough, evict whole texture
+			total -= getResidentSize(r);
+			eraseTex(h);
+		}
+	}
+}
+
+void DDSStreamer::eraseTex(const Handle h)
+{
+	auto it = _residency.find(h);
+	if (it != _residency.end())
+	{
+		if (it->second.residencyTex) 
+			glDeleteTextures(1, &it->second.residencyTex);
+		_residency.erase(it);
+	}
+	_texDeleted.push_back(h);
+	_importance.erase(h);
+	_tileUpdated.erase(h);
+	_texLastBatch.erase(h);
+	_texs.erase(h);
+	++_generation;
+}
+
+bool DDSStreamer::canBeSparse(const TexSource &src) const
+{
+	if (!_sparse || src.levels < 2) return false;
+	const GLenum format = DDSFormatToGL(src.format);
+	GLint pageCount = 0;
+	glGetInternalformativ(GL_TEXTURE_2D, format, GL_NUM_VIRTUAL_PAGE_SIZES_ARB,
+		1, &pageCount);
+	if (pageCount <= 0) return false;
+	GLint pageX = 0, pageY = 0;
+	glGetInternalformativ(GL_TEXTURE_2D, format, GL_VIRTUAL_PAGE_SIZE_X_ARB,
+		1, &pageX);
+	glGetInternalformativ(GL_TEXTURE_2D, format, GL_VIRTUAL_PAGE_SIZE_Y_ARB,
+		1, &pageY);
+	// Tiles must cover whole pages
+	return pageX > 0 && pageY > 0 && src.size%pageX == 0 && src.size%pageY == 0;
+}
+
+void DDSStreamer::commitPages(const GLuint texId, const int level, 
+	const int x, const int y, const int w, const int h, const bool commit)
+{
+	glBindTexture(GL_TEXTURE_2D, texId);
+	glTexPageCommitmentARB(GL_TEXTURE_2D, level, x, y, 0, w, h, 1, commit);
+	glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+bool DDSStreamer::isSparse() const
+{
+	return _sparse;
+}
+
+GLuint DDSStreamer::getResidencyTexture(const Handle handle, const GLuint def) const
+{
+	auto it = _residency.find(handle);
+	if (it == _residency.end() || !it->second.residencyTex) return def;
+	return it->second.residencyTex;
+}
+
+void DDSStreamer::setFeedback(const Handle handle, const uint32_t *cells, 
+	const int columns, const int rows, const float uOffset)
+{
+	auto it = _residency.find(handle);
+	if (it == _residency.end() || !it->second.source.sparse) return;
+	const TexSource &src = it->second.source;
+	const int tailLevel = src.levels-1;
+	const int maxLevel = src.mipNumber-1;
+
+	// Tiles have no borders: filtering taps close to an edge read the tile
+	// next to it, at the same level, which must then be committed too
+	int lastTile = -1;
+	for (int cy=0;cy<rows;++cy)
+	{
+		for (int cx=0;cx<columns;++cx)
+		{
+			const uint32_t cell = cells[cy*columns+cx];
+			if (cell == 0) continue;
+			// Level whose width matches the one needed
+			const int level = std::max(0, maxLevel-((int)cell-1));
+			if (level >= tailLevel) continue;
+			const int i = tailLevel-level;
+			float u = (cx+0.5f)/columns + uOffset;
+			u -= floor(u);
+			const float v = (cy+0.5f)/rows;
+			const int x = std::min((int)(u*(1<<i)), (1<<i)-1);
+			const int y = std::min((int)(v*(1<<(i-1))), (1<<(i-1))-1);
+			const int tile = TileArchive::getTileIndex(i, x, y);
+			if (tile == lastTile) continue;
+			lastTile = tile;
+			const int tileColumns = 1<<i;
+			const int tileRows = 1<<(i-1);
+			for (int dy=-1;dy<=1;++dy)
+			{
+				const int ny = y+dy;
+				if (ny < 0 || ny >= tileRows) continue;
+				for (int dx=-1;dx<=1;++dx)
+				{
+					// Longitude wraps around
+					requestTile(handle, i, (x+dx+tileColumns)%tileColumns, ny);
+				}
+			}
+		}
+	}
+}
+
+void DDSStreamer::requestTile(const Handle h, int i, int x, int y)
+{
+	Residency &r = _residency[h];
+	const GLuint texId = _texs[h].getTextureId();
+	// Coarser parents are needed for trilinear filtering
+	for (;i>=1;--i, x/=2, y/=2)
+	{
+		const int tile = TileArchive::getTileIndex(i, x, y);
+		// Already requested this frame, and so have its parents
+		if (r.tileLastUsed[tile] == _frame && 
+			r.tiles[tile] != TileState::UNCOMMITTED) break;
+		r.tileLastUsed[tile] = _frame;
+		if (r.tiles[tile] != TileState::UNCOMMITTED) continue;
+
+		const int level = r.source.levels-i-1;
+		const int size = r.source.size;
+		commitPages(texId, level, x*size, y*size, size, size, true);
+		r.tiles[tile] = TileState::LOADING;
+
+		LoadInfo info = genTileJob(h, r.source, i, x, y);
+		info.tileId = -1;
+		info.sparseTile = tile;
+		info.requestTime = chrono::steady_clock::now();
+		_loadInfoWaiting.push_back(info);
+	}
+}
+
+void DDSStreamer::setSparseTileLoaded(const Handle h, const int tile)
+{
+	auto it = _residency.find(h);
+	if (it == _residency.end()) return;
+	Residency &r = it->second;
+	if (r.tiles[tile] == TileState::LOADING)
+	{
+		r.tiles[tile] = TileState::LOADED;
+		r.residencyChanged = true;
+	}
+}
+
+void DDSStreamer::updateSparseTiles(const Handle h, Residency &r, const bool force)
+{
+	// Frames a tile is kept after it was last seen
+	const uint64_t keepFrames = 300;
+	const TexSource &src = r.source;
+	const GLuint texId = _texs[h].getTextureId();
+
+	// Finest tiles first so that parents see their children decommitted
+	for (int i=src.levels-1;i>=1;--i)
+	{
+		const int rows = 1<<(i-1);
+		const int columns = 2*rows;
+		for (int x=0;x<columns;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				const int tile = TileArchive::getTileIndex(i, x, y);
+				if (r.tiles[tile] != TileState::LOADED) continue;
+				if (!force && r.tileLastUsed[tile]+keepFrames > _frame) continue;
+				// Children still committed keep their parent
+				bool children = false;
+				if (i+1 < src.levels)
+				{
+					for (int c=0;c<4 && !children;++c)
+					{
+						const int child = TileArchive::getTileIndex(
+							i+1, 2*x+(c&1), 2*y+(c>>1));
+						children = r.tiles[child] != TileState::UNCOMMITTED;
+					}
+				}
+				if (children) continue;
+				commitPages(texId, src.levels-i-1, 
+					x*src.size, y*src.size, src.size, src.size, false);
+				r.tiles[tile] = TileState::UNCOMMITTED;
+				r.residencyChanged = true;
+			}
+		}
+	}
+
+	if (!r.residencyChanged) return;
+	r.residencyChanged = false;
+
+	// Finest level per finest tile whose parents are all loaded
+	const int tailLevel = src.levels-1;
+	const int mapColumns = 1<<tailLevel;
+	vector<bool> usable(r.tiles.size(), false);
+	fill(r.residencyMap.begin(), r.residencyMap.end(), tailLevel);
+	for (int i=1;i<src.levels;++i)
+	{
+		const int rows = 1<<(i-1);
+		const int columns = 2*rows;
+		const int span = 1<<(tailLevel-i);
+		for (int x=0;x<columns;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				const int tile = TileArchive::getTileIndex(i, x, y);
+				const bool parentUsable = (i == 1) || 
+					usable[TileArchive::getTileIndex(i-1, x/2, y/2)];
+				if (!parentUsable || r.tiles[tile] != TileState::LOADED) continue;
+				usable[tile] = true;
+				for (int my=y*span;my<(y+1)*span;++my)
+					for (int mx=x*span;mx<(x+1)*span;++mx)
+						r.residencyMap[my*mapColumns+mx] = tailLevel-i;
+			}
+		}
+	}
+	glTextureSubImage2D(r.residencyTex, 0, 0, 0, mapColumns, 
+		std::max(1, mapColumns/2), GL_RED, GL_UNSIGNED_BYTE, r.residencyMap.data());
+}
 
 const StreamTexture &DDSStreamer::getTex(Handle handle)
 {
@@ -260,22 +771,98 @@ void DDSStreamer::deleteTex(Handle handle)
 {
 	if (handle)
 	{
-		_texDeleted.push_back(handle);
-		_tileUpdated.erase(handle);
-		_texs.erase(handle);
+		_importance.erase(handle);
+		auto it = _residency.find(handle);
+		// Keep fully streamed textures resident while the budget allows
+		if (_budget > 0 && it != _residency.end() && !_tileUpdated.count(handle))
+		{
+			it->second.released = true;
+			it->second.lastUsed = _frame;
+			return;
+		}
+		eraseTex(handle);
 	}
 }
 
-vector<bool> DDSStreamer::areFencesSignaled()
+void DDSStreamer::setImportance(Handle handle, const glm::vec3 &viewDir, 
+	const float screenSize)
+{
+	if (!handle || !_asynchronous) return;
+	const auto it = _importance.find(handle);
+	if (it != _importance.end())
+	{
+		const Importance &i = it->second;
+		const float ratio = (i.screenSize > 0)?screenSize/i.screenSize:0.f;
+		if (glm::dot(viewDir, i.viewDir) >= IMPORTANCE_COS_ANGLE &&
+			ratio <= IMPORTANCE_SIZE_RATIO && ratio >= 1/IMPORTANCE_SIZE_RATIO)
+			return;
+	}
+	_importance[handle] = {viewDir, screenSize};
+	_importanceChanged = true;
+}
+
+bool DDSStreamer::acquireRange(LoadInfo &info)
+{
+	const RingAllocator::Range range = _staging.allocate(info.imageSize);
+	if (range.offset == -1) return false;
+	info.offset = range.offset;
+	info.rangeId = range.id;
+	return true;
+}
+
+void DDSStreamer::releaseRange(const uint64_t id)
+{
+	_staging.release(id);
+}
+
+void DDSStreamer::submitBatch()
 {
-	vector<bool> fencesAvailable(_pageFences.size());
-	transform(_pageFences.begin(), _pageFences.end(), 
-		fencesAvailable.begin(), [](Fence &fence){return fence.waitClient(0);});
-	return fencesAvailable;
+	if (_batchRanges.empty()) return;
+	UploadBatch batch{};
+	batch.fence.lock();
+	batch.serial = _batchSerial;
+	batch.ranges.swap(_batchRanges);
+	_batches.push_back(std::move(batch));
+	++_batchSerial;
+}
+
+void DDSStreamer::retireBatches(const bool waitOldest)
+{
+	if (waitOldest && !_batches.empty()) _batches.front().fence.waitClient();
+	// Fences signal in submission order
+	while (!_batches.empty() && _batches.front().fence.waitClient(0))
+	{
+		UploadBatch &batch = _batches.front();
+		for (const uint64_t id : batch.ranges) _staging.release(id);
+		_completedSerial = batch.serial;
+		_batches.pop_front();
+	}
 }
 
 void DDSStreamer::update()
 {
+	CPUProfiler::Scope scope("Streaming update");
+	evictTextures();
+	for (auto &p : _residency)
+	{
+		if (p.second.source.sparse && !p.second.released)
+			updateSparseTiles(p.first, p.second, false);
+	}
+	++_frame;
+	_stats.tilesUploaded = 0;
+	_stats.bytesUploaded = 0;
+
+	// Read rate over the last second
+	const auto now = chrono::steady_clock::now();
+	const double elapsed = chrono::duration<double>(now-_rateStart).count();
+	if (elapsed >= 1.0)
+	{
+		const uint64_t bytesRead = _bytesRead;
+		_stats.bytesReadPerSecond = (bytesRead-_rateStartBytes)/elapsed;
+		_rateStart = now;
+		_rateStartBytes = bytesRead;
+	}
+
 	if (!_asynchronous) return;
 	// Invalidate deleted textures from pre-queue
 	auto isDeleted = [this](const LoadInfo &info)
@@ -284,8 +871,7 @@ void DDSStreamer::update()
 		{
 			if (h == info.handle)
 			{
-				if (info.pageOffset != -1) 
-					releasePages(info.pageOffset, getPageSpan(info.imageSize));
+				if (info.offset != -1) releaseRange(info.rangeId);
 				return true;
 			}
 		}
@@ -295,51 +881,83 @@ void DDSStreamer::update()
 	_loadInfoWaiting.erase(
 		remove_if(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), isDeleted),
 		_loadInfoWaiting.end());
+	if (!_texDeleted.empty())
 	{
-		// Invalidate deleted textures from currently processing queue
-		lock_guard<mutex> lk(_mtx);
-		_loadInfoQueue.erase(
-			remove_if(_loadInfoQueue.begin(), _loadInfoQueue.end(), isDeleted),
-			_loadInfoQueue.end());
+		// Invalidate deleted textures from currently processing queues
+		for (auto &queue : _loadInfoQueues)
+		{
+			lock_guard<mutex> lk(queue->mtx);
+			const auto it = remove_if(queue->heap.begin(), queue->heap.end(), isDeleted);
+			const int removed = queue->heap.end()-it;
+			queue->heap.erase(it, queue->heap.end());
+			make_heap(queue->heap.begin(), queue->heap.end());
+			lock_guard<mutex> countLk(_mtx);
+			_queuedJobs -= removed;
+		}
 	}
 
 	// Get fence state
-	auto fencesSignaled = areFencesSignaled();
+	retireBatches();
 	// Mark textures as complete if fences are signaled
-	setTexturesAsComplete(fencesSignaled);
+	setTexturesAsComplete();
+
+	if (_importanceChanged)
+	{
+		// Reorder tiles for the new view
+		for (auto &info : _loadInfoWaiting)
+			info.priority = computePriority(info);
+		for (auto &queue : _loadInfoQueues)
+		{
+			lock_guard<mutex> lk(queue->mtx);
+			for (auto &info : queue->heap)
+				info.priority = computePriority(info);
+			make_heap(queue->heap.begin(), queue->heap.end());
+		}
+		_importanceChanged = false;
+	}
+
+	// Most urgent tiles get staging memory first
+	stable_sort(_loadInfoWaiting.begin(), _loadInfoWaiting.end(),
+		[](const LoadInfo &a, const LoadInfo &b){ return b < a; });
 
 	// Assign offsets
 	std::vector<LoadInfo> assigned;
 	std::vector<LoadInfo> nonAssigned;
 
 	for_each(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), 
-		[&assigned, &nonAssigned, &fencesSignaled, this](const LoadInfo &info) {
-			const int pages = getPageSpan(info.imageSize);
-			const int pageOffset = acquirePages(pages, fencesSignaled);
-			if (pageOffset == -1)
-			{
-				nonAssigned.push_back(info);
-			}
-			else
-			{
-				LoadInfo s = info;
-				s.pageOffset = pageOffset;
-				assigned.push_back(s);
-				_tileRanges[make_pair(info.handle, info.tileId)] = 
-					make_pair(pageOffset, pages);
-			}
+		[&assigned, &nonAssigned, this](const LoadInfo &info) {
+			LoadInfo s = info;
+			if (acquireRange(s)) assigned.push_back(s);
+			else nonAssigned.push_back(info);
 		});
 
+	if (!assigned.empty())
 	{
-		lock_guard<mutex> lk(_mtx);
-		// Submit created textures
-		_loadInfoQueue.insert(
-			_loadInfoQueue.end(),
-			assigned.begin(),
-			assigned.end());
+		// Submit tiles, spread over all threads so textures load in parallel
+		const size_t queues = _loadInfoQueues.size();
+		vector<vector<LoadInfo>> submitted(queues);
+		for (const auto &info : assigned)
+		{
+			submitted[_nextQueue].push_back(info);
+			_nextQueue = (_nextQueue+1)%queues;
+		}
+		for (size_t i=0;i<queues;++i)
+		{
+			auto &queue = *_loadInfoQueues[i];
+			lock_guard<mutex> lk(queue.mtx);
+			for (const auto &info : submitted[i])
+			{
+				queue.heap.push_back(info);
+				push_heap(queue.heap.begin(), queue.heap.end());
+			}
+		}
+		{
+			lock_guard<mutex> lk(_mtx);
+			_queuedJobs += assigned.size();
+		}
+		_cond.notify_all();
 	}
-
-	_cond.notify_one();
+	_stats.starvedTiles = nonAssigned.size();
 	_loadInfoWaiting = nonAssigned;
 	_texDeleted.clear();
 
@@ -366,6 +984,7 @@ void DDSStreamer::update()
 				return false;
 			}), _loadData.end());
 		}
+		_stats.deferredTiles = _loadData.size();
 	}
 	// Update
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, _pbo);
@@ -374,37 +993,69 @@ void DDSStreamer::update()
 		updateTile(d);
 	}
 	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	submitBatch();
 }
 
-void DDSStreamer::setTexturesAsComplete(const vector<bool> &fencesSignaled)
+uint64_t DDSStreamer::getGeneration() const
+{
+	return _generation;
+}
+
+bool DDSStreamer::isIdle()
 {
-	for (auto p : _tileUpdated)
 	{
-		if (!_texs[p.first].isComplete())
+		lock_guard<mutex> lk(_mtx);
+		if (_queuedJobs > 0) return false;
+	}
+	{
+		lock_guard<mutex> lk(_dataMtx);
+		if (!_loadData.empty()) return false;
+	}
+	return _loadInfoWaiting.empty() && _batches.empty() &&
+		_tileUpdated.empty() && _texDeleted.empty();
+}
+
+DDSStreamer::Stats DDSStreamer::getStats()
+{
+	Stats stats = _stats;
+	stats.bytesRead = _bytesRead;
+	stats.waitingTiles = _loadInfoWaiting.size();
+	{
+		lock_guard<mutex> lk(_mtx);
+		stats.queuedTiles = _queuedJobs;
+	}
+	stats.stagingUsed = _staging.getUsed();
+	stats.stagingSize = _staging.getCapacity();
+	stats.batchesInFlight = _batches.size();
+	uint64_t uploaded = 0;
+	for (const uint64_t count : stats.latencyHistogram) uploaded += count;
+	stats.meanLatency = (uploaded > 0)?_latencySum/uploaded:0.0;
+	return stats;
+}
+
+void DDSStreamer::setTexturesAsComplete()
+{
+	for (auto it=_tileUpdated.begin();it!=_tileUpdated.end();)
+	{
+		const auto &p = *it;
+		bool done = false;
+		// Get if all tiles have been set in the process of updating
+		if (all_of(p.second.begin(), p.second.end(), [](bool b){return b;}))
 		{
-			// Get if all tiles have been set in the process of updating
-			if (all_of(p.second.begin(), p.second.end(), [](bool b){return b;}))
+			// Get if the batch of the last upload has been signaled
+			if (_texLastBatch[p.first] <= _completedSerial)
 			{
-				// Get if all fences have been signaled
-				bool signaled = true;
-				for (int i=0;(i<(int)p.second.size()) && signaled;++i)
-				{
-					auto range = _tileRanges[make_pair(p.first, i)];
-					for (int j=range.first; j<range.second && signaled; ++j)
-					{
-						if (!fencesSignaled[j]) signaled = false;
-					}
-				}
-				if (signaled)
-				{
-					_texs[p.first].setComplete();
-					for (int i=0;i<(int)p.second.size();++i)
-					{
-						_tileRanges.erase(make_pair(p.first, i));
-					}
-				}
+				auto &tex = _texs[p.first];
+				tex.setComplete();
+				// Revived textures sampled a view of their resident levels
+				tex.setView(0);
+				++_generation;
+				_texLastBatch.erase(p.first);
+				done = true;
 			}
 		}
+		if (done) it = _tileUpdated.erase(it);
+		else ++it;
 	}
 }
 
@@ -416,13 +1067,20 @@ int DDSStreamer::getCost(const LoadData &data)
 
 void DDSStreamer::updateTile(const LoadData &d)
 {
+	auto it = _texs.find(d.handle);
+	if (it == _texs.end())
+	{
+		// Texture deleted while loading, range wasn't used by the GL
+		releaseRange(d.rangeId);
+		return;
+	}
 #ifndef USE_COHERENT_MAPPING
-	glFlushMappedNamedBufferRange(_pbo, d.pageOffset*_pageSize, d.imageSize);
+	glFlushMappedNamedBufferRange(_pbo, d.offset, d.imageSize);
 #endif
-	auto it = _texs.find(d.handle);
-	if (it != _texs.end())
+	auto &tex = it->second;
+	// Tiles that failed to load are left empty
+	if (d.width > 0)
 	{
-		auto &tex = it->second;
 		glCompressedTextureSubImage2D(tex.getTextureId(),
 			d.level,
 			d.offsetX,
@@ -431,67 +1089,80 @@ void DDSStreamer::updateTile(const LoadData &d)
 			d.height,
 			d.format,
 			d.imageSize,
-			(void*)(intptr_t)(d.pageOffset*_pageSize));
-
-		_tileUpdated[d.handle][d.tileId] = true;
+			(void*)(intptr_t)d.offset);
 	}
-	releasePages(d.pageOffset, getPageSpan(d.imageSize));
-}
 
-int DDSStreamer::acquirePages(int pages, const vector<bool> &fencesAvailable)
-{
-	if (pages > (int)_numPages)
+	if (d.sparseTile != -1) setSparseTileLoaded(d.handle, d.sparseTile);
+	else
 	{
-		throw runtime_error("Not enough pages");
+		_tileUpdated[d.handle][d.tileId] = true;
+		_texLastBatch[d.handle] = _batchSerial;
 	}
 
-	int start = 0;
-	for (int i=0;i<(int)_usedPages.size();++i)
-	{
-		if (_usedPages[i] || !fencesAvailable[i])
-		{
-			start = i+1;
-		}
-		else
-		{
-			if (i-start+1 == pages)
-			{
-				for (int j=start;j<start+pages;++j)
-				{
-					_usedPages[j] = true;
-				}
-				return start;
-			}
-		}
-	}
-	return -1;
-}
-void DDSStreamer::releasePages(int pageStart, int pages)
-{
-	for (int i=pageStart;i<pageStart+pages;++i)
-	{
-		_pageFences[i].lock();
-		_usedPages[i] = false;
-	}
+	_stats.tilesUploaded += 1;
+	_stats.bytesUploaded += d.imageSize;
+	const double latency = chrono::duration<double, milli>(
+		chrono::steady_clock::now()-d.requestTime).count();
+	_latencySum += latency;
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS-1 && latency >= (1<<bucket)) ++bucket;
+	_stats.latencyHistogram[bucket] += 1;
+	// Released once the batch fence is signaled
+	_batchRanges.push_back(d.rangeId);
 }
 
 DDSStreamer::LoadData DDSStreamer::load(const LoadInfo &info)
 {
 	LoadData s{};
 	int level = info.fileLevel;
-	int pageOffset = info.pageOffset;
+	char *dst = (char*)_pboPtr+info.offset;
 	s.handle = info.handle;
 	s.level = info.level;
 	s.offsetX = info.offsetX;
 	s.offsetY = info.offsetY;
-	s.width = info.loader.getWidth(level);
-	s.height = info.loader.getHeight(level);
-	s.format  = DDSFormatToGL(info.loader.getFormat());
 	s.imageSize = info.imageSize;
-	s.pageOffset = pageOffset;
+	s.offset = info.offset;
+	s.rangeId = info.rangeId;
 	s.tileId = info.tileId;
+	s.sparseTile = info.sparseTile;
+	s.requestTime = info.requestTime;
 
-	info.loader.writeImageData(level, (char*)_pboPtr+pageOffset*_pageSize);
+	try
+	{
+		if (info.archive)
+		{
+			const TileArchive &archive = *info.archive;
+			s.width = archive.getWidth(info.archiveTile, level);
+			s.height = archive.getHeight(info.archiveTile, level);
+			s.format = DDSFormatToGL(archive.getFormat());
+			if ((int)archive.getImageSize(info.archiveTile, level) != info.imageSize)
+				throw runtime_error("Unexpected tile size");
+			// Compressed tiles are inflated by this thread, so that reads
+			// shrink and decompression spreads over the loading threads
+			archive.writeImageData(info.archiveTile, level, 
+				dst);
+			_bytesRead += archive.getStoredSize(info.archiveTile, level);
+			return s;
+		}
+
+		// Header is parsed here, off the render thread
+		const DDSLoader loader(info.filename);
+		s.width = loader.getWidth(level);
+		s.height = loader.getHeight(level);
+		s.format  = DDSFormatToGL(loader.getFormat());
+		if ((int)loader.getImageSize(level) != info.imageSize)
+			throw runtime_error("Unexpected tile size");
+		// Straight from the file mapping to the PBO mapping
+		loader.writeImageData(level, dst);
+		_bytesRead += info.imageSize;
+	}
+	catch (const runtime_error &e)
+	{
+		// Tile is skipped, its range is still released after update
+		cerr << "Can't load tile " << info.filename << " : " << e.what() << endl;
+		s.width = 0;
+		s.height = 0;
+	}
 
 	return s;
 }
@@ -511,21 +1182,31 @@ StreamTexture::StreamTexture(GLuint id) :
 }
 
 StreamTexture::StreamTexture(StreamTexture &&tex) : 
-	_texId{tex._texId}
+	_texId{tex._texId},
+	_viewId{tex._viewId},
+	_complete{tex._complete}
 {
 	tex._texId = 0;
+	tex._viewId = 0;
+	tex._complete = false;
 }
 
 StreamTexture &StreamTexture::operator=(StreamTexture &&tex)
 {
+	if (_viewId && tex._viewId != _viewId) glDeleteTextures(1, &_viewId);
 	if (_texId && tex._texId != _texId) glDeleteTextures(1, &_texId);
 	_texId = tex._texId;
+	_viewId = tex._viewId;
+	_complete = tex._complete;
 	tex._texId = 0;
+	tex._viewId = 0;
+	tex._complete = false;
 	return *this;
 }
 
 StreamTexture::~StreamTexture()
 {
+	if (_viewId) glDeleteTextures(1, &_viewId);
 	if (_texId) glDeleteTextures(1, &_texId);
 }
 
@@ -547,6 +1228,12 @@ bool StreamTexture::isComplete() const
 
 GLuint StreamTexture::getCompleteTextureId(GLuint def) const
 {
-	if (isComplete()) return getTextureId(def);
+	if (isComplete()) return _viewId?_viewId:getTextureId(def);
 	return def;
+}
+
+void StreamTexture::setView(const GLuint view)
+{
+	if (_viewId && _viewId != view) glDeleteTextures(1, &_viewId);
+	_viewId = view;
 }
\ No newline at end of file
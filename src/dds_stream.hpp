@@ -6,11 +6,20 @@
 #include <mutex>
 #include <condition_variable>
 #include <map>
+#include <memory>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+#include <glm/glm.hpp>
 
 #include "ddsloader.hpp"
+#include "tile_archive.hpp"
 #include "graphics_api.hpp"
 #include "fence.hpp"
 #include "gl_util.hpp"
+#include "ring_allocator.hpp"
 
 /**
  * Texture streamed from the DDSStreamer class
@@ -51,10 +60,18 @@ public:
 	 * @return GL texture id
 	 */
 	GLuint getCompleteTextureId(GLuint def=0) const;
+	/**
+	 * Sets a view of the texture to be sampled instead of it, deleting the
+	 * previous one
+	 * @param view GL texture view id, 0 to sample the texture itself
+	 */
+	void setView(GLuint view);
 
 private:
 	/// GL texture id
 	GLuint _texId = 0;
+	/// GL texture view id sampled instead of the texture if not 0
+	GLuint _viewId = 0;
 	/// Usable texture
 	bool _complete = false;
 };
@@ -62,9 +79,18 @@ private:
 /**
  * Asynchronously streams textures from file system to GL
  *
- * Keeps a large GL buffer of several pages of a given size which are assigned
- * to streaming texture data and then freed after the corresponding texture is
- * updated.
+ * Keeps a large GL buffer used as a ring: ranges of the size of each tile are
+ * assigned to streaming texture data, and freed once the fence of the batch of
+ * uploads reading from them is signaled.
+ *
+ * Deleted textures stay resident while the total texture memory is under
+ * budget, and are given back when created again. Over budget, the finest
+ * mipmap levels of the least recently deleted textures are dropped first, so
+ * that only these levels have to be streamed again.
+ *
+ * With sparse textures, only the tail of a texture is streamed at creation.
+ * Tiles of finer levels are committed and streamed when reported as seen by
+ * setFeedback(), and decommitted when they haven't been seen for a while.
  */
 class DDSStreamer
 {
@@ -72,21 +98,60 @@ public:
 	/// Handle for keeping track of stream textures
 	typedef uint32_t Handle;
 
+	/// Number of buckets of the tile latency histogram
+	static const int LATENCY_BUCKETS = 14;
+
+	/// Streaming counters, to find out what limits streaming
+	struct Stats
+	{
+		/// Bytes read from disk since init()
+		uint64_t bytesRead = 0;
+		/// Bytes read from disk per second, over the last second
+		double bytesReadPerSecond = 0.0;
+		/// Tiles uploaded by the last update()
+		int tilesUploaded = 0;
+		/// Bytes uploaded by the last update()
+		uint64_t bytesUploaded = 0;
+		/// Tiles waiting for a staging range
+		int waitingTiles = 0;
+		/// Tiles in the loading threads' queues
+		int queuedTiles = 0;
+		/// Loaded tiles left for the next update() by the upload cost budget
+		int deferredTiles = 0;
+		/// Tiles that didn't get a staging range in the last update()
+		int starvedTiles = 0;
+		/// Bytes of the staging buffer in use
+		size_t stagingUsed = 0;
+		/// Size in bytes of the staging buffer
+		size_t stagingSize = 0;
+		/// Upload batches whose fence isn't signaled yet
+		int batchesInFlight = 0;
+		/// Tiles uploaded since init(), by time from request to upload: 
+		/// bucket i counts latencies below 2^i ms, the last one the others
+		std::array<uint64_t, LATENCY_BUCKETS> latencyHistogram{};
+		/// Mean time from request to upload in ms
+		double meanLatency = 0.0;
+	};
+
 	DDSStreamer() = default;
 	/**
 	 * @param asynchronous If set, textures won't be immediately complete after
 	 * createTexture() returns
-	 * @param anisotropy Available anisotropy
-	 * @param pageSize Size of a page in bytes
-	 * @param numPages Number of pages in the buffer
+	 * @param stagingSize Size in bytes of the buffer tiles are loaded to
 	 * @param maxSize maximum texture width/height to load
+	 * @param threads number of loading threads (0 picks from the hardware)
+	 * @param budget texture memory in bytes above which deleted textures are
+	 * evicted (0 to free them immediately)
+	 * @param sparse allocate textures sparse if supported
 	 */
-	void init(bool asynchronous, int pageSize, int numPages, int maxSize=0);
+	void init(bool asynchronous, size_t stagingSize, int maxSize=0,
+		int threads=0, size_t budget=0, bool sparse=false);
 	~DDSStreamer();
 
 	/**
 	 * Creates a stream texture, setups streaming of its data and returns its 
-	 * matching handle
+	 * matching handle. If a tile archive named filename + ".rtex" exists, it is
+	 * used instead of the texture folder
 	 * @param filename filename to load the texture from
 	 * @return handle of newly created texture
 	 */
@@ -98,23 +163,78 @@ public:
 	 */
 	const StreamTexture &getTex(Handle handle);
 	/**
-	 * Deletes a stream texture and invalidates all transfer work on it
+	 * Deletes a stream texture and invalidates all transfer work on it. Fully
+	 * streamed textures are kept resident as long as the budget allows
 	 * @param handle handle of texture to delete
 	 */
 	void deleteTex(Handle handle);
+	/**
+	 * Sets how a texture mapped on a sphere is seen, so that tiles facing the
+	 * viewer at a useful resolution are loaded first. Queued tiles are only
+	 * reordered when the view direction moves by more than about 5 degrees or
+	 * the screen size by more than 20% since the last reordering
+	 * @param handle handle of texture
+	 * @param viewDir direction from sphere center to viewer, in model space
+	 * @param screenSize on-screen diameter of the sphere in pixels
+	 */
+	void setImportance(Handle handle, const glm::vec3 &viewDir, float screenSize);
+	/**
+	 * Returns whether textures can be allocated sparse
+	 */
+	bool isSparse() const;
+	/**
+	 * Requests the tiles of a sparse texture that have been seen, and the
+	 * tiles around them that filtering reads close to tile edges
+	 * @param handle handle of texture
+	 * @param cells grid over the texture coordinates, row by row, 0 for cells
+	 * that were not seen, 1 + log2 of the needed texture width otherwise
+	 * @param columns number of columns of the grid
+	 * @param rows number of rows of the grid
+	 * @param uOffset offset added to the horizontal texture coordinate when
+	 * sampling the texture
+	 */
+	void setFeedback(Handle handle, const uint32_t *cells, int columns, int rows,
+		float uOffset=0.f);
+	/**
+	 * Returns the residency map of a sparse texture (one R8 texel per finest
+	 * tile, finest usable mipmap level/255), or def if not sparse
+	 * @param handle handle of texture
+	 * @param def default value to return
+	 */
+	GLuint getResidencyTexture(Handle handle, GLuint def=0) const;
 
 	/**
 	 * Updates GL textures with streamed data
 	 */
 	void update();
+	/**
+	 * Returns the streaming counters
+	 */
+	Stats getStats();
+	/**
+	 * Returns whether no tile is being loaded or uploaded, nor any texture
+	 * waiting to be completed or deleted
+	 */
+	bool isIdle();
+	/**
+	 * Returns a number that changes whenever GL textures given by the streamer
+	 * may have been deleted (so that GL names may be reused)
+	 */
+	uint64_t getGeneration() const;
 
 private:
 	struct LoadInfo
 	{
 		/// Texture handle
 		Handle handle;
-		/// DDS Loader on file to load
-		DDSLoader loader;
+		/// DDS file to load, opened by the loading thread
+		std::string filename;
+		/// Tile archive to load from instead of filename if set
+		std::shared_ptr<const TileArchive> archive;
+		/// Index of tile in archive
+		int archiveTile = 0;
+		/// Sparse tile streamed on demand (archive index), -1 otherwise
+		int sparseTile = -1;
 		/// Mip level in file to load
 		int fileLevel;
 		/// Offset in image to update
@@ -127,8 +247,93 @@ private:
 		int imageSize;
 		/// Unique id for this tile of this level
 		int tileId;
-		/// Index of assigned page
-		int pageOffset = -1;
+		/// Offset in bytes of assigned staging range, -1 if not assigned
+		int64_t offset = -1;
+		/// Allocation id of assigned staging range
+		uint64_t rangeId = 0;
+		/// Width in pixels of the whole mip level
+		int levelWidth;
+		/// Direction of tile center on the sphere, in model space
+		glm::vec3 direction;
+		/// Angle from tile center to its corners (radians)
+		float angularRadius;
+		/// Loading order, higher first
+		float priority = 0.0;
+		/// Time the tile was requested
+		std::chrono::steady_clock::time_point requestTime;
+
+		bool operator<(const LoadInfo &info) const;
+	};
+
+	/// Tile info queue owned by a loading thread, stored as a heap
+	struct WorkerQueue
+	{
+		std::mutex mtx;
+		std::vector<LoadInfo> heap;
+	};
+
+	/// Where the data of a texture comes from
+	struct TexSource
+	{
+		/// Texture folder given to createTex()
+		std::string filename;
+		/// Archive if the texture has been packed
+		std::shared_ptr<const TileArchive> archive;
+		/// Tile width/height
+		int size = 0;
+		/// Number of levels (after clamping to max size)
+		int levels = 0;
+		std::string prefix;
+		std::string separator;
+		std::string suffix;
+		bool rowColumnOrder = false;
+		/// Format of all tiles
+		DDSLoader::Format format = DDSLoader::Format::Undefined;
+		/// Size of the full texture
+		int width = 0;
+		int height = 0;
+		int mipNumber = 0;
+		/// Allocated with virtual pages, tiles of levels above 0 on demand
+		bool sparse = false;
+	};
+
+	/// Residency of a sparse tile
+	enum class TileState : uint8_t
+	{
+		UNCOMMITTED, LOADING, LOADED
+	};
+
+	/// Texture memory state
+	struct Residency
+	{
+		/// Data source to stream dropped levels again
+		TexSource source;
+		/// Finest mipmap level in GL memory (level 0 of the GL texture)
+		int residentLevel = 0;
+		/// Frame of creation or deletion
+		uint64_t lastUsed = 0;
+		/// Deleted with deleteTex() but kept resident
+		bool released = false;
+
+		/// Sparse: state of each tile by archive index (tail excluded)
+		std::vector<TileState> tiles;
+		/// Sparse: frame each tile was last seen
+		std::vector<uint64_t> tileLastUsed;
+		/// Sparse: finest usable level per finest tile
+		std::vector<uint8_t> residencyMap;
+		/// Sparse: GL texture of residencyMap
+		GLuint residencyTex = 0;
+		/// Sparse: residencyMap must be recomputed
+		bool residencyChanged = false;
+	};
+
+	/// How a texture is seen from the view
+	struct Importance
+	{
+		/// Direction from sphere center to viewer, in model space
+		glm::vec3 viewDir;
+		/// On-screen diameter of the sphere in pixels
+		float screenSize;
 	};
 
 	struct LoadData
@@ -149,10 +354,16 @@ private:
 		GLenum format;
 		/// Size in bytes of incoming pixel data
 		int imageSize;
-		/// Index of assigned page
-		int pageOffset;
+		/// Offset in bytes of staging range
+		int64_t offset;
+		/// Allocation id of staging range
+		uint64_t rangeId;
 		/// Unique id for this tile of this level
 		int tileId;
+		/// Sparse tile streamed on demand (archive index), -1 otherwise
+		int sparseTile;
+		/// Time the tile was requested
+		std::chrono::steady_clock::time_point requestTime;
 	};
 
 	/** Returns an approximation of the time cost of a texture update 
@@ -162,22 +373,99 @@ private:
 
 	int getPageSpan(int size);
 
-	std::vector<bool> areFencesSignaled();
+	/**
+	 * Finds the files of a texture
+	 * @param filename texture folder
+	 * @param src output source
+	 * @return false if the texture doesn't exist, is invalid or has tiles
+	 * larger than the staging buffer
+	 */
+	bool openSource(const std::string &filename, TexSource &src);
+	/// Returns the filename of a tile in a texture folder
+	static std::string getTileFilename(const TexSource &src, int level, int x, int y);
+	/**
+	 * Generates tile infos of a texture
+	 * @param h texture handle
+	 * @param src texture source
+	 * @param minLevel only tiles of this level or coarser are generated
+	 * @param maxLevel only tiles of levels below this one are generated
+	 * @return tile infos
+	 */
+	std::vector<LoadInfo> genJobs(Handle h, const TexSource &src, 
+		int minLevel, int maxLevel);
+	/// Generates the tile info of a tile of levels above 0
+	LoadInfo genTileJob(Handle h, const TexSource &src, int i, int x, int y);
+	/// Queues tiles of a texture (or loads them now in synchronous mode)
+	void submitJobs(Handle h, const std::vector<LoadInfo> &jobs);
+	/// Takes back a released texture and streams its missing levels
+	void reviveTex(Handle h);
+	/**
+	 * Reallocates a texture with a different finest mipmap level, keeping the
+	 * levels resident in both
+	 * @param h texture handle
+	 * @param level new finest level
+	 */
+	void setResidentLevel(Handle h, int level);
+	/// Returns the GL memory of a texture in bytes
+	static size_t getResidentSize(const Residency &r);
+	/// Returns the GL memory of a mipmap level of a texture in bytes
+	static size_t getLevelSize(const TexSource &src, int level);
+	/// Drops levels of released textures until under budget
+	void evictTextures();
+	/// Frees a texture and cancels its transfers
+	void eraseTex(Handle h);
+
+	/// Whether a texture of this source can be allocated sparse
+	bool canBeSparse(const TexSource &src) const;
+	/// Commits or decommits the pages of a region of a sparse texture level
+	void commitPages(GLuint texId, int level, int x, int y, int w, int h, bool commit);
+	/**
+	 * Commits and queues a sparse tile and its coarser parents
+	 * @param h texture handle
+	 * @param i tile level folder index
+	 * @param x tile column
+	 * @param y tile row
+	 */
+	void requestTile(Handle h, int i, int x, int y);
+	/// Marks a sparse tile as usable once updated
+	void setSparseTileLoaded(Handle h, int tile);
+	/// Decommits unseen sparse tiles (all of them if force) and updates residency maps
+	void updateSparseTiles(Handle h, Residency &r, bool force);
+
+	/**
+	 * Computes the loading priority of a tile from its texture importance
+	 * @param info tile info
+	 * @return priority, higher first
+	 */
+	float computePriority(const LoadInfo &info) const;
+	/**
+	 * Sets the tile position on the sphere
+	 * @param info tile info whose offset, level and level width are set
+	 * @param tileWidth width of tile in pixels
+	 */
+	void setTileBounds(LoadInfo &info, int tileWidth) const;
 
-	void setTexturesAsComplete(const std::vector<bool> &fencesSignaled);
+	/// Sets textures whose tiles have all been uploaded by the GPU as complete
+	void setTexturesAsComplete();
 
 	/**
-	 * Acquires one or several free pages
-	 * @param size in bytes to acquire
-	 * @return index of first page acquired
+	 * Assigns a staging range to a tile
+	 * @param info tile info whose offset and range id are set
+	 * @return false if the staging buffer is full
+	 */
+	bool acquireRange(LoadInfo &info);
+	/**
+	 * Releases a staging range never used by the GL
+	 * @param id allocation id of the range
 	 */
-	int acquirePages(int pages, const std::vector<bool> &fencesAvailable);
+	void releaseRange(uint64_t id);
+	/// Puts a fence after the uploads of this update and starts a new batch
+	void submitBatch();
 	/**
-	 * Releases one or several pages corresponding to buffer range
-	 * @param offset offset in bytes of buffer range
-	 * @param size size in bytes of buffer range
+	 * Releases the staging ranges of batches whose fence is signaled
+	 * @param waitOldest wait for the oldest batch if none is signaled
 	 */
-	void releasePages(int pageStart, int pages);
+	void retireBatches(bool waitOldest=false);
 	/**
 	 * Loads an image from disk
 	 * @param info input loading information
@@ -185,6 +473,20 @@ private:
 	 */
 	LoadData load(const LoadInfo &info);
 
+	/**
+	 * Loading thread main loop
+	 * @param worker index of the thread's own queue
+	 */
+	void work(int worker);
+	/**
+	 * Takes the most urgent tile of the thread's queue, or steals one from
+	 * another thread if it is empty
+	 * @param worker index of the thread's own queue
+	 * @param info output tile info
+	 * @return false if all queues are empty
+	 */
+	bool popJob(int worker, LoadInfo &info);
+
 	/**
 	 * Updates texture data
 	 * @param data data that has been loaded
@@ -203,47 +505,95 @@ private:
 
 	/// Maximum width/height of textures
 	int _maxSize = 0;
-	/// Size of pages in bytes
-	int _pageSize = 0;
-	/// Number of pages
-	size_t _numPages = 0;
+	/// Staging ranges uploaded from, behind a single fence
+	struct UploadBatch
+	{
+		/// Signaled once the GL is done with the ranges
+		Fence fence;
+		/// Batch number
+		uint64_t serial;
+		/// Allocation ids of staging ranges
+		std::vector<uint64_t> ranges;
+	};
 
 	/// GL id of Pixel Buffer
 	GLuint _pbo = 0;
 	/// Persistent map of pixel buffer
 	void *_pboPtr = nullptr;
-	/// Indicates whether a page is in use
-	std::vector<bool> _usedPages;
-	/// Fences to synchronize each page
-	std::vector<Fence> _pageFences;
+	/// Suballocation of the pixel buffer
+	RingAllocator _staging;
+	/// Batches in flight, oldest first
+	std::deque<UploadBatch> _batches;
+	/// Staging ranges uploaded from since the last submitBatch()
+	std::vector<uint64_t> _batchRanges;
+	/// Number of the batch being recorded
+	uint64_t _batchSerial = 1;
+	/// Number of the last batch whose fence is signaled
+	uint64_t _completedSerial = 0;
 
 	/// Tile info waiting to be put in the streaming queue
 	std::vector<LoadInfo> _loadInfoWaiting;
-	/// Tile info queue in use by the loading thread
-	std::vector<LoadInfo> _loadInfoQueue;
+	/// Tile info queues in use by the loading threads
+	std::vector<std::unique_ptr<WorkerQueue>> _loadInfoQueues;
+	/// Queue the next submitted tile goes to
+	size_t _nextQueue = 0;
+	/// Number of tiles in all queues
+	int _queuedJobs = 0;
 	/// Tile data that finished loading
 	std::vector<LoadData> _loadData;
 
 	/// Map of Handle->Stream Texture
 	std::map<Handle, StreamTexture> _texs;
+	/// Memory state of textures in _texs
+	std::map<Handle, Residency> _residency;
+	/// Texture memory budget in bytes, 0 to disable residency
+	size_t _budget = 0;
+	/// Number of update() calls
+	uint64_t _frame = 0;
+	/// Incremented when GL textures are deleted
+	uint64_t _generation = 0;
+	/// Sparse textures are supported and wanted
+	bool _sparse = false;
 
 	std::map<Handle, std::vector<bool>> _tileUpdated;
-	std::map<std::pair<Handle,int>, std::pair<int, int>> _tileRanges;
+	/// Batch of the last tile upload of textures being streamed
+	std::map<Handle, uint64_t> _texLastBatch;
+
+	/// Importance of textures as given by setImportance(), only updated when
+	/// it changes enough to reorder tiles
+	std::map<Handle, Importance> _importance;
+	/// Cosine of the view direction change updating an importance
+	static constexpr float IMPORTANCE_COS_ANGLE = 0.996f;
+	/// Screen size ratio updating an importance
+	static constexpr float IMPORTANCE_SIZE_RATIO = 1.2f;
+	/// Whether priorities of queued tiles must be recomputed
+	bool _importanceChanged = false;
 
 	/// Textures to be deleted in next update() call
 	std::vector<Handle> _texDeleted;
 	/// Dummy texture to indicate inexistent texture
 	StreamTexture _nullTex{};
 
-	/// Synchronizes input
+	/// Synchronizes _queuedJobs and _killThread for idle threads
 	std::mutex _mtx;
 	/// Synchronizes output
 	std::mutex _dataMtx;
-	/// Streaming thread
-	std::thread _t;
-	/// Signals thread for it to terminate itself
+	/// Streaming threads
+	std::vector<std::thread> _threads;
+	/// Signals threads for them to terminate themselves
 	bool _killThread = false;
-	/// Waits on tiles to load or thread to kill
+	/// Waits on tiles to load or threads to kill
 	std::condition_variable _cond;
+
+	/// Streaming counters
+	Stats _stats{};
+	/// Bytes read by the loading threads
+	std::atomic<uint64_t> _bytesRead{0};
+	/// Sum of latencies in ms of uploaded tiles
+	double _latencySum = 0.0;
+	/// Start of the current bytes per second measure
+	std::chrono::steady_clock::time_point _rateStart;
+	/// Value of _bytesRead at _rateStart
+	uint64_t _rateStartBytes = 0;
 	
 };
\ No newline at end of file
@@ -1,13 +1,16 @@
 #include "ddsloader.hpp"
 
 #include <string>
-#include <fstream>
 #include <cstring>
 #include <string>
 #include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 
+/// Maximum number of DDS files kept mapped
+const size_t MAX_MAPPED_FILES = 256;
+
 typedef uint32_t DWORD;
 
 struct DDS_PIXELFORMAT {
@@ -300,15 +303,29 @@ DDSLoader::Format getDDSFormat(const DXGI_FORMAT format)
 	}
 }
 
+static MappedFileCache &getFileCache()
+{
+	static MappedFileCache cache(MAX_MAPPED_FILES);
+	return cache;
+}
+
 DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 {
-	ifstream in(_filename.c_str(), ios::in | ios::binary);
-	if (!in) throw runtime_error("File not found : " + _filename);
+	_file = getFileCache().get(_filename);
+	const uint8_t *data = _file->getData();
+	const size_t fileSize = _file->getSize();
+	size_t pos = 0;
+	auto read = [&](void *dst, size_t size)
+	{
+		if (pos+size > fileSize)
+			throw runtime_error("Truncated DDS file : " + _filename);
+		memcpy(dst, data+pos, size);
+		pos += size;
+	};
 
 	// Magic number
-	in.seekg(0, ios::beg);
 	char buf[4];
-	in.read(buf, 4);
+	read(buf, 4);
 	if (strncmp(buf, "DDS ", 4))
 	{
 		throw runtime_error("Not a DDS file : " + _filename);
@@ -317,13 +334,13 @@ DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 	// DDS header
 	bool hasDX10Header = false;
 	DDS_HEADER header;
-	in.read((char*)&header, sizeof(DDS_HEADER));
+	read(&header, sizeof(DDS_HEADER));
 	DXGI_FORMAT format;
 	if (!strncmp((const char*)&header.ddspf.dwFourCC, "DX10", 4))
 	{
 		hasDX10Header = true;
 		DDS_HEADER_DXT10 dx10Header;
-		in.read((char*)&dx10Header, sizeof(DDS_HEADER_DXT10));
+		read(&dx10Header, sizeof(DDS_HEADER_DXT10));
 		format = dx10Header.dxgiFormat;
 	}
 	else
@@ -350,6 +367,14 @@ DDSLoader::DDSLoader(const string &filename) : _filename(filename)
 		_sizes.push_back(size);
 		offset += size;
 	}
+	if (offset > fileSize)
+		throw runtime_error("Truncated DDS file : " + _filename);
+}
+
+size_t DDSLoader::computeImageSize(const Format format, 
+	const int width, const int height)
+{
+	return getSize(width, height, format);
 }
 
 DDSLoader::Format DDSLoader::getFormat() const
@@ -392,8 +417,7 @@ vector<uint8_t> DDSLoader::getImageData(const int mipmapLevel) const
 
 void DDSLoader::writeImageData(const int mipmapLevel, void* ptr) const
 {
-	ifstream in(_filename.c_str(), ios::in | ios::binary);
-	if (!in) throw runtime_error(string("Can't open file ") + _filename);
-	in.seekg(_offsets[mipmapLevel], ios::beg);
-	in.read((char*)ptr, getImageSize(mipmapLevel));
+	if (!_file) throw runtime_error("No file opened");
+	const size_t size = getImageSize(mipmapLevel);
+	memcpy(ptr, _file->getData()+_offsets[mipmapLevel], size);
 }
\ No newline at end of file
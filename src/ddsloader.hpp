@@ -2,9 +2,15 @@
 
 #include <string>
 #include <vector>
+#include <memory>
+
+#include "mapped_file.hpp"
 
 /**
  * Loads DDS files from file system
+ *
+ * Files are memory mapped through a cache shared by all loaders, so that
+ * several reads of the same file don't open it again.
  */
 class DDSLoader
 {
@@ -30,6 +36,14 @@ public:
 	 * @param filename DDS file path
 	 */
 	explicit DDSLoader(const std::string &filename);
+	/**
+	 * Returns the size in bytes of an image
+	 * @param format block compression format
+	 * @param width width in pixels
+	 * @param height height in pixels
+	 * @return size in bytes
+	 */
+	static size_t computeImageSize(Format format, int width, int height);
 	/**
 	 * Returns the number of mipmaps in this file
 	 */
@@ -68,6 +82,8 @@ public:
 private:
 	/// Filename
 	std::string _filename = "";
+	/// Mapped file contents
+	std::shared_ptr<const MappedFile> _file;
 	/// Number of mipmap levels
 	int _mipmapCount = 0;
 	/// Width of largest mipmap level
@@ -1,9 +1,14 @@
 #include "entity.hpp"
+#include "job_system.hpp"
 
 #include <fstream>
 #include <string>
 #include <algorithm>
 #include <limits>
+#include <cstring>
+#include <sstream>
+#include <iomanip>
+#include <functional>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/quaternion.hpp>
@@ -35,38 +40,45 @@ Orbit::Orbit(
 
 }
 
-static double meanToEccentric(const double mean, const double ecc)
+dvec3 Orbit::computePosition(
+	const double epoch) const
 {
-	// Newton to find eccentric anomaly (En)
-	double En = (ecc<0.8)?mean:pi<float>(); // Starting value of En
-	const int it = 20; // Number of iterations
-	for (int i=0;i<it;++i)
-		En -= (En - ecc*sin(En)-mean)/(1-ecc*cos(En));
-	return En;
+	return OrbitPropagator::computePosition(*this, epoch);
 }
 
-dvec3 Orbit::computePosition(
-	const double epoch) const
+double Orbit::getEccentricity() const
 {
-	// Mean Anomaly compute
-	const double meanMotion = 2*pi<float>()/_pr;
-	const double meanAnomaly = fmod(epoch*meanMotion + _m0, 2*pi<float>());
-	// Mean anomaly to Eccentric
-	const double En = meanToEccentric(meanAnomaly, _ecc);
-	// Eccentric anomaly to True anomaly
-	const double trueAnomaly = 2*atan2(sqrt(1+_ecc)*sin(En/2), sqrt(1-_ecc)*cos(En/2));
-	// Distance from parent body
-	const double dist = _sma*((1-_ecc*_ecc)/(1+_ecc*cos(trueAnomaly)));
-	// Plane changes
-	const dvec3 posInPlane = dvec3(
-		-sin(trueAnomaly)*dist,
-		cos(trueAnomaly)*dist,
-		0.0);
-	const dquat q =
-		  rotate(dquat(), _lan, dvec3(0,0,1))
-		* rotate(dquat(), _inc, dvec3(0,1,0))
-		* rotate(dquat(), _arg, dvec3(0,0,1));
-	return q*posInPlane;
+	return _ecc;
+}
+
+double Orbit::getSemiMajorAxis() const
+{
+	return _sma;
+}
+
+double Orbit::getInclination() const
+{
+	return _inc;
+}
+
+double Orbit::getLongitudeOfAscendingNode() const
+{
+	return _lan;
+}
+
+double Orbit::getArgumentOfPeriapsis() const
+{
+	return _arg;
+}
+
+double Orbit::getPeriod() const
+{
+	return _pr;
+}
+
+double Orbit::getMeanAnomalyAtEpoch() const
+{
+	return _m0;
 }
 
 Atmo::Atmo(
@@ -124,7 +136,8 @@ static vec2 intersectsSphere(
 
 vector<float> Atmo::generateLookupTable(
 	const size_t size,
-	const float radius) const
+	const float radius,
+	JobSystem *jobs) const
 {
 	/* 2 channel lookup table :
 	 * y-axis for altitude (0.0 for sea level, 1.0 for maxHeight)
@@ -134,24 +147,81 @@ vector<float> Atmo::generateLookupTable(
 	 */
 	vector<float> table(size*size*2);
 
-	size_t index = 0;
-	for (size_t i=0;i<size;++i)
+	// Rows are independent, each one written by a single job
+	const auto generateRows = [&](const size_t begin, const size_t end, size_t)
+	{
+		for (size_t i=begin;i<end;++i)
+		{
+			const float altitude = (float)i/(float)size * _maxHeight;
+			const float density = exp(-altitude/_scaleHeight);
+			size_t index = i*size*2;
+			for (size_t j=0;j<size;++j)
+			{
+				const float angle = acos(2*(float)j/(float)(size-1)-1);
+				const vec2 rayDir = vec2(sin(angle), cos(angle));
+				const vec2 rayOri = vec2(0, radius + altitude);
+				const float t = intersectsSphere(rayOri, rayDir, radius+_maxHeight).y;
+				const vec2 u = rayOri + rayDir*t;
+				const float depth = scatOptic(rayOri, u, radius, _scaleHeight, _maxHeight, 50);
+				table[index+0] = density;
+				table[index+1] = depth;
+				index += 2;
+			}
+		}
+	};
+	if (jobs) jobs->parallelFor(size, 4, generateRows);
+	else generateRows(0, size, 0);
+	return table;
+}
+
+vector<float> Atmo::getCachedLookupTable(
+	const size_t size,
+	const float radius,
+	const string &cacheDir,
+	JobSystem *jobs) const
+{
+	// Table parameters, stored in the file to rule out hash collisions
+	const uint32_t version = 1;
+	const float key[8] = {
+		radius, _K.x, _K.y, _K.z, _K.w, _density, _maxHeight, _scaleHeight};
+	const string keyBytes = string((const char*)&version, sizeof(version))+
+		to_string(size)+string((const char*)key, sizeof(key));
+	stringstream filename;
+	filename << cacheDir << "/atmo_" << hex << setw(16) << setfill('0') <<
+		(uint64_t)hash<string>()(keyBytes) << ".bin";
+
+	vector<float> table(size*size*2);
 	{
-		const float altitude = (float)i/(float)size * _maxHeight;
-		const float density = exp(-altitude/_scaleHeight);
-		for (size_t j=0;j<size;++j)
+		ifstream in(filename.str(), ios::binary);
+		char magic[4];
+		uint32_t fileVersion = 0;
+		uint32_t fileSize = 0;
+		float fileKey[8];
+		in.read(magic, sizeof(magic));
+		in.read((char*)&fileVersion, sizeof(fileVersion));
+		in.read((char*)&fileSize, sizeof(fileSize));
+		in.read((char*)fileKey, sizeof(fileKey));
+		if (in && strncmp(magic, "RALT", 4) == 0 && fileVersion == version &&
+			fileSize == size && memcmp(fileKey, key, sizeof(key)) == 0)
 		{
-			const float angle = acos(2*(float)j/(float)(size-1)-1);
-			const vec2 rayDir = vec2(sin(angle), cos(angle));
-			const vec2 rayOri = vec2(0, radius + altitude);
-			const float t = intersectsSphere(rayOri, rayDir, radius+_maxHeight).y;
-			const vec2 u = rayOri + rayDir*t;
-			const float depth = scatOptic(rayOri, u, radius, _scaleHeight, _maxHeight, 50);
-			table[index+0] = density;
-			table[index+1] = depth;
-			index += 2;
+			in.read((char*)table.data(), table.size()*sizeof(float));
+			if (in) return table;
 		}
 	}
+
+	table = generateLookupTable(size, radius, jobs);
+
+	// Not being able to write the cache only costs the generation next time
+	ofstream out(filename.str(), ios::binary);
+	if (out)
+	{
+		const uint32_t fileSize = size;
+		out.write("RALT", 4);
+		out.write((const char*)&version, sizeof(version));
+		out.write((const char*)&fileSize, sizeof(fileSize));
+		out.write((const char*)key, sizeof(key));
+		out.write((const char*)table.data(), table.size()*sizeof(float));
+	}
 	return table;
 }
 
@@ -183,7 +253,8 @@ Ring::Ring(
 	const string &forwardscatFilename,
 	const string &unlitFilename,
 	const string &transparencyFilename,
-	const string &colorFilename) :
+	const string &colorFilename,
+	const string &packedFilename) :
 	_innerDistance{innerDistance},
 	_outerDistance{outerDistance},
 	_normal{normalize(normal)},
@@ -191,45 +262,22 @@ Ring::Ring(
 	_forwardscatFilename{forwardscatFilename},
 	_unlitFilename{unlitFilename},
 	_transparencyFilename{transparencyFilename},
-	_colorFilename{colorFilename}
+	_colorFilename{colorFilename},
+	_packedFilename{packedFilename}
 {
 
 }
 
-vector<float> Ring::loadFile(
-	const string &filename) const
+RingProfile Ring::loadProfile() const
 {
-	ifstream in(filename);
-
-	if (!in)
-	{
-		throw runtime_error("Can't open ring file " + filename);
-	}
-
-	// Clear values
-	vector<float> pixelData;
-	in.seekg(0, ios::beg);
-
-	string number = "";
-
-	while (!in.eof())
-	{
-		char c;
-		in.read(&c, 1);
-		if (c == ' ' || c == '\t' || c == '\n')
-		{
-			if (number.size() > 0)
-			{
-				pixelData.push_back(stof(number.c_str()));
-				number = "";
-			}
-		}
-		else
-		{
-			number += c;
-		}
-	}
-	return pixelData;
+	if (!_packedFilename.empty() && ifstream(_packedFilename))
+		return RingProfile::loadPacked(_packedFilename);
+	return RingProfile::loadText(
+		_backscatFilename,
+		_forwardscatFilename,
+		_unlitFilename,
+		_transparencyFilename,
+		_colorFilename);
 }
 
 float Ring::getInnerDistance() const
@@ -272,6 +320,11 @@ string Ring::getColorFilename() const
 	return _colorFilename;
 }
 
+string Ring::getPackedFilename() const
+{
+	return _packedFilename;
+}
+
 Model::Model(
 	const float radius,
 	const double GM,
@@ -422,6 +475,24 @@ string Specular::getFilename() const
 	return _filename;
 }
 
+Heightmap::Heightmap(const string &filename,
+	const float scale) :
+	_filename{filename},
+	_scale{scale}
+{
+
+}
+
+string Heightmap::getFilename() const
+{
+	return _filename;
+}
+
+float Heightmap::getScale() const
+{
+	return _scale;
+}
+
 void EntityParam::setName(const string &name)
 {
 	_name = name;
@@ -477,6 +548,11 @@ void EntityParam::setSpecular(const Specular &specular)
 	_specular = make_pair(true, specular);
 }
 
+void EntityParam::setHeightmap(const Heightmap &heightmap)
+{
+	_heightmap = make_pair(true, heightmap);
+}
+
 bool EntityParam::hasOrbit() const
 {
 	return _orbit.first;
@@ -517,6 +593,11 @@ bool EntityParam::hasSpecular() const
 	return _specular.first;
 }
 
+bool EntityParam::hasHeightmap() const
+{
+	return _heightmap.first;
+}
+
 string EntityParam::getName() const
 {
 	return _name;
@@ -572,6 +653,58 @@ const Specular &EntityParam::getSpecular() const
 	return _specular.second;
 }
 
+const Heightmap &EntityParam::getHeightmap() const
+{
+	return _heightmap.second;
+}
+
+MinorBodies::MinorBodies(
+	const string &parentName,
+	const string &filename,
+	const vec3 &color) :
+	_parentName{parentName},
+	_filename{filename},
+	_color{color}
+{
+
+}
+
+vector<MinorBodies::Elements> MinorBodies::loadFile() const
+{
+	ifstream in(_filename, ios::binary);
+	if (!in) throw runtime_error("Can't open minor body file " + _filename);
+
+	// Header : magic, version, number of bodies
+	char magic[4];
+	uint32_t version = 0;
+	uint32_t count = 0;
+	in.read(magic, sizeof(magic));
+	in.read((char*)&version, sizeof(version));
+	in.read((char*)&count, sizeof(count));
+	if (!in || strncmp(magic, "RMBT", 4) != 0 || version != 1)
+		throw runtime_error("Invalid minor body file " + _filename);
+
+	vector<Elements> elements(count);
+	in.read((char*)elements.data(), count*sizeof(Elements));
+	if (!in) throw runtime_error("Truncated minor body file " + _filename);
+	return elements;
+}
+
+string MinorBodies::getParentName() const
+{
+	return _parentName;
+}
+
+string MinorBodies::getFilename() const
+{
+	return _filename;
+}
+
+vec3 MinorBodies::getColor() const
+{
+	return _color;
+}
+
 EntityState::EntityState(
 	const dvec3 &pos, float rotationAngle, float cloudDisp) :
 	_position{pos},
@@ -628,10 +761,14 @@ bool EntityHandle::operator==(const EntityHandle &h) const
 	return _id == h._id;
 }
 
-void EntityCollection::init(const vector<EntityParam> &param)
+void EntityCollection::init(
+	const vector<EntityParam> &param,
+	const vector<MinorBodies> &minorBodies)
 {
 	_param = param;
-	_state.clear();
+	for (auto &state : _state)
+		state.assign(_param.size(), EntityState());
+	_frontState = 0;
 	_parents.resize(_param.size());
 	// Assign parents
 	for (size_t i=0;i<_param.size();++i)
@@ -663,18 +800,108 @@ void EntityCollection::init(const vector<EntityParam> &param)
 		if (_param.at(i).isBody())
 			_bodies.push_back(h);
 	}
+
+	// Children adjacency
+	const int n = _param.size();
+	_childOffsets.assign(n+1, 0);
+	for (int i=0;i<n;++i)
+	{
+		if (_parents[i] != -1)
+			++_childOffsets[_parents[i]+1];
+	}
+	for (int i=0;i<n;++i)
+		_childOffsets[i+1] += _childOffsets[i];
+	_children.resize(_childOffsets[n]);
+	vector<int> childFill(_childOffsets.begin(), _childOffsets.end()-1);
+	for (int i=0;i<n;++i)
+	{
+		if (_parents[i] != -1)
+			_children[childFill[_parents[i]]++] = createHandle(i);
+	}
+
+	// Parent before child order, starting from roots
+	_hierarchy.clear();
+	_hierarchyIndex.assign(n, -1);
+	_subtreeEnd.assign(n, -1);
+	for (int i=0;i<n;++i)
+	{
+		if (_parents[i] == -1)
+			buildHierarchy(i);
+	}
+	if ((int)_hierarchy.size() != n)
+		throw runtime_error("Entity hierarchy contains a cycle");
+
+	// Orbiting entities, batched for propagation
+	vector<Orbit> orbits;
+	vector<int> orbitIds;
+	for (int i=0;i<(int)_param.size();++i)
+	{
+		if (_parents[i] != -1 && _param[i].hasOrbit())
+		{
+			orbits.push_back(_param[i].getOrbit());
+			orbitIds.push_back(i);
+		}
+	}
+	_orbitPropagator.init(orbits, orbitIds);
+
+	// Minor body parents
+	_minorBodies = minorBodies;
+	_minorBodiesParents.assign(_minorBodies.size(), -1);
+	for (size_t i=0;i<_minorBodies.size();++i)
+	{
+		const string parent = _minorBodies[i].getParentName();
+		for (size_t j=0;j<_param.size();++j)
+		{
+			if (_param[j].getName() == parent)
+			{
+				_minorBodiesParents[i] = j;
+				break;
+			}
+		}
+		if (_minorBodiesParents[i] == -1)
+			throw runtime_error("Minor body parent " + parent + " doesn't exist");
+	}
 }
 
-void EntityCollection::setState(const std::map<EntityHandle, EntityState> &state)
+void EntityCollection::computeRelativePositions(
+	const double epoch, vector<dvec3> &positions, JobSystem *jobs)
 {
-	_state.clear();
-	_state.resize(_param.size());
-	for (auto &p : state)
+	positions.assign(_param.size(), dvec3(0.0));
+	_orbitPropagator.propagate(epoch, positions.data(), jobs);
+}
+
+void EntityCollection::computeAbsolutePositions(
+	const double epoch, vector<dvec3> &positions, JobSystem *jobs)
+{
+	computeRelativePositions(epoch, positions, jobs);
+	// Parents are always visited first, so their position is already absolute
+	for (const auto &h : _hierarchy)
 	{
-		_state[p.first._id] = p.second;
+		const int parent = _parents[h._id];
+		if (parent != -1)
+			positions[h._id] += positions[parent];
 	}
 }
 
+void EntityCollection::buildHierarchy(const int id)
+{
+	_hierarchyIndex[id] = _hierarchy.size();
+	_hierarchy.push_back(createHandle(id));
+	for (int i=_childOffsets[id];i<_childOffsets[id+1];++i)
+		buildHierarchy(_children[i]._id);
+	_subtreeEnd[id] = _hierarchy.size();
+}
+
+vector<EntityState> &EntityCollection::getNextState()
+{
+	return _state[1-_frontState];
+}
+
+void EntityCollection::swapState()
+{
+	_frontState = 1-_frontState;
+}
+
 const vector<EntityHandle> &EntityCollection::getAll() const
 {
 	return _all;
@@ -685,6 +912,26 @@ const vector<EntityHandle> &EntityCollection::getBodies() const
 	return _bodies;
 }
 
+const vector<EntityHandle> &EntityCollection::getHierarchy() const
+{
+	return _hierarchy;
+}
+
+const vector<MinorBodies> &EntityCollection::getMinorBodies() const
+{
+	return _minorBodies;
+}
+
+EntityHandle EntityCollection::getMinorBodiesParent(const size_t group) const
+{
+	return createHandle(_minorBodiesParents.at(group));
+}
+
+const OrbitPropagator &EntityCollection::getOrbitPropagator() const
+{
+	return _orbitPropagator;
+}
+
 EntityHandle EntityHandle::getParent() const
 {
 	if (!exists()) return {};
@@ -705,30 +952,50 @@ vector<EntityHandle> EntityHandle::getAllParents() const
 	return allParents;
 }
 
-vector<EntityHandle> EntityHandle::getChildren() const
+EntityRange EntityHandle::getChildren() const
 {
 	if (!exists()) return {};
-	vector<EntityHandle> children = {};
-	for (size_t i=0;i<_collec->_parents.size();++i)
-	{
-		if (_collec->_parents[i] == _id) 
-			children.push_back(_collec->createHandle(i));
-	}
-	return children;
+	const EntityHandle *children = _collec->_children.data();
+	return EntityRange(
+		children+_collec->_childOffsets[_id],
+		children+_collec->_childOffsets[_id+1]);
 }
 
-vector<EntityHandle> EntityHandle::getAllChildren() const
+EntityRange EntityHandle::getAllChildren() const
 {
 	if (!exists()) return {};
-	auto c = getChildren();
-	vector<EntityHandle> accum = {};
-	for (auto i : c)
-	{
-		auto cc = i.getAllChildren();
-		accum.insert(accum.end(), cc.begin(), cc.end());
-	}
-	c.insert(c.end(), accum.begin(), accum.end());
-	return c;
+	// Subtree is contiguous, skip the entity itself
+	const EntityHandle *hierarchy = _collec->_hierarchy.data();
+	return EntityRange(
+		hierarchy+_collec->_hierarchyIndex[_id]+1,
+		hierarchy+_collec->_subtreeEnd[_id]);
+}
+
+EntityRange::EntityRange(
+	const EntityHandle *begin, const EntityHandle *end) :
+	_begin{begin}, _end{end}
+{
+
+}
+
+const EntityHandle *EntityRange::begin() const
+{
+	return _begin;
+}
+
+const EntityHandle *EntityRange::end() const
+{
+	return _end;
+}
+
+size_t EntityRange::size() const
+{
+	return _end-_begin;
+}
+
+bool EntityRange::empty() const
+{
+	return _begin == _end;
 }
 
 EntityHandle EntityCollection::createHandle(int id) const
@@ -745,5 +1012,5 @@ const EntityParam &EntityCollection::getParam(const EntityHandle &handle) const
 const EntityState &EntityCollection::getState(const EntityHandle &handle) const
 {
 	if (!handle.exists()) throw runtime_error("Entity doesn't exist");
-	return _state.at(handle._id);
+	return _state[_frontState].at(handle._id);
 }
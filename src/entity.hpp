@@ -4,21 +4,26 @@
 #include <vector>
 #include <limits>
 #include <utility>
-#include <map>
 
 #include <glm/glm.hpp>
 
+#include "orbit_propagator.hpp"
+#include "ring_profile.hpp"
+
+class JobSystem;
+
 class Orbit
 {
 public:
 	Orbit() = default;
 	/**
 	 * @param ecc Eccentricity
-	 * @param sma Semi-Major Axis (meters)
+	 * @param sma Semi-Major Axis (meters), periapsis distance for parabolic orbits
 	 * @param inc Inclination (radians)
 	 * @param lan Longitude of ascending node (radians)
 	 * @param arg Argument of periapsis (radians)
-	 * @param period Period of orbit (seconds)
+	 * @param period Period of orbit (seconds), for parabolic and hyperbolic
+	 * orbits the time taken by the mean anomaly to increase by 2pi
 	 * @param m0 Mean anomaly at epoch (radians)
 	 */
 	Orbit(
@@ -30,6 +35,14 @@ public:
 	 * @return cartesian coordinates around parent entity
 	 */
 	glm::dvec3 computePosition(double epoch) const;
+
+	double getEccentricity() const;
+	double getSemiMajorAxis() const;
+	double getInclination() const;
+	double getLongitudeOfAscendingNode() const;
+	double getArgumentOfPeriapsis() const;
+	double getPeriod() const;
+	double getMeanAnomalyAtEpoch() const;
 private:
 	// Kepler orbital parameters (Meters & radians)
 	/// Eccentricity
@@ -63,8 +76,20 @@ public:
 	 * Generate lookup texture for atmosphere rendering
 	 * @param size width and height of texture
 	 * @param radius radius of entity
+	 * @param jobs job system to split rows across cores (optional)
+	 */
+	std::vector<float> generateLookupTable(size_t size, float radius,
+		JobSystem *jobs=nullptr) const;
+	/**
+	 * Loads the lookup texture from a cache file, generating and writing it if
+	 * the file is missing or holds a table of other parameters
+	 * @param size width and height of texture
+	 * @param radius radius of entity
+	 * @param cacheDir directory of cache files
+	 * @param jobs job system to split rows across cores (optional)
 	 */
-	std::vector<float> generateLookupTable(size_t size, float radius) const;
+	std::vector<float> getCachedLookupTable(size_t size, float radius,
+		const std::string &cacheDir, JobSystem *jobs=nullptr) const;
 
 	glm::vec4 getScatteringConstant() const;
 	float getDensity() const;
@@ -94,16 +119,19 @@ public:
 	 * @param unlitFilename unlit side brightness amount
 	 * @param transparencyFilename transparency amount
 	 * @param colorFilename ring color texture
+	 * @param packedFilename profiles packed by ring_pack, used instead of
+	 * the text files when it exists
 	 */
 	Ring(float innerDistance, float outerDistance, glm::vec3 normal,
 		const std::string &backscatFilename,
 		const std::string &forwardscatFilename,
 		const std::string &unlitFilename,
 		const std::string &transparencyFilename,
-		const std::string &colorFilename);
+		const std::string &colorFilename,
+		const std::string &packedFilename = "");
 
-	/** Load txt files for rings */
-	std::vector<float> loadFile(const std::string &filename) const;
+	/** Loads ring profiles, from the packed file if there is one */
+	RingProfile loadProfile() const;
 
 	float getInnerDistance() const;
 	float getOuterDistance() const;
@@ -113,6 +141,7 @@ public:
 	std::string getUnlitFilename() const;
 	std::string getTransparencyFilename() const;
 	std::string getColorFilename() const;
+	std::string getPackedFilename() const;
 private:
 	/// distance from entity center to inner edge
 	float _innerDistance = 0.0;
@@ -127,6 +156,7 @@ private:
 	std::string _unlitFilename;
 	std::string _transparencyFilename;
 	std::string _colorFilename;
+	std::string _packedFilename;
 };
 
 class Model
@@ -242,6 +272,22 @@ private:
 	Mask _mask1;
 };
 
+class Heightmap
+{
+public:
+	Heightmap() = default;
+	/**
+	 * @param filename Height texture filename
+	 * @param scale Height of white areas of the texture (km)
+	 */
+	explicit Heightmap(const std::string &filename, float scale);
+	std::string getFilename() const;
+	float getScale() const;
+private:
+	std::string _filename;
+	float _scale;
+};
+
 /**
  * Fixed state of an entity, unlikely to change
  */
@@ -304,6 +350,11 @@ public:
 	 * @param specular Specular highlight properties
 	 */
 	void setSpecular(const Specular &specular);
+	/**
+	 * Sets the terrain displacement properties of the entity
+	 * @param heightmap Heightmap properties
+	 */
+	void setHeightmap(const Heightmap &heightmap);
 
 	/// Indicates whether the entity is fixed in place or orbits some other entity
 	bool hasOrbit() const;
@@ -321,6 +372,8 @@ public:
 	bool hasNight() const;
 	/// Indicates whether the entity has a reflective surface
 	bool hasSpecular() const;
+	/// Indicates whether the entity has terrain displacement
+	bool hasHeightmap() const;
 
 	/// Returns the name of the entity
 	std::string getName() const;
@@ -344,6 +397,8 @@ public:
 	const Night &getNight() const;
 	/// Returns the specular highlight properties
 	const Specular &getSpecular() const;
+	/// Returns the terrain displacement properties
+	const Heightmap &getHeightmap() const;
 
 private:
 	std::string _name = "Undefined";
@@ -357,6 +412,7 @@ private:
 	std::pair<bool, Clouds> _clouds = std::make_pair(false, Clouds());
 	std::pair<bool, Night> _night = std::make_pair(false, Night());
 	std::pair<bool, Specular> _specular = std::make_pair(false, Specular());
+	std::pair<bool, Heightmap> _heightmap = std::make_pair(false, Heightmap());
 };
 
 /**
@@ -384,7 +440,57 @@ private:
 	float _cloudDisp = 0.0;
 };
 
+/**
+ * Group of small bodies (asteroids, comets...) orbiting the same parent, too
+ * numerous to be entities and only ever rendered as flares
+ */
+class MinorBodies
+{
+public:
+	/// Orbital elements and size of a single body, as stored in the element table
+	struct Elements
+	{
+		/// Eccentricity
+		float ecc;
+		/// Semi-Major Axis
+		float sma;
+		/// Inclination (radians)
+		float inc;
+		/// Longitude of ascending node (radians)
+		float lan;
+		/// Argument of periapsis (radians)
+		float arg;
+		/// Period of orbit (seconds)
+		float period;
+		/// Mean anomaly at epoch (radians)
+		float m0;
+		/// Radius of body
+		float radius;
+	};
+
+	MinorBodies() = default;
+	/**
+	 * @param parentName name of the entity all bodies orbit
+	 * @param filename binary element table filename
+	 * @param color mean color of bodies
+	 */
+	MinorBodies(const std::string &parentName, const std::string &filename,
+		const glm::vec3 &color);
+
+	/** Loads the binary element table */
+	std::vector<Elements> loadFile() const;
+
+	std::string getParentName() const;
+	std::string getFilename() const;
+	glm::vec3 getColor() const;
+private:
+	std::string _parentName;
+	std::string _filename;
+	glm::vec3 _color = glm::vec3(1.0);
+};
+
 class EntityCollection;
+class EntityRange;
 
 class EntityHandle
 {
@@ -398,21 +504,76 @@ public:
 	const EntityState &getState() const;
 	EntityHandle getParent() const;
 	std::vector<EntityHandle> getAllParents() const;
-	std::vector<EntityHandle> getChildren() const;
-	std::vector<EntityHandle> getAllChildren() const;
+	/// Returns direct children, in id order
+	EntityRange getChildren() const;
+	/// Returns all descendants, parents before their children
+	EntityRange getAllChildren() const;
 	bool operator<(const EntityHandle &h) const;
 	bool operator==(const EntityHandle &h) const;
 	friend class EntityCollection;
 };
 
+/**
+ * Contiguous, non-owning range of handles stored in an EntityCollection
+ */
+class EntityRange
+{
+public:
+	EntityRange() = default;
+	EntityRange(const EntityHandle *begin, const EntityHandle *end);
+	const EntityHandle *begin() const;
+	const EntityHandle *end() const;
+	size_t size() const;
+	bool empty() const;
+private:
+	const EntityHandle *_begin = nullptr;
+	const EntityHandle *_end = nullptr;
+};
+
 class EntityCollection
 {
 public:
 	EntityCollection() = default;
-	void init(const std::vector<EntityParam> &param);
-	void setState(const std::map<EntityHandle, EntityState> &state);
+	/**
+	 * Initializes the collection
+	 * @param param parameters of all entities
+	 * @param minorBodies groups of minor bodies orbiting some of the entities
+	 */
+	void init(const std::vector<EntityParam> &param,
+		const std::vector<MinorBodies> &minorBodies = {});
+	/**
+	 * Returns the back state buffer, indexed like getAll(), where the next
+	 * state is written in place while the front buffer is being read
+	 */
+	std::vector<EntityState> &getNextState();
+	/// Makes the back state buffer the current state
+	void swapState();
+	/**
+	 * Computes the position of each entity relative to its parent
+	 * @param epoch epoch in seconds
+	 * @param positions output positions, indexed like getAll()
+	 * @param jobs job system to split orbit propagation with (optional)
+	 */
+	void computeRelativePositions(double epoch, std::vector<glm::dvec3> &positions,
+		JobSystem *jobs=nullptr);
+	/**
+	 * Computes the world space position of each entity
+	 * @param epoch epoch in seconds
+	 * @param positions output positions, indexed like getAll()
+	 * @param jobs job system to split orbit propagation with (optional)
+	 */
+	void computeAbsolutePositions(double epoch, std::vector<glm::dvec3> &positions,
+		JobSystem *jobs=nullptr);
 	const std::vector<EntityHandle> &getAll() const;
 	const std::vector<EntityHandle> &getBodies() const;
+	/// Returns all entities with parents before their children, subtrees being contiguous
+	const std::vector<EntityHandle> &getHierarchy() const;
+	/// Returns all groups of minor bodies
+	const std::vector<MinorBodies> &getMinorBodies() const;
+	/// Returns the entity the minor bodies of given group orbit
+	EntityHandle getMinorBodiesParent(size_t group) const;
+	/// Returns the propagator of all orbits, for solver statistics
+	const OrbitPropagator &getOrbitPropagator() const;
 	friend class EntityHandle;
 private:
 	EntityHandle createHandle(int id) const;
@@ -420,10 +581,31 @@ private:
 	const EntityState &getState(const EntityHandle &handle) const;
 
 	std::vector<EntityParam> _param;
-	std::vector<EntityState> _state;
+	/// Double buffered state, _state[_frontState] is the current one
+	std::vector<EntityState> _state[2];
+	int _frontState = 0;
 
 	std::vector<EntityHandle> _all;
 	std::vector<EntityHandle> _bodies;
 
 	std::vector<int> _parents;
+
+	std::vector<MinorBodies> _minorBodies;
+	/// Parent of each minor body group
+	std::vector<int> _minorBodiesParents;
+
+	/// Appends the subtree of given entity to _hierarchy in preorder
+	void buildHierarchy(int id);
+	/// Entities in preorder
+	std::vector<EntityHandle> _hierarchy;
+	/// Index in _hierarchy of each entity
+	std::vector<int> _hierarchyIndex;
+	/// End index in _hierarchy of each entity's subtree (exclusive)
+	std::vector<int> _subtreeEnd;
+	/// Children of entity i are in [_childOffsets[i], _childOffsets[i+1])
+	std::vector<int> _childOffsets;
+	/// Children of all entities, grouped by parent
+	std::vector<EntityHandle> _children;
+
+	OrbitPropagator _orbitPropagator;
 };
\ No newline at end of file
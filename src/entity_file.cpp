@@ -0,0 +1,358 @@
+#include "entity_file.hpp"
+#include "mapped_file.hpp"
+
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+using namespace glm;
+
+/// Appends values to a snapshot
+class SnapshotWriter
+{
+public:
+	template<class T>
+	void write(const T &value)
+	{
+		_data.append((const char*)&value, sizeof(T));
+	}
+	void write(const string &value)
+	{
+		write((uint32_t)value.size());
+		_data.append(value);
+	}
+	const string &getData() const { return _data; }
+private:
+	string _data;
+};
+
+/// Reads values from a snapshot, throws when reading past the end
+class SnapshotReader
+{
+public:
+	SnapshotReader(const uint8_t *data, size_t size) : _p(data), _end(data+size) {}
+	template<class T>
+	T read()
+	{
+		T value;
+		check(sizeof(T));
+		memcpy(&value, _p, sizeof(T));
+		_p += sizeof(T);
+		return value;
+	}
+	string readString()
+	{
+		const uint32_t size = read<uint32_t>();
+		check(size);
+		const string value((const char*)_p, size);
+		_p += size;
+		return value;
+	}
+	bool isDone() const { return _p == _end; }
+private:
+	void check(size_t size) const
+	{
+		if ((size_t)(_end-_p) < size)
+			throw runtime_error("Truncated entity snapshot");
+	}
+	const uint8_t *_p;
+	const uint8_t *_end;
+};
+
+/// Flags of the optional parts of an entity
+enum EntityParts : uint32_t
+{
+	PART_ORBIT     = 1 << 0,
+	PART_MODEL     = 1 << 1,
+	PART_ATMO      = 1 << 2,
+	PART_RING      = 1 << 3,
+	PART_STAR      = 1 << 4,
+	PART_CLOUDS    = 1 << 5,
+	PART_NIGHT     = 1 << 6,
+	PART_SPECULAR  = 1 << 7,
+	PART_HEIGHTMAP = 1 << 8
+};
+
+uint64_t EntityFile::hash(const string &content)
+{
+	uint64_t h = 14695981039346656037ull;
+	for (const char c : content)
+	{
+		h ^= (unsigned char)c;
+		h *= 1099511628211ull;
+	}
+	return h;
+}
+
+static void writeParam(SnapshotWriter &w, const EntityParam &param)
+{
+	w.write(param.getName());
+	w.write(param.getDisplayName());
+	w.write(param.getParentName());
+
+	uint32_t parts = 0;
+	if (param.hasOrbit())     parts |= PART_ORBIT;
+	if (param.isBody())       parts |= PART_MODEL;
+	if (param.hasAtmo())      parts |= PART_ATMO;
+	if (param.hasRing())      parts |= PART_RING;
+	if (param.isStar())       parts |= PART_STAR;
+	if (param.hasClouds())    parts |= PART_CLOUDS;
+	if (param.hasNight())     parts |= PART_NIGHT;
+	if (param.hasSpecular())  parts |= PART_SPECULAR;
+	if (param.hasHeightmap()) parts |= PART_HEIGHTMAP;
+	w.write(parts);
+
+	if (parts & PART_ORBIT)
+	{
+		const Orbit &o = param.getOrbit();
+		w.write(o.getEccentricity());
+		w.write(o.getSemiMajorAxis());
+		w.write(o.getInclination());
+		w.write(o.getLongitudeOfAscendingNode());
+		w.write(o.getArgumentOfPeriapsis());
+		w.write(o.getPeriod());
+		w.write(o.getMeanAnomalyAtEpoch());
+	}
+	if (parts & PART_MODEL)
+	{
+		const Model &m = param.getModel();
+		w.write(m.getRadius());
+		w.write(m.getGM());
+		w.write(m.getRotationAxis());
+		w.write(m.getRotationPeriod());
+		w.write(m.getMeanColor());
+		w.write(m.getDiffuseFilename());
+	}
+	if (parts & PART_ATMO)
+	{
+		const Atmo &a = param.getAtmo();
+		w.write(a.getScatteringConstant());
+		w.write(a.getDensity());
+		w.write(a.getMaxHeight());
+		w.write(a.getScaleHeight());
+	}
+	if (parts & PART_RING)
+	{
+		const Ring &r = param.getRing();
+		w.write(r.getInnerDistance());
+		w.write(r.getOuterDistance());
+		w.write(r.getNormal());
+		w.write(r.getBackscatFilename());
+		w.write(r.getForwardscatFilename());
+		w.write(r.getUnlitFilename());
+		w.write(r.getTransparencyFilename());
+		w.write(r.getColorFilename());
+		w.write(r.getPackedFilename());
+	}
+	if (parts & PART_STAR)
+	{
+		const Star &s = param.getStar();
+		w.write(s.getBrightness());
+		w.write(s.getFlareFadeInStart());
+		w.write(s.getFlareFadeInEnd());
+		w.write(s.getFlareAttenuation());
+		w.write(s.getFlareMinSize());
+		w.write(s.getFlareMaxSize());
+	}
+	if (parts & PART_CLOUDS)
+	{
+		w.write(param.getClouds().getFilename());
+		w.write(param.getClouds().getPeriod());
+	}
+	if (parts & PART_NIGHT)
+	{
+		w.write(param.getNight().getFilename());
+		w.write(param.getNight().getIntensity());
+	}
+	if (parts & PART_SPECULAR)
+	{
+		const Specular &s = param.getSpecular();
+		w.write(s.getFilename());
+		w.write(s.getMask0().color);
+		w.write(s.getMask0().hardness);
+		w.write(s.getMask1().color);
+		w.write(s.getMask1().hardness);
+	}
+	if (parts & PART_HEIGHTMAP)
+	{
+		w.write(param.getHeightmap().getFilename());
+		w.write(param.getHeightmap().getScale());
+	}
+}
+
+static EntityParam readParam(SnapshotReader &r)
+{
+	EntityParam param;
+	param.setName(r.readString());
+	param.setDisplayName(r.readString());
+	param.setParentName(r.readString());
+
+	const uint32_t parts = r.read<uint32_t>();
+	if (parts & PART_ORBIT)
+	{
+		const double ecc = r.read<double>();
+		const double sma = r.read<double>();
+		const double inc = r.read<double>();
+		const double lan = r.read<double>();
+		const double arg = r.read<double>();
+		const double period = r.read<double>();
+		const double m0 = r.read<double>();
+		param.setOrbit(Orbit(ecc, sma, inc, lan, arg, period, m0));
+	}
+	if (parts & PART_MODEL)
+	{
+		const float radius = r.read<float>();
+		const double GM = r.read<double>();
+		const vec3 rotAxis = r.read<vec3>();
+		const float rotPeriod = r.read<float>();
+		const vec3 meanColor = r.read<vec3>();
+		param.setModel(Model(radius, GM, rotAxis, rotPeriod, meanColor, r.readString()));
+	}
+	if (parts & PART_ATMO)
+	{
+		const vec4 K = r.read<vec4>();
+		const float density = r.read<float>();
+		const float maxHeight = r.read<float>();
+		const float scaleHeight = r.read<float>();
+		param.setAtmo(Atmo(K, density, maxHeight, scaleHeight));
+	}
+	if (parts & PART_RING)
+	{
+		const float inner = r.read<float>();
+		const float outer = r.read<float>();
+		const vec3 normal = r.read<vec3>();
+		const string backscat = r.readString();
+		const string forwardscat = r.readString();
+		const string unlit = r.readString();
+		const string transparency = r.readString();
+		const string color = r.readString();
+		const string packed = r.readString();
+		param.setRing(Ring(inner, outer, normal,
+			backscat, forwardscat, unlit, transparency, color, packed));
+	}
+	if (parts & PART_STAR)
+	{
+		float values[6];
+		for (float &v : values) v = r.read<float>();
+		param.setStar(Star(values[0], values[1], values[2],
+			values[3], values[4], values[5]));
+	}
+	if (parts & PART_CLOUDS)
+	{
+		const string filename = r.readString();
+		param.setClouds(Clouds(filename, r.read<float>()));
+	}
+	if (parts & PART_NIGHT)
+	{
+		const string filename = r.readString();
+		param.setNight(Night(filename, r.read<float>()));
+	}
+	if (parts & PART_SPECULAR)
+	{
+		const string filename = r.readString();
+		Specular::Mask mask0, mask1;
+		mask0.color = r.read<vec3>();
+		mask0.hardness = r.read<float>();
+		mask1.color = r.read<vec3>();
+		mask1.hardness = r.read<float>();
+		param.setSpecular(Specular(filename, mask0, mask1));
+	}
+	if (parts & PART_HEIGHTMAP)
+	{
+		const string filename = r.readString();
+		param.setHeightmap(Heightmap(filename, r.read<float>()));
+	}
+	return param;
+}
+
+bool EntityFile::loadSnapshot(const string &filename, const string &content)
+{
+	unique_ptr<MappedFile> file;
+	try
+	{
+		file.reset(new MappedFile(filename));
+	}
+	catch (const runtime_error &)
+	{
+		return false;
+	}
+
+	Header header;
+	if (file->getSize() < sizeof(Header)) return false;
+	memcpy(&header, file->getData(), sizeof(Header));
+	if (strncmp(header.magic, "RENT", 4) ||
+		header.version != VERSION ||
+		header.sourceSize != content.size() ||
+		header.sourceHash != hash(content))
+	{
+		return false;
+	}
+
+	try
+	{
+		SnapshotReader r(file->getData()+sizeof(Header), file->getSize()-sizeof(Header));
+		EntityFile loaded;
+		loaded.ambientColor = r.read<float>();
+		loaded.startingBody = r.readString();
+		loaded.starMapFilename = r.readString();
+		loaded.starMapIntensity = r.read<float>();
+		loaded.starCatalogFilename = r.readString();
+		loaded.starMagnitudeLimit = r.read<float>();
+
+		const uint32_t entityCount = r.read<uint32_t>();
+		for (uint32_t i=0;i<entityCount;++i)
+			loaded.entities.push_back(readParam(r));
+
+		const uint32_t minorCount = r.read<uint32_t>();
+		for (uint32_t i=0;i<minorCount;++i)
+		{
+			const string parentName = r.readString();
+			const string minorFilename = r.readString();
+			loaded.minorBodies.push_back(
+				MinorBodies(parentName, minorFilename, r.read<vec3>()));
+		}
+		if (!r.isDone()) return false;
+		*this = loaded;
+	}
+	catch (const runtime_error &)
+	{
+		return false;
+	}
+	return true;
+}
+
+void EntityFile::saveSnapshot(const string &filename, const string &content) const
+{
+	SnapshotWriter w;
+	w.write(ambientColor);
+	w.write(startingBody);
+	w.write(starMapFilename);
+	w.write(starMapIntensity);
+	w.write(starCatalogFilename);
+	w.write(starMagnitudeLimit);
+
+	w.write((uint32_t)entities.size());
+	for (const EntityParam &param : entities)
+		writeParam(w, param);
+
+	w.write((uint32_t)minorBodies.size());
+	for (const MinorBodies &mb : minorBodies)
+	{
+		w.write(mb.getParentName());
+		w.write(mb.getFilename());
+		w.write(mb.getColor());
+	}
+
+	Header header{};
+	memcpy(header.magic, "RENT", 4);
+	header.version = VERSION;
+	header.sourceHash = hash(content);
+	header.sourceSize = content.size();
+
+	ofstream out(filename, ios::binary);
+	if (!out) return;
+	out.write((const char*)&header, sizeof(Header));
+	out.write(w.getData().data(), w.getData().size());
+}
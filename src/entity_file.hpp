@@ -0,0 +1,60 @@
+#pragma once
+
+#include "entity.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/**
+ * Resolved contents of the entity file, as given to EntityCollection::init()
+ *
+ * Parsing the SHAUN file can be skipped with a binary snapshot of these
+ * values, valid as long as the hash of the source file matches. Snapshot
+ * layout (little endian):
+ * - Header
+ * - Scene values, entities then minor bodies, strings as a 32 bit length
+ * followed by the characters
+ */
+struct EntityFile
+{
+	/// Snapshot file header
+	struct Header
+	{
+		/// "RENT"
+		char magic[4];
+		uint32_t version;
+		/// Hash of the source file contents
+		uint64_t sourceHash;
+		/// Size of the source file, to rule out most hash collisions
+		uint64_t sourceSize;
+	};
+
+	/// Current snapshot format version, to increase when EntityParam changes
+	static const uint32_t VERSION = 2;
+
+	/// Returns the hash of the source file contents (64 bit FNV-1a)
+	static uint64_t hash(const std::string &content);
+	/**
+	 * Loads a snapshot
+	 * @param filename snapshot file path
+	 * @param content source file contents
+	 * @return false if the snapshot is missing, invalid or of another source
+	 */
+	bool loadSnapshot(const std::string &filename, const std::string &content);
+	/**
+	 * Writes a snapshot, not being able to only costs the parsing next time
+	 * @param filename snapshot file path
+	 * @param content source file contents
+	 */
+	void saveSnapshot(const std::string &filename, const std::string &content) const;
+
+	float ambientColor = 0.0;
+	std::string startingBody;
+	std::string starMapFilename;
+	float starMapIntensity = 1.0;
+	std::string starCatalogFilename;
+	float starMagnitudeLimit = 6.5;
+	std::vector<EntityParam> entities;
+	std::vector<MinorBodies> minorBodies;
+};
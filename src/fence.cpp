@@ -1,4 +1,5 @@
 #include "fence.hpp"
+#include "cpu_profiler.hpp"
 
 #include <stdexcept>
 
@@ -34,7 +35,10 @@ bool Fence::waitClient(int64_t timeout)
 {
 	if (!sync) return true;
 
+	// Polls are too frequent to be worth recording
+	if (timeout != 0) CPUProfiler::begin("Fence wait");
 	const GLenum ret = glClientWaitSync(sync, 0, (timeout == -1)?criticalWaitTime:timeout);
+	if (timeout != 0) CPUProfiler::end();
 
 	if (ret == GL_CONDITION_SATISFIED ||
 		ret == GL_ALREADY_SIGNALED) return true;
@@ -1,4 +1,3 @@
-#include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
 
@@ -15,11 +14,26 @@
 #include <sstream>
 #include <iomanip>
 #include <fstream>
+#include <iterator>
 #include <stdexcept>
 #include <ctime>
 
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
 #include "renderer.hpp"
 #include "renderer_gl.hpp"
+#ifdef USE_VULKAN
+#include "renderer_vk.hpp"
+#endif
+#include "cpu_profiler.hpp"
+#include "entity_file.hpp"
 
 #include <SHAUN/sweeper.hpp>
 #include <SHAUN/parser.hpp>
@@ -33,12 +47,21 @@ string generateScreenshotName();
 
 Game::Game()
 {
-	_renderer.reset(new RendererGL());
 }
 
 Game::~Game()
 {
-	_renderer->destroy();
+	if (_simThread.joinable())
+	{
+		{
+			lock_guard<mutex> lk(_simMtx);
+			_killSim = true;
+		}
+		_simCond.notify_all();
+		_simThread.join();
+	}
+
+	if (_renderer) _renderer->destroy();
 
 	glfwTerminate();
 }
@@ -61,9 +84,70 @@ void Game::loadSettingsFile()
 		}
 
 		shaun::sweeper graphics(swp("graphics"));
+		shaun::sweeper api(graphics("api"));
+		if (!api.is_null())
+		{
+			const string name = api.value<shaun::string>();
+			_graphicsApi = name;
+		}
 		_maxTexSize = graphics("maxTexSize").value<shaun::number>();
 		_msaaSamples = graphics("msaaSamples").value<shaun::number>();
 		_syncTexLoading = graphics("syncTexLoading").value<shaun::boolean>();
+		shaun::sweeper streamThreads(graphics("streamThreads"));
+		_streamThreads = (streamThreads.is_null())?0:(int)streamThreads.value<shaun::number>();
+		shaun::sweeper texBudget(graphics("texBudget"));
+		_texBudget = (texBudget.is_null())?1024:(int)texBudget.value<shaun::number>();
+		shaun::sweeper sparseTextures(graphics("sparseTextures"));
+		_sparseTextures = (sparseTextures.is_null())?false:
+			(bool)sparseTextures.value<shaun::boolean>();
+		shaun::sweeper computeBloom(graphics("computeBloom"));
+		_computeBloom = (computeBloom.is_null())?true:
+			(bool)computeBloom.value<shaun::boolean>();
+		shaun::sweeper targetFrameTime(graphics("targetFrameTime"));
+		_targetFrameTime = (targetFrameTime.is_null())?0.0:
+			(float)targetFrameTime.value<shaun::number>();
+		shaun::sweeper minRenderScale(graphics("minRenderScale"));
+		_minRenderScale = (minRenderScale.is_null())?0.5:
+			(float)minRenderScale.value<shaun::number>();
+		shaun::sweeper screenshotTiles(graphics("screenshotTiles"));
+		_screenshotTiles = (screenshotTiles.is_null())?2:
+			(int)screenshotTiles.value<shaun::number>();
+
+		shaun::sweeper record(swp("record"));
+		if (!record.is_null())
+		{
+			shaun::sweeper fps(record("fps"));
+			if (!fps.is_null()) _recordFps = fps.value<shaun::number>();
+			shaun::sweeper tiles(record("tiles"));
+			if (!tiles.is_null()) _recordTiles = (int)tiles.value<shaun::number>();
+			shaun::sweeper folder(record("folder"));
+			if (!folder.is_null())
+			{
+				const string name = folder.value<shaun::string>();
+				_recordFolder = name;
+			}
+			shaun::sweeper pipe(record("pipe"));
+			if (!pipe.is_null())
+			{
+				const string command = pipe.value<shaun::string>();
+				_recordPipe = command;
+			}
+		}
+
+		shaun::sweeper jobThreads(graphics("jobThreads"));
+		_jobThreads = (jobThreads.is_null())?0:(int)jobThreads.value<shaun::number>();
+		shaun::sweeper pipelineSimulation(graphics("pipelineSimulation"));
+		_pipelineSimulation = (pipelineSimulation.is_null())?false:
+			(bool)pipelineSimulation.value<shaun::boolean>();
+		shaun::sweeper framesInFlight(graphics("framesInFlight"));
+		_framesInFlight = (framesInFlight.is_null())?3:
+			(int)framesInFlight.value<shaun::number>();
+		shaun::sweeper lowLatency(graphics("lowLatency"));
+		_lowLatency = (lowLatency.is_null())?false:
+			(bool)lowLatency.value<shaun::boolean>();
+		shaun::sweeper idleFps(graphics("idleFps"));
+		_idleFps = (idleFps.is_null())?1.0:
+			(float)idleFps.value<shaun::number>();
 
 		shaun::sweeper controls(swp("controls"));
 		_sensitivity = controls("sensitivity").value<shaun::number>();
@@ -98,12 +182,19 @@ void Game::scrollFun(int offset)
 	}
 }
 
-void Game::init()
+void Game::init(const string &benchmarkFile)
 {
+	CPUProfiler::setThreadName("Main");
 	loadSettingsFile();
-	loadEntityFiles();
+	if (!benchmarkFile.empty()) loadBenchmarkFile(benchmarkFile);
+	_jobs.init(_jobThreads);
+	_startup.init(0);
+	if (_pipelineSimulation)
+		_simThread = thread(&Game::simulationWork, this);
 
-	_viewPolar.z = getFocusedBody().getParam().getModel().getRadius()*4;
+	// Parsed while the window and context are created
+	const TaskGraph::Task entityTask = _startup.add("Entities", 
+		[this]{ loadEntityFiles();});
 
 	// Window & context creation
 	glfwSetErrorCallback([](int error, const char* desc) {
@@ -119,6 +210,17 @@ void Game::init()
 	glfwWindowHint(GLFW_BLUE_BITS, mode->blueBits);
 	glfwWindowHint(GLFW_REFRESH_RATE, mode->refreshRate);
 	glfwWindowHint(GLFW_SRGB_CAPABLE, GLFW_TRUE);
+
+#ifdef USE_VULKAN
+	if (_graphicsApi == "vulkan")
+		_renderer.reset(new RendererVK());
+#endif
+	if (!_renderer)
+	{
+		if (_graphicsApi != "gl")
+			cerr << "Unknown graphics API " << _graphicsApi << ", using gl" << endl;
+		_renderer.reset(new RendererGL());
+	}
 	_renderer->windowHints();
 
 	if (_fullscreen)
@@ -141,26 +243,57 @@ void Game::init()
 	glfwSetScrollCallback(_win, [](GLFWwindow* win, double, double yoffset){
 		((Game*)glfwGetWindowUserPointer(win))->scrollFun(yoffset);
 	});
-	glfwMakeContextCurrent(_win);
+	glfwSetKeyCallback(_win, [](GLFWwindow* win, int, int, int action, int){
+		if (action == GLFW_PRESS) ((Game*)glfwGetWindowUserPointer(win))->_anyInput = true;
+	});
+	glfwSetMouseButtonCallback(_win, [](GLFWwindow* win, int, int action, int){
+		if (action == GLFW_PRESS) ((Game*)glfwGetWindowUserPointer(win))->_anyInput = true;
+	});
+	glfwSetWindowRefreshCallback(_win, [](GLFWwindow* win){
+		((Game*)glfwGetWindowUserPointer(win))->_redraw = true;
+	});
+	// Benchmarks choose whether to wait for vertical sync, the driver does otherwise
+	_renderer->initWindow(_win, _benchmark?(_benchmarkVsync?1:0):-1);
 
-	glewExperimental = true;
-	const GLenum err = glewInit();
-	if (err != GLEW_OK)
+	_startup.wait(entityTask);
+	if (_benchmark)
 	{
-		throw runtime_error("Can't initialize GLEW : " + string((const char*)glewGetErrorString(err)));
+		// Bodies of the path are known once entities are loaded
+		const auto &bodies = _entityCollection.getBodies();
+		for (auto &key : _benchmarkPath)
+		{
+			auto it = find_if(bodies.begin(), bodies.end(), [&](const EntityHandle &h){
+				return h.getParam().getName() == key.body;});
+			if (it == bodies.end())
+				throw runtime_error("Unknown benchmark body " + key.body);
+			key.bodyId = it-bodies.begin();
+		}
+		_focusedBodyId = _benchmarkPath.front().bodyId;
 	}
+	_viewPolar.z = getFocusedBody().getParam().getModel().getRadius()*4;
 
 	// Set _epoch as current time (get time since 1970 + adjust for 2017)
-	_epoch = (long)time(NULL) - 1483228800;
+	_epoch = _benchmark?_benchmarkEpoch:(long)time(NULL) - 1483228800;
 
 	// Renderer init
 	_renderer->init({
 		&_entityCollection, 
 		_starMapFilename, 
 		_starMapIntensity, 
+		_starCatalogFilename,
+		_starMagnitudeLimit,
 		_msaaSamples, 
 		_maxTexSize, 
 		_syncTexLoading, 
+		_streamThreads, 
+		_texBudget, 
+		_sparseTextures,
+		_computeBloom,
+		_targetFrameTime,
+		_minRenderScale,
+		_framesInFlight,
+		&_jobs,
+		&_startup,
 		_width, _height});
 }
 
@@ -262,7 +395,8 @@ Ring parseRing(shaun::sweeper &ringsw, const mat3 &axialMat)
 		get<string>(ringsw("forwardscat")),
 		get<string>(ringsw("unlit")),
 		get<string>(ringsw("transparency")),
-		get<string>(ringsw("color")));
+		get<string>(ringsw("color")),
+		get<string>(ringsw("packed")));
 }
 
 Star parseStar(shaun::sweeper &starsw)
@@ -302,25 +436,41 @@ Specular parseSpecular(shaun::sweeper &specsw)
 		 (float)get<double>(mask1("hardness"))});
 }
 
-void Game::loadEntityFiles()
+Heightmap parseHeightmap(shaun::sweeper &heightsw)
+{
+	return Heightmap(
+		get<string>(heightsw("filename")),
+		get<double>(heightsw("scale")));
+}
+
+EntityFile parseEntityFile(const string &content)
 {
 	try
 	{
-		shaun::object obj = shaun::parse_file("config/entities.sn");
+		shaun::object obj = shaun::parse(content);
 		shaun::sweeper swp(obj);
+		EntityFile file;
 
-		_ambientColor = (float)get<double>(swp("ambientColor"));
-		string startingBody = swp("startingBody").value<shaun::string>();
+		file.ambientColor = (float)get<double>(swp("ambientColor"));
+		const string startingBody = swp("startingBody").value<shaun::string>();
+		file.startingBody = startingBody;
 
 		shaun::sweeper starMap(swp("starMap"));
-		_starMapFilename = get<string>(starMap("diffuse"));
-		_starMapIntensity = (float)get<double>(starMap("intensity"));
+		file.starMapFilename = get<string>(starMap("diffuse"));
+		file.starMapIntensity = (float)get<double>(starMap("intensity"));
+		shaun::sweeper catalog(starMap("catalog"));
+		if (!catalog.is_null())
+		{
+			const string catalogFilename = catalog.value<shaun::string>();
+			file.starCatalogFilename = catalogFilename;
+		}
+		shaun::sweeper magnitudeLimit(starMap("magnitudeLimit"));
+		if (!magnitudeLimit.is_null())
+			file.starMagnitudeLimit = (float)magnitudeLimit.value<shaun::number>();
 
 		const float axialTilt = radians(get<double>(swp("axialTilt")));
 		const mat3 axialMat = mat3(rotate(mat4(), axialTilt, vec3(0,-1,0)));
 
-		vector<EntityParam> entities;
-
 		shaun::sweeper barycenterSw(swp("barycenters"));
 		for (int i=0;i<(int)barycenterSw.size();++i)
 		{
@@ -334,7 +484,7 @@ void Game::loadEntityFiles()
 			{
 				entity.setOrbit(parseOrbit(orbitsw));
 			}
-			entities.push_back(entity);
+			file.entities.push_back(entity);
 		}
 
 		shaun::sweeper bodySweeper(swp("bodies"));
@@ -390,19 +540,24 @@ void Game::loadEntityFiles()
 			{
 				entity.setSpecular(parseSpecular(specsw));
 			}
-			entities.push_back(entity);
+			shaun::sweeper heightsw(bd("heightmap"));
+			if (!heightsw.is_null())
+			{
+				entity.setHeightmap(parseHeightmap(heightsw));
+			}
+			file.entities.push_back(entity);
 		}
-		_entityCollection.init(entities);
 
-		// Set focused body
-		for (int i=0;i<(int)_entityCollection.getBodies().size();++i)
+		shaun::sweeper minorSweeper(swp("minorBodies"));
+		for (int i=0;i<(int)minorSweeper.size();++i)
 		{
-			if (_entityCollection.getBodies()[i].getParam().getName() == startingBody)
-			{
-				_focusedBodyId = i;
-				break;
-			}
+			shaun::sweeper mb(minorSweeper[i]);
+			file.minorBodies.push_back(MinorBodies(
+				mb("parent").value<shaun::string>(),
+				mb("file").value<shaun::string>(),
+				get<vec3>(mb("color"))));
 		}
+		return file;
 	}
 	catch (const shaun::exception &e)
 	{
@@ -410,6 +565,84 @@ void Game::loadEntityFiles()
 	}
 }
 
+void Game::loadEntityFiles()
+{
+	const string filename = "config/entities.sn";
+	ifstream in(filename, ios::binary);
+	if (!in) throw runtime_error("Can't open entity file " + filename);
+	const string content((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+
+	// Parsed values are kept while the file doesn't change
+	const string snapshotFile = "cache/entities.bin";
+	EntityFile file;
+	if (!file.loadSnapshot(snapshotFile, content))
+	{
+		file = parseEntityFile(content);
+		file.saveSnapshot(snapshotFile, content);
+	}
+
+	_ambientColor = file.ambientColor;
+	_starMapFilename = file.starMapFilename;
+	_starMapIntensity = file.starMapIntensity;
+	_starCatalogFilename = file.starCatalogFilename;
+	_starMagnitudeLimit = file.starMagnitudeLimit;
+	_entityCollection.init(file.entities, file.minorBodies);
+
+	// Set focused body
+	for (int i=0;i<(int)_entityCollection.getBodies().size();++i)
+	{
+		if (_entityCollection.getBodies()[i].getParam().getName() == file.startingBody)
+		{
+			_focusedBodyId = i;
+			break;
+		}
+	}
+}
+
+void Game::loadBenchmarkFile(const string &filename)
+{
+	try
+	{
+		shaun::object obj = shaun::parse_file(filename);
+		shaun::sweeper swp(obj);
+		shaun::sweeper bench(swp("benchmark"));
+
+		_benchmarkEpoch = get<double>(bench("epoch"));
+		_benchmarkTimeStep = get<double>(bench("timeStep"));
+		_benchmarkFrames = (int)get<double>(bench("frames"));
+		_benchmarkWarmup = (int)get<double>(bench("warmup"));
+		_benchmarkVsync = get<bool>(bench("vsync"));
+		const string output = get<string>(bench("output"));
+		if (!output.empty()) _benchmarkOutput = output;
+
+		shaun::sweeper path(bench("path"));
+		for (int i=0;i<(int)path.size();++i)
+		{
+			shaun::sweeper key(path[i]);
+			const double fovy = get<double>(key("fovy"));
+			_benchmarkPath.push_back({
+				(int)get<double>(key("frame")),
+				get<string>(key("body")), 0,
+				vec3(
+					radians(get<double>(key("theta"))),
+					radians(get<double>(key("phi"))),
+					get<double>(key("distance"))),
+				(float)radians((fovy>0)?fovy:40.0)});
+		}
+	}
+	catch (const shaun::exception &e)
+	{
+		throw runtime_error("Error when parsing benchmark file :\n" + e.to_string());
+	}
+	if (_benchmarkPath.empty() || _benchmarkFrames <= 0)
+		throw runtime_error("Benchmark file needs frames and a path : " + filename);
+
+	// Keyframes on the same frame are kept in order, as cuts
+	stable_sort(_benchmarkPath.begin(), _benchmarkPath.end(),
+		[](const BenchmarkKey &a, const BenchmarkKey &b){ return a.frame < b.frame;});
+	_benchmark = true;
+}
+
 bool Game::isPressedOnce(const int key)
 {
 	if (glfwGetKey(_win, key))
@@ -497,48 +730,84 @@ string getFormattedTime(long _epochInSeconds)
 		format(seconds) + " UTC";
 }
 
-void Game::update(const double dt)
+void Game::updateLoading()
 {
-	_epoch += _timeWarpValues[_timeWarpIndex]*dt;
-
-	map<EntityHandle, dvec3> relativePositions;
-	// Entity state update
-	for (const auto &h : _entityCollection.getAll())
+	// Benchmarks start as soon as loading is done
+	if (_loaded && (_anyInput || _benchmark))
 	{
-		relativePositions[h] = (!h.getParent().exists() || !h.getParam().hasOrbit())?
-			dvec3(0.0):
-			h.getParam().getOrbit().computePosition(_epoch);
+		_loading = false;
+		// Don't let the closing input act on the scene
+		_keysHeld.set();
+		glfwGetCursorPos(_win, &_preMousePosX, &_preMousePosY);
+		return;
 	}
+	// Inputs given during loading don't count
+	if (!_loaded) _anyInput = false;
+
+	Renderer::LoadingInfo info;
+	info.lines = {
+		"Left click + drag: rotate view",
+		"Right click + drag: pan view",
+		"Scroll: zoom, Ctrl + scroll: exposure, Alt + scroll: field of view",
+		"Tab / Shift + Tab: next / previous body",
+		"K / L: slower / faster time, B: bloom, W: wireframe",
+		"F5: profiler, F12: screenshot, Escape: quit"};
+	if (_loaded) info.lines.push_back("Press any key to start");
+	_loaded = _renderer->loadStep(info);
+
+	_renderer->present();
+	glfwPollEvents();
+}
 
-	map<EntityHandle, EntityState> state;
-
-	// Entity absolute position update
-	for (auto h : _entityCollection.getAll())
+void Game::update(const double dt)
+{
+	CPUProfiler::Scope scope("Game update");
+	if (_loading)
+	{
+		updateLoading();
+		return;
+	}
+	// Waiting for the GPU before sampling input instead of when the frame
+	// is submitted, so that the input is shown as soon as possible
+	if (_lowLatency)
 	{
-		dvec3 absPosition = relativePositions[h];
-		auto parent = h.getParent();
-		while (parent.exists())
+		_renderer->waitFrame();
+		glfwPollEvents();
+	}
+	const uint64_t frameStart = CPUProfiler::now();
+
+	// Recording advances time by exactly one frame once the previous one is
+	// read back, whatever the real frame time
+	const bool recordFrame = _recording && !_renderer->isCapturing() &&
+		_renderer->getPendingScreenshots() < RECORD_BACKLOG;
+	const double stepDt = _recording?(recordFrame?1.0/_recordFps:0.0):dt;
+
+	// Tiles of big screenshots all show the same simulation time, benchmarks
+	// advance by a fixed step per frame
+	if (_benchmark)
+		_epoch = _benchmarkEpoch+_benchmarkFrame*_benchmarkTimeStep;
+	else if (!_renderer->isCapturing())
+		_epoch += _timeWarpValues[_timeWarpIndex]*stepDt;
+
+	if (_pipelineSimulation)
+	{
+		// State simulated while the previous frame was rendered, this frame's
+		// epoch is simulated while this one is
+		if (_simStarted) _stateEpoch = waitSimulation();
+		else
 		{
-			absPosition += relativePositions[parent];
-			parent = parent.getParent();
+			simulate(_epoch);
+			_stateEpoch = _epoch;
 		}
-
-		// Entity Angle
-		const float rotationAngle = 
-			(2.0*pi<float>())*
-			fmod(_epoch/h.getParam().getModel().getRotationPeriod(),1.f);
-
-		// Cloud Displacement
-		const float cloudDisp = [&]{
-			if (h.getParam().hasClouds()) return 0.0;
-			const float period = h.getParam().getClouds().getPeriod();
-			return (period)?fmod(-_epoch/period, 1.f):0.f;
-		}();
-
-		state[h] = EntityState(absPosition, rotationAngle, cloudDisp);
+		_entityCollection.swapState();
+		startSimulation(_epoch);
+	}
+	else
+	{
+		simulate(_epoch);
+		_stateEpoch = _epoch;
+		_entityCollection.swapState();
 	}
-
-	_entityCollection.setState(state);
 	
 	// Wireframe on/off
 	if (isPressedOnce(GLFW_KEY_W))
@@ -555,18 +824,23 @@ void Game::update(const double dt)
 	// Mouse move
 	double posX, posY;
 	glfwGetCursorPos(_win, &posX, &posY);
+	const uint64_t inputTime = CPUProfiler::now();
 
-	if (_switchPhase == SwitchPhase::IDLE)
+	if (_benchmark)
 	{
-		updateIdle(dt, posX, posY);
+		updateBenchmarkView();
+	}
+	else if (_switchPhase == SwitchPhase::IDLE)
+	{
+		updateIdle(stepDt, posX, posY);
 	}
 	else if (_switchPhase == SwitchPhase::TRACK)
 	{
-		updateTrack(dt);
+		updateTrack(stepDt);
 	}
 	else if (_switchPhase == SwitchPhase::MOVE)
 	{
-		updateMove(dt);
+		updateMove(stepDt);
 	}
 
 	// Mouse reset
@@ -576,7 +850,24 @@ void Game::update(const double dt)
 	// Screenshot
 	if (isPressedOnce(GLFW_KEY_F12))
 	{
-		_renderer->takeScreenshot(generateScreenshotName());
+		// Shift for an image bigger than the window
+		const bool big = glfwGetKey(_win, GLFW_KEY_LEFT_SHIFT);
+		_renderer->takeScreenshot(generateScreenshotName(),
+			big?_screenshotTiles:1);
+	}
+
+	// Recording
+	if (isPressedOnce(GLFW_KEY_F9))
+	{
+		toggleRecording();
+	}
+	if (recordFrame)
+	{
+		stringstream filename;
+		if (_recordPipe.empty())
+			filename << _recordName << setfill('0') << setw(6) << _recordFrame << ".png";
+		_renderer->takeScreenshot(filename.str(), _recordTiles);
+		++_recordFrame;
 	}
 
 	// Focused entities
@@ -584,41 +875,229 @@ void Game::update(const double dt)
 		getTexLoadBodies(getFocusedBody());
 
 	// Time formatting
-	const long _epochInSeconds = floor(_epoch);
+	const long _epochInSeconds = floor(_stateEpoch);
 	const string formattedTime = getFormattedTime(_epochInSeconds);
 		
+	// The view is sampled again by the renderer right before it is used,
+	// only when dragging it around the focused body
+	std::function<uint64_t(dvec3&, mat3&)> latchView;
+	if (_lowLatency && !_benchmark && _switchPhase == SwitchPhase::IDLE)
+	{
+		latchView = [this](dvec3 &viewPos, mat3 &viewDir)
+		{
+			return latchIdleView(viewPos, viewDir);
+		};
+	}
+		
+	// Idle mode: once the scene is static, the last frame stays on screen
+	// and a frame is only rendered at the idle rate, until anything changes
+	bool idle = false;
+	if (_idleFps > 0 && !_benchmark && !_recording &&
+		_switchPhase == SwitchPhase::IDLE && !_redraw &&
+		!_renderer->isBusy() && isSceneStatic(formattedTime))
+	{
+		++_staticFrames;
+		_idleTime += dt;
+		idle = _staticFrames > IDLE_FRAMES && _idleTime < 1.0/_idleFps;
+	}
+	else
+	{
+		_staticFrames = 0;
+	}
+
 	// Scene rendering
-	_renderer->render({
-		_viewPos, _viewFovy, _viewDir,
-		_exposure, _ambientColor, _wireframe, _bloom, texLoadBodies, 
-		getDisplayedBody().getParam().getDisplayName(),
-		_bodyNameFade, formattedTime});
+	if (!idle)
+	{
+		_renderer->render({
+			_viewPos, _viewFovy, _viewDir,
+			_exposure, _ambientColor, _wireframe, _bloom, texLoadBodies, 
+			getDisplayedBody().getParam().getDisplayName(),
+			_bodyNameFade, formattedTime, _stateEpoch,
+			inputTime, latchView});
+		keepRenderedState(formattedTime);
+		_idleTime = 0.0;
+		_redraw = false;
+	}
+
+	// Profiler statistics and trace export
+	if (isPressedOnce(GLFW_KEY_F5))
+	{
+		const auto p = _renderer->getProfilerStats();
+		const auto s = _renderer->getStreamingStats();
+		displayProfiling(p);
+		cout << "Streaming: " << endl;
+		displayStreamingStats(s);
+		const Renderer::LatencyStats l = _renderer->getLatencyStats();
+		if (l.frames > 0)
+		{
+			cout << "Latency (ms): last " << l.last/1E6 << ", avg " << l.avg/1E6
+				<< ", p99 " << l.p99/1E6 << ", max " << l.max/1E6 << endl;
+		}
+		dumpProfiling("profiling.json", p, s, l);
+		if (_renderer->writeProfilerTrace("profiling_trace.json"))
+			cout << "Trace written to profiling_trace.json" << endl;
+		// Solver statistics are atomic, the simulation thread may be propagating
+		const OrbitPropagator &orbits = _entityCollection.getOrbitPropagator();
+		cout << "Kepler solver: " << orbits.getIterationCount() << " iterations for "
+			<< orbits.size() << " orbits (max " << orbits.getMaxIterationCount() << ")" << endl;
+	}
 
-	auto a = _renderer->getProfilerTimes();
+	const uint64_t cpuEnd = CPUProfiler::now();
+	if (idle)
+	{
+		// Input wakes the update up right away
+		glfwWaitEventsTimeout(IDLE_WAIT);
+		return;
+	}
+	_renderer->present();
+	glfwPollEvents();
 
-	updateProfiling(a);
+	if (_benchmark) measureBenchmarkFrame(frameStart, cpuEnd);
+}
 
-	// Display profiler in console
-	if (isPressedOnce(GLFW_KEY_F5) && !a.empty())
+bool Game::isSceneStatic(const string &formattedTime)
+{
+	const RenderedState &r = _rendered;
+	if (r.fovy != _viewFovy || r.exposure != _exposure ||
+		r.wireframe != _wireframe || r.bloom != _bloom ||
+		r.bodyNameFade != _bodyNameFade || r.time != formattedTime)
+		return false;
+
+	// Angles in radians under which motion is less than the threshold
+	const float threshold = IDLE_MOTION*_viewFovy/_height;
+	for (int i=0;i<3;++i)
 	{
-		cout << "Current Frame: " << endl;
-		displayProfiling(a);
-		auto b = computeAverage(_fullTimes, _numFrames);
-		cout << "Average: " << endl;
-		displayProfiling(b);
-		cout << "Max: " << endl;
-		displayProfiling(_maxTimes);
+		if (length(r.viewDir[i]-_viewDir[i]) > threshold) return false;
 	}
 
-	glfwSwapBuffers(_win);
-	glfwPollEvents();
+	const auto &entities = _entityCollection.getAll();
+	if (r.positions.size() != entities.size()) return false;
+	for (size_t i=0;i<entities.size();++i)
+	{
+		const EntityHandle h = entities[i];
+		const EntityState &state = h.getState();
+		const dvec3 position = state.getPosition()-_viewPos;
+		const double distance = length(position);
+		// Displacement of the body, and of points of its surface by rotation
+		// and cloud motion
+		const double radius = h.getParam().getModel().getRadius();
+		const double motion = length(position-r.positions[i])+radius*(
+			abs(state.getRotationAngle()-r.angles[i])+
+			2*pi<double>()*abs(state.getCloudDisp()-r.clouds[i]));
+		if (motion > threshold*distance) return false;
+	}
+	return true;
+}
+
+void Game::keepRenderedState(const string &formattedTime)
+{
+	RenderedState &r = _rendered;
+	r.viewDir = _viewDir;
+	r.fovy = _viewFovy;
+	r.exposure = _exposure;
+	r.wireframe = _wireframe;
+	r.bloom = _bloom;
+	r.bodyNameFade = _bodyNameFade;
+	r.time = formattedTime;
+	const auto &entities = _entityCollection.getAll();
+	r.positions.resize(entities.size());
+	r.angles.resize(entities.size());
+	r.clouds.resize(entities.size());
+	for (size_t i=0;i<entities.size();++i)
+	{
+		const EntityState &state = entities[i].getState();
+		r.positions[i] = state.getPosition()-_viewPos;
+		r.angles[i] = state.getRotationAngle();
+		r.clouds[i] = state.getCloudDisp();
+	}
+}
+
+void Game::simulate(const double epoch)
+{
+	CPUProfiler::Scope scope("Simulation");
+	// Entity absolute position update
+	_entityCollection.computeAbsolutePositions(epoch, _entityPositions, &_jobs);
+
+	// Entity state update, written in place in the back buffer
+	vector<EntityState> &state = _entityCollection.getNextState();
+	_jobs.parallelFor(_entityPositions.size(), 64,
+		[&](const size_t begin, const size_t end, size_t)
+	{
+		for (size_t i=begin;i<end;++i)
+		{
+			const EntityHandle h = _entityCollection.getAll()[i];
+			const dvec3 absPosition = _entityPositions[i];
+
+			// Entity Angle
+			const float rotationAngle = 
+				(2.0*pi<float>())*
+				fmod(epoch/h.getParam().getModel().getRotationPeriod(),1.f);
+
+			// Cloud Displacement
+			const float cloudDisp = [&]{
+				if (h.getParam().hasClouds()) return 0.0;
+				const float period = h.getParam().getClouds().getPeriod();
+				return (period)?fmod(-epoch/period, 1.f):0.f;
+			}();
+
+			state[i] = EntityState(absPosition, rotationAngle, cloudDisp);
+		}
+	});
+}
+
+void Game::simulationWork()
+{
+	CPUProfiler::setThreadName("Simulation");
+	while (true)
+	{
+		double epoch;
+		{
+			unique_lock<mutex> lk(_simMtx);
+			_simCond.wait(lk, [this]{ return _killSim || _simPending;});
+			if (_killSim) return;
+			epoch = _simEpoch;
+		}
+
+		simulate(epoch);
+
+		{
+			lock_guard<mutex> lk(_simMtx);
+			_simPending = false;
+		}
+		_simCond.notify_all();
+	}
+}
+
+void Game::startSimulation(const double epoch)
+{
+	{
+		lock_guard<mutex> lk(_simMtx);
+		_simEpoch = epoch;
+		_simPending = true;
+	}
+	_simStarted = true;
+	_simCond.notify_all();
+}
+
+double Game::waitSimulation()
+{
+	CPUProfiler::Scope scope("Simulation wait");
+	unique_lock<mutex> lk(_simMtx);
+	_simCond.wait(lk, [this]{ return !_simPending;});
+	return _simEpoch;
 }
 
 bool Game::isRunning()
 {
+	if (_benchmark && _benchmarkFrame >= _benchmarkFrames) return false;
 	return !glfwGetKey(_win, GLFW_KEY_ESCAPE) && !glfwWindowShouldClose(_win);
 }
 
+bool Game::isBenchmark() const
+{
+	return _benchmark;
+}
+
 EntityHandle Game::getFocusedBody()
 {
 	return _entityCollection.getBodies()[_focusedBodyId];
@@ -709,15 +1188,8 @@ void Game::updateIdle(float dt, double posX, double posY)
 		_panPolar.y = -maxVerticalAngle - _viewPolar.y;
 	}
 
-	// Position around center
-	const vec3 relViewPos = polarToCartesian(vec2(_viewPolar))*
-		_viewPolar.z;
-
-	_viewPos = dvec3(relViewPos) + getFocusedBody().getState().getPosition();
-
-	const vec3 direction = -polarToCartesian(vec2(_viewPolar)+_panPolar);
-
-	_viewDir = mat3(lookAt(vec3(0), direction, vec3(0,0,1)));
+	placeIdleView(_viewPos, _viewDir);
+	const vec3 relViewPos = polarToCartesian(vec2(_viewPolar))*_viewPolar.z;
 
 	// Time warping
 	if (isPressedOnce(GLFW_KEY_K))
@@ -783,6 +1255,56 @@ void Game::updateIdle(float dt, double posX, double posY)
 	}
 }
 
+void Game::placeIdleView(dvec3 &viewPos, mat3 &viewDir)
+{
+	// Position around center
+	const vec3 relViewPos = polarToCartesian(vec2(_viewPolar))*
+		_viewPolar.z;
+
+	viewPos = dvec3(relViewPos) + getFocusedBody().getState().getPosition();
+
+	const vec3 direction = -polarToCartesian(vec2(_viewPolar)+_panPolar);
+
+	viewDir = mat3(lookAt(vec3(0), direction, vec3(0,0,1)));
+}
+
+uint64_t Game::latchIdleView(dvec3 &viewPos, mat3 &viewDir)
+{
+	glfwPollEvents();
+	double posX, posY;
+	glfwGetCursorPos(_win, &posX, &posY);
+	const uint64_t inputTime = CPUProfiler::now();
+
+	// Same effect as the next updateIdle() would have given the move, which
+	// is consumed here
+	const vec2 move = {-posX+_preMousePosX, posY-_preMousePosY};
+	if (_dragging && glfwGetMouseButton(_win, GLFW_MOUSE_BUTTON_1))
+	{
+		const vec2 speed = glm::clamp(move*_sensitivity,
+			vec2(-_maxViewSpeed)-vec2(_viewSpeed), vec2(_maxViewSpeed)-vec2(_viewSpeed));
+		_viewSpeed.x += speed.x;
+		_viewSpeed.y += speed.y;
+		_viewPolar.x += speed.x;
+		_viewPolar.y += speed.y;
+	}
+	else if (_dragging && glfwGetMouseButton(_win, GLFW_MOUSE_BUTTON_2))
+	{
+		_panPolar += move*_sensitivity*_viewFovy;
+	}
+	_preMousePosX = posX;
+	_preMousePosY = posY;
+
+	const float maxVerticalAngle = pi<float>()/2 - 0.001;
+	_viewPolar.y = glm::clamp(_viewPolar.y, -maxVerticalAngle, maxVerticalAngle);
+	_panPolar.y = glm::clamp(_panPolar.y,
+		-maxVerticalAngle-_viewPolar.y, maxVerticalAngle-_viewPolar.y);
+
+	placeIdleView(viewPos, viewDir);
+	_viewPos = viewPos;
+	_viewDir = viewDir;
+	return inputTime;
+}
+
 float ease(float t)
 {
 	return 6*t*t*t*t*t-15*t*t*t*t+10*t*t*t;
@@ -914,6 +1436,189 @@ vector<EntityHandle> Game::getTexLoadBodies(const EntityHandle &focusedEntity)
 	return v;
 }
 
+/// Replaces all occurences of a word
+string replaceAll(string s, const string &word, const string &value)
+{
+	for (size_t pos = s.find(word);pos != string::npos;pos = s.find(word, pos+value.size()))
+		s.replace(pos, word.size(), value);
+	return s;
+}
+
+void Game::toggleRecording()
+{
+	if (_recording)
+	{
+		_recording = false;
+		if (!_recordPipe.empty()) _renderer->setScreenshotPipe("");
+		cout << "Recorded " << _recordFrame << " frames" << endl;
+		return;
+	}
+
+	const int tiles = std::max(_recordTiles, 1);
+	if (!_recordPipe.empty())
+	{
+		string command = _recordPipe;
+		command = replaceAll(command, "$WIDTH", to_string(_width*tiles));
+		command = replaceAll(command, "$HEIGHT", to_string(_height*tiles));
+		command = replaceAll(command, "$FPS", to_string(_recordFps));
+		if (!_renderer->setScreenshotPipe(command))
+		{
+			cout << "WARNING : Can't start recording command " << command << endl;
+			return;
+		}
+		cout << "Recording to " << command << endl;
+	}
+	else
+	{
+		_recordName = _recordFolder + "record_" + to_string(time(0)) + "_";
+		cout << "Recording to " << _recordName << "*.png" << endl;
+	}
+	_recording = true;
+	_recordFrame = 0;
+}
+
+void Game::updateBenchmarkView()
+{
+	// Keyframes around the current frame, the last one holds
+	size_t next = 0;
+	while (next < _benchmarkPath.size() && _benchmarkPath[next].frame <= _benchmarkFrame)
+		++next;
+	const BenchmarkKey &k0 = _benchmarkPath[(next>0)?next-1:0];
+	const BenchmarkKey &k1 = _benchmarkPath[std::min(next, _benchmarkPath.size()-1)];
+
+	// Ease between keyframes on the same body, cut to other bodies
+	float t = 0.f;
+	if (k1.bodyId == k0.bodyId && k1.frame > k0.frame)
+		t = ease((_benchmarkFrame-k0.frame)/(float)(k1.frame-k0.frame));
+
+	_focusedBodyId = k0.bodyId;
+	_bodyNameId = _focusedBodyId;
+	_bodyNameFade = 1.f;
+
+	const float radius = getFocusedBody().getParam().getModel().getRadius();
+	const float maxVerticalAngle = pi<float>()/2 - 0.001;
+	_viewPolar = vec3(
+		mix(k0.polar.x, k1.polar.x, t),
+		clamp(mix(k0.polar.y, k1.polar.y, t), -maxVerticalAngle, maxVerticalAngle),
+		// Distances interpolated geometrically for constant approach speed
+		radius*std::exp(mix(std::log(k0.polar.z), std::log(k1.polar.z), t)));
+	_viewFovy = mix(k0.fovy, k1.fovy, t);
+	_panPolar = vec2(0);
+	_viewSpeed = vec3(0);
+
+	const vec3 relViewPos = polarToCartesian(vec2(_viewPolar))*_viewPolar.z;
+	_viewPos = dvec3(relViewPos) + getFocusedBody().getState().getPosition();
+	_viewDir = mat3(lookAt(vec3(0), -polarToCartesian(vec2(_viewPolar)), vec3(0,0,1)));
+}
+
+void Game::measureBenchmarkFrame(const uint64_t frameStart, const uint64_t cpuEnd)
+{
+	const uint64_t frameEnd = CPUProfiler::now();
+	if (_benchmarkFrame == 0) _benchmarkStart = frameStart;
+	const bool measured = _benchmarkFrame >= _benchmarkWarmup;
+	if (measured)
+	{
+		_benchmarkFrameTimes.push_back((frameEnd-frameStart)/1E6);
+		_benchmarkCpuTimes.push_back((cpuEnd-frameStart)/1E6);
+	}
+
+	// GPU times come back a few frames later, once available
+	const uint64_t gpuFrames = _renderer->getProfilerFrameCount();
+	if (gpuFrames != _benchmarkGpuFrames)
+	{
+		_benchmarkGpuFrames = gpuFrames;
+		for (const auto &t : _renderer->getProfilerTimes())
+		{
+			if (measured && t.first == "Full frame")
+				_benchmarkGpuTimes.push_back(t.second/1E6);
+		}
+	}
+	const Renderer::LatencyStats latency = _renderer->getLatencyStats();
+	if (latency.frames != _benchmarkLatencyFrames)
+	{
+		_benchmarkLatencyFrames = latency.frames;
+		if (measured) _benchmarkLatencies.push_back(latency.last/1E6);
+	}
+
+	// Streaming is done once no tile waits to be loaded or uploaded
+	for (const auto &s : _renderer->getStreamingStats())
+	{
+		if (s.second > 0 && (
+			s.first == "Tiles waiting for staging" ||
+			s.first == "Tiles in loading queues" ||
+			s.first == "Tiles over upload budget" ||
+			s.first == "Upload batches in flight"))
+		{
+			_benchmarkStreamingTime = (frameEnd-_benchmarkStart)/1E9;
+		}
+	}
+
+	++_benchmarkFrame;
+	if (_benchmarkFrame == _benchmarkFrames) writeBenchmarkReport();
+}
+
+/// Returns the peak resident memory of the process in bytes
+static uint64_t getPeakMemory()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters{};
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters))) return 0;
+	return counters.PeakWorkingSetSize;
+#else
+	struct rusage usage{};
+	if (getrusage(RUSAGE_SELF, &usage)) return 0;
+#ifdef __APPLE__
+	return usage.ru_maxrss;
+#else
+	return (uint64_t)usage.ru_maxrss*1024;
+#endif
+#endif
+}
+
+void Game::writeBenchmarkReport()
+{
+	ofstream out(_benchmarkOutput.c_str());
+	if (!out)
+	{
+		cout << "Can't write " << _benchmarkOutput << endl;
+		return;
+	}
+
+	// Times in ms
+	auto writePercentiles = [&](const string &name, vector<double> t)
+	{
+		out << "  \"" << name << "\": {";
+		if (!t.empty())
+		{
+			sort(t.begin(), t.end());
+			double sum = 0.0;
+			for (const double v : t) sum += v;
+			auto percentile = [&](const int p){ return t[std::min(t.size()-1, t.size()*p/100)];};
+			out << "\"min\": " << t.front() << ", \"avg\": " << sum/t.size()
+				<< ", \"p50\": " << percentile(50) << ", \"p95\": " << percentile(95)
+				<< ", \"p99\": " << percentile(99) << ", \"max\": " << t.back();
+		}
+		out << "},\n";
+	};
+
+	const double duration = (CPUProfiler::now()-_benchmarkStart)/1E9;
+	out << fixed << setprecision(3);
+	out << "{\n";
+	out << "  \"frames\": " << _benchmarkFrames << ",\n";
+	out << "  \"warmup\": " << _benchmarkWarmup << ",\n";
+	out << "  \"vsync\": " << (_benchmarkVsync?"true":"false") << ",\n";
+	out << "  \"width\": " << _width << ", \"height\": " << _height << ",\n";
+	out << "  \"duration\": " << duration << ",\n";
+	writePercentiles("frameTime", _benchmarkFrameTimes);
+	writePercentiles("cpuTime", _benchmarkCpuTimes);
+	writePercentiles("gpuTime", _benchmarkGpuTimes);
+	writePercentiles("latency", _benchmarkLatencies);
+	out << "  \"streamingTime\": " << _benchmarkStreamingTime << ",\n";
+	out << "  \"peakMemory\": " << getPeakMemory() << "\n";
+	out << "}\n";
+	cout << "Benchmark written to " << _benchmarkOutput << endl;
+}
+
 string generateScreenshotName()
 {
 	time_t t = time(0);
@@ -930,66 +1635,78 @@ string generateScreenshotName()
 	return filenameBuilder.str();
 }
 
-void Game::displayProfiling(const vector<pair<string, uint64_t>> &a)
+void Game::displayProfiling(const vector<Renderer::ProfilerStats> &p)
 {
-	// First entry is full time of frame
-	uint64_t full = a[0].second;
-	// Compute which label has the largest width
+	// Compute which label has the largest width, with indentation
 	size_t largestName = 0;
-	for (auto p : a)
+	for (const auto &t : p)
 	{
-		if (p.first.size() > largestName) largestName = p.first.size();
+		largestName = std::max(largestName, t.name.size()+t.depth*2);
 	}
-	// Display each entry
-	for (auto p : a)
+	const auto flags = cout.flags();
+	cout.width(largestName);
+	cout << left << "GPU (ms)" << "     last      avg      p99      min" << endl;
+	// Display each entry under the one it's nested in
+	for (const auto &t : p)
 	{
 		cout.width(largestName);
-		cout << left << p.first;
-		uint64_t nano = p.second;
-		double percent = 100*nano/(double)full;
-		double fps = 1E9/(double)nano;
-		double micro = nano/1E6;
-		// If entry is full time, display fps instead of percentage of frame
-		if (nano == full)
-			cout << "  " << micro << "ms (" << fps << "FPS)" << endl;
-		else
-			cout << "  " << micro << "ms (" << percent << "%)" << endl;
+		cout << left << (string(t.depth*2, ' ')+t.name) << fixed << setprecision(3);
+		for (const uint64_t nano : {t.last, t.avg, t.p99, t.min})
+		{
+			cout << " ";
+			cout.width(8);
+			cout << right << nano/1E6;
+		}
+		cout << endl;
 	}
+	cout.flags(flags);
 	cout << "-------------------------" << endl;
 }
 
-void Game::updateProfiling(const vector<pair<string, uint64_t>> &a)
+void Game::displayStreamingStats(const vector<pair<string, double>> &s)
 {
-	for (auto p : a)
+	size_t largestName = 0;
+	for (auto p : s)
 	{
-		// Full time update
-		{
-			auto it = find_if(_fullTimes.begin(), _fullTimes.end(), [&](pair<string, uint64_t> pa){
-				return pa.first == p.first;
-			});
-			if (it == _fullTimes.end()) _fullTimes.push_back(p);
-			else it->second += p.second;
-		}
-
-		// Max time update
-		{
-			auto it = find_if(_maxTimes.begin(), _maxTimes.end(), [&](pair<string, uint64_t> pa){
-				return pa.first == p.first;
-			});
-			if (it == _maxTimes.end()) _maxTimes.push_back(p);
-			else it->second = glm::max(it->second, p.second);
-		}
+		if (p.first.size() > largestName) largestName = p.first.size();
+	}
+	for (auto p : s)
+	{
+		cout.width(largestName);
+		cout << left << p.first << "  " << p.second << endl;
 	}
-	_numFrames += 1;
+	cout << "-------------------------" << endl;
 }
 
-vector<pair<string, uint64_t>> Game::computeAverage(
-	const vector<pair<string, uint64_t>> &a, int frames)
+void Game::dumpProfiling(const string &filename,
+	const vector<Renderer::ProfilerStats> &p,
+	const vector<pair<string, double>> &s,
+	const Renderer::LatencyStats &l)
 {
-	vector<pair<string, uint64_t>> result = a;
-	for (auto &p : result)
+	ofstream out(filename.c_str());
+	if (!out)
+	{
+		cout << "Can't write " << filename << endl;
+		return;
+	}
+	// Times in ns, scopes in nesting order
+	out << "{\n  \"gpu\": [";
+	for (size_t i=0;i<p.size();++i)
+	{
+		out << ((i>0)?",":"") << "\n    {\"name\": \"" << p[i].name
+			<< "\", \"depth\": " << p[i].depth
+			<< ", \"last\": " << p[i].last << ", \"min\": " << p[i].min
+			<< ", \"avg\": " << p[i].avg << ", \"p99\": " << p[i].p99 << "}";
+	}
+	out << "\n  ],\n  \"streaming\": {";
+	for (size_t i=0;i<s.size();++i)
 	{
-		p.second /= (float)frames;
+		out << ((i>0)?",":"") << "\n    \"" << s[i].first << "\": " << fixed << s[i].second;
 	}
-	return result;
+	out << "\n  },\n  \"latency\": {\"frames\": " << l.frames
+		<< ", \"last\": " << l.last << ", \"min\": " << l.min
+		<< ", \"avg\": " << l.avg << ", \"p99\": " << l.p99
+		<< ", \"max\": " << l.max << "}\n}\n";
+	cout << "Profiling written to " << filename << endl;
 }
+
@@ -4,11 +4,15 @@
 
 #include "entity.hpp"
 #include "renderer.hpp"
+#include "task_graph.hpp"
 #include <glm/glm.hpp>
 
 #include <bitset>
 #include <vector>
 #include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 /**
  * All application logic
@@ -20,8 +24,14 @@ public:
 	~Game();
 	/**
 	 * Loads configuration files
+	 * @param benchmarkFile flythrough to run instead of interactive control,
+	 * none if empty
 	 */
-	void init();
+	void init(const std::string &benchmarkFile = "");
+	/**
+	 * Updates the loading screen until loading is done and any input is given
+	 */
+	void updateLoading();
 	/**
 	 * Updates one frame
 	 * @dt delta time since last frame
@@ -31,6 +41,11 @@ public:
 	 * Indicates whether the application has been requested to stop
 	 */
 	bool isRunning();
+	/**
+	 * Indicates whether a benchmark is running, frames must then not be
+	 * limited to a fixed rate
+	 */
+	bool isBenchmark() const;
 
 private:
 	/**
@@ -44,22 +59,60 @@ private:
 	void loadEntityFiles();
 	/// Loads settings file
 	void loadSettingsFile();
+	/// Loads benchmark flythrough file
+	void loadBenchmarkFile(const std::string &filename);
 
 	enum class SwitchPhase
 	{
 		IDLE, TRACK, MOVE 
 	};
 	void updateIdle(float dt, double mousePosX, double mousePosY);
+	/// Places the view around the focused body from the polar coordinates
+	void placeIdleView(glm::dvec3 &viewPos, glm::mat3 &viewDir);
+	/**
+	 * Samples the mouse again to move the view around the focused body at
+	 * the last moment, when rendering in low latency mode
+	 * @return time the input was sampled at
+	 */
+	uint64_t latchIdleView(glm::dvec3 &viewPos, glm::mat3 &viewDir);
 	void updateTrack(float dt);
 	void updateMove(float dt);
+	/// Computes entity positions and states at an epoch, into the back state buffer
+	void simulate(double epoch);
+	/// Simulation thread function, when pipelined
+	void simulationWork();
+	/// Starts simulating an epoch on the simulation thread
+	void startSimulation(double epoch);
+	/// Waits for the simulation thread to be done, returns the epoch simulated
+	double waitSimulation();
+	/// Starts or stops recording frames
+	void toggleRecording();
+	/// Places the view along the benchmark path for the current frame
+	void updateBenchmarkView();
+	/**
+	 * Returns whether the frame would look like the last one rendered, to
+	 * within a fraction of a pixel
+	 * @param formattedTime displayed time of the frame
+	 */
+	bool isSceneStatic(const std::string &formattedTime);
+	/// Keeps what the frame being rendered shows, for isSceneStatic()
+	void keepRenderedState(const std::string &formattedTime);
+	/// Records timings of the frame rendered
+	void measureBenchmarkFrame(uint64_t frameStart, uint64_t cpuEnd);
+	/// Writes benchmark results as JSON
+	void writeBenchmarkReport();
 
 	/// Returns bodies that need to have their texture loaded when the focus is on 'focusedEntity'
 	std::vector<EntityHandle> getTexLoadBodies(const EntityHandle &focusedEntity);
 
-	void displayProfiling(const std::vector<std::pair<std::string, uint64_t>> &a);
-	void updateProfiling(const std::vector<std::pair<std::string, uint64_t>> &a);
-	std::vector<std::pair<std::string, uint64_t>> computeAverage(
-		const std::vector<std::pair<std::string, uint64_t>> &a, int frames);
+	/// Prints profiler statistics as a tree of scopes
+	void displayProfiling(const std::vector<Renderer::ProfilerStats> &p);
+	void displayStreamingStats(const std::vector<std::pair<std::string, double>> &s);
+	/// Writes profiler statistics and streaming counters as JSON
+	void dumpProfiling(const std::string &filename,
+		const std::vector<Renderer::ProfilerStats> &p,
+		const std::vector<std::pair<std::string, double>> &s,
+		const Renderer::LatencyStats &l);
 
 	void scrollFun(int offsetY);
 
@@ -70,11 +123,39 @@ private:
 
 	// Main entity collection
 	EntityCollection _entityCollection;
+	/// Absolute entity positions, kept to avoid reallocating every frame
+	std::vector<glm::dvec3> _entityPositions;
+	/// Splits simulation and frame preparation across cores
+	JobSystem _jobs;
 
 	/// Index in the  the view follows
 	int _focusedBodyId = 0; 
 	/// Seconds since January 1st 2017 00:00:00 UTC
 	double _epoch = 0.0;
+	/// Epoch of the current entity state, one frame behind _epoch when pipelined
+	double _stateEpoch = 0.0;
+
+	/// Simulates the next frame on its own thread while the current one is rendered
+	bool _pipelineSimulation = false;
+	/// Frames the CPU can submit ahead of the GPU
+	int _framesInFlight = 3;
+	/// Waits for the GPU before sampling input, and samples it again right
+	/// before the view is used for rendering
+	bool _lowLatency = false;
+	std::thread _simThread;
+	/// Synchronizes the members below
+	std::mutex _simMtx;
+	/// Wakes the simulation thread up when an epoch is given, and the main
+	/// thread when it is done
+	std::condition_variable _simCond;
+	/// Epoch given to the simulation thread
+	double _simEpoch = 0.0;
+	/// Whether the simulation thread has an epoch to simulate or is simulating it
+	bool _simPending = false;
+	/// Signals the simulation thread to terminate itself
+	bool _killSim = false;
+	/// Whether an epoch has been given to the simulation thread, main thread only
+	bool _simStarted = false;
 	/// Index in the timeWarpValues collection which indicates the current timewarp factor
 	int _timeWarpIndex = 0;
 	/// Timewarp factors
@@ -89,10 +170,20 @@ private:
 
 	/// Renderer
 	std::unique_ptr<Renderer> _renderer;
+	/// Startup work, destroyed first as tasks may use the members above
+	TaskGraph _startup;
+	/// Whether the loading screen is displayed
+	bool _loading = true;
+	/// Whether the renderer is done loading
+	bool _loaded = false;
+	/// Set by input callbacks, closes the loading screen once loaded
+	bool _anyInput = false;
 	/// Exposure coefficient
 	float _exposure = 0.0;
 	/// Ambient light coefficient
 	float _ambientColor = 0.0;
+	/// Graphics API of the renderer ("gl" or "vulkan")
+	std::string _graphicsApi = "gl";
 	/// MSAA samples per pixel
 	int _msaaSamples = 1;
 	/// Maximum texture width/height
@@ -103,16 +194,127 @@ private:
 	bool _bloom = true;
 	/// Wait for whole texture to load before displaying (no pop-ins)
 	bool _syncTexLoading = false;
+	/// Number of texture loading threads (0 for automatic)
+	int _streamThreads = 0;
+	/// Texture memory budget in megabytes (0 to free unloaded textures immediately)
+	int _texBudget = 1024;
+	/// Stream only visible tiles into sparse textures
+	bool _sparseTextures = false;
+	/// Make bloom with compute shaders
+	bool _computeBloom = true;
+	/// GPU frame time in ms held by dynamic resolution (0 to disable)
+	float _targetFrameTime = 0.0;
+	/// Smallest dynamic resolution scale
+	float _minRenderScale = 0.5;
+	/// Tiles along each side of big screenshots
+	int _screenshotTiles = 2;
+
+	// Recording
+	/// Whether frames are being recorded
+	bool _recording = false;
+	/// Simulated frames per second of recordings
+	double _recordFps = 60.0;
+	/// Tiles along each side of recorded frames
+	int _recordTiles = 1;
+	/// Folder of recorded image sequences
+	std::string _recordFolder = "record/";
+	/// Command receiving raw recorded frames, image sequence if empty
+	std::string _recordPipe = "";
+	/// Filename prefix of the frames of the current recording
+	std::string _recordName = "";
+	/// Number of frames of the current recording
+	int _recordFrame = 0;
+	/// Frames waiting to be saved before the simulation waits for them
+	static const size_t RECORD_BACKLOG = 8;
+
+	// Idle mode
+	/// Frames rendered per second while the scene is static (0 to always render)
+	float _idleFps = 1.0;
+	/// What the last rendered frame showed
+	struct RenderedState
+	{
+		glm::mat3 viewDir;
+		float fovy;
+		float exposure;
+		bool wireframe;
+		bool bloom;
+		float bodyNameFade;
+		std::string time;
+		/// Entity positions relative to the view
+		std::vector<glm::dvec3> positions;
+		/// Entity rotation angles
+		std::vector<float> angles;
+		/// Entity cloud displacements
+		std::vector<float> clouds;
+	};
+	RenderedState _rendered;
+	/// Consecutive frames the scene was static for
+	int _staticFrames = 0;
+	/// Seconds since the last frame was rendered while the scene is static
+	double _idleTime = 0.0;
+	/// Set when the window content needs to be redrawn
+	bool _redraw = true;
+	/// Static frames still rendered before idling, for streaming feedback and
+	/// frames in flight to settle
+	static const int IDLE_FRAMES = 8;
+	/// On-screen motion in pixels under which the scene is static
+	static constexpr float IDLE_MOTION = 0.25f;
+	/// Longest wait for events between two idle updates, in seconds
+	static constexpr double IDLE_WAIT = 0.1;
+	/// Number of job system threads, including the main one (0 for automatic)
+	int _jobThreads = 0;
+
+	// Benchmark
+	/// Camera keyframe of a benchmark path
+	struct BenchmarkKey
+	{
+		int frame;
+		std::string body;
+		/// Index of body in the main collection
+		int bodyId;
+		/// Polar coordinates (theta, phi, distance in body radii)
+		glm::vec3 polar;
+		/// Vertical field of view in radians
+		float fovy;
+	};
+	/// Whether a benchmark flythrough replaces interactive control
+	bool _benchmark = false;
+	/// Epoch of the first frame
+	double _benchmarkEpoch = 0.0;
+	/// Simulated seconds per frame
+	double _benchmarkTimeStep = 0.0;
+	/// Number of frames to render
+	int _benchmarkFrames = 0;
+	/// First frames excluded from timings
+	int _benchmarkWarmup = 0;
+	/// Wait for vertical sync when presenting
+	bool _benchmarkVsync = false;
+	/// File results are written to
+	std::string _benchmarkOutput = "benchmark.json";
+	/// Camera keyframes, by frame
+	std::vector<BenchmarkKey> _benchmarkPath;
+	/// Current frame
+	int _benchmarkFrame = 0;
+	/// Time in ns of the start of the first frame and of the previous one
+	uint64_t _benchmarkStart = 0;
+	uint64_t _benchmarkPreviousFrame = 0;
+	/// Frame times in ms: between frame starts, until presentation (CPU), on the GPU
+	std::vector<double> _benchmarkFrameTimes;
+	std::vector<double> _benchmarkCpuTimes;
+	std::vector<double> _benchmarkGpuTimes;
+	/// Input to end of GPU frame latencies in ms
+	std::vector<double> _benchmarkLatencies;
+	/// Number of latencies measured by the renderer at the last frame
+	uint64_t _benchmarkLatencyFrames = 0;
+	/// Number of GPU frames read back by the profiler at the last frame
+	uint64_t _benchmarkGpuFrames = 0;
+	/// Time in s since the first frame of the last frame with streaming work
+	double _benchmarkStreamingTime = 0.0;
 
 	std::string _starMapFilename = "";
 	float _starMapIntensity = 1.0;
-
-	// PROFILING
-	/// Total times
-	std::vector<std::pair<std::string, uint64_t>> _fullTimes;
-	/// Max times
-	std::vector<std::pair<std::string, uint64_t>> _maxTimes;
-	int _numFrames = 0;
+	std::string _starCatalogFilename = "";
+	float _starMagnitudeLimit = 6.5;
 
 	// VIEW CONTROL
 	/// Mouse position of previous update cycle
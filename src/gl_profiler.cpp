@@ -1,69 +1,128 @@
 #include "gl_profiler.hpp"
+#include "cpu_profiler.hpp"
 
 using namespace std;
 
 void GPUProfilerGL::begin(const string &name)
 {
-	int id = (bufferId+1)%2;
-	auto &val = queries[id][name].first;
-	if (val == 0)
+	if (!_recording)
 	{
-		glCreateQueries(GL_TIMESTAMP, 1, &val);
+		_stack.push_back(-1);
+		return;
 	}
-	glQueryCounter(val, GL_TIMESTAMP);
-	names.push(name);
-	orderedNames[id].push_back(name);
+	PendingScope scope{};
+	scope.name = name;
+	scope.depth = _stack.size();
+	scope.parent = _stack.empty()?-1:_stack.back();
+	scope.beginQuery = acquireQuery();
+	glQueryCounter(scope.beginQuery, GL_TIMESTAMP);
+	_current.lastQuery = scope.beginQuery;
+	_stack.push_back(_current.scopes.size());
+	_current.scopes.push_back(scope);
 }
 
 void GPUProfilerGL::end()
 {
-	string name = names.top();
-	names.pop();
-	int id = (bufferId+1)%2;
-	auto &val = queries[id][name].second;
-	if (val == 0)
+	const int id = _stack.back();
+	_stack.pop_back();
+	if (id == -1) return;
+	auto &scope = _current.scopes[id];
+	scope.endQuery = acquireQuery();
+	glQueryCounter(scope.endQuery, GL_TIMESTAMP);
+	_current.lastQuery = scope.endQuery;
+}
+
+bool GPUProfilerGL::endFrame()
+{
+	if (!_current.scopes.empty())
+	{
+		_pending.push_back(std::move(_current));
+		_current = QueryFrame();
+	}
+
+	// GL timestamps drift from the CPU clock, measure the offset now and then
+	if (--_calibrationFrames <= 0)
+	{
+		GLint64 gpuTime = 0;
+		glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+		_clockOffset = (int64_t)CPUProfiler::now()-gpuTime;
+		_calibrationFrames = CALIBRATION_FRAMES;
+	}
+
+	// Queries complete in order, stop at the first frame not available
+	bool read = false;
+	while (!_pending.empty() && readFrame(_pending.front()))
 	{
-		glCreateQueries(GL_TIMESTAMP, 1, &val);
+		_pending.pop_front();
+		read = true;
 	}
-	glQueryCounter(val, GL_TIMESTAMP);
+
+	// Skip measuring rather than reusing queries still in flight
+	_recording = _pending.size() < QUERY_FRAMES;
+	if (!_recording) ++_skippedFrames;
+	return read;
 }
 
-vector<pair<string,uint64_t>> GPUProfilerGL::get()
+GLuint GPUProfilerGL::acquireQuery()
 {
-	vector<pair<string,uint64_t>> result;
-	auto &m = queries[bufferId];
-	for (const string name : orderedNames[bufferId])
+	GLuint query = 0;
+	if (_freeQueries.empty())
 	{
-		auto val = m.find(name);
-		GLuint q1 = val->second.first;
-		GLuint q2 = val->second.second;
-		if (q1 && q2)
-		{
-			uint64_t start, end;
-			glGetQueryObjectui64v(q1, GL_QUERY_RESULT, &start);
-			glGetQueryObjectui64v(q2, GL_QUERY_RESULT, &end);
-			result.push_back(make_pair(name, end-start));
-		}
-		if (q1) glDeleteQueries(1, &q1);
-		if (q2) glDeleteQueries(1, &q2);
+		glCreateQueries(GL_TIMESTAMP, 1, &query);
+	}
+	else
+	{
+		query = _freeQueries.back();
+		_freeQueries.pop_back();
 	}
+	return query;
+}
+
+bool GPUProfilerGL::readFrame(QueryFrame &frame)
+{
+	GLuint available = GL_FALSE;
+	glGetQueryObjectuiv(frame.lastQuery, GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return false;
+
+	vector<Scope> scopes;
+	scopes.reserve(frame.scopes.size());
+	for (const auto &pending : frame.scopes)
+	{
+		uint64_t start = 0, end = 0;
+		glGetQueryObjectui64v(pending.beginQuery, GL_QUERY_RESULT, &start);
+		glGetQueryObjectui64v(pending.endQuery, GL_QUERY_RESULT, &end);
+		scopes.push_back({pending.name, pending.depth, pending.parent,
+			(uint64_t)(start+_clockOffset), (end>start)?end-start:0});
+		_freeQueries.push_back(pending.beginQuery);
+		_freeQueries.push_back(pending.endQuery);
+	}
+
+	addFrame(std::move(scopes));
+	return true;
+}
 
-	m.clear();
-	orderedNames[bufferId].clear();
-	bufferId = (bufferId+1)%2;
-	return result;
+uint64_t GPUProfilerGL::getSkippedFrames() const
+{
+	return _skippedFrames;
+}
+
+uint64_t GPUProfilerGL::toCPUClock(const uint64_t gpuTime) const
+{
+	return (uint64_t)(gpuTime+_clockOffset);
 }
 
 GPUProfilerGL::~GPUProfilerGL()
 {
-	for (auto q : queries)
+	vector<GLuint> queries = _freeQueries;
+	auto addFrame = [&](const QueryFrame &frame)
 	{
-		for (auto m : q)
+		for (const auto &scope : frame.scopes)
 		{
-			auto q1 = m.second.first;
-			auto q2 = m.second.second;
-			if (q1) glDeleteQueries(1, &q1);
-			if (q2) glDeleteQueries(1, &q2);
+			queries.push_back(scope.beginQuery);
+			if (scope.endQuery) queries.push_back(scope.endQuery);
 		}
-	}
-}
\ No newline at end of file
+	};
+	addFrame(_current);
+	for (const auto &frame : _pending) addFrame(frame);
+	if (!queries.empty()) glDeleteQueries(queries.size(), queries.data());
+}
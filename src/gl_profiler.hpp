@@ -1,37 +1,84 @@
 #pragma once
 
 #include "graphics_api.hpp"
+#include "gpu_profiler.hpp"
 #include <string>
 #include <vector>
-#include <map>
-#include <stack>
-#include <utility>
+#include <deque>
+#include <cstdint>
 
 /** Measures time intervals on the GPU when commands have completed
+ *
+ * Timestamp queries of the last frames are kept in flight and only read
+ * once available, so that measuring never waits for the GPU. Scopes keep
+ * their nesting. GPU times are converted to the CPUProfiler clock, so that
+ * both can be shown on the same timeline.
  */
-class GPUProfilerGL
+class GPUProfilerGL : public GPUProfiler
 {
 public:
 	GPUProfilerGL() = default;
+	GPUProfilerGL(const GPUProfilerGL &) = delete;
+	GPUProfilerGL &operator=(const GPUProfilerGL &) = delete;
 	~GPUProfilerGL();
-	/** Resets the timer for a label
+	/** Starts a timer, nested in the timers still running
 	 * @param name name of label
 	 */
 	void begin(const std::string &name);
 	/** Stops the timer for the last started timer still running.
 	 */
 	void end();
-	/** Returns times for all labels
-	 * @return vector of pairs of label, and time in ns 
+	/** Ends the frame of the timers started since the last call and reads
+	 * back frames whose results are available, without waiting
+	 * @return true if at least one frame was read back
 	 */
-	std::vector<std::pair<std::string,uint64_t>> get();
+	bool endFrame();
+	/// Returns the number of frames not measured because no query frame was free
+	uint64_t getSkippedFrames() const;
+	/// Converts a GL_TIMESTAMP time to the CPUProfiler clock
+	uint64_t toCPUClock(uint64_t gpuTime) const;
+
 private:
-	/// Double-buffered map of label->(timestamp query of beginning, timestamp query of end)
-	std::map<std::string, std::pair<GLuint, GLuint>> queries[2];
-	/// Stack of last started timers
-	std::stack<std::string> names;
-	/// Labels by order of call to begin()
-	std::vector<std::string> orderedNames[2];
-	/// Double buffering flip
-	int bufferId = 0;
-};
\ No newline at end of file
+	/// Frames of queries in flight, more than the frames buffered by the renderer
+	static const size_t QUERY_FRAMES = 6;
+	/// Frames between measures of the GPU clock
+	static const int CALIBRATION_FRAMES = 120;
+
+	/// Scope whose queries are in flight
+	struct PendingScope
+	{
+		std::string name;
+		int depth;
+		int parent;
+		GLuint beginQuery;
+		GLuint endQuery;
+	};
+	/// Scopes of a frame whose queries are in flight
+	struct QueryFrame
+	{
+		std::vector<PendingScope> scopes;
+		/// Query issued last, available once the others are
+		GLuint lastQuery = 0;
+	};
+
+	/// Takes a query from the pool, creating it if needed
+	GLuint acquireQuery();
+	/// Reads back a frame if available, returning its queries to the pool
+	bool readFrame(QueryFrame &frame);
+
+	/// Frame being recorded
+	QueryFrame _current;
+	/// Whether the current frame has a free query frame to be recorded in
+	bool _recording = true;
+	/// Frames in flight, oldest first
+	std::deque<QueryFrame> _pending;
+	/// Unused queries
+	std::vector<GLuint> _freeQueries;
+	/// Indices of running scopes in the current frame
+	std::vector<int> _stack;
+	uint64_t _skippedFrames = 0;
+	/// CPU clock minus GPU clock, in ns
+	int64_t _clockOffset = 0;
+	/// Frames until the next clock measure
+	int _calibrationFrames = 0;
+};
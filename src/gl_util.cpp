@@ -155,6 +155,12 @@ BufferRange Buffer::assignSSBO(const uint32_t size,
 	return assign(size, _alignSSBO, data);
 }
 
+uint32_t Buffer::getUBOStride(const uint32_t size)
+{
+	getLimits();
+	return align(size, _alignUBO);
+}
+
 void Buffer::storageStatic()
 {
 	glNamedBufferStorage(_id, _size, nullptr, GL_DYNAMIC_STORAGE_BIT);
@@ -231,9 +237,7 @@ void Buffer::write(const BufferRange range, const void *data)
 	if (_usage == Usage::DYNAMIC)
 	{
 		memcpy((uint8_t*)_mapPtr+range.getOffset(), data, range.getSize());
-#ifndef USE_COHERENT_MAPPING
-		glFlushMappedNamedBufferRange(_id, range.getOffset(), range.getSize());
-#endif
+		flush(range);
 	}
 	// Static data : BufferSubData
 	else
@@ -242,6 +246,14 @@ void Buffer::write(const BufferRange range, const void *data)
 	}
 }
 
+void Buffer::flush(const BufferRange range)
+{
+#ifndef USE_COHERENT_MAPPING
+	if (_usage == Usage::DYNAMIC)
+		glFlushMappedNamedBufferRange(_id, range.getOffset(), range.getSize());
+#endif
+}
+
 void Buffer::read(const BufferRange range, void *data)
 {
 	if (_access == Access::NO_ACCESS ||
@@ -307,7 +319,7 @@ DrawCommand::DrawCommand(
 	_vertexInfo = vertexInfo;
 }
 
-void DrawCommand::draw(bool tessellated) const
+void DrawCommand::draw(bool tessellated, GLsizei instances) const
 {
 	glBindVertexArray(_vao);
 	for (const auto &info : _vertexInfo)
@@ -316,14 +328,44 @@ void DrawCommand::draw(bool tessellated) const
 	if (_indexed)
 	{
 		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _elementBuffer);
-		glDrawElements(mode, _count, _type, _indices);
+		if (instances == 1) glDrawElements(mode, _count, _type, _indices);
+		else glDrawElementsInstanced(mode, _count, _type, _indices, instances);
 	}
 	else
 	{
-		glDrawArrays(mode, 0, _count);
+		if (instances == 1) glDrawArrays(mode, 0, _count);
+		else glDrawArraysInstanced(mode, 0, _count, instances);
 	}
 }
 
+DrawElementsIndirectCommand DrawCommand::getIndirect(GLuint baseInstance,
+	GLuint instances) const
+{
+	if (!_indexed) throw runtime_error("Indirect command of non-indexed draw");
+	GLuint indexSize = 4;
+	if (_type == GL_UNSIGNED_SHORT) indexSize = 2;
+	else if (_type == GL_UNSIGNED_BYTE) indexSize = 1;
+
+	DrawElementsIndirectCommand command{};
+	command.count = _count;
+	command.instanceCount = instances;
+	command.firstIndex = (GLuint)((intptr_t)_indices/indexSize);
+	command.baseVertex = 0;
+	command.baseInstance = baseInstance;
+	return command;
+}
+
+void DrawCommand::multiDraw(bool tessellated, uint32_t offset, GLsizei drawCount) const
+{
+	if (drawCount <= 0) return;
+	glBindVertexArray(_vao);
+	for (const auto &info : _vertexInfo)
+		glBindVertexBuffer(info.binding, info.buffer, info.range.getOffset(), info.stride);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, _elementBuffer);
+	const GLenum mode = tessellated?GL_PATCHES:_mode;
+	glMultiDrawElementsIndirect(mode, _type, (void*)(intptr_t)offset, drawCount, 0);
+}
+
 BufferRange::BufferRange(uint32_t offset, uint32_t size) :
 	_offset(offset),
 	_size(size)
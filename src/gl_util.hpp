@@ -48,6 +48,18 @@ private:
 	uint32_t _size = 0;
 };
 
+/**
+ * Parameters of an indexed draw read from a buffer by glMultiDrawElementsIndirect
+ */
+struct DrawElementsIndirectCommand
+{
+	GLuint count;
+	GLuint instanceCount;
+	GLuint firstIndex;
+	GLint baseVertex;
+	GLuint baseInstance;
+};
+
 /**
  * Information necessary to draw geometry
  */
@@ -77,8 +89,24 @@ public:
 	/** Not Indexed */
 	DrawCommand(GLuint vao, GLenum mode, size_t count, 
 		const std::vector<VertexInfo> &vertexInfo);
-	/** Draw model */
-	void draw(bool tessellated = false) const;
+	/** Draw model
+	 * @param tessellated whether to draw patches instead of the command's mode
+	 * @param instances number of instances to draw
+	 */
+	void draw(bool tessellated = false, GLsizei instances = 1) const;
+	/** Returns the indirect parameters of the (indexed) command
+	 * @param baseInstance first instance, read by shaders as a draw index
+	 * @param instances number of instances to draw
+	 */
+	DrawElementsIndirectCommand getIndirect(GLuint baseInstance,
+		GLuint instances = 1) const;
+	/** Draws several indexed commands sharing the vertex and index buffers of
+	 * this one, from the buffer bound to GL_DRAW_INDIRECT_BUFFER
+	 * @param tessellated whether to draw patches instead of the command's mode
+	 * @param offset offset in bytes of the first DrawElementsIndirectCommand
+	 * @param drawCount number of commands
+	 */
+	void multiDraw(bool tessellated, uint32_t offset, GLsizei drawCount) const;
 private:
 	bool _indexed;
 	GLenum _vao;
@@ -172,6 +200,13 @@ public:
 	 * @return reserved range
 	 */
 	BufferRange assignSSBO(uint32_t size, const void* data=nullptr);
+	/**
+	 * Returns the distance in bytes between two consecutive UBOs in an array
+	 * bound one element at a time
+	 * (GL Context sensitve method!)
+	 * @param size size in bytes of an UBO
+	 */
+	uint32_t getUBOStride(uint32_t size);
 
 	/**
 	 * Locks assigned ranges so writing and reading can take place
@@ -185,6 +220,12 @@ public:
 	 * @param data data to write to the buffer
 	 */
 	void write(BufferRange range, const void *data);
+	/**
+	 * Makes writes done through getPtr() visible to the GL
+	 * (GL Context sensitve method!)
+	 * @param range written range
+	 */
+	void flush(BufferRange range);
 	/**
 	 * Reads from the buffer
 	 * (GL Context sensitve method!)
@@ -0,0 +1,112 @@
+#include "gpu_profiler.hpp"
+
+#include <map>
+#include <algorithm>
+
+using namespace std;
+
+void GPUProfiler::addFrame(vector<Scope> &&scopes)
+{
+	_history.push_back(std::move(scopes));
+	++_readFrames;
+	if (_history.size() > HISTORY_FRAMES) _history.pop_front();
+}
+
+const vector<GPUProfiler::Scope> &GPUProfiler::getLastFrame() const
+{
+	static const vector<Scope> empty;
+	return _history.empty()?empty:_history.back();
+}
+
+vector<GPUProfiler::Stats> GPUProfiler::getStats() const
+{
+	// Times of each path per frame, scopes with the same path in a frame are summed
+	vector<Stats> stats;
+	vector<vector<uint64_t>> times;
+	map<string, size_t> statIds;
+	// Stat of the enclosing scope of each stat, npos for outermost ones
+	vector<size_t> statParents;
+	for (size_t f=0;f<_history.size();++f)
+	{
+		const auto &scopes = _history[f];
+		vector<string> paths(scopes.size());
+		vector<size_t> ids(scopes.size());
+		for (size_t i=0;i<scopes.size();++i)
+		{
+			const Scope &scope = scopes[i];
+			paths[i] = (scope.parent==-1)?scope.name:paths[scope.parent]+"/"+scope.name;
+			auto it = statIds.find(paths[i]);
+			if (it == statIds.end())
+			{
+				it = statIds.insert({paths[i], stats.size()}).first;
+				stats.push_back({paths[i], scope.name, scope.depth, 0, 0, 0, 0});
+				times.emplace_back();
+				statParents.push_back((scope.parent==-1)?string::npos:ids[scope.parent]);
+			}
+			ids[i] = it->second;
+			auto &t = times[it->second];
+			t.resize(f+1, 0);
+			t[f] += scope.duration;
+			if (f+1 == _history.size()) stats[it->second].last = t[f];
+		}
+	}
+
+	for (size_t i=0;i<stats.size();++i)
+	{
+		// Frames without the scope don't count
+		vector<uint64_t> t;
+		for (const uint64_t v : times[i]) if (v) t.push_back(v);
+		if (t.empty()) continue;
+		sort(t.begin(), t.end());
+		uint64_t sum = 0;
+		for (const uint64_t v : t) sum += v;
+		stats[i].min = t.front();
+		stats[i].avg = sum/t.size();
+		stats[i].p99 = t[std::min(t.size()-1, (t.size()*99)/100)];
+	}
+
+	// Scopes first seen in later frames go after their parent
+	vector<vector<size_t>> children(stats.size()+1);
+	for (size_t i=0;i<stats.size();++i)
+	{
+		const size_t parent = statParents[i];
+		children[(parent==string::npos)?stats.size():parent].push_back(i);
+	}
+	vector<Stats> ordered;
+	ordered.reserve(stats.size());
+	vector<size_t> toVisit(children.back().rbegin(), children.back().rend());
+	while (!toVisit.empty())
+	{
+		const size_t i = toVisit.back();
+		toVisit.pop_back();
+		ordered.push_back(stats[i]);
+		toVisit.insert(toVisit.end(), children[i].rbegin(), children[i].rend());
+	}
+	return ordered;
+}
+
+uint64_t GPUProfiler::getReadFrames() const
+{
+	return _readFrames;
+}
+
+uint64_t GPUProfiler::getHistoryStart() const
+{
+	return (_history.empty() || _history.front().empty())?0:_history.front().front().start;
+}
+
+void GPUProfiler::writeTraceEvents(ostream &out, const uint64_t origin) const
+{
+	// Chrome trace times are in microseconds
+	out << ",\n  {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 0, \"tid\": 0, "
+		"\"args\": {\"name\": \"GPU\"}}";
+	for (const auto &scopes : _history)
+	{
+		for (const Scope &scope : scopes)
+		{
+			out << ",\n  {\"name\": \"" << scope.name
+				<< "\", \"cat\": \"gpu\", \"ph\": \"X\", \"pid\": 0, \"tid\": 0, \"ts\": "
+				<< ((int64_t)scope.start-(int64_t)origin)/1000.0 << ", \"dur\": " << scope.duration/1000.0 << "}";
+		}
+	}
+}
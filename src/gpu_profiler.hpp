@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <ostream>
+#include <cstdint>
+
+/** Scopes measured on the GPU, whatever the graphics API
+ *
+ * Implementations read back the timestamps of their scopes, convert them to
+ * the CPUProfiler clock and add them frame by frame. The last frames added
+ * are kept for rolling statistics and trace export.
+ */
+class GPUProfiler
+{
+public:
+	/// Time range of a scope in a frame
+	struct Scope
+	{
+		std::string name;
+		/// Nesting level, 0 for outermost scopes
+		int depth;
+		/// Index of the enclosing scope in the frame, -1 if none
+		int parent;
+		/// Beginning in ns, on the CPUProfiler clock
+		uint64_t start;
+		/// Duration in ns
+		uint64_t duration;
+	};
+	/// Statistics of a scope over the frames kept, in ns
+	struct Stats
+	{
+		/// Scope names from the outermost one, separated by '/'
+		std::string path;
+		std::string name;
+		int depth;
+		/// Time in the last frame read back, 0 if not in it
+		uint64_t last;
+		uint64_t min, avg, p99;
+	};
+
+	/// Returns scopes of the last frame read back, in begin() order
+	const std::vector<Scope> &getLastFrame() const;
+	/// Returns statistics of each scope, in begin() order
+	std::vector<Stats> getStats() const;
+	/// Returns the number of frames read back since the start
+	uint64_t getReadFrames() const;
+	/// Returns the beginning of the oldest frame kept, on the CPUProfiler clock
+	uint64_t getHistoryStart() const;
+	/** Writes the frames kept as Chrome trace events, each one preceded by a
+	 * comma
+	 * @param out stream to write to
+	 * @param origin time in ns of the origin of event times
+	 */
+	void writeTraceEvents(std::ostream &out, uint64_t origin) const;
+
+protected:
+	GPUProfiler() = default;
+	~GPUProfiler() = default;
+	/// Adds the scopes of a frame read back, dropping the oldest one kept
+	void addFrame(std::vector<Scope> &&scopes);
+
+private:
+	/// Frames kept for statistics and traces
+	static const size_t HISTORY_FRAMES = 240;
+
+	/// Last frames read back, oldest first
+	std::deque<std::vector<Scope>> _history;
+	uint64_t _readFrames = 0;
+};
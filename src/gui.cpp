@@ -39,7 +39,7 @@ Gui::Image Gui::loadImage(const string &filename)
 	return genHandle();
 }
 
-void Gui::init()
+void Gui::rasterize()
 {
 	map<Font, stbtt_fontinfo> infos;
 	vector<stbrp_rect> rects;
@@ -73,32 +73,39 @@ void Gui::init()
 		stbtt_GetFontVMetrics(&info, 
 			&finfo.ascent, &finfo.descent, &finfo.lineGap);
 
-		// Find glyphs
-		finfo.codepointGlyphs.resize(codepointMax);
+		// Find glyphs, giving a slot to each distinct one
+		map<int, int> glyphSlots;
+		finfo.codepointSlots.resize(codepointMax);
 		for (int i=0;i<codepointMax;++i)
 		{
 			const int glyph = stbtt_FindGlyphIndex(&info, i);
-			finfo.codepointGlyphs[i] = glyph;
-			finfo.allGlyphs.insert(glyph);
+			auto it = glyphSlots.find(glyph);
+			if (it == glyphSlots.end())
+			{
+				it = glyphSlots.insert({glyph, (int)finfo.slotGlyphs.size()}).first;
+				finfo.slotGlyphs.push_back(glyph);
+			}
+			finfo.codepointSlots[i] = it->second;
 		}
+		const int slotCount = finfo.slotGlyphs.size();
 
 		// H metrics for each glyph
-		for (int i : finfo.allGlyphs)
+		finfo.advanceWidth.resize(slotCount);
+		finfo.leftSideBearing.resize(slotCount);
+		for (int i=0;i<slotCount;++i)
 		{
-			int advanceWidth, leftSideBearing;
-			stbtt_GetGlyphHMetrics(&info, i, 
-				&advanceWidth, &leftSideBearing);
-			finfo.advanceWidth[i] = advanceWidth;
-			finfo.leftSideBearing[i] = leftSideBearing;
+			stbtt_GetGlyphHMetrics(&info, finfo.slotGlyphs[i], 
+				&finfo.advanceWidth[i], &finfo.leftSideBearing[i]);
 		}
 
 		// Kerning
-		for (int i : finfo.allGlyphs)
+		finfo.kernAdvance.resize(slotCount*slotCount);
+		for (int i=0;i<slotCount;++i)
 		{
-			for (int j : finfo.allGlyphs)
+			for (int j=0;j<slotCount;++j)
 			{
-				finfo.kernAdvance[make_pair(i,j)] = 
-					stbtt_GetGlyphKernAdvance(&info, i,j);
+				finfo.kernAdvance[i*slotCount+j] = stbtt_GetGlyphKernAdvance(
+					&info, finfo.slotGlyphs[i], finfo.slotGlyphs[j]);
 			}
 		}
 
@@ -109,10 +116,11 @@ void Gui::init()
 			float scale = stbtt_ScaleForPixelHeight(&info, 
 				fontSizeInfo.pixelSize);
 			fontSizeInfo.scale = scale;
-			for (int i : finfo.allGlyphs)
+			fontSizeInfo.glyphInfo.resize(slotCount);
+			for (int i=0;i<slotCount;++i)
 			{
 				auto &glyphInfo = fontSizeInfo.glyphInfo[i];
-				stbtt_GetGlyphBitmapBox(&info, i, scale, scale,
+				stbtt_GetGlyphBitmapBox(&info, finfo.slotGlyphs[i], scale, scale,
 					&glyphInfo.x0, &glyphInfo.y0,
 					&glyphInfo.x1, &glyphInfo.y1);
 				rects.push_back({(int)rects.size(), 
@@ -158,7 +166,7 @@ void Gui::init()
 		for (auto &p2 : finfo.fontSizeInfo)
 		{
 			auto &fontSizeInfo = p2.second;
-			for (int i : finfo.allGlyphs)
+			for (size_t i=0;i<finfo.slotGlyphs.size();++i)
 			{
 				auto &glyphInfo = fontSizeInfo.glyphInfo[i];
 				auto rect = rects[rectId];
@@ -169,7 +177,7 @@ void Gui::init()
 				stbtt_MakeGlyphBitmap(&infos[p.first], 
 					&greyscale[glyphInfo.y*width+glyphInfo.x],
 					glyphInfo.w, glyphInfo.h, width, 
-					fontSizeInfo.scale, fontSizeInfo.scale, i);
+					fontSizeInfo.scale, fontSizeInfo.scale, finfo.slotGlyphs[i]);
 				rectId += 1;
 			}
 		}
@@ -186,7 +194,14 @@ void Gui::init()
 
 	_atlasWidth = width;
 	_atlasHeight = height;
-	initGraphics(width, height, move(rgba));
+	_atlasData = move(rgba);
+}
+
+void Gui::init()
+{
+	if (_atlasData.empty()) rasterize();
+	initGraphics(_atlasWidth, _atlasHeight, _atlasData);
+	_atlasData = vector<uint8_t>();
 }
 
 void Gui::setText(FontSize fontSize, int posX, int posY, const string &text,
@@ -201,57 +216,86 @@ void Gui::setImage(Image img, int posX, int posY, float size)
 
 }
 
-void Gui::display(int width, int height)
+bool Gui::TextRenderInfo::operator==(const TextRenderInfo &t) const
 {
-	RenderInfo renderInfo = {};
+	return fontSize == t.fontSize && posX == t.posX && posY == t.posY &&
+		r == t.r && g == t.g && b == t.b && a == t.a && text == t.text;
+}
 
-	for (const auto &text : _textRenderInfo)
-	{
-		const auto &fontInfo = _fontInfo[text.font];
-		const auto &fontSizeInfo = fontInfo.fontSizeInfo.at(text.fontSize);
-		const float scale = fontSizeInfo.scale;
+void Gui::buildText(const TextRenderInfo &text, const int width, const int height,
+	vector<Vertex> &vertices)
+{
+	const auto &fontInfo = _fontInfo[text.font];
+	const auto &fontSizeInfo = fontInfo.fontSizeInfo.at(text.fontSize);
+	const float scale = fontSizeInfo.scale;
+	const int slotCount = fontInfo.slotGlyphs.size();
+
+	float currentPosX = text.posX;
+	float currentPosY = text.posY;
+
+	int previousSlot = -1;
 
-		float currentPosX = text.posX;
-		float currentPosY = text.posY;
+	vertices.clear();
+	vertices.reserve(text.text.size()*6);
+	for (const char c : text.text)
+	{
+		const int slot = fontInfo.codepointSlots[(unsigned char)c];
+		const float advanceWidth = fontInfo.advanceWidth[slot]*scale;
+		const float kernAdvance = (previousSlot==-1)?0:
+			fontInfo.kernAdvance[previousSlot*slotCount+slot]*scale;
+		const auto &glyphInfo = fontSizeInfo.glyphInfo[slot];
+
+		currentPosX += kernAdvance;
+
+		const float x0 = (currentPosX+glyphInfo.x0)/(float)width;
+		const float x1 = (currentPosX+glyphInfo.x1)/(float)width;
+		const float y0 = 1-(currentPosY+glyphInfo.y0)/(float)height;
+		const float y1 = 1-(currentPosY+glyphInfo.y1)/(float)height;
+
+		const float u0 = (glyphInfo.x)/(float)_atlasWidth;
+		const float u1 = (glyphInfo.x+glyphInfo.w)/(float)_atlasWidth;
+		const float v0 = (glyphInfo.y)/(float)_atlasHeight;
+		const float v1 = (glyphInfo.y+glyphInfo.h)/(float)_atlasHeight;
+
+		const Vertex v[4] = {
+			{x0, y0, u0, v0, text.r, text.g, text.b, text.a},
+			{x1, y0, u1, v0, text.r, text.g, text.b, text.a},
+			{x0, y1, u0, v1, text.r, text.g, text.b, text.a},
+			{x1, y1, u1, v1, text.r, text.g, text.b, text.a}
+		};
+
+		for (int i : {0,2,1,2,3,1})
+			vertices.push_back(v[i]);
+
+		previousSlot = slot;
+		currentPosX += advanceWidth;
+	}
+}
 
-		int previousGlyph = -1;
+void Gui::display(int width, int height)
+{
+	RenderInfo renderInfo = {};
 
-		for (const char c : text.text)
+	// Texts set in the same order as last time are only rebuilt if different
+	renderInfo.changed = (_textRenderInfo.size() != _textCache.size());
+	_textCache.resize(_textRenderInfo.size());
+	for (size_t i=0;i<_textRenderInfo.size();++i)
+	{
+		const auto &text = _textRenderInfo[i];
+		auto &cache = _textCache[i];
+		if (!(cache.text == text) || cache.width != width || cache.height != height)
 		{
-			const int glyphIndex = fontInfo.codepointGlyphs[c];
-			const float advanceWidth = fontInfo.advanceWidth.at(glyphIndex)*scale;
-			const float kernAdvance = (previousGlyph==-1)?0:
-				fontInfo.kernAdvance.at(make_pair(previousGlyph, glyphIndex))*scale;
-			const auto &glyphInfo = fontSizeInfo.glyphInfo.at(glyphIndex);
-
-			currentPosX += kernAdvance;
-
-			const float x0 = (currentPosX+glyphInfo.x0)/(float)width;
-			const float x1 = (currentPosX+glyphInfo.x1)/(float)width;
-			const float y0 = 1-(currentPosY+glyphInfo.y0)/(float)height;
-			const float y1 = 1-(currentPosY+glyphInfo.y1)/(float)height;
-
-			const float u0 = (glyphInfo.x)/(float)_atlasWidth;
-			const float u1 = (glyphInfo.x+glyphInfo.w)/(float)_atlasWidth;
-			const float v0 = (glyphInfo.y)/(float)_atlasHeight;
-			const float v1 = (glyphInfo.y+glyphInfo.h)/(float)_atlasHeight;
-
-			const Vertex v[4] = {
-				{x0, y0, u0, v0, text.r, text.g, text.b, text.a},
-				{x1, y0, u1, v0, text.r, text.g, text.b, text.a},
-				{x0, y1, u0, v1, text.r, text.g, text.b, text.a},
-				{x1, y1, u1, v1, text.r, text.g, text.b, text.a}
-			};
-
-			for (int i : {0,2,1,2,3,1})
-				renderInfo.vertices.push_back(v[i]);
-
-			previousGlyph = glyphIndex;
-			currentPosX += advanceWidth;
+			cache.text = text;
+			cache.width = width;
+			cache.height = height;
+			buildText(text, width, height, cache.vertices);
+			renderInfo.changed = true;
 		}
+		renderInfo.batches.push_back({cache.vertices.data(), cache.vertices.size()});
+		renderInfo.vertexCount += cache.vertices.size();
 	}
 
-	displayGraphics(move(renderInfo));
+	displayGraphics(renderInfo);
 	_textRenderInfo.clear();
 }
 
@@ -3,7 +3,6 @@
 #include <string>
 #include <vector>
 #include <map>
-#include <set>
 
 class Gui
 {
@@ -21,6 +20,12 @@ public:
 	FontSize loadFontSize(Font font, float size);
 	Image loadImage(const std::string &filename);
 
+	/**
+	 * Loads font files and rasterizes the glyph atlas, doesn't use the graphics
+	 * API so it can run on another thread, before init()
+	 */
+	void rasterize();
+	/// Creates graphics resources, rasterizing the atlas if not done already
 	void init();
 	void setText(FontSize fontSize, int posX, int posY, const std::string &text, 
 		uint8_t r, uint8_t g, uint8_t b, uint8_t a);
@@ -37,7 +42,12 @@ protected:
 
 	struct RenderInfo
 	{
-		std::vector<Vertex> vertices;
+		/// Vertices of each text, drawn in order
+		std::vector<std::pair<const Vertex*, size_t>> batches;
+		/// Total number of vertices
+		size_t vertexCount;
+		/// Whether vertices differ from the last call
+		bool changed;
 	};
 
 	virtual void initGraphics(
@@ -54,22 +64,30 @@ private:
 		int x, y, w, h;
 	};
 
+	// Glyph metrics are in dense arrays indexed by slot, one per distinct
+	// glyph of the codepoints
 	struct FontSizeInfo
 	{
 		float pixelSize;
 		float scale;
-		std::map<int, GlyphInfo> glyphInfo;
+		/// By slot
+		std::vector<GlyphInfo> glyphInfo;
 	};
 	struct FontInfo
 	{
 		std::string filename;
 		std::map<FontSize, FontSizeInfo> fontSizeInfo;
 		int ascent, descent, lineGap;
-		std::map<int, int> advanceWidth;
-		std::map<int, int> leftSideBearing;
-		std::map<std::pair<int,int>, int> kernAdvance;
-		std::vector<int> codepointGlyphs;
-		std::set<int> allGlyphs;
+		/// By slot
+		std::vector<int> advanceWidth;
+		/// By slot
+		std::vector<int> leftSideBearing;
+		/// By pair of slots (previous*slotCount+next)
+		std::vector<int> kernAdvance;
+		/// Slot of each codepoint
+		std::vector<int> codepointSlots;
+		/// Glyph index of each slot
+		std::vector<int> slotGlyphs;
 	};
 
 	std::map<Font, FontInfo> _fontInfo;
@@ -82,8 +100,24 @@ private:
 		int posX, posY;
 		std::string text;
 		uint8_t r,g,b,a;
+		bool operator==(const TextRenderInfo &t) const;
 	};
+	/// Quads of a text, kept while the text and screen size don't change
+	struct TextCache
+	{
+		TextRenderInfo text;
+		int width, height;
+		std::vector<Vertex> vertices;
+	};
+
+	/// Builds the quads of a text for a screen size
+	void buildText(const TextRenderInfo &text, int width, int height,
+		std::vector<Vertex> &vertices);
 
 	std::vector<TextRenderInfo> _textRenderInfo;
+	/// Quads of the texts of the last display() call, in setText() order
+	std::vector<TextCache> _textCache;
 	int _atlasWidth, _atlasHeight;
+	/// RGBA atlas between rasterize() and init()
+	std::vector<uint8_t> _atlasData;
 };
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "gui_gl.hpp"
 
 #include <algorithm>
+#include <stdexcept>
 
 using namespace std;
 
@@ -47,44 +48,88 @@ void GuiGL::initGraphics(
 		Buffer::Usage::DYNAMIC,
 		Buffer::Access::WRITE_ONLY);
 
-	_ranges.resize(_bufferFrames);
-	for (auto &range : _ranges)
-		range = _vertexBuffer.assignVertices(maxVertices, sizeof(Vertex));
+	// Room for a few frames of full text, for the GL to draw from while new
+	// vertices are written
+	_ringRange = _vertexBuffer.assignVertices(maxVertices*3, sizeof(Vertex));
 	_vertexBuffer.validate();
-
-	// Fences
-	_fences.resize(_bufferFrames);
+	_ring = RingAllocator(_ringRange.getSize(), sizeof(Vertex));
 
 	// Shader pipeline
 	ShaderFactory factory;
 	factory.setVersion(450);
 	factory.setFolder("shaders/");
+	factory.setCacheFolder("cache/");
 
 	_pipeline = factory.createPipeline({
 		{GL_VERTEX_SHADER, "gui.vert"},
 		{GL_FRAGMENT_SHADER, "gui.frag"}});
 }
 
+void GuiGL::retireRanges(const bool waitOldest)
+{
+	if (waitOldest && !_retiredRanges.empty()) _retiredRanges.front().fence.waitClient();
+	// Fences signal in submission order
+	while (!_retiredRanges.empty() && _retiredRanges.front().fence.waitClient(0))
+	{
+		_ring.release(_retiredRanges.front().id);
+		_retiredRanges.pop_front();
+	}
+}
+
 void GuiGL::displayGraphics(const RenderInfo &info)
 {
+	retireRanges(false);
+
+	if (info.changed || !_current)
+	{
+		if (_current)
+		{
+			_retiredRanges.push_back(std::move(*_current));
+			_current.reset();
+		}
+
+		const size_t count = min(info.vertexCount, maxVertices);
+		if (count == 0) return;
+
+		// Wait for old ranges to be drawn if the ring is full
+		const uint32_t size = count*sizeof(Vertex);
+		RingAllocator::Range allocation = _ring.allocate(size);
+		while (allocation.offset == -1 && !_retiredRanges.empty())
+		{
+			retireRanges(true);
+			allocation = _ring.allocate(size);
+		}
+		if (allocation.offset == -1)
+			throw runtime_error("Can't allocate GUI vertices");
+
+		_current.reset(new DrawnRange{});
+		_current->id = allocation.id;
+		_current->range = BufferRange(
+			_ringRange.getOffset()+allocation.offset, size);
+		_current->count = count;
+
+		// Copy text batches straight to mapped memory
+		Vertex *dst = (Vertex*)((uint8_t*)_vertexBuffer.getPtr()+
+			_current->range.getOffset());
+		size_t written = 0;
+		for (const auto &batch : info.batches)
+		{
+			const size_t batchCount = min(batch.second, count-written);
+			copy(batch.first, batch.first+batchCount, dst+written);
+			written += batchCount;
+			if (written == count) break;
+		}
+		_vertexBuffer.flush(_current->range);
+	}
+
 	// Blending add
 	glBlendEquation(GL_FUNC_ADD);
 	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
 
-	_fences[_frameId].waitClient();
-
-	const size_t count = min(info.vertices.size(), maxVertices);
-	const BufferRange frameRange = _ranges[_frameId];
-	const BufferRange drawRange = {
-		frameRange.getOffset(), 
-		(uint32_t)(count*sizeof(Vertex))};
-	_vertexBuffer.write(drawRange, info.vertices.data());
-
 	_pipeline.bind();
 	glBindTextureUnit(0, _atlas);
-	DrawCommand(_vao, GL_TRIANGLES, count, 
-		{{0, _vertexBuffer.getId(), drawRange, sizeof(Vertex)}}).draw();
-	_fences[_frameId].lock();
-
-	_frameId = (_frameId+1)%_bufferFrames;
-}
\ No newline at end of file
+	DrawCommand(_vao, GL_TRIANGLES, _current->count, 
+		{{0, _vertexBuffer.getId(), _current->range, sizeof(Vertex)}}).draw();
+	// Covers this draw and the previous ones from the same range
+	_current->fence.lock();
+}
@@ -6,8 +6,11 @@
 #include "gl_util.hpp"
 #include "fence.hpp"
 #include "shader_pipeline.hpp"
+#include "ring_allocator.hpp"
 
 #include <vector>
+#include <deque>
+#include <memory>
 
 class GuiGL : public Gui
 {
@@ -18,12 +21,31 @@ protected:
 	void displayGraphics(const RenderInfo &info);
 
 private:
+	/// Vertices written to the ring
+	struct DrawnRange
+	{
+		/// Allocation id in the ring
+		uint64_t id;
+		/// Range in the vertex buffer
+		BufferRange range;
+		/// Number of vertices
+		size_t count;
+		/// Signaled once the GL is done drawing the range
+		Fence fence;
+	};
+
+	/// Releases ranges the GL is done with, waiting for the oldest if asked
+	void retireRanges(bool waitOldest);
+
 	GLuint _atlas;
 	GLuint _vao;
 	Buffer _vertexBuffer;
+	/// Whole range of the vertex buffer, split by _ring
+	BufferRange _ringRange;
+	RingAllocator _ring;
+	/// Range drawn last, drawn again while vertices don't change
+	std::unique_ptr<DrawnRange> _current;
+	/// Replaced ranges the GL may still be drawing from, oldest first
+	std::deque<DrawnRange> _retiredRanges;
 	ShaderPipeline _pipeline;
-	int _frameId = 0;
-	int _bufferFrames = 3;
-	std::vector<BufferRange> _ranges;
-	std::vector<Fence> _fences;
 };
\ No newline at end of file
@@ -0,0 +1,155 @@
+#include "gui_vk.hpp"
+
+#include <algorithm>
+#include <cstddef>
+
+using namespace std;
+
+static const size_t maxVertices = 10000;
+
+void GuiVK::setContext(ContextVK &ctx, VkRenderPass renderPass, const uint32_t frames)
+{
+	_ctx = &ctx;
+	_renderPass = renderPass;
+	_slotCounts.assign(frames, 0);
+	_slotStale.assign(frames, true);
+}
+
+void GuiVK::setCommandBuffer(VkCommandBuffer cmd, const uint32_t slot)
+{
+	_cmd = cmd;
+	_slot = slot;
+}
+
+void GuiVK::initGraphics(
+	int atlasWidth, int atlasHeight,
+	const vector<uint8_t> &atlasData)
+{
+	const VkDevice device = _ctx->device;
+
+	// Atlas
+	ImageVK::Info info{};
+	info.format = VK_FORMAT_R8G8B8A8_UNORM;
+	info.width = atlasWidth;
+	info.height = atlasHeight;
+	info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	_atlas = ImageVK(*_ctx, info);
+	_atlas.upload(atlasData.data(), atlasData.size(), false, {atlasData.size()});
+	_sampler = createSamplerVK(*_ctx, false);
+
+	// Vertices are rewritten in a slot once its fence is signaled
+	_vertexBuffer = BufferVK(*_ctx, maxVertices*sizeof(Vertex)*_slotCounts.size(),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+
+	VkDescriptorSetLayoutBinding binding{};
+	binding.binding = 0;
+	binding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	binding.descriptorCount = 1;
+	binding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	VkDescriptorSetLayoutCreateInfo layoutInfo{};
+	layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	layoutInfo.bindingCount = 1;
+	layoutInfo.pBindings = &binding;
+	checkVK(vkCreateDescriptorSetLayout(device, &layoutInfo, nullptr, &_setLayout),
+		"GUI descriptor set layout creation");
+
+	VkDescriptorPoolSize poolSize{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, 1};
+	VkDescriptorPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	poolInfo.maxSets = 1;
+	poolInfo.poolSizeCount = 1;
+	poolInfo.pPoolSizes = &poolSize;
+	checkVK(vkCreateDescriptorPool(device, &poolInfo, nullptr, &_descriptorPool),
+		"GUI descriptor pool creation");
+
+	VkDescriptorSetAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	allocInfo.descriptorPool = _descriptorPool;
+	allocInfo.descriptorSetCount = 1;
+	allocInfo.pSetLayouts = &_setLayout;
+	checkVK(vkAllocateDescriptorSets(device, &allocInfo, &_set),
+		"GUI descriptor set allocation");
+	VkDescriptorImageInfo imageInfo{_sampler, _atlas.getView(),
+		VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL};
+	VkWriteDescriptorSet write{};
+	write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	write.dstSet = _set;
+	write.dstBinding = 0;
+	write.descriptorCount = 1;
+	write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	write.pImageInfo = &imageInfo;
+	vkUpdateDescriptorSets(device, 1, &write, 0, nullptr);
+
+	VkPipelineLayoutCreateInfo pipelineLayoutInfo{};
+	pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+	pipelineLayoutInfo.setLayoutCount = 1;
+	pipelineLayoutInfo.pSetLayouts = &_setLayout;
+	checkVK(vkCreatePipelineLayout(device, &pipelineLayoutInfo, nullptr, &_pipelineLayout),
+		"GUI pipeline layout creation");
+
+	// Blending add
+	PipelineStateVK state{};
+	state.shaders = {
+		{VK_SHADER_STAGE_VERTEX_BIT, "shaders/spirv/gui.vert.spv"},
+		{VK_SHADER_STAGE_FRAGMENT_BIT, "shaders/spirv/gui.frag.spv"}};
+	state.bindings = {{0, sizeof(Vertex), VK_VERTEX_INPUT_RATE_VERTEX}};
+	state.attributes = {
+		{0, 0, VK_FORMAT_R32G32_SFLOAT, (uint32_t)offsetof(Vertex, x)},
+		{1, 0, VK_FORMAT_R32G32_SFLOAT, (uint32_t)offsetof(Vertex, u)},
+		{2, 0, VK_FORMAT_R8G8B8A8_UNORM, (uint32_t)offsetof(Vertex, r)}};
+	state.blend = true;
+	state.srcFactor = VK_BLEND_FACTOR_ONE;
+	state.dstFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+	_pipeline = createPipelineVK(device, state, _pipelineLayout, _renderPass);
+}
+
+void GuiVK::displayGraphics(const RenderInfo &info)
+{
+	if (info.changed) fill(_slotStale.begin(), _slotStale.end(), true);
+
+	const VkDeviceSize slotOffset = _slot*maxVertices*sizeof(Vertex);
+	if (_slotStale[_slot])
+	{
+		// Copy text batches straight to mapped memory
+		const size_t count = min(info.vertexCount, maxVertices);
+		Vertex *dst = (Vertex*)(_vertexBuffer.getPtr()+slotOffset);
+		size_t written = 0;
+		for (const auto &batch : info.batches)
+		{
+			if (written == count) break;
+			const size_t batchCount = min(batch.second, count-written);
+			copy(batch.first, batch.first+batchCount, dst+written);
+			written += batchCount;
+		}
+		_slotCounts[_slot] = count;
+		_slotStale[_slot] = false;
+	}
+	if (_slotCounts[_slot] == 0) return;
+
+	const VkBuffer buffer = _vertexBuffer.getBuffer();
+	vkCmdBindPipeline(_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipeline);
+	vkCmdBindDescriptorSets(_cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineLayout,
+		0, 1, &_set, 0, nullptr);
+	vkCmdBindVertexBuffers(_cmd, 0, 1, &buffer, &slotOffset);
+	vkCmdDraw(_cmd, _slotCounts[_slot], 1, 0, 0);
+}
+
+void GuiVK::destroy()
+{
+	if (!_ctx) return;
+	const VkDevice device = _ctx->device;
+	if (_pipeline) vkDestroyPipeline(device, _pipeline, nullptr);
+	if (_pipelineLayout) vkDestroyPipelineLayout(device, _pipelineLayout, nullptr);
+	if (_descriptorPool) vkDestroyDescriptorPool(device, _descriptorPool, nullptr);
+	if (_setLayout) vkDestroyDescriptorSetLayout(device, _setLayout, nullptr);
+	if (_sampler) vkDestroySampler(device, _sampler, nullptr);
+	_atlas = ImageVK();
+	_vertexBuffer = BufferVK();
+	_pipeline = VK_NULL_HANDLE;
+	_pipelineLayout = VK_NULL_HANDLE;
+	_descriptorPool = VK_NULL_HANDLE;
+	_setLayout = VK_NULL_HANDLE;
+	_sampler = VK_NULL_HANDLE;
+	_ctx = nullptr;
+}
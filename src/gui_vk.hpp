@@ -0,0 +1,57 @@
+#pragma once
+
+#include "gui.hpp"
+
+#include "vk_util.hpp"
+
+#include <vector>
+
+/**
+ * Gui drawn by the Vulkan renderer, in the command buffer it sets before
+ * display()
+ */
+class GuiVK : public Gui
+{
+public:
+	/**
+	 * Sets where the GUI is drawn, before init()
+	 * @param ctx context of the renderer
+	 * @param renderPass render pass the GUI is drawn in
+	 * @param frames number of frame slots, each with its own vertices
+	 */
+	void setContext(ContextVK &ctx, VkRenderPass renderPass, uint32_t frames);
+	/**
+	 * Sets the command buffer the next display() records to
+	 * @param cmd command buffer inside the render pass, viewport set
+	 * @param slot frame slot the command buffer is submitted in
+	 */
+	void setCommandBuffer(VkCommandBuffer cmd, uint32_t slot);
+	/// Destroys the Vulkan objects, once the device is idle
+	void destroy();
+
+protected:
+	void initGraphics(
+		int atlasWidth, int atlasHeight,
+		const std::vector<uint8_t> &atlasData);
+	void displayGraphics(const RenderInfo &info);
+
+private:
+	ContextVK *_ctx = nullptr;
+	VkRenderPass _renderPass = VK_NULL_HANDLE;
+	ImageVK _atlas;
+	VkSampler _sampler = VK_NULL_HANDLE;
+	/// Vertices of each slot, one after the other
+	BufferVK _vertexBuffer;
+	/// Number of vertices written in each slot
+	std::vector<size_t> _slotCounts;
+	/// Whether the vertices of each slot are older than the last change
+	std::vector<bool> _slotStale;
+	VkCommandBuffer _cmd = VK_NULL_HANDLE;
+	uint32_t _slot = 0;
+	VkDescriptorSetLayout _setLayout = VK_NULL_HANDLE;
+	VkDescriptorPool _descriptorPool = VK_NULL_HANDLE;
+	/// Atlas binding, never updated
+	VkDescriptorSet _set = VK_NULL_HANDLE;
+	VkPipelineLayout _pipelineLayout = VK_NULL_HANDLE;
+	VkPipeline _pipeline = VK_NULL_HANDLE;
+};
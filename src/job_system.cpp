@@ -0,0 +1,140 @@
+#include "job_system.hpp"
+#include "cpu_profiler.hpp"
+
+#include <algorithm>
+
+using namespace std;
+
+JobSystem::~JobSystem()
+{
+	if (!_threads.empty())
+	{
+		{
+			lock_guard<mutex> lk(_mtx);
+			_killThread = true;
+		}
+		_cond.notify_all();
+		for (auto &t : _threads)
+			t.join();
+	}
+}
+
+void JobSystem::init(int threads)
+{
+	if (threads <= 0)
+		threads = max((int)thread::hardware_concurrency(), 1);
+
+	// The calling thread runs chunks too
+	for (int i=0;i<threads-1;++i)
+		_threads.emplace_back(&JobSystem::work, this);
+}
+
+int JobSystem::getThreadCount() const
+{
+	return _threads.size()+1;
+}
+
+size_t JobSystem::getChunkSize(const size_t count, size_t grain) const
+{
+	grain = max(grain, (size_t)1);
+	// A few chunks per thread to even out uneven iterations
+	const size_t target = getThreadCount()*4;
+	return max(grain, ((count+target-1)/target+grain-1)/grain*grain);
+}
+
+size_t JobSystem::getChunkCount(const size_t count, const size_t grain) const
+{
+	if (count == 0) return 0;
+	const size_t chunkSize = getChunkSize(count, grain);
+	return (count+chunkSize-1)/chunkSize;
+}
+
+void JobSystem::parallelFor(const size_t count, const size_t grain, const Job &job)
+{
+	const size_t chunkCount = getChunkCount(count, grain);
+	if (chunkCount == 0) return;
+	if (chunkCount == 1)
+	{
+		job(0, count, 0);
+		return;
+	}
+
+	lock_guard<mutex> loopLock(_loopMtx);
+	{
+		unique_lock<mutex> lk(_mtx);
+		// Workers woken up by the previous loop may still be leaving
+		_doneCond.wait(lk, [this]{ return _activeWorkers == 0;});
+		_job = &job;
+		_count = count;
+		_chunkSize = getChunkSize(count, grain);
+		_chunkCount = chunkCount;
+		_nextChunk = 0;
+		_doneChunks = 0;
+		_error = nullptr;
+		++_generation;
+	}
+	_cond.notify_all();
+
+	runChunks();
+
+	exception_ptr error;
+	{
+		unique_lock<mutex> lk(_mtx);
+		_doneCond.wait(lk, [this]{
+			return _doneChunks == _chunkCount && _activeWorkers == 0;});
+		_job = nullptr;
+		error = _error;
+	}
+	if (error) rethrow_exception(error);
+}
+
+void JobSystem::work()
+{
+	CPUProfiler::setThreadName("Job worker");
+	uint64_t generation = 0;
+	while (true)
+	{
+		{
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [&]{ return _killThread || _generation != generation;});
+			if (_killThread) return;
+			generation = _generation;
+			++_activeWorkers;
+		}
+
+		runChunks();
+
+		{
+			lock_guard<mutex> lk(_mtx);
+			--_activeWorkers;
+		}
+		_doneCond.notify_all();
+	}
+}
+
+void JobSystem::runChunks()
+{
+	while (true)
+	{
+		const size_t chunk = _nextChunk++;
+		if (chunk >= _chunkCount) return;
+		const size_t begin = chunk*_chunkSize;
+		const size_t end = min(begin+_chunkSize, _count);
+		try
+		{
+			CPUProfiler::Scope scope("Job chunk");
+			(*_job)(begin, end, chunk);
+		}
+		catch (...)
+		{
+			lock_guard<mutex> lk(_mtx);
+			if (!_error) _error = current_exception();
+		}
+		if (++_doneChunks == _chunkCount)
+		{
+			// Lock so that the wake up can't be missed
+			lock_guard<mutex> lk(_mtx);
+			_doneCond.notify_all();
+		}
+	}
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <cstddef>
+
+/**
+ * Splits loops with independent iterations across cores
+ *
+ * A loop is cut into contiguous chunks which are taken by the worker threads
+ * and by the calling thread. Each chunk gets its index, so that results
+ * written per chunk can be merged in chunk order, giving the same result as a
+ * single-threaded loop whatever the number of threads.
+ * Only one loop runs at a time, loops started from other threads wait for
+ * it to end. parallelFor() must not be called from a job.
+ */
+class JobSystem
+{
+public:
+	/// Function called on [begin, end) of chunk index chunk
+	typedef std::function<void(size_t begin, size_t end, size_t chunk)> Job;
+
+	JobSystem() = default;
+	JobSystem(const JobSystem &) = delete;
+	JobSystem &operator=(const JobSystem &) = delete;
+	~JobSystem();
+	/**
+	 * Starts the worker threads
+	 * @param threads number of threads including the calling one, 0 for the
+	 * number of cores, 1 to run everything on the calling thread
+	 */
+	void init(int threads);
+	/// Returns the number of threads running jobs, including the calling one
+	int getThreadCount() const;
+	/**
+	 * Returns the number of chunks a loop is cut into
+	 * @param count number of iterations
+	 * @param grain minimum number of iterations per chunk
+	 */
+	size_t getChunkCount(size_t count, size_t grain) const;
+	/**
+	 * Runs job over [0, count) and waits for all chunks to be done.
+	 * Exceptions thrown by a job are rethrown here.
+	 * @param count number of iterations
+	 * @param grain minimum number of iterations per chunk (chunk boundaries are
+	 * multiples of it)
+	 * @param job function called once per chunk
+	 */
+	void parallelFor(size_t count, size_t grain, const Job &job);
+
+private:
+	/// Worker thread function
+	void work();
+	/// Runs chunks of the current loop until none is left
+	void runChunks();
+	/// Returns the number of iterations per chunk
+	size_t getChunkSize(size_t count, size_t grain) const;
+
+	std::vector<std::thread> _threads;
+	/// Held by the thread running a loop
+	std::mutex _loopMtx;
+	/// Synchronizes _generation, _killThread and _error
+	std::mutex _mtx;
+	/// Wakes workers up when a loop starts
+	std::condition_variable _cond;
+	/// Wakes the calling thread up when the last chunk is done
+	std::condition_variable _doneCond;
+	/// Incremented at each loop
+	uint64_t _generation = 0;
+	/// Signals threads to terminate themselves
+	bool _killThread = false;
+	/// Number of workers running chunks
+	int _activeWorkers = 0;
+
+	// Current loop
+	const Job *_job = nullptr;
+	size_t _count = 0;
+	size_t _chunkSize = 0;
+	size_t _chunkCount = 0;
+	/// Next chunk to take
+	std::atomic<size_t> _nextChunk{0};
+	/// Number of chunks done
+	std::atomic<size_t> _doneChunks{0};
+	/// First exception thrown by a job
+	std::exception_ptr _error;
+};
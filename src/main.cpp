@@ -2,6 +2,8 @@
 
 #include <thread>
 #include <chrono>
+#include <string>
+#include <iostream>
 
 int main(int argc, char **argv)
 {
@@ -10,9 +12,21 @@ int main(int argc, char **argv)
 	const long minFrameTime{(long)(1e9/(double)maxFramerate)};
 	std::chrono::nanoseconds minFrameTimeNano{minFrameTime};
 
+	// A flythrough file replaces interactive control
+	std::string benchmarkFile;
+	if (argc == 3 && std::string(argv[1]) == "--benchmark")
+	{
+		benchmarkFile = argv[2];
+	}
+	else if (argc > 1)
+	{
+		std::cout << "Usage: " << argv[0] << " [--benchmark <file>]" << std::endl;
+		return 1;
+	}
+
 	// Game init
 	Game game;
-	game.init();
+	game.init(benchmarkFile);
 
 	double dt{0.0};
 
@@ -22,7 +36,8 @@ int main(int argc, char **argv)
 		game.update(dt);
 		const auto end{std::chrono::high_resolution_clock::now()};
 		const std::chrono::duration<double, std::nano> elapsed{end-start};
-		if (elapsed < minFrameTimeNano)
+		// Benchmarks run as fast as they can
+		if (elapsed < minFrameTimeNano && !game.isBenchmark())
 		{
 			const auto sleepTime{minFrameTimeNano - elapsed};
 			std::this_thread::sleep_for(sleepTime);
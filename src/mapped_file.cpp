@@ -0,0 +1,142 @@
+#include "mapped_file.hpp"
+
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+#ifdef _WIN32
+
+MappedFile::MappedFile(const string &filename)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ,
+		nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file == INVALID_HANDLE_VALUE)
+		throw runtime_error("File not found : " + filename);
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw runtime_error("Can't get size of file " + filename);
+	}
+	_size = size.QuadPart;
+
+	// Mapping an empty file fails, leave it null
+	if (_size > 0)
+	{
+		_mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (_mapping)
+			_data = (const uint8_t*)MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+	CloseHandle(file);
+	if (_size > 0 && !_data)
+	{
+		if (_mapping) CloseHandle(_mapping);
+		throw runtime_error("Can't map file " + filename);
+	}
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data) UnmapViewOfFile(_data);
+	if (_mapping) CloseHandle(_mapping);
+}
+
+#else
+
+MappedFile::MappedFile(const string &filename)
+{
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd == -1) throw runtime_error("File not found : " + filename);
+
+	struct stat st;
+	if (fstat(fd, &st) == -1)
+	{
+		close(fd);
+		throw runtime_error("Can't get size of file " + filename);
+	}
+	_size = st.st_size;
+
+	// Mapping an empty file fails, leave it null
+	if (_size > 0)
+	{
+		void *ptr = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ptr != MAP_FAILED)
+		{
+			_data = (const uint8_t*)ptr;
+			// Tiles are read once from start to end
+			madvise(ptr, _size, MADV_SEQUENTIAL);
+		}
+	}
+	// The mapping keeps its own reference to the file
+	close(fd);
+	if (_size > 0 && !_data) throw runtime_error("Can't map file " + filename);
+}
+
+MappedFile::~MappedFile()
+{
+	if (_data) munmap((void*)_data, _size);
+}
+
+#endif
+
+const uint8_t *MappedFile::getData() const
+{
+	return _data;
+}
+
+size_t MappedFile::getSize() const
+{
+	return _size;
+}
+
+MappedFileCache::MappedFileCache(const size_t capacity) :
+	_capacity{max<size_t>(1, capacity)}
+{
+
+}
+
+shared_ptr<const MappedFile> MappedFileCache::get(const string &filename)
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		auto it = _index.find(filename);
+		if (it != _index.end())
+		{
+			// Move to front
+			_files.splice(_files.begin(), _files, it->second);
+			return it->second->second;
+		}
+	}
+
+	// Map outside of the lock so other threads aren't blocked on disk access
+	shared_ptr<const MappedFile> file = make_shared<MappedFile>(filename);
+
+	lock_guard<mutex> lk(_mtx);
+	auto it = _index.find(filename);
+	if (it != _index.end())
+	{
+		// Another thread mapped it in the meantime
+		_files.splice(_files.begin(), _files, it->second);
+		return it->second->second;
+	}
+	_files.emplace_front(filename, file);
+	_index[filename] = _files.begin();
+	if (_files.size() > _capacity)
+	{
+		_index.erase(_files.back().first);
+		_files.pop_back();
+	}
+	return file;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <string>
+#include <memory>
+#include <list>
+#include <map>
+#include <mutex>
+#include <cstdint>
+
+/**
+ * Read-only memory mapping of a whole file
+ */
+class MappedFile
+{
+public:
+	/**
+	 * Maps a file in memory
+	 * @param filename path of file to map
+	 */
+	explicit MappedFile(const std::string &filename);
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	~MappedFile();
+
+	/// Returns the mapped file contents
+	const uint8_t *getData() const;
+	/// Returns the size of the file in bytes
+	size_t getSize() const;
+
+private:
+	/// Mapped file contents
+	const uint8_t *_data = nullptr;
+	/// Size of the file in bytes
+	size_t _size = 0;
+#ifdef _WIN32
+	/// File mapping object
+	void *_mapping = nullptr;
+#endif
+};
+
+/**
+ * Thread-safe cache of the most recently used mapped files
+ */
+class MappedFileCache
+{
+public:
+	/**
+	 * @param capacity maximum number of files kept mapped by the cache
+	 */
+	explicit MappedFileCache(size_t capacity);
+	/**
+	 * Returns the mapping of a file, mapping it if it isn't in the cache
+	 * @param filename path of file to map
+	 * @return mapped file, stays valid even if evicted from the cache
+	 */
+	std::shared_ptr<const MappedFile> get(const std::string &filename);
+
+private:
+	typedef std::pair<std::string, std::shared_ptr<const MappedFile>> Entry;
+	/// Maximum number of files kept mapped
+	size_t _capacity;
+	/// Mapped files, most recently used first
+	std::list<Entry> _files;
+	/// Filename->position in _files
+	std::map<std::string, std::list<Entry>::iterator> _index;
+	/// Synchronizes access
+	std::mutex _mtx;
+};
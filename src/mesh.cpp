@@ -1,7 +1,8 @@
 #include "mesh.hpp"
 
 #include <glm/gtc/constants.hpp>
-#include <cstring>
+#include <glm/gtc/packing.hpp>
+#include <algorithm>
 
 using namespace std;
 using namespace glm;
@@ -9,9 +10,11 @@ using namespace glm;
 
 Mesh::Mesh(
 	const std::vector<Vertex> &vertices,
-	const std::vector<Index> &indices) :
+	const std::vector<Index> &indices,
+	const VertexFormat format) :
 	_vertices{vertices},
-	_indices{indices}
+	_indices{indices},
+	_format{format}
 {
 
 }
@@ -26,6 +29,97 @@ const std::vector<Index> &Mesh::getIndices() const
 	return _indices;
 }
 
+VertexFormat Mesh::getFormat() const
+{
+	return _format;
+}
+
+/// Sign that is 1 for 0, so that encoded vectors stay on the octahedron
+static vec2 signNotZero(const vec2 &v)
+{
+	return vec2((v.x >= 0)?1.f:-1.f, (v.y >= 0)?1.f:-1.f);
+}
+
+/// Octahedral encoding of a unit vector, a null vector gives (0,0,1)
+static vec2 octEncode(const vec3 &n)
+{
+	const float l1 = abs(n.x)+abs(n.y)+abs(n.z);
+	if (l1 <= 0) return vec2(0);
+	const vec2 p = vec2(n)/l1;
+	if (n.z >= 0) return p;
+	return (vec2(1)-abs(vec2(p.y, p.x)))*signNotZero(p);
+}
+
+vector<PackedVertex> Mesh::getPackedVertices() const
+{
+	const bool compact = (_format == VertexFormat::COMPACT);
+	vector<PackedVertex> packed(_vertices.size());
+	for (size_t i=0;i<_vertices.size();++i)
+	{
+		const Vertex &v = _vertices[i];
+		PackedVertex &p = packed[i];
+		for (int c=0;c<3;++c)
+		{
+			p.position[c] = compact?
+				packSnorm1x16(v.position[c]):packHalf1x16(v.position[c]);
+		}
+		p.position[3] = 0;
+		for (int c=0;c<2;++c)
+			p.uv[c] = compact?packUnorm1x16(v.uv[c]):packHalf1x16(v.uv[c]);
+		const vec2 normal = octEncode(v.normal);
+		p.normal[0] = packSnorm1x16(normal.x);
+		p.normal[1] = packSnorm1x16(normal.y);
+	}
+	return packed;
+}
+
+/**
+ * Returns the quad patches of a grid of (columns+1)*(rows+1) vertices, in
+ * bands of a few columns so that the vertices shared with the previous row
+ * are still in the post-transform cache
+ */
+static vector<Index> gridPatches(const int columns, const int rows)
+{
+	const int BAND_WIDTH = 8;
+	const int stride = columns+1;
+	vector<Index> indices;
+	indices.reserve(columns*rows*4);
+	for (int band=0;band<columns;band+=BAND_WIDTH)
+	{
+		const int bandEnd = std::min(band+BAND_WIDTH, columns);
+		for (int i=0;i<rows;++i)
+		{
+			for (int j=band;j<bandEnd;++j)
+			{
+				indices.push_back(i*stride+j);
+				indices.push_back(i*stride+j+1);
+				indices.push_back((i+1)*stride+j);
+				indices.push_back((i+1)*stride+j+1);
+			}
+		}
+	}
+	return indices;
+}
+
+/// Renumbers vertices in the order of their first use, for fetch locality
+static void reorderVertices(vector<Vertex> &vertices, vector<Index> &indices)
+{
+	const Index UNUSED = ~(Index)0;
+	vector<Index> remap(vertices.size(), UNUSED);
+	vector<Vertex> ordered;
+	ordered.reserve(vertices.size());
+	for (Index &index : indices)
+	{
+		if (remap[index] == UNUSED)
+		{
+			remap[index] = ordered.size();
+			ordered.push_back(vertices[index]);
+		}
+		index = remap[index];
+	}
+	vertices.swap(ordered);
+}
+
 Mesh generateSphere(
 	const int meridians, 
 	const int rings)
@@ -56,26 +150,30 @@ Mesh generateSphere(
 	}
 
 	// Indices
-	vector<Index> indices(meridians*rings*4);
-	offset = 0;
-	for (int i=0;i<rings;++i)
+	vector<Index> indices = gridPatches(meridians, rings);
+	reorderVertices(vertices, indices);
+	return Mesh(vertices, indices, VertexFormat::COMPACT);
+}
+
+Mesh generateGrid(const int size)
+{
+	// Vertices
+	vector<Vertex> vertices((size+1)*(size+1));
+	size_t offset = 0;
+	for (int i=0;i<=size;++i)
 	{
-		for (int j=0;j<meridians;++j)
+		for (int j=0;j<=size;++j)
 		{
-			const Index i1 = i+1;
-			const Index j1 = j+1;
-			vector<Index> ind = {
-				(Index)(i *(rings+1)+j),
-				(Index)(i *(rings+1)+j1),
-				(Index)(i1*(rings+1)+j),
-				(Index)(i1*(rings+1)+j1)
-			};
-			// Copy to indices
-			memcpy(&indices[offset], ind.data(), ind.size()*sizeof(Index));
-			offset += 4;
+			const vec2 pos = vec2(j, i)/(float)size;
+			vertices[offset] = {vec3(pos, 0), pos, vec3(0,0,1)};
+			offset++;
 		}
 	}
-	return Mesh(vertices, indices);
+
+	// Indices, same order as sphere patches
+	vector<Index> indices = gridPatches(size, size);
+	reorderVertices(vertices, indices);
+	return Mesh(vertices, indices, VertexFormat::COMPACT);
 }
 
 Mesh generateFlareMesh(const int detail)
@@ -100,7 +198,7 @@ Mesh generateFlareMesh(const int detail)
 		indices[i*6+4] = (i*2)+1;
 		indices[i*6+5] = (i*2)+3;
 	}
-	return Mesh(vertices, indices);
+	return Mesh(vertices, indices, VertexFormat::COMPACT);
 }
 
 Mesh generateRingMesh(
@@ -115,8 +213,8 @@ Mesh generateRingMesh(
 		{
 			float angle = (glm::pi<float>()*i)/(float)meridians;
 			vec2 pos = vec2(cos(angle),sin(angle));
-			vertices[offset+0] = {vec3(pos*near, 0.0), vec2(pos*1.f)};
-			vertices[offset+1] = {vec3(pos*far , 0.0), vec2(pos*2.f)};
+			vertices[offset+0] = {vec3(pos*(near/far), 0.0), vec2(pos*1.f)};
+			vertices[offset+1] = {vec3(pos, 0.0), vec2(pos*2.f)};
 			offset += 2;
 		}
 	}
@@ -135,5 +233,6 @@ Mesh generateRingMesh(
 			vert += 2; 
 		}
 	}
-	return Mesh(vertices, indices);
+	// Uvs go up to 2
+	return Mesh(vertices, indices, VertexFormat::HALF);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <vector>
+#include <cstdint>
 #include <glm/glm.hpp>
 
 struct Vertex
@@ -10,22 +11,63 @@ struct Vertex
 	glm::vec3 normal;
 };
 
+/// Layout of vertices in vertex buffers
+enum class VertexFormat
+{
+	/// snorm16 position, unorm16 uv, for meshes within [-1,1] with uvs in [0,1]
+	COMPACT,
+	/// Half float position and uv
+	HALF
+};
+
+/**
+ * Vertex as stored in vertex buffers (16 bytes), position and uv encoded
+ * as given by the VertexFormat, normal octahedral encoded as snorm16
+ */
+struct PackedVertex
+{
+	uint16_t position[4];
+	uint16_t uv[2];
+	uint16_t normal[2];
+};
+
 typedef uint32_t Index;
 
 class Mesh
 {
 public:
 	Mesh() = default;
-	Mesh(const std::vector<Vertex> &vertices, const std::vector<Index> &indices);
+	Mesh(const std::vector<Vertex> &vertices, const std::vector<Index> &indices,
+		VertexFormat format = VertexFormat::HALF);
 	const std::vector<Vertex> &getVertices() const;
 	const std::vector<Index> &getIndices() const;
+	VertexFormat getFormat() const;
+	/// Returns the vertices encoded in the format of the mesh
+	std::vector<PackedVertex> getPackedVertices() const;
 private:
 	std::vector<Vertex> _vertices;
 	std::vector<Index> _indices;
+	VertexFormat _format = VertexFormat::HALF;
 };
 
+/**
+ * Generates a unit sphere of quad patches, vertices in the order they are
+ * first used and patches in bands for vertex cache reuse
+ */
 Mesh generateSphere(int meridians, int rings);
 
+/**
+ * Generates a square grid of quad patches covering [0,1]x[0,1] (z = 0),
+ * in the same order as the sphere
+ * @param size number of quads per side
+ */
+Mesh generateGrid(int size);
+
 Mesh generateFlareMesh(int detail);
 
+/**
+ * Generates a half ring in units of the outer distance
+ * @param near inner distance
+ * @param far outer distance
+ */
 Mesh generateRingMesh(int meridians, float near, float far);
\ No newline at end of file
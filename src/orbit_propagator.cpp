@@ -0,0 +1,553 @@
+#include "orbit_propagator.hpp"
+#include "entity.hpp"
+#include "job_system.hpp"
+
+#include <cmath>
+#include <stdexcept>
+#include <algorithm>
+
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/constants.hpp>
+
+// The AVX2 path is built for x86 whatever the compiler flags, and only taken
+// on CPUs that support it
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64)
+#define ORBIT_AVX2
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define AVX2_TARGET
+#else
+#define AVX2_TARGET __attribute__((target("avx2")))
+#endif
+#endif
+
+using namespace glm;
+using namespace std;
+
+/// Solver stops when the anomaly correction is below this (radians)
+static const double tolerance = 1e-12;
+/// Solver iteration limit, only reached in degenerate cases
+static const int maxIterations = 50;
+/// Eccentricity above which ellipses are solved with the careful scalar path
+static const double highEccentricity = 0.9;
+/// Largest estimated anomaly change between calls allowing a warm start (radians)
+static const double warmStartMaxStep = 0.5;
+
+/// E - e*sin(E), without cancellation for small E and e close to 1
+static double keplerElliptic(const double E, const double ecc)
+{
+	if (ecc < highEccentricity || abs(E) > 1.0)
+		return E - ecc*sin(E);
+	// E - sin(E) series
+	const double E2 = E*E;
+	double term = E*E2/6;
+	double sum = 0.0;
+	for (int k=4;k<40 && term != 0.0;k+=2)
+	{
+		sum += term;
+		term *= -E2/(k*(k+1));
+		if (abs(term) < 1e-17*abs(sum)) break;
+	}
+	return (1-ecc)*E + ecc*sum;
+}
+
+/// e*sinh(H) - H, without cancellation for small H and e close to 1
+static double keplerHyperbolic(const double H, const double ecc)
+{
+	if (abs(H) > 1.0)
+		return ecc*sinh(H) - H;
+	// sinh(H) - H series
+	const double H2 = H*H;
+	double term = H*H2/6;
+	double sum = 0.0;
+	for (int k=4;k<40 && term != 0.0;k+=2)
+	{
+		sum += term;
+		term *= H2/(k*(k+1));
+		if (abs(term) < 1e-17*abs(sum)) break;
+	}
+	return (ecc-1)*H + ecc*sum;
+}
+
+/**
+ * Solves M = E - e*sin(E) with Newton's method
+ * @param mean mean anomaly in [0, 2pi)
+ * @param guess starting value of E
+ * @param iterations incremented by the number of iterations done
+ */
+static double solveElliptic(
+	const double mean, const double ecc, const double guess, int &iterations)
+{
+	// Solve on [0, pi] by symmetry, where the equation is convex
+	const bool mirror = mean > pi<double>();
+	const double M = mirror?2*pi<double>()-mean:mean;
+	double En = mirror?2*pi<double>()-guess:guess;
+	for (int it=0;it<maxIterations;++it)
+	{
+		const double h = sin(En/2);
+		const double d = (keplerElliptic(En, ecc)-M)/((1-ecc) + 2*ecc*h*h);
+		En -= d;
+		++iterations;
+		if (abs(d) < tolerance) break;
+	}
+	return mirror?2*pi<double>()-En:En;
+}
+
+/**
+ * Solves M = e*sinh(H) - H with Newton's method
+ * @param mean mean anomaly
+ * @param guess starting value of H
+ * @param iterations incremented by the number of iterations done
+ */
+static double solveHyperbolic(
+	const double mean, const double ecc, const double guess, int &iterations)
+{
+	double H = guess;
+	for (int it=0;it<maxIterations;++it)
+	{
+		const double h = sinh(H/2);
+		const double d = (keplerHyperbolic(H, ecc)-mean)/((ecc-1) + 2*ecc*h*h);
+		H -= d;
+		++iterations;
+		if (abs(d) < tolerance*std::max(1.0, abs(H))) break;
+	}
+	return H;
+}
+
+/// Danby's starting value for the elliptic Kepler equation
+static double coldStartElliptic(const double mean, const double ecc)
+{
+	return mean + ((mean<pi<double>())?0.85:-0.85)*ecc;
+}
+
+/// Starting value for the hyperbolic Kepler equation
+static double coldStartHyperbolic(const double mean, const double ecc)
+{
+	return ((mean<0)?-1:1)*log(2*abs(mean)/ecc + 1.8);
+}
+
+/// Solves Barker's equation M = D + D^3/3, with D = tan(true anomaly/2)
+static double solveParabolic(const double mean)
+{
+	// Odd function, solve for positive M to avoid cancellation
+	const double M = abs(mean);
+	const double y = cbrt((3*M + sqrt(9*M*M+4))/2);
+	return ((mean<0)?-1:1)*(y - 1/y);
+}
+
+/// Kind of orbit, also their order in the propagator arrays
+enum class OrbitKind
+{
+	ELLIPTIC, HIGHLY_ELLIPTIC, PARABOLIC, HYPERBOLIC
+};
+
+static OrbitKind getKind(const double ecc)
+{
+	if (ecc < highEccentricity) return OrbitKind::ELLIPTIC;
+	if (ecc < 1.0) return OrbitKind::HIGHLY_ELLIPTIC;
+	if (ecc == 1.0) return OrbitKind::PARABOLIC;
+	return OrbitKind::HYPERBOLIC;
+}
+
+/**
+ * Computes the directions whose combination gives the position of an orbit,
+ * position = P*a(anomaly) + Q*b(anomaly)
+ * @param orbit orbit
+ * @param p periapsis direction scaled by semi-major axis
+ * @param q semi-minor axis direction scaled by semi-minor axis
+ */
+static void computeAxes(const Orbit &orbit, dvec3 &p, dvec3 &q)
+{
+	const double ecc = orbit.getEccentricity();
+	const double sma = abs(orbit.getSemiMajorAxis());
+
+	// Orbital plane to parent frame, fixed for the orbit's lifetime
+	const dquat r =
+		  rotate(dquat(), orbit.getLongitudeOfAscendingNode(), dvec3(0,0,1))
+		* rotate(dquat(), orbit.getInclination(), dvec3(0,1,0))
+		* rotate(dquat(), orbit.getArgumentOfPeriapsis(), dvec3(0,0,1));
+
+	const double minor =
+		(getKind(ecc) == OrbitKind::PARABOLIC)?2*sma:sma*sqrt(abs(1-ecc*ecc));
+	p = r*dvec3(0,1,0)*sma;
+	q = r*dvec3(-1,0,0)*minor;
+}
+
+/**
+ * Solves the Kepler equation of one orbit
+ * @param ecc eccentricity
+ * @param mean mean anomaly
+ * @param warm whether prevMean and prevAnomaly hold the previous solution
+ * @param prevMean previous mean anomaly, replaced by this one
+ * @param prevAnomaly previous anomaly, replaced by the solution
+ * @param iterations number of solver iterations
+ * @return coefficients a and b of the position along the orbit axes
+ */
+static dvec2 solveOrbit(const double ecc, double mean, const bool warm,
+	double &prevMean, double &prevAnomaly, int &iterations)
+{
+	double anomaly, a, b;
+	iterations = 0;
+	if (ecc < 1.0)
+	{
+		mean = fmod(mean, 2*pi<double>());
+		if (mean < 0) mean += 2*pi<double>();
+		double guess = coldStartElliptic(mean, ecc);
+		if (warm)
+		{
+			// Keep the same revolution as the previous anomaly
+			const double dMean = mean-prevMean;
+			const double dMeanWrapped = 
+				dMean - 2*pi<double>()*round(dMean/(2*pi<double>()));
+			const double step = dMeanWrapped/(1-ecc*cos(prevAnomaly));
+			if (abs(step) < warmStartMaxStep)
+				guess = prevAnomaly + (dMean-dMeanWrapped) + step;
+		}
+		anomaly = solveElliptic(mean, ecc, guess, iterations);
+		a = cos(anomaly)-ecc;
+		b = sin(anomaly);
+	}
+	else if (ecc == 1.0)
+	{
+		anomaly = solveParabolic(mean);
+		a = 1-anomaly*anomaly;
+		b = anomaly;
+	}
+	else
+	{
+		double guess = coldStartHyperbolic(mean, ecc);
+		if (warm)
+		{
+			const double step = (mean-prevMean)/(ecc*cosh(prevAnomaly)-1);
+			if (abs(step) < warmStartMaxStep)
+				guess = prevAnomaly + step;
+		}
+		anomaly = solveHyperbolic(mean, ecc, guess, iterations);
+		a = ecc-cosh(anomaly);
+		b = sinh(anomaly);
+	}
+	prevMean = mean;
+	prevAnomaly = anomaly;
+	return dvec2(a, b);
+}
+
+dvec3 OrbitPropagator::computePosition(const Orbit &orbit, const double epoch)
+{
+	dvec3 p, q;
+	computeAxes(orbit, p, q);
+	double prevMean = 0.0, prevAnomaly = 0.0;
+	int iterations = 0;
+	const dvec2 ab = solveOrbit(orbit.getEccentricity(),
+		epoch*2*pi<double>()/orbit.getPeriod() + orbit.getMeanAnomalyAtEpoch(),
+		false, prevMean, prevAnomaly, iterations);
+	return p*ab.x + q*ab.y;
+}
+
+void OrbitPropagator::init(
+	const vector<Orbit> &orbits,
+	const vector<int> &outputIds)
+{
+	if (orbits.size() != outputIds.size())
+		throw runtime_error("Orbit and output id counts don't match");
+
+	// Sort by kind, vectorizable orbits first
+	const size_t n = orbits.size();
+	vector<size_t> order(n);
+	for (size_t i=0;i<n;++i) order[i] = i;
+	stable_sort(order.begin(), order.end(), [&](size_t a, size_t b){
+		return getKind(orbits[a].getEccentricity()) < getKind(orbits[b].getEccentricity());
+	});
+
+	for (auto v : {&_ecc, &_meanMotion, &_m0, &_px, &_py, &_pz, &_qx, &_qy, &_qz,
+		&_prevMean, &_prevAnomaly})
+	{
+		v->assign(n, 0.0);
+	}
+	_outputIds.resize(n);
+	_vectorCount = 0;
+	_warm = false;
+
+	for (size_t i=0;i<n;++i)
+	{
+		const Orbit &o = orbits[order[i]];
+		const double ecc = o.getEccentricity();
+		if (getKind(ecc) == OrbitKind::ELLIPTIC) _vectorCount = i+1;
+
+		dvec3 p, s;
+		computeAxes(o, p, s);
+
+		_ecc[i] = ecc;
+		_meanMotion[i] = 2*pi<double>()/o.getPeriod();
+		_m0[i] = o.getMeanAnomalyAtEpoch();
+		_px[i] = p.x; _py[i] = p.y; _pz[i] = p.z;
+		_qx[i] = s.x; _qy[i] = s.y; _qz[i] = s.z;
+		_outputIds[i] = outputIds[order[i]];
+	}
+}
+
+size_t OrbitPropagator::size() const
+{
+	return _ecc.size();
+}
+
+int OrbitPropagator::getIterationCount() const
+{
+	return _iterationCount.load(memory_order_relaxed);
+}
+
+int OrbitPropagator::getMaxIterationCount() const
+{
+	return _maxIterationCount.load(memory_order_relaxed);
+}
+
+void OrbitPropagator::propagate(const double epoch, dvec3 *positions,
+	JobSystem *jobs)
+{
+	const bool vectorize = hasAVX2();
+	if (!jobs)
+	{
+		Counters counters{};
+		const size_t first = vectorize?
+			propagateAVX2(epoch, 0, _vectorCount, positions, counters):0;
+		propagateScalar(epoch, first, size(), positions, counters);
+		_iterationCount.store(counters.iterations, memory_order_relaxed);
+		_maxIterationCount.store(counters.maxIterations, memory_order_relaxed);
+		_warm = true;
+		return;
+	}
+
+	// Chunks are multiple of 4 orbits so lanes are the same as in a single loop
+	const size_t grain = 64;
+	vector<Counters> counters(jobs->getChunkCount(size(), grain));
+	jobs->parallelFor(size(), grain,
+		[&](const size_t begin, const size_t end, const size_t chunk)
+	{
+		const size_t vectorEnd = std::max(begin, std::min(end, _vectorCount));
+		const size_t first = vectorize?
+			propagateAVX2(epoch, begin, vectorEnd, positions, counters[chunk]):begin;
+		propagateScalar(epoch, first, end, positions, counters[chunk]);
+	});
+	// Totals are only stored once complete
+	Counters total{};
+	for (const auto &c : counters)
+	{
+		total.iterations += c.iterations;
+		total.maxIterations = std::max(total.maxIterations, c.maxIterations);
+	}
+	_iterationCount.store(total.iterations, memory_order_relaxed);
+	_maxIterationCount.store(total.maxIterations, memory_order_relaxed);
+	_warm = true;
+}
+
+void OrbitPropagator::propagateScalar(
+	const double epoch, const size_t begin, const size_t end,
+	dvec3 *positions, Counters &counters)
+{
+	for (size_t i=begin;i<end;++i)
+	{
+		int iterations = 0;
+		const dvec2 ab = solveOrbit(_ecc[i], epoch*_meanMotion[i] + _m0[i],
+			_warm, _prevMean[i], _prevAnomaly[i], iterations);
+		const double a = ab.x;
+		const double b = ab.y;
+		counters.iterations += iterations;
+		counters.maxIterations = std::max(counters.maxIterations, iterations);
+
+		positions[_outputIds[i]] = dvec3(
+			_px[i]*a + _qx[i]*b,
+			_py[i]*a + _qy[i]*b,
+			_pz[i]*a + _qz[i]*b);
+	}
+}
+
+#if defined(ORBIT_AVX2)
+
+bool OrbitPropagator::hasAVX2()
+{
+	static const bool supported = []{
+#if defined(_MSC_VER) && !defined(__clang__)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) return false;
+		// YMM registers must be saved by the OS
+		__cpuid(info, 1);
+		if (!(info[2] & (1<<27)) || (_xgetbv(0) & 6) != 6) return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1<<5)) != 0;
+#else
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("avx2") != 0;
+#endif
+	}();
+	return supported;
+}
+
+/// Sine and cosine of four doubles (Cephes polynomials, Cody-Waite reduction)
+AVX2_TARGET static void sincos4(const __m256d x, __m256d &s, __m256d &c)
+{
+	const __m256d signMask = _mm256_set1_pd(-0.0);
+	const __m256d fourOverPi = _mm256_set1_pd(1.27323954473516268615);
+	const __m256d dp1 = _mm256_set1_pd(7.85398125648498535156E-1);
+	const __m256d dp2 = _mm256_set1_pd(3.77489470793079817668E-8);
+	const __m256d dp3 = _mm256_set1_pd(2.69515142907905952645E-15);
+
+	const __m256d signSin = _mm256_and_pd(x, signMask);
+	__m256d ax = _mm256_andnot_pd(signMask, x);
+
+	// Octant, rounded up to even
+	__m128i j = _mm256_cvttpd_epi32(_mm256_mul_pd(ax, fourOverPi));
+	j = _mm_and_si128(_mm_add_epi32(j, _mm_set1_epi32(1)), _mm_set1_epi32(~1));
+	const __m256d y = _mm256_cvtepi32_pd(j);
+
+	// Sign swaps and polynomial selection per octant
+	const __m256d swapSin = _mm256_castsi256_pd(_mm256_slli_epi64(
+		_mm256_cvtepi32_epi64(_mm_and_si128(j, _mm_set1_epi32(4))), 61));
+	const __m256d signCos = _mm256_castsi256_pd(_mm256_slli_epi64(
+		_mm256_cvtepi32_epi64(_mm_andnot_si128(
+			_mm_sub_epi32(j, _mm_set1_epi32(2)), _mm_set1_epi32(4))), 61));
+	const __m256d polyMask = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(
+		_mm_cmpeq_epi32(_mm_and_si128(j, _mm_set1_epi32(2)), _mm_setzero_si128())));
+
+	// Extended precision reduction to [-pi/4, pi/4]
+	ax = _mm256_sub_pd(ax, _mm256_mul_pd(y, dp1));
+	ax = _mm256_sub_pd(ax, _mm256_mul_pd(y, dp2));
+	ax = _mm256_sub_pd(ax, _mm256_mul_pd(y, dp3));
+	const __m256d z = _mm256_mul_pd(ax, ax);
+
+	// Cosine polynomial
+	__m256d pc = _mm256_set1_pd(-1.13585365213876817300E-11);
+	pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(2.08757008419747316778E-9));
+	pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(-2.75573141792967388112E-7));
+	pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(2.48015872888517045348E-5));
+	pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(-1.38888888888730564116E-3));
+	pc = _mm256_add_pd(_mm256_mul_pd(pc, z), _mm256_set1_pd(4.16666666666665929218E-2));
+	pc = _mm256_mul_pd(_mm256_mul_pd(pc, z), z);
+	pc = _mm256_sub_pd(pc, _mm256_mul_pd(z, _mm256_set1_pd(0.5)));
+	pc = _mm256_add_pd(pc, _mm256_set1_pd(1.0));
+
+	// Sine polynomial
+	__m256d ps = _mm256_set1_pd(1.58962301576546568060E-10);
+	ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(-2.50507477628578072866E-8));
+	ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(2.75573136213857245213E-6));
+	ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(-1.98412698295895385996E-4));
+	ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(8.33333333332211858878E-3));
+	ps = _mm256_add_pd(_mm256_mul_pd(ps, z), _mm256_set1_pd(-1.66666666666666307295E-1));
+	ps = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(ps, z), ax), ax);
+
+	s = _mm256_xor_pd(_mm256_blendv_pd(pc, ps, polyMask), _mm256_xor_pd(signSin, swapSin));
+	c = _mm256_xor_pd(_mm256_blendv_pd(ps, pc, polyMask), signCos);
+}
+
+/// Number of set bits in a 4 lane mask
+static int laneCount(const int mask)
+{
+	return (mask&1) + ((mask>>1)&1) + ((mask>>2)&1) + ((mask>>3)&1);
+}
+
+AVX2_TARGET size_t OrbitPropagator::propagateAVX2(
+	const double epoch, const size_t begin, const size_t end,
+	dvec3 *positions, Counters &counters)
+{
+	const __m256d twoPi = _mm256_set1_pd(2*pi<double>());
+	const __m256d invTwoPi = _mm256_set1_pd(1.0/(2*pi<double>()));
+	const __m256d one = _mm256_set1_pd(1.0);
+	const __m256d vPi = _mm256_set1_pd(pi<double>());
+	const __m256d danby = _mm256_set1_pd(0.85);
+	const __m256d absMask = _mm256_castsi256_pd(_mm256_set1_epi64x(0x7FFFFFFFFFFFFFFF));
+	const __m256d vTolerance = _mm256_set1_pd(tolerance);
+	const __m256d maxStep = _mm256_set1_pd(warmStartMaxStep);
+	const __m256d vEpoch = _mm256_set1_pd(epoch);
+
+	size_t i = begin;
+	for (;i+4<=end;i+=4)
+	{
+		const __m256d ecc = _mm256_loadu_pd(&_ecc[i]);
+		// Mean anomaly in [0, 2pi)
+		__m256d mean = _mm256_add_pd(
+			_mm256_mul_pd(vEpoch, _mm256_loadu_pd(&_meanMotion[i])),
+			_mm256_loadu_pd(&_m0[i]));
+		mean = _mm256_sub_pd(mean, _mm256_mul_pd(twoPi,
+			_mm256_floor_pd(_mm256_mul_pd(mean, invTwoPi))));
+
+		// Danby's starting value
+		const __m256d danbyOffset = _mm256_mul_pd(danby, ecc);
+		__m256d En = _mm256_blendv_pd(
+			_mm256_sub_pd(mean, danbyOffset),
+			_mm256_add_pd(mean, danbyOffset),
+			_mm256_cmp_pd(mean, vPi, _CMP_LT_OQ));
+
+		__m256d s, c;
+		if (_warm)
+		{
+			// Previous anomaly, kept on the same revolution, plus first order step
+			const __m256d prevMean = _mm256_loadu_pd(&_prevMean[i]);
+			const __m256d prevEn = _mm256_loadu_pd(&_prevAnomaly[i]);
+			const __m256d dMean = _mm256_sub_pd(mean, prevMean);
+			const __m256d revolutions = _mm256_round_pd(_mm256_mul_pd(dMean, invTwoPi),
+				_MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+			const __m256d shift = _mm256_mul_pd(twoPi, revolutions);
+			sincos4(prevEn, s, c);
+			const __m256d step = _mm256_div_pd(_mm256_sub_pd(dMean, shift),
+				_mm256_sub_pd(one, _mm256_mul_pd(ecc, c)));
+			const __m256d warm = _mm256_add_pd(_mm256_add_pd(prevEn, shift), step);
+			En = _mm256_blendv_pd(En, warm,
+				_mm256_cmp_pd(_mm256_and_pd(step, absMask), maxStep, _CMP_LT_OQ));
+		}
+
+		// Newton to find eccentric anomaly, until all lanes converge
+		int active = 0xF;
+		int iterations = 0;
+		while (active && iterations < maxIterations)
+		{
+			sincos4(En, s, c);
+			const __m256d f = _mm256_sub_pd(
+				_mm256_sub_pd(En, _mm256_mul_pd(ecc, s)), mean);
+			const __m256d df = _mm256_sub_pd(one, _mm256_mul_pd(ecc, c));
+			const __m256d d = _mm256_div_pd(f, df);
+			En = _mm256_sub_pd(En, d);
+			++iterations;
+			counters.iterations += laneCount(active);
+			active = _mm256_movemask_pd(
+				_mm256_cmp_pd(_mm256_and_pd(d, absMask), vTolerance, _CMP_GE_OQ));
+		}
+		counters.maxIterations = std::max(counters.maxIterations, iterations);
+		_mm256_storeu_pd(&_prevMean[i], mean);
+		_mm256_storeu_pd(&_prevAnomaly[i], En);
+
+		sincos4(En, s, c);
+		const __m256d a = _mm256_sub_pd(c, ecc);
+
+		double x[4], y[4], z[4];
+		_mm256_storeu_pd(x, _mm256_add_pd(
+			_mm256_mul_pd(_mm256_loadu_pd(&_px[i]), a),
+			_mm256_mul_pd(_mm256_loadu_pd(&_qx[i]), s)));
+		_mm256_storeu_pd(y, _mm256_add_pd(
+			_mm256_mul_pd(_mm256_loadu_pd(&_py[i]), a),
+			_mm256_mul_pd(_mm256_loadu_pd(&_qy[i]), s)));
+		_mm256_storeu_pd(z, _mm256_add_pd(
+			_mm256_mul_pd(_mm256_loadu_pd(&_pz[i]), a),
+			_mm256_mul_pd(_mm256_loadu_pd(&_qz[i]), s)));
+
+		for (int k=0;k<4;++k)
+			positions[_outputIds[i+k]] = dvec3(x[k], y[k], z[k]);
+	}
+	return i;
+}
+
+#else
+
+bool OrbitPropagator::hasAVX2()
+{
+	return false;
+}
+
+size_t OrbitPropagator::propagateAVX2(
+	const double, const size_t begin, const size_t,
+	dvec3 *, Counters &)
+{
+	// No vector path, everything goes through propagateScalar()
+	return begin;
+}
+
+#endif
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <vector>
+#include <atomic>
+
+#include <glm/glm.hpp>
+
+class Orbit;
+class JobSystem;
+
+/**
+ * Propagates many Kepler orbits at once
+ *
+ * Orbital elements are stored as a structure of arrays, with the orbital plane
+ * rotation already applied to the periapsis and semi-minor axis directions so
+ * that only the Kepler equation has to be solved at each update. On x86 CPUs
+ * with AVX2 support (checked at runtime), four orbits are solved per iteration.
+ *
+ * Orbits are sorted by kind: moderately eccentric ellipses first (vectorized),
+ * then highly eccentric ellipses, parabolas and hyperbolas, which need more
+ * care close to periapsis and are solved one at a time. The solver iterates
+ * until convergence, starting from the anomaly of the previous call when the
+ * epoch hasn't changed too much since.
+ */
+class OrbitPropagator
+{
+public:
+	OrbitPropagator() = default;
+	/**
+	 * Precomputes orbit data
+	 * @param orbits orbits to propagate
+	 * @param outputIds index in the output array of each orbit's position
+	 */
+	void init(const std::vector<Orbit> &orbits, const std::vector<int> &outputIds);
+	/**
+	 * Computes cartesian coordinates of all orbits around their parent
+	 * @param epoch epoch in seconds
+	 * @param positions output array, written at the output ids given in init()
+	 * @param jobs job system to split orbits across cores (optional)
+	 */
+	void propagate(double epoch, glm::dvec3 *positions, JobSystem *jobs=nullptr);
+	/**
+	 * Computes cartesian coordinates of a single orbit around its parent,
+	 * with the same solver and without any allocation
+	 * @param orbit orbit to solve
+	 * @param epoch epoch in seconds
+	 */
+	static glm::dvec3 computePosition(const Orbit &orbit, double epoch);
+	/// Returns the number of orbits
+	size_t size() const;
+	/** Returns the total number of solver iterations of the last propagate(),
+	 * can be called while another thread propagates
+	 */
+	int getIterationCount() const;
+	/// Returns the highest number of solver iterations of a single orbit in the last propagate()
+	int getMaxIterationCount() const;
+
+private:
+	/// Solver iterations of a range of orbits
+	struct Counters
+	{
+		int iterations = 0;
+		int maxIterations = 0;
+	};
+	/// Solves orbits [begin, end) one at a time
+	void propagateScalar(double epoch, size_t begin, size_t end,
+		glm::dvec3 *positions, Counters &counters);
+	/// Returns whether the CPU can run propagateAVX2()
+	static bool hasAVX2();
+	/// Solves elliptic orbits [begin, end) four at a time, returns the first unsolved one
+	size_t propagateAVX2(double epoch, size_t begin, size_t end,
+		glm::dvec3 *positions, Counters &counters);
+
+	/// Eccentricity
+	std::vector<double> _ecc;
+	/// Mean motion (radians per second)
+	std::vector<double> _meanMotion;
+	/// Mean anomaly at epoch (radians)
+	std::vector<double> _m0;
+	/// Periapsis direction scaled by semi-major axis
+	std::vector<double> _px, _py, _pz;
+	/// Semi-minor axis direction scaled by semi-minor axis
+	std::vector<double> _qx, _qy, _qz;
+	/// Output index of each orbit
+	std::vector<int> _outputIds;
+	/// Number of orbits at the start of the arrays that can be vectorized
+	size_t _vectorCount = 0;
+
+	/// Mean anomaly of last propagate()
+	std::vector<double> _prevMean;
+	/// Eccentric (or hyperbolic) anomaly of last propagate()
+	std::vector<double> _prevAnomaly;
+	/// Whether _prevMean and _prevAnomaly can be used as starting values
+	bool _warm = false;
+
+	/// Solver statistics of the last propagate(), read from any thread
+	std::atomic<int> _iterationCount{0};
+	std::atomic<int> _maxIterationCount{0};
+};
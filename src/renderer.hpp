@@ -1,8 +1,14 @@
 #pragma once
 
 #include "entity.hpp"
+#include "job_system.hpp"
+#include "task_graph.hpp"
 #include <glm/glm.hpp>
 #include <string>
+#include <functional>
+#include <cstdint>
+
+struct GLFWwindow;
 
 /**
  * Renderer Interface
@@ -13,6 +19,14 @@ public:
 	virtual ~Renderer() {}
 	/// Window initialization necessary for the API to work
 	virtual void windowHints() {}
+	/**
+	 * Binds the API to the window once it is created
+	 * @param window window rendered to
+	 * @param swapInterval vertical syncs waited per frame, -1 leaves it to the driver
+	 */
+	virtual void initWindow(GLFWwindow *window, int swapInterval) {}
+	/// Shows the last rendered frame in the window
+	virtual void present() {}
 
 	struct InitInfo
 	{
@@ -20,14 +34,36 @@ public:
 		const EntityCollection * collection;
 		/// Star map texture filename
 		std::string starMapFilename;
-		/// Star map brightness
+		/// Star map brightness, or brightness of the faintest catalog stars
 		float starMapIntensity;
+		/// Packed star catalog drawn instead of the star map texture if not empty
+		std::string starCatalogFilename;
+		/// Faintest magnitude of catalog stars drawn
+		float starMagnitudeLimit;
 		/// MSAA samples per pixel
 		int msaa;
 		/// Maximum texture width/height
 		int maxTexSize;
 		/// Wait for whole texture to load before displaying
 		int syncTexLoading;
+		/// Number of texture loading threads (0 for automatic)
+		int streamThreads;
+		/// Texture memory budget in megabytes
+		int texBudget;
+		/// Stream only visible tiles into sparse textures if supported
+		bool sparseTextures;
+		/// Make bloom with compute shaders if supported
+		bool computeBloom;
+		/// GPU frame time in ms held by scaling the HDR pass (0 to disable)
+		float targetFrameTime;
+		/// Smallest HDR pass resolution scale
+		float minRenderScale;
+		/// Frames the CPU can prepare ahead of the GPU, each with its own buffers
+		int framesInFlight;
+		/// Job system shared with the simulation (nullptr to run on one thread)
+		JobSystem *jobs;
+		/// Startup tasks shared with the application (nullptr for own threads)
+		TaskGraph *startup;
 		/// Window width in pixels
 		unsigned windowWidth;
 		/// Window height in pixels
@@ -58,22 +94,72 @@ public:
 		float entityNameFade;
 		/// Formatted time
 		std::string currentTime;
+		/// Seconds since January 1st 2017 00:00:00 UTC
+		double epoch;
+		/// Time the view was sampled from input, on the CPUProfiler clock
+		uint64_t inputTime;
+		/** Samples the view again from the latest input, called right before
+		 * the view is written for the GPU (optional)
+		 * @return time of the new input sample
+		 */
+		std::function<uint64_t(glm::dvec3 &viewPos, glm::mat3 &viewDir)> latchView;
 	};
 
-	/** Initializes the renderer
+	struct LoadingInfo
+	{
+		/// Lines of text displayed on the loading screen (controls...)
+		std::vector<std::string> lines;
+	};
+
+	/** Initializes the renderer. CPU side work is started on the startup
+	 * tasks, resources are created by loadStep()
 	 * @param info Initialization info
 	 */
 	virtual void init(const InitInfo &info) {}
 
+	/** Runs initialization steps for about a frame and draws the loading
+	 * screen, to be called each frame until it returns true
+	 * @param info Loading screen info
+	 * @return true once the renderer is ready to render frames
+	 */
+	virtual bool loadStep(const LoadingInfo &info) { return true; }
+
+	/** Waits for the GPU to be done with the frames submitted, so that the
+	 * input sampled next is shown as soon as possible
+	 */
+	virtual void waitFrame() {}
+
 	/** Renders one frame with the given info
 	 * @param info Rendering info
 	 */
 	virtual void render(const RenderInfo &info) {}
 
 	/** Sets a screenshot to be taken and saved at the given location
-	 * @param filename filename to save screenshot image to
+	 * @param filename filename to save screenshot image to, empty to write
+	 * it to the screenshot pipe
+	 * @param tiles number of window sized tiles along each side of the image
+	 * (1 for an image of the window, bigger ones are rendered without GUI over
+	 * tiles*tiles frames)
+	 */
+	virtual void takeScreenshot(const std::string &filename, int tiles) {}
+
+	/// Returns whether tiles of a screenshot are waiting to be rendered
+	virtual bool isCapturing() { return false; }
+
+	/// Returns the number of screenshots taken and not saved yet
+	virtual size_t getPendingScreenshots() { return 0; }
+	/** Returns whether frames would still change without any change of the
+	 * scene (textures streaming, screenshots being taken)
 	 */
-	virtual void takeScreenshot(const std::string &filename) {}
+	virtual bool isBusy() { return false; }
+
+	/** Starts a command receiving screenshots without filename as raw RGBA
+	 * on its standard input, in order
+	 * @param command shell command, empty to close the pipe once the
+	 * screenshots already taken are written
+	 * @return false if the command couldn't be started
+	 */
+	virtual bool setScreenshotPipe(const std::string &command) { return false; }
 
 	/** 
 	 * Deletes resources
@@ -84,4 +170,42 @@ public:
 	 * @return a vector of pairs of strings (label of time range) and uint64_t (time range in ns)
 	 */
 	virtual std::vector<std::pair<std::string,uint64_t>> getProfilerTimes() { return {}; }
+	/** Returns the number of frames whose profiler times have been measured,
+	 * getProfilerTimes() changes when it does
+	 */
+	virtual uint64_t getProfilerFrameCount() { return 0; }
+
+	/// Rolling statistics of a profiler scope, in ns
+	struct ProfilerStats
+	{
+		std::string name;
+		/// Nesting level, 0 for outermost scopes
+		int depth;
+		uint64_t last, min, avg, p99;
+	};
+	/** Returns statistics of profiler scopes over the last frames, each
+	 * scope followed by the scopes nested in it
+	 */
+	virtual std::vector<ProfilerStats> getProfilerStats() { return {}; }
+	/** Writes profiler scopes of the last frames as a Chrome trace
+	 * @param filename JSON file to write
+	 * @return false if the file couldn't be written
+	 */
+	virtual bool writeProfilerTrace(const std::string &filename) { return false; }
+
+	/// Time from input sampling to the GPU finishing the frame, in ns
+	struct LatencyStats
+	{
+		/// Number of frames measured since the start, the others are over
+		/// the last frames
+		uint64_t frames;
+		uint64_t last, min, avg, p99, max;
+	};
+	/// Returns latency statistics over the last frames
+	virtual LatencyStats getLatencyStats() { return {}; }
+
+	/** Returns texture streaming counters associated with their label
+	 * @return a vector of pairs of strings (label of counter) and double (value)
+	 */
+	virtual std::vector<std::pair<std::string,double>> getStreamingStats() { return {}; }
 };
\ No newline at end of file
@@ -1,14 +1,20 @@
 #include "renderer_gl.hpp"
 #include "ddsloader.hpp"
 #include "mesh.hpp"
+#include "cpu_profiler.hpp"
+#include "star_catalog.hpp"
 
 #include <stdexcept>
 #include <cstring>
 #include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <iomanip>
 #include <array>
+#include <limits>
 #include <functional>
+#include <chrono>
+#include <thread>
 
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/constants.hpp>
@@ -24,6 +30,26 @@ void RendererGL::windowHints()
 	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE); 
 }
 
+void RendererGL::initWindow(GLFWwindow *window, int swapInterval)
+{
+	_win = window;
+	glfwMakeContextCurrent(_win);
+
+	glewExperimental = true;
+	const GLenum err = glewInit();
+	if (err != GLEW_OK)
+	{
+		throw runtime_error("Can't initialize GLEW : " + string((const char*)glewGetErrorString(err)));
+	}
+
+	if (swapInterval >= 0) glfwSwapInterval(swapInterval);
+}
+
+void RendererGL::present()
+{
+	glfwSwapBuffers(_win);
+}
+
 GLenum indexType()
 {
 	switch (sizeof(Index))
@@ -35,20 +61,21 @@ GLenum indexType()
 }
 
 DrawCommand getCommand(
-	GLuint vao, 
+	const map<VertexFormat, GLuint> &vaos, 
 	GLenum indexType,
 	Buffer &vertexBuffer,
 	Buffer &indexBuffer,
 	const Mesh &mesh)
 {
+	const vector<PackedVertex> vertices = mesh.getPackedVertices();
 	BufferRange vertexRange = vertexBuffer.assignVertices(
-		mesh.getVertices().size(), sizeof(Vertex), mesh.getVertices().data());
+		vertices.size(), sizeof(PackedVertex), vertices.data());
 	BufferRange indexRange = indexBuffer.assignIndices(
 		mesh.getIndices().size(), sizeof(Index), mesh.getIndices().data());
 
-	return DrawCommand(vao, GL_TRIANGLES,
+	return DrawCommand(vaos.at(mesh.getFormat()), GL_TRIANGLES,
 		{
-			{0, vertexBuffer.getId(), vertexRange, sizeof(Vertex)}
+			{0, vertexBuffer.getId(), vertexRange, sizeof(PackedVertex)}
 		},
 		{indexType, indexBuffer.getId(), indexRange, mesh.getIndices().size()});
 }
@@ -64,7 +91,8 @@ void RendererGL::createMeshes()
 		Buffer::Access::WRITE_ONLY);
 
 	// Fullscreen tri (no vertex data)
-	_fullscreenTri = DrawCommand(_vertexArray, GL_TRIANGLES, 3, {});
+	_fullscreenTri = DrawCommand(_vertexArrays.at(VertexFormat::COMPACT),
+		GL_TRIANGLES, 3, {});
 
 	// Flare
 	const int detail = 8;
@@ -75,6 +103,10 @@ void RendererGL::createMeshes()
 	const int entityRings = 32;
 	auto sphereMesh = generateSphere(entityMeridians, entityRings);
 
+	// Terrain patch
+	const int patchGridSize = 4;
+	auto patchMesh = generateGrid(patchGridSize);
+
 	// Load ring models
 	map<EntityHandle, Mesh> ringMeshes;
 	for (const auto &h: _entityCollection->getBodies())
@@ -91,12 +123,13 @@ void RendererGL::createMeshes()
 	}
 
 	// Shorter mesh->command function
-	auto command = bind(getCommand, _vertexArray,
+	auto command = bind(getCommand, cref(_vertexArrays),
 		indexType(), ref(_vertexBuffer), ref(_indexBuffer), std::placeholders::_1);
 
 	// Get commands
 	_flareDraw  = command(flareMesh);
 	_sphereDraw = command(sphereMesh);
+	_patchDraw = command(patchMesh);
 
 	// Get ring commands
 	map<EntityHandle, DrawCommand> ringCommands;
@@ -126,28 +159,166 @@ void RendererGL::createUBO()
 		Buffer::Usage::DYNAMIC, 
 		Buffer::Access::WRITE_ONLY);
 
+	_bodyUBOStride = _uboBuffer.getUBOStride(sizeof(BodyUBO));
+
 	_dynamicData.resize(_bufferFrames); // multiple buffering
 	for (auto &data : _dynamicData)
 	{
 		// Scene UBO
 		data.sceneUBO = _uboBuffer.assignUBO(sizeof(SceneUBO));
+		// Flare culling parameters
+		data.flareCullUBO = _uboBuffer.assignUBO(sizeof(FlareCullUBO));
+		// Star culling parameters
+		data.starCullUBO = _uboBuffer.assignUBO(sizeof(StarCullUBO));
 		// Entity UBOs
-		for (const auto &h: _entityCollection->getBodies())
+		data.bodyUBOs = _uboBuffer.assignUBO(
+			_entityCollection->getBodies().size()*_bodyUBOStride);
+		// Minor body UBOs
+		data.minorBodyUBOs.resize(_minorBodyGroups.size());
+		for (auto &range : data.minorBodyUBOs)
 		{
-			data.bodyUBOs[h] = _uboBuffer.assignUBO(sizeof(BodyUBO));
+			range = _uboBuffer.assignUBO(sizeof(MinorBodyUBO));
 		}
 	}
 
 	_uboBuffer.validate();
+
+	if (!_minorBodyGroups.empty())
+	{
+		// Rewritten by each frame when the reference epoch of a group moves
+		_minorBodyAnomalyBuffer = Buffer(
+			Buffer::Usage::DYNAMIC,
+			Buffer::Access::WRITE_ONLY);
+		for (auto &data : _dynamicData)
+		{
+			for (const auto &group : _minorBodyGroups)
+			{
+				data.minorBodyAnomalies.push_back(
+					_minorBodyAnomalyBuffer.assignSSBO(group.count*sizeof(vec2)));
+				data.minorBodyEpochs.push_back(numeric_limits<double>::quiet_NaN());
+			}
+		}
+		_minorBodyAnomalyBuffer.validate();
+	}
+
+	if (_sparseFeedback)
+	{
+		// Read back by the CPU once the frame's fence is signaled
+		_feedbackBuffer = Buffer(
+			Buffer::Usage::DYNAMIC,
+			Buffer::Access::READ_WRITE);
+		const vector<uint32_t> zeros(
+			FEEDBACK_SLOTS*FEEDBACK_COLUMNS*FEEDBACK_ROWS, 0);
+		for (auto &data : _dynamicData)
+		{
+			data.feedback = _feedbackBuffer.assignSSBO(
+				zeros.size()*sizeof(uint32_t), zeros.data());
+		}
+		_feedbackBuffer.validate();
+	}
+
+	if (_multiDraw)
+	{
+		_drawBuffer = Buffer(
+			Buffer::Usage::DYNAMIC,
+			Buffer::Access::WRITE_ONLY);
+		const uint32_t bodies = _entityCollection->getBodies().size();
+		const uint32_t commandSize = sizeof(DrawElementsIndirectCommand);
+		for (auto &data : _dynamicData)
+		{
+			data.bodySSBO = _drawBuffer.assignSSBO(bodies*sizeof(BodyUBO));
+			data.bodyTexSSBO = _drawBuffer.assignSSBO(bodies*sizeof(BodyTexHandles));
+			data.bodyCommands = _drawBuffer.assign(bodies*commandSize, commandSize);
+		}
+		_drawBuffer.validate();
+	}
+
+	// Terrain patches
+	_terrainBuffer = Buffer(
+		Buffer::Usage::DYNAMIC,
+		Buffer::Access::WRITE_ONLY);
+	for (auto &data : _dynamicData)
+	{
+		data.terrainPatches = _terrainBuffer.assignSSBO(
+			MAX_TERRAIN_PATCHES*sizeof(TerrainPatch));
+	}
+	_terrainBuffer.validate();
+
+	// Sun visibility, only accessed by shaders
+	const float sunVisibility = 1.0;
+	_sunVisibilityBuffer = Buffer(
+		Buffer::Usage::STATIC,
+		Buffer::Access::READ_WRITE);
+	_sunVisibility = _sunVisibilityBuffer.assignSSBO(sizeof(float), &sunVisibility);
+	_sunVisibilityBuffer.validate();
+
+	// Bloom downsample groups done, reset by the last group
+	const uint32_t bloomCounter = 0;
+	_bloomCounterBuffer = Buffer(
+		Buffer::Usage::STATIC,
+		Buffer::Access::READ_WRITE);
+	_bloomCounter = _bloomCounterBuffer.assignSSBO(sizeof(uint32_t), &bloomCounter);
+	_bloomCounterBuffer.validate();
+
+	// Flares of all bodies except stars are culled on the GPU
+	_flareBodies.clear();
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		if (!h.getParam().isStar()) _flareBodies.push_back(h);
+	}
+	if (!_flareBodies.empty())
+	{
+		const size_t count = _flareBodies.size();
+		vector<vec4> colors;
+		colors.reserve(count);
+		for (const auto &h : _flareBodies)
+		{
+			const EntityParam &param = h.getParam();
+			colors.push_back(vec4(
+				param.getModel().getMeanColor(), param.getModel().getRadius()));
+		}
+		_flareBodyBuffer = Buffer(
+			Buffer::Usage::STATIC,
+			Buffer::Access::READ_WRITE);
+		_flareBodyColors = _flareBodyBuffer.assignSSBO(
+			count*sizeof(vec4), colors.data());
+		_flareCullBuffer = Buffer(
+			Buffer::Usage::DYNAMIC,
+			Buffer::Access::WRITE_ONLY);
+		for (auto &data : _dynamicData)
+		{
+			data.flareInstances = _flareBodyBuffer.assignSSBO(
+				count*sizeof(FlareInstance));
+			data.flarePositions = _flareCullBuffer.assignSSBO(count*sizeof(vec4));
+			data.flareCommand = _flareCullBuffer.assignSSBO(
+				sizeof(DrawElementsIndirectCommand));
+		}
+		_flareBodyBuffer.validate();
+		_flareCullBuffer.validate();
+	}
 }
 
 void RendererGL::init(const InitInfo &info)
 {
 	this->_entityCollection = info.collection;
 	this->_msaaSamples = info.msaa;
+	this->_maxMsaaSamples = info.msaa;
 	this->_maxTexSize = info.maxTexSize;
 	this->_windowWidth = info.windowWidth;
 	this->_windowHeight = info.windowHeight;
+	this->_renderWidth = info.windowWidth;
+	this->_renderHeight = info.windowHeight;
+	this->_targetFrameTime = info.targetFrameTime;
+	this->_minRenderScale = clamp(info.minRenderScale, 0.1f, 1.f);
+	this->_starCatalogFilename = info.starCatalogFilename;
+	this->_starMagnitudeLimit = info.starMagnitudeLimit;
+
+	this->_jobs = info.jobs?info.jobs:&_serialJobs;
+	initHierarchy();
+
+	// Patches are split when larger than half their distance, up to ~1/10000 of a face
+	this->_terrain = TerrainQuadtree(0.5, 14);
+	this->_terrainCoarse = TerrainQuadtree(0.5, 1);
 
 	// Find the sun
 	for (const auto &h : _entityCollection->getBodies())
@@ -155,37 +326,170 @@ void RendererGL::init(const InitInfo &info)
 		if (h.getParam().isStar()) _sun = h;
 	}
 
-	this->_bufferFrames = 3; // triple-buffering
+	this->_bufferFrames = glm::clamp(info.framesInFlight, 1, (int)MAX_FRAMES_IN_FLIGHT);
 
 	for (const auto &h : _entityCollection->getBodies())
+	{
 		this->_bodyData[h] = BodyData();
+		initBodyUBO(h.getParam(), this->_bodyData[h].ubo);
+	}
 
 	this->_fences.resize(_bufferFrames);
+	this->_frameInputTimes.resize(_bufferFrames, 0);
+	this->_frameEndQueries.resize(_bufferFrames);
+	glGenQueries(_bufferFrames, _frameEndQueries.data());
+
+	// Indirect draws index BodyUBOs with the base instance, textures are bindless
+	this->_multiDraw = GLEW_ARB_bindless_texture && GLEW_ARB_shader_draw_parameters;
+
+	// Sparse tiles are requested by the shaders, needs asynchronous loading
+	this->_sparseFeedback = info.sparseTextures && !info.syncTexLoading && 
+		GLEW_ARB_sparse_texture;
+
+	// The downsample binds one image per highpass mipmap
+	GLint maxImageUniforms = 0;
+	glGetIntegerv(GL_MAX_COMPUTE_IMAGE_UNIFORMS, &maxImageUniforms);
+	this->_computeBloom = info.computeBloom && _bloomDepth <= maxImageUniforms;
+
+	// CPU side work runs on the startup tasks, the GL thread creates the
+	// other resources in the meantime and uploads task results when done
+	if (info.startup)
+	{
+		this->_startup = info.startup;
+	}
+	else
+	{
+		_ownStartup.init(0);
+		this->_startup = &_ownStartup;
+	}
 
-	createVertexArray();
-	createMeshes();
-	createUBO();
-	createShaders();
-	createRendertargets();
-	createTextures();
-	createFlare();
-	createScreenshot();
-	createAtmoLookups();
-	createRingTextures();
-
-	// Gui init
+	// Gui
 	Gui::Font f = _gui.loadFont("fonts/Lato-Regular.ttf");
 	_mainFontBig = _gui.loadFontSize(f, 40.f);
 	_mainFontMedium = _gui.loadFontSize(f, 20.f);
-	_gui.init();
+	const TaskGraph::Task glyphTask = _startup->add("Glyphs", [this]{
+		_gui.rasterize();
+	});
+
+	// Atmospheric scattering lookup tables and ring profiles, one task per body
+	vector<TaskGraph::Task> atmoTasks;
+	vector<TaskGraph::Task> ringTasks;
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const EntityParam &param = h.getParam();
+		if (param.hasAtmo())
+		{
+			vector<float> &table = _atmoTables[h];
+			atmoTasks.push_back(_startup->add("Atmo " + param.getName(),
+				[this, h, &table]{
+					const EntityParam &param = h.getParam();
+					table = param.getAtmo().getCachedLookupTable(
+						ATMO_LOOKUP_SIZE, param.getModel().getRadius(), "cache", _jobs);
+				}));
+		}
+		if (param.hasRing())
+		{
+			RingProfile &profile = _ringProfiles[h];
+			ringTasks.push_back(_startup->add("Ring " + param.getName(),
+				[h, &profile]{
+					profile = h.getParam().getRing().loadProfile();
+				}));
+		}
+	}
+
+	const bool syncTexLoading = info.syncTexLoading;
+	const int streamThreads = info.streamThreads;
+	const int texBudget = info.texBudget;
+	const string starMapFilename = info.starMapFilename;
+	const float starMapIntensity = info.starMapIntensity;
+
+	// Shader compilation is the longest, the glyph atlas is usually done
+	// before so that the loading screen shows progress. Compilation is only
+	// waited for at the end, it runs in the driver during the other stages
+	_initStages = {
+		{[this]{ initState();}, {}},
+		{[this]{ createVertexArray();}, {}},
+		{[this]{ createMeshes();}, {}},
+		{[this]{ createMinorBodies();}, {}},
+		{[this]{ createUBO();}, {}},
+		{[this]{ createStars();}, {}},
+		{[this]{ _gui.init(); _guiReady = true;}, {glyphTask}},
+		{[this]{ createShaders();}, {}},
+		{[this]{ createRendertargets();}, {}},
+		{[this]{ createTextures();}, {}},
+		{[this]{ createFlare();}, {}},
+		{[this]{ createScreenshot();}, {}},
+		{[this]{ createAtmoLookups();}, atmoTasks},
+		{[this]{ createRingTextures();}, ringTasks},
+		// Shaders compiled by the driver in the meantime
+		{[]{}, {}, [this]{ return finishShaders();}},
+		{[=]{
+			// Streamer init
+			_streamer.init(!syncTexLoading, 512*512*200, _maxTexSize,
+				streamThreads, (size_t)std::max(0, texBudget)*1024*1024,
+				_sparseFeedback);
+
+			// Create starMap texture, unless stars come from the catalog
+			if (_starCount == 0)
+				_starMapTexHandle = _streamer.createTex(starMapFilename);
+			_starMapIntensity = starMapIntensity;
+		}, {}}};
+	_initStageCount = _initStages.size();
+}
+
+bool RendererGL::loadStep(const LoadingInfo &info)
+{
+	// Run stages for about a frame so that the loading screen stays responsive
+	const auto start = chrono::steady_clock::now();
+	const auto frameTime = chrono::milliseconds(16);
+	while (!_initStages.empty() && chrono::steady_clock::now()-start < frameTime)
+	{
+		const InitStage &stage = _initStages.front();
+		// Rethrows errors of failed tasks
+		const bool ready = all_of(stage.tasks.begin(), stage.tasks.end(),
+			[this](const TaskGraph::Task t){ return _startup->isDone(t);}) &&
+			(!stage.ready || stage.ready());
+		if (!ready) break;
+		stage.function();
+		_initStages.pop_front();
+	}
+
+	renderLoading(info);
+	return _initStages.empty();
+}
+
+void RendererGL::renderLoading(const LoadingInfo &info)
+{
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	glViewport(0,0, _windowWidth, _windowHeight);
+	glClearColor(0.0, 0.0, 0.0, 1.0);
+	glClear(GL_COLOR_BUFFER_BIT);
+
+	if (!_guiReady) return;
 
-	// Streamer init
-	_streamer.init(!info.syncTexLoading, 512*512, 200, _maxTexSize);
+	// No depth test/write
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_ALWAYS);
 
-	// Create starMap texture
-	_starMapTexHandle = _streamer.createTex(info.starMapFilename);
-	_starMapIntensity = info.starMapIntensity;
+	const int left = _windowWidth/8;
+	int top = _windowHeight/3;
+	_gui.setText(_mainFontBig, left, top, "Roche", 255, 255, 255, 255);
+	top += 40;
+	const size_t done = _initStageCount-_initStages.size();
+	const string progress = _initStages.empty()?"Loaded":
+		"Loading... " + to_string(done) + "/" + to_string(_initStageCount);
+	_gui.setText(_mainFontMedium, left, top, progress, 180, 180, 180, 255);
+	top += 20;
+	for (const string &line : info.lines)
+	{
+		top += 24;
+		_gui.setText(_mainFontMedium, left, top, line, 255, 255, 255, 255);
+	}
+	renderGui();
+}
 
+void RendererGL::initState()
+{
 	// Backface culling
 	glFrontFace(GL_CCW);
 	glEnable(GL_CULL_FACE);
@@ -207,9 +511,6 @@ void RendererGL::init(const InitInfo &info)
 	glPatchParameterfv(GL_PATCH_DEFAULT_OUTER_LEVEL, outerLevel);
 	float innerLevel[] = {1.0,1.0};
 	glPatchParameterfv(GL_PATCH_DEFAULT_INNER_LEVEL, innerLevel);
-
-	// Sun Occlusion query for flare
-	glCreateQueries(GL_SAMPLES_PASSED, 2, _sunOcclusionQueries);
 }
 
 float getAnisotropy(const int requestedAnisotropy)
@@ -240,6 +541,16 @@ void RendererGL::createTextures()
 	_cloudTexDefault = create1PixTex({0,0,0,0});
 	_nightTexDefault = create1PixTex({0,0,0,0});
 	_specularTexDefault = create1PixTex({0,0,0,0});
+	_heightTexDefault = create1PixTex({0,0,0,0});
+
+	// Finest level resident everywhere
+	const uint8_t residency = 0;
+	glCreateTextures(GL_TEXTURE_2D, 1, &_residencyTexDefault);
+	glTextureStorage2D(_residencyTexDefault, 1, GL_R8, 1, 1);
+	glTextureSubImage2D(_residencyTexDefault, 0, 0, 0, 1, 1, 
+		GL_RED, GL_UNSIGNED_BYTE, &residency);
+	glTextureParameteri(_residencyTexDefault, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTextureParameteri(_residencyTexDefault, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 
 	// Samplers
 	glCreateSamplers(1, &_bodyTexSampler);
@@ -285,48 +596,74 @@ void RendererGL::createFlare()
 
 void RendererGL::createVertexArray()
 {
-	// Vertex Array Object creation
+	// Vertex Array Object creation, one per vertex format
 	const int VERTEX_BINDING = 0;
-	glCreateVertexArrays(1, &_vertexArray);
 
 	const int VERTEX_ATTRIB_POS     = 0;
 	const int VERTEX_ATTRIB_UV      = 1;
 	const int VERTEX_ATTRIB_NORMAL  = 2;
 
-	// Position
-	glEnableVertexArrayAttrib(_vertexArray, VERTEX_ATTRIB_POS);
-	glVertexArrayAttribBinding(_vertexArray, VERTEX_ATTRIB_POS, VERTEX_BINDING);
-	glVertexArrayAttribFormat(_vertexArray, VERTEX_ATTRIB_POS, 3, GL_FLOAT, false, offsetof(Vertex, position));
-
-	// UVs
-	glEnableVertexArrayAttrib(_vertexArray, VERTEX_ATTRIB_UV);
-	glVertexArrayAttribBinding(_vertexArray, VERTEX_ATTRIB_UV, VERTEX_BINDING);
-	glVertexArrayAttribFormat(_vertexArray, VERTEX_ATTRIB_UV, 2, GL_FLOAT, false, offsetof(Vertex, uv));
-
-	// Normals
-	glEnableVertexArrayAttrib(_vertexArray, VERTEX_ATTRIB_NORMAL);
-	glVertexArrayAttribBinding(_vertexArray, VERTEX_ATTRIB_NORMAL, VERTEX_BINDING);
-	glVertexArrayAttribFormat(_vertexArray, VERTEX_ATTRIB_NORMAL, 3, GL_FLOAT, false, offsetof(Vertex, normal));
+	for (const VertexFormat format : {VertexFormat::COMPACT, VertexFormat::HALF})
+	{
+		GLuint vao;
+		glCreateVertexArrays(1, &vao);
+		_vertexArrays[format] = vao;
+
+		const bool compact = (format == VertexFormat::COMPACT);
+
+		// Position
+		glEnableVertexArrayAttrib(vao, VERTEX_ATTRIB_POS);
+		glVertexArrayAttribBinding(vao, VERTEX_ATTRIB_POS, VERTEX_BINDING);
+		glVertexArrayAttribFormat(vao, VERTEX_ATTRIB_POS, 3,
+			compact?GL_SHORT:GL_HALF_FLOAT, compact, offsetof(PackedVertex, position));
+
+		// UVs
+		glEnableVertexArrayAttrib(vao, VERTEX_ATTRIB_UV);
+		glVertexArrayAttribBinding(vao, VERTEX_ATTRIB_UV, VERTEX_BINDING);
+		glVertexArrayAttribFormat(vao, VERTEX_ATTRIB_UV, 2,
+			compact?GL_UNSIGNED_SHORT:GL_HALF_FLOAT, compact, offsetof(PackedVertex, uv));
+
+		// Normals, octahedral encoded (decoded by the vertex shader)
+		glEnableVertexArrayAttrib(vao, VERTEX_ATTRIB_NORMAL);
+		glVertexArrayAttribBinding(vao, VERTEX_ATTRIB_NORMAL, VERTEX_BINDING);
+		glVertexArrayAttribFormat(vao, VERTEX_ATTRIB_NORMAL, 2,
+			GL_SHORT, true, offsetof(PackedVertex, normal));
+	}
 }
 
-void RendererGL::createRendertargets()
+void RendererGL::createHdrRendertargets()
 {
+	glDeleteTextures(1, &_depthStencilTex);
+	glDeleteTextures(1, &_hdrMSRendertarget);
+	if (_hdrFBO) glDeleteFramebuffers(1, &_hdrFBO);
+
 	// Depth stencil texture
 	glCreateTextures(GL_TEXTURE_2D_MULTISAMPLE, 1, &_depthStencilTex);
 	glTextureStorage2DMultisample(
 		_depthStencilTex, _msaaSamples, GL_DEPTH24_STENCIL8, _windowWidth, _windowHeight, GL_FALSE);
 
-	const GLenum hdrFormat = GL_RGB16F;
-
 	// HDR MSAA Rendertarget
 	glCreateTextures(GL_TEXTURE_2D_MULTISAMPLE, 1, &_hdrMSRendertarget);
-	glTextureStorage2DMultisample(_hdrMSRendertarget, _msaaSamples, hdrFormat,
+	glTextureStorage2DMultisample(_hdrMSRendertarget, _msaaSamples, GL_RGB16F,
 		_windowWidth, _windowHeight, GL_FALSE);
 
+	glCreateFramebuffers(1, &_hdrFBO);
+	glNamedFramebufferTexture(_hdrFBO, GL_COLOR_ATTACHMENT0, _hdrMSRendertarget, 0);
+	glNamedFramebufferTexture(_hdrFBO, GL_DEPTH_STENCIL_ATTACHMENT, _depthStencilTex, 0);
+}
+
+void RendererGL::createRendertargets()
+{
+	createHdrRendertargets();
+
+	// Same format as the HDR rendertarget, but compute shaders write bloom
+	// mipmaps as images and RGB16F can't be
+	const GLenum bloomFormat = _computeBloom?GL_RGBA16F:GL_RGB16F;
+
 	// Highpass rendertargets
 	glCreateTextures(GL_TEXTURE_2D, 1, &_highpassRendertargets);
 	glTextureStorage2D(_highpassRendertargets, _bloomDepth+1, 
-		hdrFormat, _windowWidth, _windowHeight);
+		bloomFormat, _windowWidth, _windowHeight);
 
 	// Highpass views
 	_highpassViews.resize(_bloomDepth+1);
@@ -334,13 +671,13 @@ void RendererGL::createRendertargets()
 	for (size_t i=0;i<_highpassViews.size();++i)
 	{
 		glTextureView(_highpassViews[i], GL_TEXTURE_2D, _highpassRendertargets, 
-			hdrFormat, i, 1, 0, 1);
+			bloomFormat, i, 1, 0, 1);
 	}
 
 	// Bloom rendertargets
 	glCreateTextures(GL_TEXTURE_2D, 1, &_bloomRendertargets);
 	glTextureStorage2D(_bloomRendertargets, _bloomDepth,
-		hdrFormat, _windowWidth/2, _windowHeight/2);
+		bloomFormat, _windowWidth/2, _windowHeight/2);
 
 	// Bloom views
 	_bloomViews.resize(_bloomDepth);
@@ -348,9 +685,12 @@ void RendererGL::createRendertargets()
 	for (size_t i=0;i<_bloomViews.size();++i)
 	{
 		glTextureView(_bloomViews[i], GL_TEXTURE_2D, _bloomRendertargets,
-			hdrFormat, i, 1, 0, 1);
+			bloomFormat, i, 1, 0, 1);
 	}
 
+	// Nothing to upsample below the smallest bloom level
+	if (_computeBloom) _bloomBlackTex = create1PixTex({0,0,0,0});
+
 	// Sampler
 	glCreateSamplers(1, &_rendertargetSampler);
 	glSamplerParameteri(_rendertargetSampler, GL_TEXTURE_WRAP_S, GL_CLAMP);
@@ -359,10 +699,6 @@ void RendererGL::createRendertargets()
 	glSamplerParameteri(_rendertargetSampler, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 
 	// Framebuffers
-	glCreateFramebuffers(1, &_hdrFBO);
-	glNamedFramebufferTexture(_hdrFBO, GL_COLOR_ATTACHMENT0, _hdrMSRendertarget, 0);
-	glNamedFramebufferTexture(_hdrFBO, GL_DEPTH_STENCIL_ATTACHMENT, _depthStencilTex, 0);
-
 	_highpassFBOs.resize(_bloomDepth+1);
 	glCreateFramebuffers(_highpassFBOs.size(), _highpassFBOs.data());
 	for (size_t i=0;i<_highpassFBOs.size();++i)
@@ -383,6 +719,7 @@ void RendererGL::createShaders()
 	factory.setVersion(450);
 	factory.setFolder("shaders/");
 	factory.setSandbox("sandbox.shad");
+	factory.setCacheFolder("cache/");
 
 	typedef pair<GLenum,string> shader;
 
@@ -418,26 +755,53 @@ void RendererGL::createShaders()
 	const string isFarRing = "IS_FAR_RING";
 	const string isNearRing = "IS_NEAR_RING";
 	const string hasRing = "HAS_RING";
+	const string isTerrain = "IS_TERRAIN";
+	const string hasClouds = "HAS_CLOUDS";
+	const string hasNight = "HAS_NIGHT";
+	const string hasSpecular = "HAS_SPECULAR";
 
 	const string blurW = "BLUR_W";
 	const string blurH = "BLUR_H";
 
 	const string bloom = "USE_BLOOM";
 
+	const string isMinorBody = "IS_MINOR_BODY";
+
+	const string multiDraw = "MULTI_DRAW";
+
+	// Body shaders write texture feedback when streaming sparse textures
+	// and take their UBO from a buffer when drawn indirectly
+	const auto bodyDefines = [&](vector<string> defines, const bool multi)
+	{
+		if (_sparseFeedback) defines.push_back("SPARSE_FEEDBACK");
+		if (_multiDraw && multi) defines.push_back(multiDraw);
+		return defines;
+	};
+
 	const vector<shader> entityFilenames = {
 		bodyVert, bodyTesc, bodyTese, bodyFrag
 	};
 
-	_pipelineBodyBare = factory.createPipeline(
-		entityFilenames);
-
-	_pipelineBodyAtmo = factory.createPipeline(
-		entityFilenames,
-		{hasAtmo});
-
-	_pipelineBodyAtmoRing = factory.createPipeline(
-		entityFilenames,
-		{hasAtmo, hasRing});
+	// One variant per combination of features found among the bodies, so
+	// that body shaders don't sample or compute what a body doesn't have
+	_bodyPipelines.clear();
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const EntityParam &param = h.getParam();
+		if (param.isStar()) continue;
+		const uint32_t features = getBodyFeatures(param);
+		if (_bodyPipelines.count(features)) continue;
+
+		vector<string> defines = {isTerrain};
+		if (features & BODY_ATMO) defines.push_back(hasAtmo);
+		if (features & BODY_RING) defines.push_back(hasRing);
+		if (features & BODY_CLOUDS) defines.push_back(hasClouds);
+		if (features & BODY_NIGHT) defines.push_back(hasNight);
+		if (features & BODY_SPECULAR) defines.push_back(hasSpecular);
+		_bodyPipelines[features] = factory.createPipeline(
+			entityFilenames,
+			bodyDefines(defines, true));
+	}
 
 	_pipelineStarMap = factory.createPipeline(
 		{starMapVert, starMapTese, starMapFrag});
@@ -448,7 +812,7 @@ void RendererGL::createShaders()
 
 	_pipelineSun = factory.createPipeline(
 		entityFilenames,
-		{isStar});
+		bodyDefines({isStar}, false));
 
 	const vector<shader> ringFilenames = {
 		bodyVert, bodyTesc, bodyTese, ringFrag
@@ -479,15 +843,88 @@ void RendererGL::createShaders()
 	_pipelineBloomAdd = factory.createPipeline(
 		{deferred, bloomAdd});
 
+	const string bloomDepth = "BLOOM_DEPTH " + to_string(_bloomDepth);
+	if (_computeBloom)
+	{
+		_pipelineBloomDownsample = factory.createPipeline(
+			{{GL_COMPUTE_SHADER, "bloom_downsample.comp"}},
+			{bloomDepth});
+
+		_pipelineBloomUpsample = factory.createPipeline(
+			{{GL_COMPUTE_SHADER, "bloom_upsample.comp"}});
+	}
+
 	_pipelineFlare = factory.createPipeline(
 		{flareVert, flareFrag});
 
+	_pipelineCulledFlare = factory.createPipeline(
+		{flareVert, flareFrag},
+		{"IS_CULLED_FLARE"});
+
+	_pipelineFlareCull = factory.createPipeline(
+		{{GL_COMPUTE_SHADER, "flare_cull.comp"}});
+
+	_pipelineStarCull = factory.createPipeline(
+		{{GL_COMPUTE_SHADER, "star_cull.comp"}});
+
+	_pipelineSunOcclusion = factory.createPipeline(
+		{{GL_COMPUTE_SHADER, "sun_occlusion.comp"}});
+
+	_pipelineMinorBodyFlare = factory.createPipeline(
+		{flareVert, flareFrag},
+		{isMinorBody});
+
+	_pipelineMinorBodyCompute = factory.createPipeline(
+		{{GL_COMPUTE_SHADER, "minor_body.comp"}});
+
 	_pipelineTonemapBloom = factory.createPipeline(
 		{deferred, tonemap},
 		{bloom});
 
 	_pipelineTonemapNoBloom = factory.createPipeline(
 		{deferred, tonemap});
+
+	_compilingPipelines = {
+		&_pipelineStarMap, &_pipelineAtmo, &_pipelineSun,
+		&_pipelineRingFar, &_pipelineRingNear,
+		&_pipelineHighpass, &_pipelineDownsample,
+		&_pipelineBlurW, &_pipelineBlurH, &_pipelineBloomAdd,
+		&_pipelineFlare, &_pipelineCulledFlare, &_pipelineFlareCull,
+		&_pipelineStarCull,
+		&_pipelineSunOcclusion, &_pipelineMinorBodyFlare,
+		&_pipelineMinorBodyCompute,
+		&_pipelineTonemapBloom, &_pipelineTonemapNoBloom};
+	if (_computeBloom)
+	{
+		_compilingPipelines.push_back(&_pipelineBloomDownsample);
+		_compilingPipelines.push_back(&_pipelineBloomUpsample);
+	}
+	for (auto &p : _bodyPipelines)
+		_compilingPipelines.push_back(&p.second);
+}
+
+uint32_t RendererGL::getBodyFeatures(const EntityParam &param)
+{
+	uint32_t features = 0;
+	if (param.hasAtmo()) features |= BODY_ATMO;
+	if (param.hasRing()) features |= BODY_RING;
+	if (param.hasClouds()) features |= BODY_CLOUDS;
+	if (param.hasNight()) features |= BODY_NIGHT;
+	if (param.hasSpecular()) features |= BODY_SPECULAR;
+	return features;
+}
+
+bool RendererGL::finishShaders()
+{
+	auto &pipelines = _compilingPipelines;
+	pipelines.erase(remove_if(pipelines.begin(), pipelines.end(),
+		[](ShaderPipeline *p){
+			if (!p->isReady()) return false;
+			// Throws compilation errors
+			p->finish();
+			return true;
+		}), pipelines.end());
+	return pipelines.empty();
 }
 
 void RendererGL::createScreenshot()
@@ -501,100 +938,231 @@ void RendererGL::createScreenshot()
 		_screenBestFormat = Screenshot::Format::RGBA8;
 	else if (_screenBestFormatGL == GL_BGRA) 
 		_screenBestFormat = Screenshot::Format::BGRA8;
+
+	// Persistently mapped readback PBOs
+	const size_t size = 4*_windowWidth*_windowHeight;
+	const GLbitfield flags = GL_MAP_READ_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+	for (auto &readback : _screenReadbacks)
+	{
+		glCreateBuffers(1, &readback.buffer);
+		glNamedBufferStorage(readback.buffer, size, nullptr, flags);
+		readback.data = (const uint8_t*)glMapNamedBufferRange(
+			readback.buffer, 0, size, flags);
+	}
+
+	// Encoding is much slower than copying, keep cores for the simulation
+	_screenshot.init(std::max((int)thread::hardware_concurrency()/2, 1));
 }
 
 void RendererGL::createAtmoLookups()
 {
-	for (const auto &h : _entityCollection->getBodies())
+	for (auto &p : _atmoTables)
 	{
-		const EntityParam &param = h.getParam();
-		auto &data = _bodyData[h];
-
-		// Generate atmospheric scattering lookup texture
-		if (param.hasAtmo())
-		{
-			const int size = 128;
-			vector<float> table = param.getAtmo().
-				generateLookupTable(size, param.getModel().getRadius());
-
-			GLuint &tex = data.atmoLookupTable;
-
-			glCreateTextures(GL_TEXTURE_2D, 1, &tex);
-			glTextureStorage2D(tex, mipmapCount(size), GL_RG32F, size, size);
-			glTextureSubImage2D(tex, 0, 0, 0, size, size, GL_RG, GL_FLOAT, table.data());
-			glGenerateTextureMipmap(tex);
-		}
+		// Atmospheric scattering lookup texture
+		const int size = ATMO_LOOKUP_SIZE;
+		GLuint &tex = _bodyData[p.first].atmoLookupTable;
+
+		glCreateTextures(GL_TEXTURE_2D, 1, &tex);
+		glTextureStorage2D(tex, mipmapCount(size), GL_RG32F, size, size);
+		glTextureSubImage2D(tex, 0, 0, 0, size, size, GL_RG, GL_FLOAT, p.second.data());
+		glGenerateTextureMipmap(tex);
 	}
+	_atmoTables.clear();
 }
 
 void RendererGL::createRingTextures()
 {
-	for (const auto &h : _entityCollection->getBodies())
+	for (const auto &p : _ringProfiles)
 	{
-		const EntityParam &param = h.getParam();
-		auto &data = _bodyData[h];
+		const RingProfile &profile = p.second;
+		const size_t size = profile.getSampleCount();
+		auto &data = _bodyData[p.first];
+
+		GLuint &tex1 = data.ringTex1;
+		GLuint &tex2 = data.ringTex2;
+
+		glCreateTextures(GL_TEXTURE_1D, 1, &tex1);
+		glTextureStorage1D(tex1, mipmapCount(size), GL_RGB32F, size);
+		glTextureSubImage1D(tex1, 0, 0, size, GL_RGB, GL_FLOAT, profile.getScattering().data());
+		glGenerateTextureMipmap(tex1);
+
+		glCreateTextures(GL_TEXTURE_1D, 1, &tex2);
+		glTextureStorage1D(tex2, mipmapCount(size), GL_RGBA32F, size);
+		glTextureSubImage1D(tex2, 0, 0, size, GL_RGBA, GL_FLOAT, profile.getColor().data());
+		glGenerateTextureMipmap(tex2);
+	}
+	_ringProfiles.clear();
+}
 
-		// Load ring textures
-		if (param.hasRing())
+void RendererGL::createMinorBodies()
+{
+	_minorBodyBuffer = Buffer(
+		Buffer::Usage::STATIC,
+		Buffer::Access::WRITE_ONLY);
+
+	const auto &allMinorBodies = _entityCollection->getMinorBodies();
+	for (size_t i=0;i<allMinorBodies.size();++i)
+	{
+		const MinorBodies &minorBodies = allMinorBodies[i];
+
+		// Same precomputation as OrbitPropagator, done once
+		MinorBodyGroup group;
+		vector<MinorBodySSBO> orbits;
+		int skipped = 0;
+		for (const auto &e : minorBodies.loadFile())
 		{
-			// Load files
-			const Ring &ring = param.getRing();
-			vector<float> backscat = ring.loadFile(ring.getBackscatFilename());
-			vector<float> forwardscat = ring.loadFile(ring.getForwardscatFilename());
-			vector<float> unlit = ring.loadFile(ring.getUnlitFilename());
-			vector<float> transparency = ring.loadFile(ring.getTransparencyFilename());
-			vector<float> color = ring.loadFile(ring.getColorFilename());
-
-			size_t size = backscat.size();
-
-			// Check sizes
-			if (size != forwardscat.size() &&
-				size != unlit.size() &&
-				size != transparency.size() &&
-				size*3 != color.size())
+			// Compute shader only solves elliptic orbits
+			if (e.ecc >= 1.0)
 			{
-				throw runtime_error("Ring texture sizes don't match");
+				++skipped;
+				continue;
 			}
+			const dquat q =
+				  rotate(dquat(), (double)e.lan, dvec3(0,0,1))
+				* rotate(dquat(), (double)e.inc, dvec3(0,1,0))
+				* rotate(dquat(), (double)e.arg, dvec3(0,0,1));
+			const dvec3 p = q*dvec3(0,1,0)*(double)e.sma;
+			const dvec3 m = q*dvec3(-1,0,0)*(e.sma*sqrt(1.0-e.ecc*e.ecc));
+
+			const double meanMotion = 2*pi<double>()/e.period;
+			MinorBodySSBO orbit{};
+			orbit.periapsisEcc = vec4(vec3(p), e.ecc);
+			orbit.minorMeanMotion = vec4(vec3(m), meanMotion);
+			orbits.push_back(orbit);
+			group.meanMotions.push_back(meanMotion);
+			group.m0s.push_back(e.m0);
+			group.radii.push_back(e.radius);
+			group.maxMeanMotion = std::max(group.maxMeanMotion, abs(meanMotion));
+		}
+		if (skipped > 0)
+		{
+			cerr << "Skipped " << skipped << " non-elliptic minor bodies of " <<
+				minorBodies.getFilename() << endl;
+		}
+		if (orbits.empty()) continue;
+
+		group.parent = _entityCollection->getMinorBodiesParent(i);
+		group.color = minorBodies.getColor();
+		group.count = orbits.size();
+		group.elements = _minorBodyBuffer.assignSSBO(
+			orbits.size()*sizeof(MinorBodySSBO), orbits.data());
+		group.positions = _minorBodyBuffer.assignSSBO(
+			orbits.size()*sizeof(vec4));
+		_minorBodyGroups.push_back(group);
+	}
 
-			// Assemble values into two textures (t1 for back, forward and unlit, t2 for color+transparency)
-			vector<float> t1(size*3);
-			vector<float> t2(size*4);
-			for (size_t i=0;i<size;++i)
-			{
-				t1[i*3+0] = backscat[i];
-				t1[i*3+1] = forwardscat[i];
-				t1[i*3+2] = unlit[i];
-				t2[i*4+0] = color[i*3+0];
-				t2[i*4+1] = color[i*3+1];
-				t2[i*4+2] = color[i*3+2];
-				t2[i*4+3] = transparency[i];
-			}
+	if (!_minorBodyGroups.empty())
+		_minorBodyBuffer.validate();
+}
 
-			GLuint &tex1 = data.ringTex1;
-			GLuint &tex2 = data.ringTex2;
+void RendererGL::createStars()
+{
+	if (_starCatalogFilename.empty()) return;
 
-			glCreateTextures(GL_TEXTURE_1D, 1, &tex1);
-			glTextureStorage1D(tex1, mipmapCount(size), GL_RGB32F, size);
-			glTextureSubImage1D(tex1, 0, 0, size, GL_RGB, GL_FLOAT, t1.data());
-			glGenerateTextureMipmap(tex1);
+	// Only stars above the magnitude limit are uploaded, brightest first
+	const StarCatalog catalog = StarCatalog::loadPacked(_starCatalogFilename);
+	_starCount = catalog.getCountBrighterThan(_starMagnitudeLimit);
+	if (_starCount == 0) return;
 
-			glCreateTextures(GL_TEXTURE_1D, 1, &tex2);
-			glTextureStorage1D(tex2, mipmapCount(size), GL_RGBA32F, size);
-			glTextureSubImage1D(tex2, 0, 0, size, GL_RGBA, GL_FLOAT, t2.data());
-			glGenerateTextureMipmap(tex2);
-		}
+	_starBuffer = Buffer(
+		Buffer::Usage::STATIC,
+		Buffer::Access::READ_WRITE);
+	_stars = _starBuffer.assignSSBO(
+		_starCount*sizeof(StarCatalog::Star), catalog.getStars().data());
+	_starCommandBuffer = Buffer(
+		Buffer::Usage::DYNAMIC,
+		Buffer::Access::WRITE_ONLY);
+	for (auto &data : _dynamicData)
+	{
+		data.starInstances = _starBuffer.assignSSBO(
+			_starCount*sizeof(FlareInstance));
+		data.starCommand = _starCommandBuffer.assignSSBO(
+			sizeof(DrawElementsIndirectCommand));
 	}
+	_starBuffer.validate();
+	_starCommandBuffer.validate();
 }
 
 void RendererGL::destroy()
 {
+	if (!_frameEndQueries.empty())
+		glDeleteQueries(_frameEndQueries.size(), _frameEndQueries.data());
+}
+
+void RendererGL::waitFrame()
+{
+	const uint32_t lastFrame = (_frameId+_bufferFrames-1)%_bufferFrames;
+	CPUProfiler::Scope scope("Latency wait");
+	_fences[lastFrame].waitClient();
+}
+
+void RendererGL::readFrameLatency()
+{
+	const uint64_t inputTime = _frameInputTimes[_frameId];
+	if (inputTime == 0) return;
+	_frameInputTimes[_frameId] = 0;
+
+	GLuint available = GL_FALSE;
+	glGetQueryObjectuiv(_frameEndQueries[_frameId], GL_QUERY_RESULT_AVAILABLE, &available);
+	if (!available) return;
+	GLuint64 end = 0;
+	glGetQueryObjectui64v(_frameEndQueries[_frameId], GL_QUERY_RESULT, &end);
+	const uint64_t cpuEnd = _profiler.toCPUClock(end);
+	if (cpuEnd <= inputTime) return;
+
+	_latencies.push_back(cpuEnd-inputTime);
+	++_latencyFrames;
+	if (_latencies.size() > LATENCY_FRAMES) _latencies.pop_front();
+}
+
+Renderer::LatencyStats RendererGL::getLatencyStats()
+{
+	LatencyStats stats{};
+	if (_latencies.empty()) return stats;
+	vector<uint64_t> sorted(_latencies.begin(), _latencies.end());
+	sort(sorted.begin(), sorted.end());
+	uint64_t sum = 0;
+	for (const uint64_t l : sorted) sum += l;
+	stats.frames = _latencyFrames;
+	stats.last = _latencies.back();
+	stats.min = sorted.front();
+	stats.avg = sum/sorted.size();
+	stats.p99 = sorted[std::min(sorted.size()-1, sorted.size()*99/100)];
+	stats.max = sorted.back();
+	return stats;
+}
+
+void RendererGL::takeScreenshot(const string &filename, int tiles)
+{
+	tiles = std::max(tiles, 1);
+	const Screenshot::Image image = _screenshot.begin(filename,
+		_windowWidth*tiles, _windowHeight*tiles, tiles*tiles);
+	_screenCaptures.push_back({image, tiles, 0});
+}
+
+bool RendererGL::isCapturing()
+{
+	return !_screenCaptures.empty();
+}
+
+size_t RendererGL::getPendingScreenshots()
+{
+	return _screenshot.getPendingCount();
+}
 
+bool RendererGL::isBusy()
+{
+	return isCapturing() || getPendingScreenshots() > 0 || !_streamer.isIdle();
 }
 
-void RendererGL::takeScreenshot(const string &filename)
+bool RendererGL::setScreenshotPipe(const string &command)
 {
-	_takeScreen = true;
-	_screenFilename = filename;
+	if (command.empty())
+	{
+		_screenshot.closePipe();
+		return true;
+	}
+	return _screenshot.openPipe(command);
 }
 
 bool testSpherePlane(const vec3 &sphereCenter, float radius, const vec4 &plane)
@@ -618,13 +1186,31 @@ void RendererGL::render(const RenderInfo &info)
 	this->_texLoadDistance = _closeBodyMaxDistance*1.4;
 	this->_texUnloadDistance = _closeBodyMaxDistance*1.6;
 
+	CPUProfiler::Scope scope("Render");
 	_profiler.begin("Full frame");
 
 	auto &currentData = _dynamicData[_frameId];
 
 	// Projection and view matrices
-	const mat4 projMat = perspective(info.fovy, _windowWidth/(float)_windowHeight, 0.f,1.f);
-	const mat4 viewMat = mat4(info.viewDir);
+	mat4 projMat = perspective(info.fovy, _windowWidth/(float)_windowHeight, 0.f,1.f);
+	// Screenshots are always at full resolution
+	if (!_screenCaptures.empty())
+	{
+		_renderWidth = _windowWidth;
+		_renderHeight = _windowHeight;
+	}
+
+	// Big screenshots zoom on one tile of the view each frame
+	const bool screenTile = !_screenCaptures.empty() && _screenCaptures.front().tiles > 1;
+	if (screenTile)
+	{
+		const int tiles = _screenCaptures.front().tiles;
+		const int tile = _screenCaptures.front().nextTile;
+		projMat = 
+			translate(mat4(), vec3(tiles-1-2*(tile%tiles), tiles-1-2*(tile/tiles), 0))*
+			scale(mat4(), vec3(tiles, tiles, 1))*projMat;
+	}
+	mat4 viewMat = mat4(info.viewDir);
 
 	// Frustum construction
 	const float f = tan(info.fovy/2.0);
@@ -639,80 +1225,158 @@ void RendererGL::render(const RenderInfo &info)
 		vec4(normalize(vec3(0, -1, f)), 0)
 	};
 
-	// Entity classification
-	vector<EntityHandle> closeEntities;
-	vector<EntityHandle> translucentEntities;
-	vector<EntityHandle> flares;
+	// Bounding spheres of subtrees from this frame's positions
+	_profiler.begin("Culling");
+	CPUProfiler::begin("Culling");
+	refitSubtreeBounds();
 
-	vector<EntityHandle> texLoadEntities;
-	vector<EntityHandle> texUnloadEntities;
+	// Subtrees far from the view only contain flares (culled on the GPU), the
+	// others have their bodies tested one by one
+	vector<EntityHandle> candidates;
+	cullHierarchy(info.viewPos, candidates);
 
-	for (const auto &h : _entityCollection->getBodies())
+	// Entity classification, lists of each chunk merged in candidate order
+	struct Classification
 	{
-		auto &data = _bodyData[h];
-		const auto &param = h.getParam();
-		const auto &state = h.getState();
-		const float radius = param.getModel().getRadius();
-		const float maxRadius = radius+(param.hasRing()?
-			param.getRing().getOuterDistance():0);
-		const dvec3 pos = state.getPosition();
-		const double dist = distance(info.viewPos, pos)/radius;
-		bool focused = count(
-			info.focusedEntitiesId.begin(), 
-			info.focusedEntitiesId.end(), h)>0;
+		vector<EntityHandle> close;
+		vector<EntityHandle> translucent;
+		vector<EntityHandle> texLoad;
+		/// Bodies needing a UBO this frame
+		vector<EntityHandle> ubo;
+	};
 
-		if ((focused || dist < _texLoadDistance) && !data.texLoaded)
-		{
-			texLoadEntities.push_back(h);
-		}
-		else if (!focused && data.texLoaded && dist > _texUnloadDistance)
-		{
-			// Textures need to be unloaded
-			texUnloadEntities.push_back(h);
-		}
+	const size_t classificationGrain = 64;
+	vector<Classification> chunks(
+		_jobs->getChunkCount(candidates.size(), classificationGrain));
 
-		// Frustum test
-		const vec3 viewSpacePos = vec3(viewMat*vec4(pos - info.viewPos,1.0));
-		bool visible = true;
-		for (vec4 plane : frustum)
+	_jobs->parallelFor(candidates.size(), classificationGrain,
+		[&](const size_t begin, const size_t end, const size_t chunk)
+	{
+		Classification &lists = chunks[chunk];
+		for (size_t i=begin;i<end;++i)
 		{
-			visible = visible && testSpherePlane(viewSpacePos, maxRadius, plane);
-		}
+			const EntityHandle &h = candidates[i];
+			const auto &data = _bodyData.at(h);
+			const auto &param = h.getParam();
+			const auto &state = h.getState();
+			const float radius = param.getModel().getRadius();
+			const float maxRadius = radius+(param.hasRing()?
+				param.getRing().getOuterDistance():0);
+			const dvec3 pos = state.getPosition();
+			const double dist = distance(info.viewPos, pos)/radius;
+
+			// Focused bodies and unloading are handled below
+			if (dist < _texLoadDistance && !data.texLoaded)
+			{
+				lists.texLoad.push_back(h);
+			}
 
-		// Render entities inside the frustum
-		if (visible)
-		{
-			// Render if is range, always render sun
-			if (dist < _closeBodyMaxDistance || param.isStar())
+			// Frustum test
+			const vec3 viewSpacePos = vec3(viewMat*vec4(pos - info.viewPos,1.0));
+			bool visible = true;
+			for (vec4 plane : frustum)
+			{
+				visible = visible && testSpherePlane(viewSpacePos, maxRadius, plane);
+			}
+
+			// Render entities inside the frustum
+			if (visible)
 			{
-				closeEntities.push_back(h);
-				// Entity atmospheres
-				if (param.hasAtmo() || param.hasRing())
+				// Render if is range, always render sun
+				if (dist < _closeBodyMaxDistance || param.isStar())
 				{
-					translucentEntities.push_back(h);
+					lists.close.push_back(h);
+					lists.ubo.push_back(h);
+					// Entity atmospheres
+					if (param.hasAtmo() || param.hasRing())
+					{
+						lists.translucent.push_back(h);
+					}
 				}
 			}
 		}
+	});
 
-		if (dist > _flareMinDistance && !param.isStar())
-		{
-			flares.push_back(h); 
-		}
-	}
+	vector<EntityHandle> closeEntities;
+	vector<EntityHandle> translucentEntities;
 
-	// Manage stream textures
-	_profiler.begin("Texture creation/deletion");
-	loadTextures(texLoadEntities);
-	unloadTextures(texUnloadEntities);
-	_profiler.end();
-	_profiler.begin("Texture updating");
-	uploadLoadedTextures();
-	_profiler.end();
+	vector<EntityHandle> texLoadEntities;
+	vector<EntityHandle> texUnloadEntities;
 
-	const float exp = pow(2, info.exposure);
+	for (const auto &h : _uboEntities) _bodyData[h].uboSlot = -1;
+	_uboEntities.clear();
 
-	// Scene uniform update
-	SceneUBO sceneUBO{};
+	for (const auto &lists : chunks)
+	{
+		closeEntities.insert(closeEntities.end(), lists.close.begin(), lists.close.end());
+		translucentEntities.insert(translucentEntities.end(),
+			lists.translucent.begin(), lists.translucent.end());
+		texLoadEntities.insert(texLoadEntities.end(),
+			lists.texLoad.begin(), lists.texLoad.end());
+		_uboEntities.insert(_uboEntities.end(), lists.ubo.begin(), lists.ubo.end());
+	}
+	for (size_t i=0;i<_uboEntities.size();++i)
+		_bodyData[_uboEntities[i]].uboSlot = i;
+	// The sun's UBO is used by its flare
+	if (_sun.exists() && _bodyData[_sun].uboSlot == -1)
+	{
+		_bodyData[_sun].uboSlot = _uboEntities.size();
+		_uboEntities.push_back(_sun);
+	}
+
+	// Focused bodies are always loaded, the others unloaded when far enough
+	for (const auto &h : info.focusedEntitiesId)
+	{
+		auto it = _bodyData.find(h);
+		if (it != _bodyData.end() && !it->second.texLoaded &&
+			find(texLoadEntities.begin(), texLoadEntities.end(), h) == texLoadEntities.end())
+			texLoadEntities.push_back(h);
+	}
+	for (const auto &h : _texLoadedBodies)
+	{
+		const double dist = distance(info.viewPos, h.getState().getPosition())/
+			h.getParam().getModel().getRadius();
+		const bool focused = count(
+			info.focusedEntitiesId.begin(), 
+			info.focusedEntitiesId.end(), h)>0;
+		if (!focused && dist > _texUnloadDistance)
+		{
+			// Textures need to be unloaded
+			texUnloadEntities.push_back(h);
+		}
+	}
+	CPUProfiler::end();
+	_profiler.end();
+
+	// Manage stream textures
+	_profiler.begin("Texture creation/deletion");
+	CPUProfiler::begin("Texture creation/deletion");
+	loadTextures(texLoadEntities);
+	unloadTextures(texUnloadEntities);
+	CPUProfiler::end();
+	_profiler.end();
+	_profiler.begin("Texture updating");
+	CPUProfiler::begin("Texture updating");
+	updateTextureImportance(info);
+	uploadLoadedTextures();
+	CPUProfiler::end();
+	_profiler.end();
+
+	const float exp = pow(2, info.exposure);
+
+	// View sampled again from the latest input, everything written for the
+	// GPU from here on uses it while culling uses the view of the frame
+	dvec3 viewPos = info.viewPos;
+	uint64_t inputTime = info.inputTime;
+	if (info.latchView)
+	{
+		mat3 viewDir = info.viewDir;
+		inputTime = info.latchView(viewPos, viewDir);
+		viewMat = mat4(viewDir);
+	}
+
+	// Scene uniform update
+	SceneUBO sceneUBO{};
 	sceneUBO.projMat = projMat;
 	sceneUBO.viewMat = viewMat;
 	sceneUBO.starMapMat = viewMat*scale(mat4(), vec3(-1));
@@ -722,30 +1386,103 @@ void RendererGL::render(const RenderInfo &info)
 	sceneUBO.exposure = exp;
 	sceneUBO.logDepthFarPlane = (1.0/log2(_logDepthC*_logDepthFarPlane + 1.0));
 	sceneUBO.logDepthC = _logDepthC;
+	sceneUBO.renderScale = vec2(
+		_renderWidth/(float)_windowWidth,
+		_renderHeight/(float)_windowHeight);
+
+	// Entity uniform update and terrain patch selection
+	vector<vector<TerrainPatch>> bodyPatches(_uboEntities.size());
+	vector<TerrainQuadtree::View> bodyViews(_uboEntities.size());
+	CPUProfiler::begin("Body update");
+	_jobs->parallelFor(_uboEntities.size(), 1,
+		[&](const size_t begin, const size_t end, size_t)
+	{
+		for (size_t i=begin;i<end;++i)
+		{
+			const EntityHandle &h = _uboEntities[i];
+			const EntityParam &param = h.getParam();
+			BodyUBO &ubo = _bodyData.at(h).ubo;
+			updateBodyUBO(info.fovy, exp, viewPos, projMat, viewMat, 
+				h.getState(), param, ubo);
+			// Stars are drawn as spheres
+			if (param.isStar()) continue;
+			TerrainQuadtree::View view{};
+			view.modelViewMat = viewMat*ubo.modelMat;
+			view.radius = param.getModel().getRadius();
+			view.maxHeight = ubo.heightScale;
+			view.frustum = frustum;
+			bodyViews[i] = view;
+			_terrain.select(view, bodyPatches[i]);
+		}
+	});
 
-	// Entity uniform update
-	map<EntityHandle, BodyUBO> bodyUBOs;
-	for (const auto &h : _entityCollection->getBodies())
+	CPUProfiler::end();
+
+	// Patches of all bodies packed in slot order, a body whose patches don't
+	// fit with room left for the coarse patches of the next ones is drawn
+	// with coarse patches itself
+	size_t remainingBodies = 0;
+	for (const auto &h : _uboEntities)
 	{
-		bodyUBOs[h] = getBodyUBO(info.fovy, exp, info.viewPos, projMat, viewMat, 
-			h.getState(), h.getParam(), _bodyData[h]);
+		if (!h.getParam().isStar()) ++remainingBodies;
 	}
+	vector<TerrainPatch> patches;
+	size_t coarseBodies = 0;
+	size_t truncatedBodies = 0;
+	for (size_t i=0;i<_uboEntities.size();++i)
+	{
+		auto &data = _bodyData[_uboEntities[i]];
+		vector<TerrainPatch> &selected = bodyPatches[i];
+		data.ubo.firstPatch = patches.size();
+		data.patchCount = 0;
+		if (_uboEntities[i].getParam().isStar()) continue;
+		--remainingBodies;
+		if (patches.size()+selected.size()+
+			remainingBodies*MAX_COARSE_TERRAIN_PATCHES > MAX_TERRAIN_PATCHES)
+		{
+			selected.clear();
+			_terrainCoarse.select(bodyViews[i], selected);
+			++coarseBodies;
+		}
+		// Only with more bodies than coarse patches fit
+		const size_t count = std::min(selected.size(),
+			(size_t)MAX_TERRAIN_PATCHES-patches.size());
+		if (count < selected.size()) ++truncatedBodies;
+		data.patchCount = count;
+		patches.insert(patches.end(), selected.begin(), selected.begin()+count);
+	}
+	if (coarseBodies > 0 && !_terrainOverflow)
+	{
+		cerr << "Terrain patch buffer full (" << MAX_TERRAIN_PATCHES <<
+			" patches), " << coarseBodies << " bodies drawn with coarse patches";
+		if (truncatedBodies > 0)
+			cerr << ", " << truncatedBodies << " of them partially";
+		cerr << endl;
+	}
+	_terrainOverflow = coarseBodies > 0;
 
 	// Dynamic data upload
 	_profiler.begin("Sync wait");
+	CPUProfiler::begin("Sync wait");
 	_fences[_frameId].waitClient();
+	CPUProfiler::end();
 	_profiler.end();
 
-	_uboBuffer.write(currentData.sceneUBO, &sceneUBO);
-	for (const auto &h : _entityCollection->getBodies())
+	// The previous frame in this slot is done, its end time is available
+	readFrameLatency();
+	_frameInputTimes[_frameId] = inputTime;
+
+	if (_sparseFeedback)
 	{
-		_uboBuffer.write(currentData.bodyUBOs[h], &bodyUBOs[h]);
+		_profiler.begin("Texture feedback");
+		readTextureFeedback(currentData);
+		_profiler.end();
 	}
 
 	auto closerFun = [&](const EntityHandle &i, const EntityHandle &j)
 	{
-		const float distI = distance(i.getState().getPosition(), info.viewPos);
-		const float distJ = distance(j.getState().getPosition(), info.viewPos);
+		const float distI = distance(i.getState().getPosition(), viewPos);
+		const float distJ = distance(j.getState().getPosition(), viewPos);
 		return distI < distJ;
 	};
 
@@ -760,18 +1497,150 @@ void RendererGL::render(const RenderInfo &info)
 	// Atmosphere sorting from back to front
 	sort(translucentEntities.begin(), translucentEntities.end(), fartherFun);
 
+	if (_sparseFeedback) 
+		assignFeedbackSlots(closeEntities, currentData);
+
+	_uboBuffer.write(currentData.sceneUBO, &sceneUBO);
+	if (!patches.empty())
+	{
+		_terrainBuffer.write(BufferRange(currentData.terrainPatches.getOffset(),
+			patches.size()*sizeof(TerrainPatch)), patches.data());
+	}
+	if (!_uboEntities.empty())
+	{
+		// Body UBOs are copied by slot to mapped memory, with a single flush
+		uint8_t *ubos = (uint8_t*)_uboBuffer.getPtr()+currentData.bodyUBOs.getOffset();
+		for (size_t i=0;i<_uboEntities.size();++i)
+			memcpy(ubos+i*_bodyUBOStride, &_bodyData[_uboEntities[i]].ubo, sizeof(BodyUBO));
+		_uboBuffer.flush(BufferRange(currentData.bodyUBOs.getOffset(),
+			_uboEntities.size()*_bodyUBOStride));
+		if (_multiDraw)
+		{
+			// Same UBOs packed for indirect draws
+			BodyUBO *ssbo = (BodyUBO*)((uint8_t*)_drawBuffer.getPtr()+
+				currentData.bodySSBO.getOffset());
+			for (size_t i=0;i<_uboEntities.size();++i)
+				ssbo[i] = _bodyData[_uboEntities[i]].ubo;
+			_drawBuffer.flush(BufferRange(currentData.bodySSBO.getOffset(),
+				_uboEntities.size()*sizeof(BodyUBO)));
+		}
+	}
+	if (!_flareBodies.empty())
+	{
+		// Only positions are uploaded for flares, culling is done on the GPU
+		vec4 *positions = (vec4*)((uint8_t*)_flareCullBuffer.getPtr()+
+			currentData.flarePositions.getOffset());
+		_jobs->parallelFor(_flareBodies.size(), 1024,
+			[&](const size_t begin, const size_t end, size_t)
+		{
+			for (size_t i=begin;i<end;++i)
+			{
+				positions[i] = vec4(vec3(
+					_flareBodies[i].getState().getPosition() - viewPos), 0.0);
+			}
+		});
+		_flareCullBuffer.flush(currentData.flarePositions);
+
+		DrawElementsIndirectCommand command = _flareDraw.getIndirect(0);
+		command.instanceCount = 0;
+		_flareCullBuffer.write(currentData.flareCommand, &command);
+
+		FlareCullUBO cullUBO{};
+		cullUBO.viewPos = vec4(vec3(viewPos), 1.0);
+		cullUBO.flareSize = vec2(_windowHeight/(float)_windowWidth, 1.0)*(4.f/_windowHeight);
+		cullUBO.flareMinDistance = _flareMinDistance;
+		cullUBO.flareOptimalDistance = _flareOptimalDistance;
+		cullUBO.count = _flareBodies.size();
+		_uboBuffer.write(currentData.flareCullUBO, &cullUBO);
+	}
+	if (_starCount > 0)
+	{
+		// Stars are drawn with flare instances, culled on the GPU
+		DrawElementsIndirectCommand command = _flareDraw.getIndirect(0);
+		command.instanceCount = 0;
+		_starCommandBuffer.write(currentData.starCommand, &command);
+
+		StarCullUBO starUBO{};
+		starUBO.flareSize = vec2(_windowHeight/(float)_windowWidth, 1.0)*(2.f/_windowHeight);
+		starUBO.intensity = _starMapIntensity;
+		starUBO.magnitudeLimit = _starMagnitudeLimit;
+		starUBO.count = _starCount;
+		_uboBuffer.write(currentData.starCullUBO, &starUBO);
+	}
+	for (size_t i=0;i<_minorBodyGroups.size();++i)
+	{
+		auto &group = _minorBodyGroups[i];
+		// Mean anomalies are reduced in double precision to a reference epoch
+		// close enough to the current one for the shader to work in floats
+		if (abs(info.epoch-group.referenceEpoch)*group.maxMeanMotion >
+			MINOR_BODY_REBASE_ANGLE)
+			group.referenceEpoch = info.epoch;
+		if (currentData.minorBodyEpochs[i] != group.referenceEpoch)
+		{
+			vector<vec2> anomalies(group.count);
+			for (uint32_t j=0;j<group.count;++j)
+			{
+				anomalies[j] = vec2(fmod(group.meanMotions[j]*group.referenceEpoch+
+					group.m0s[j], 2*pi<double>()), group.radii[j]);
+			}
+			_minorBodyAnomalyBuffer.write(currentData.minorBodyAnomalies[i],
+				anomalies.data());
+			currentData.minorBodyEpochs[i] = group.referenceEpoch;
+		}
+
+		const dvec3 parentPos = group.parent.getState().getPosition();
+		MinorBodyUBO ubo{};
+		ubo.parentPos = vec4(vec3(parentPos - viewPos), 1.0);
+		ubo.parentWorldPos = vec4(vec3(parentPos), 1.0);
+		ubo.color = vec4(group.color, 1.0);
+		ubo.flareSize = vec2(_windowHeight/(float)_windowWidth, 1.0)*(4.f/_windowHeight);
+		ubo.epochOffset = info.epoch-group.referenceEpoch;
+		ubo.count = group.count;
+		_uboBuffer.write(currentData.minorBodyUBOs[i], &ubo);
+	}
+
+	_profiler.begin("Minor body propagation");
+	computeMinorBodies(currentData);
+	_profiler.end();
+	_profiler.begin("Flare culling");
+	cullFlares(currentData);
+	_profiler.end();
+	_profiler.begin("Star culling");
+	cullStars(currentData);
+	_profiler.end();
+
 	if (info.wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
 	_profiler.begin("Bodies");
 	renderHdr(closeEntities, currentData);
+	// Make feedback writes visible to the CPU once the fence is signaled
+	if (_sparseFeedback) glMemoryBarrier(GL_CLIENT_MAPPED_BUFFER_BARRIER_BIT);
+	_profiler.end();
+	_profiler.begin("Stars");
+	renderStars(currentData);
+	_profiler.end();
+	_profiler.begin("Sun occlusion");
+	computeSunOcclusion(currentData);
 	_profiler.end();
 	_profiler.begin("Flares");
-	renderEntityFlares(flares, currentData);
+	renderEntityFlares(currentData);
+	_profiler.end();
+	_profiler.begin("Minor body flares");
+	renderMinorBodyFlares(currentData);
 	_profiler.end();
 	_profiler.begin("Translucent objects");
 	renderTranslucent(translucentEntities, currentData);
 	_profiler.end();
 	if (info.wireframe) glPolygonMode(GL_FRONT_AND_BACK, GL_FILL);
-	if (info.bloom)
+	if (info.bloom && _computeBloom)
+	{
+		_profiler.begin("Downsample");
+		computeBloomDownsample(currentData);
+		_profiler.end();
+		_profiler.begin("Bloom");
+		computeBloomUpsample();
+		_profiler.end();
+	}
+	else if (info.bloom)
 	{
 		_profiler.begin("Highpass");
 		renderHighpass(currentData);
@@ -789,47 +1658,210 @@ void RendererGL::render(const RenderInfo &info)
 	_profiler.begin("Sun Flare");
 	renderSunFlare(currentData);
 	_profiler.end();
-	_profiler.begin("GUI");
-	renderGui();
-	_profiler.end();
-
-	if (_takeScreen)
+	if (!screenTile)
 	{
-		saveScreenshot();
-		_takeScreen = false;
+		_profiler.begin("GUI");
+		renderGui();
+		_profiler.end();
 	}
 
+	pollScreenReadbacks();
+	if (!_screenCaptures.empty()) readScreenTile();
+
 	_profiler.end();
 
+	glQueryCounter(_frameEndQueries[_frameId], GL_TIMESTAMP);
 	_fences[_frameId].lock();
 
 	_frameId = (_frameId+1)%_bufferFrames;
+
+	// Results of past frames, only when already available
+	if (_profiler.endFrame())
+	{
+		_profilerTimes.clear();
+		for (const auto &scope : _profiler.getLastFrame())
+			_profilerTimes.push_back({scope.name, scope.duration});
+		updateRenderScale();
+	}
 }
 
-float RendererGL::getSunVisibility()
+void RendererGL::updateRenderScale()
 {
-	for (int i=0;i<2;++i)
+	if (_targetFrameTime <= 0) return;
+	auto it = find_if(_profilerTimes.begin(), _profilerTimes.end(),
+		[](const pair<string,uint64_t> &t){ return t.first == "Full frame";});
+	if (it == _profilerTimes.end()) return;
+	const float frameTime = it->second/1e6f;
+
+	// Only react outside of a margin, so that the resolution doesn't change
+	// every frame with the measure noise
+	const bool overBudget = frameTime > _targetFrameTime;
+	const bool underBudget = frameTime < _targetFrameTime*0.8f;
+	if (overBudget || underBudget)
+	{
+		// Frame time roughly follows the pixel count, aim under the target
+		// and limit steps as part of the frame doesn't scale
+		const float maxStep = 0.05;
+		const float wanted = _renderScale*
+			sqrt(_targetFrameTime*0.9f/std::max(frameTime, 0.01f));
+		_renderScale = clamp(wanted, _renderScale-maxStep, _renderScale+maxStep);
+		_renderScale = clamp(_renderScale, _minRenderScale, 1.f);
+	}
+	_renderWidth = std::max(1, (int)round(_windowWidth*_renderScale));
+	_renderHeight = std::max(1, (int)round(_windowHeight*_renderScale));
+
+	// MSAA is halved when the resolution can't go lower and doubled back
+	// when full resolution has a lot of margin, after a while to avoid
+	// reallocating rendertargets back and forth
+	const int msaaFrames = 60;
+	_msaaDownFrames = (overBudget && _renderScale <= _minRenderScale && 
+		_msaaSamples > 1)?_msaaDownFrames+1:0;
+	_msaaUpFrames = (frameTime < _targetFrameTime*0.5f && _renderScale >= 1.f &&
+		_msaaSamples < _maxMsaaSamples)?_msaaUpFrames+1:0;
+	if (_msaaDownFrames >= msaaFrames || _msaaUpFrames >= msaaFrames)
 	{
-		glGetQueryObjectiv(_sunOcclusionQueries[i], GL_QUERY_RESULT_NO_WAIT, 
-			&_occlusionQueryResults[i]);
+		_msaaSamples = (_msaaDownFrames >= msaaFrames)?
+			_msaaSamples/2:
+			std::min(_msaaSamples*2, _maxMsaaSamples);
+		_msaaDownFrames = 0;
+		_msaaUpFrames = 0;
+		createHdrRendertargets();
 	}
+}
+
+void RendererGL::computeSunOcclusion(const DynamicData &data)
+{
+	if (!_sun.exists()) return;
+
+	_pipelineSunOcclusion.bind();
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		data.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+	glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+		getBodyUBOOffset(data, _sun),
+		sizeof(BodyUBO));
+	glBindTextureUnit(0, _depthStencilTex);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _sunVisibilityBuffer.getId(),
+		_sunVisibility.getOffset(), _sunVisibility.getSize());
+
+	// A single group samples the whole disk
+	glDispatchCompute(1, 1, 1);
+	// Read by the sun flare vertex shader
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+GLuint64 RendererGL::getTextureHandle(const GLuint tex, const GLuint sampler)
+{
+	if (tex == 0) return 0;
 
-	return _occlusionQueryResults[0]/(float)std::max(1,_occlusionQueryResults[1]);
+	// Texture ids may be reused once the streamer deletes textures
+	if (_streamer.getGeneration() != _texHandlesGeneration)
+	{
+		_texHandles.clear();
+		_texHandlesGeneration = _streamer.getGeneration();
+	}
+
+	auto it = _texHandles.find({tex, sampler});
+	if (it != _texHandles.end()) return it->second;
+
+	const GLuint64 handle = sampler?
+		glGetTextureSamplerHandleARB(tex, sampler):
+		glGetTextureHandleARB(tex);
+	if (!glIsTextureHandleResidentARB(handle))
+		glMakeTextureHandleResidentARB(handle);
+	_texHandles[{tex, sampler}] = handle;
+	return handle;
+}
+
+RendererGL::BodyTexHandles RendererGL::getBodyTexHandles(const BodyData &data)
+{
+	BodyTexHandles handles{};
+	handles.diffuse = getTextureHandle(
+		_streamer.getTex(data.diffuse).getCompleteTextureId(_diffuseTexDefault),
+		_bodyTexSampler);
+	handles.cloud = getTextureHandle(
+		_streamer.getTex(data.cloud).getCompleteTextureId(_cloudTexDefault),
+		_bodyTexSampler);
+	handles.night = getTextureHandle(
+		_streamer.getTex(data.night).getCompleteTextureId(_nightTexDefault),
+		_bodyTexSampler);
+	handles.specular = getTextureHandle(
+		_streamer.getTex(data.specular).getCompleteTextureId(_specularTexDefault),
+		_bodyTexSampler);
+	handles.atmo = getTextureHandle(data.atmoLookupTable, _atmoSampler);
+	handles.ringOcclusion = getTextureHandle(data.ringTex2, _ringSampler);
+	handles.height = getTextureHandle(
+		_streamer.getTex(data.height).getCompleteTextureId(_heightTexDefault),
+		_bodyTexSampler);
+
+	if (_sparseFeedback)
+	{
+		// Residency maps (only when sampling the streamed texture)
+		const DDSStreamer::Handle texs[4] = {
+			data.diffuse, data.cloud, data.night, data.specular};
+		for (int i=0;i<4;++i)
+		{
+			handles.residency[i] = getTextureHandle(
+				_streamer.getTex(texs[i]).isComplete()?
+				_streamer.getResidencyTexture(texs[i], _residencyTexDefault):
+				_residencyTexDefault, 0);
+		}
+		handles.heightResidency = getTextureHandle(
+			_streamer.getTex(data.height).isComplete()?
+			_streamer.getResidencyTexture(data.height, _residencyTexDefault):
+			_residencyTexDefault, 0);
+	}
+	return handles;
 }
 
-void RendererGL::saveScreenshot()
+void RendererGL::readScreenTile()
 {
-	// Cancel if already saving screenshot
-	if (_screenshot.isSaving()) return;
-	// Read screen
-	vector<uint8_t> buffer(4*_windowWidth*_windowHeight);
-	glReadBuffer(GL_FRONT);
+	// Without a free PBO, the same tile is rendered again next frame
+	auto it = find_if(_screenReadbacks.begin(), _screenReadbacks.end(),
+		[](const ScreenReadback &r){ return !r.busy;});
+	if (it == _screenReadbacks.end()) return;
+
+	ScreenCapture &capture = _screenCaptures.front();
+	ScreenReadback &readback = *it;
+	readback.busy = true;
+	readback.reading = true;
+	readback.sequence = _screenReadbackCount++;
+	readback.image = capture.image;
+	readback.x = (capture.nextTile%capture.tiles)*_windowWidth;
+	readback.y = (capture.nextTile/capture.tiles)*_windowHeight;
+
+	// Read screen, picked up once the fence is signaled
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, readback.buffer);
+	glReadBuffer(GL_BACK);
 	glReadPixels(0, 0, _windowWidth, _windowHeight, 
-		_screenBestFormatGL, GL_UNSIGNED_BYTE, buffer.data());
-	_screenshot.save(
-		_screenFilename,
-		_windowWidth, _windowHeight, 
-		_screenBestFormat, buffer);
+		_screenBestFormatGL, GL_UNSIGNED_BYTE, nullptr);
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	readback.fence.lock();
+
+	if (++capture.nextTile == capture.tiles*capture.tiles)
+		_screenCaptures.pop_front();
+}
+
+void RendererGL::pollScreenReadbacks()
+{
+	// Tiles are given in readback order, so that piped images stay in order
+	while (true)
+	{
+		auto it = _screenReadbacks.end();
+		for (auto r=_screenReadbacks.begin();r!=_screenReadbacks.end();++r)
+		{
+			if (r->reading && (it == _screenReadbacks.end() || r->sequence < it->sequence))
+				it = r;
+		}
+		if (it == _screenReadbacks.end() || !it->fence.waitClient(0)) return;
+		ScreenReadback &readback = *it;
+		readback.reading = false;
+		// Copied by a Screenshot thread straight from the mapping
+		atomic<bool> *busy = &readback.busy;
+		_screenshot.addTile(readback.image, readback.x, readback.y,
+			_windowWidth, _windowHeight, _screenBestFormat, readback.data,
+			[busy]{ *busy = false;});
+	}
 }
 
 void RendererGL::renderHdr(
@@ -837,7 +1869,7 @@ void RendererGL::renderHdr(
 	const DynamicData &ddata)
 {
 	// Viewport
-	glViewport(0,0, _windowWidth, _windowHeight);
+	glViewport(0,0, _renderWidth, _renderHeight);
 
 	// Depth test/write
 	glDepthMask(GL_TRUE);
@@ -860,21 +1892,78 @@ void RendererGL::renderHdr(
 	// Bind FBO for rendering
 	glBindFramebuffer(GL_FRAMEBUFFER, _hdrFBO);
 
-	// Entity rendering
+	// Indirect rendering of planets, grouped by pipeline
+	if (_multiDraw)
+	{
+		// Variants in mask order, a group per variant
+		map<uint32_t, vector<EntityHandle>> groups;
+		for (const auto &h : closeEntities)
+		{
+			const EntityParam &param = h.getParam();
+			if (param.isStar()) continue;
+			groups[getBodyFeatures(param)].push_back(h);
+		}
+
+		vector<BodyTexHandles> handles(_bodyData.size());
+		vector<DrawElementsIndirectCommand> commands;
+		for (const auto &group : groups)
+		{
+			for (const auto &h : group.second)
+			{
+				const auto &data = _bodyData[h];
+				handles[data.uboSlot] = getBodyTexHandles(data);
+				commands.push_back(_patchDraw.getIndirect(data.uboSlot, data.patchCount));
+			}
+		}
+		_drawBuffer.write(ddata.bodyTexSSBO, handles.data());
+		if (!commands.empty())
+		{
+			_drawBuffer.write(BufferRange(ddata.bodyCommands.getOffset(),
+				commands.size()*sizeof(DrawElementsIndirectCommand)), commands.data());
+		}
+
+		glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+			ddata.sceneUBO.getOffset(),
+			sizeof(SceneUBO));
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 4, _drawBuffer.getId(),
+			ddata.bodySSBO.getOffset(), ddata.bodySSBO.getSize());
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 5, _drawBuffer.getId(),
+			ddata.bodyTexSSBO.getOffset(), ddata.bodyTexSSBO.getSize());
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 6, _terrainBuffer.getId(),
+			ddata.terrainPatches.getOffset(), ddata.terrainPatches.getSize());
+		if (_sparseFeedback)
+		{
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, _feedbackBuffer.getId(),
+				ddata.feedback.getOffset(), ddata.feedback.getSize());
+		}
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _drawBuffer.getId());
+
+		uint32_t start = 0;
+		for (const auto &group : groups)
+		{
+			_bodyPipelines.at(group.first).bind();
+			_patchDraw.multiDraw(true, ddata.bodyCommands.getOffset()+
+				start*sizeof(DrawElementsIndirectCommand), group.second.size());
+			start += group.second.size();
+		}
+	}
+
+	// Entity rendering, front to back so pipelines are only bound on change
+	ShaderPipeline *boundPipeline = nullptr;
 	for (const auto &h : closeEntities)
 	{
 		auto &data = _bodyData[h];
 		const EntityParam &param = h.getParam();
 		const bool star = param.isStar();
-		const bool hasAtmo = param.hasAtmo();
-		const bool hasRing = param.hasRing();
-		if (star) _pipelineSun.bind();
-		else if (hasAtmo)
+		// Only stars are left, they have their own pipeline
+		if (_multiDraw && !star) continue;
+		ShaderPipeline *pipeline = star?&_pipelineSun:
+			&_bodyPipelines.at(getBodyFeatures(param));
+		if (pipeline != boundPipeline)
 		{
-			if (hasRing) _pipelineBodyAtmoRing.bind();
-			else _pipelineBodyAtmo.bind();
+			pipeline->bind();
+			boundPipeline = pipeline;
 		}
-		else _pipelineBodyBare.bind();
 
 		// Bind Scene UBO
 		glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
@@ -883,9 +1972,16 @@ void RendererGL::renderHdr(
 
 		// Bind entity UBO
 		glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
-			ddata.bodyUBOs.at(h).getOffset(),
+			getBodyUBOOffset(ddata, h),
 			sizeof(BodyUBO));
 
+		// Bind feedback grids
+		if (_sparseFeedback)
+		{
+			glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, _feedbackBuffer.getId(),
+				ddata.feedback.getOffset(), ddata.feedback.getSize());
+		}
+
 		// Bind samplers
 		const vector<GLuint> samplers = {
 			_bodyTexSampler,
@@ -908,25 +2004,44 @@ void RendererGL::renderHdr(
 		glBindSamplers(2, samplers.size(), samplers.data());
 		glBindTextures(2, texs.size(), texs.data());
 
-		if (star) glBeginQuery(GL_SAMPLES_PASSED, _sunOcclusionQueries[0]);
-		data.bodyDraw.draw(true);
+		if (_sparseFeedback)
+		{
+			// Residency maps (only when sampling the streamed texture)
+			vector<GLuint> residencyTexs;
+			for (auto tex : {data.diffuse, data.cloud, data.night, data.specular})
+			{
+				residencyTexs.push_back(_streamer.getTex(tex).isComplete()?
+					_streamer.getResidencyTexture(tex, _residencyTexDefault):
+					_residencyTexDefault);
+			}
+			glBindTextures(8, residencyTexs.size(), residencyTexs.data());
+		}
+
 		if (star)
 		{
-			glEndQuery(GL_SAMPLES_PASSED);
-			glDepthFunc(GL_ALWAYS);
-			glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
-			glDepthMask(GL_FALSE);
-			glBeginQuery(GL_SAMPLES_PASSED, _sunOcclusionQueries[1]);
 			data.bodyDraw.draw(true);
-			glEndQuery(GL_SAMPLES_PASSED);
-			glDepthFunc(GL_LESS);
-			glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
-			glDepthMask(GL_TRUE);
+			continue;
+		}
+
+		// Terrain patches and heightmap
+		if (data.patchCount == 0) continue;
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 6, _terrainBuffer.getId(),
+			ddata.terrainPatches.getOffset(), ddata.terrainPatches.getSize());
+		glBindSampler(12, _bodyTexSampler);
+		glBindTextureUnit(12,
+			_streamer.getTex(data.height).getCompleteTextureId(_heightTexDefault));
+		if (_sparseFeedback)
+		{
+			glBindTextureUnit(13, _streamer.getTex(data.height).isComplete()?
+				_streamer.getResidencyTexture(data.height, _residencyTexDefault):
+				_residencyTexDefault);
 		}
+		_patchDraw.draw(true, data.patchCount);
 	}
 
-	// Star map rendering
+	// Star map rendering, catalog stars are drawn by renderStars()
 	// Don't render if star map texture not loaded
+	if (_starCount > 0) return;
 	auto &starMapTex = _streamer.getTex(_starMapTexHandle);
 	if (starMapTex.isComplete())
 	{
@@ -942,11 +2057,37 @@ void RendererGL::renderHdr(
 	}
 }
 
-void RendererGL::renderEntityFlares(
-	const vector<EntityHandle> &flares,
-	const DynamicData &data)
+void RendererGL::cullFlares(const DynamicData &data)
 {
-	glViewport(0,0, _windowWidth, _windowHeight);
+	if (_flareBodies.empty()) return;
+
+	_pipelineFlareCull.bind();
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		data.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+	glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+		data.flareCullUBO.getOffset(),
+		sizeof(FlareCullUBO));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _flareCullBuffer.getId(),
+		data.flarePositions.getOffset(), data.flarePositions.getSize());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, _flareBodyBuffer.getId(),
+		_flareBodyColors.getOffset(), _flareBodyColors.getSize());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, _flareBodyBuffer.getId(),
+		data.flareInstances.getOffset(), data.flareInstances.getSize());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, _flareCullBuffer.getId(),
+		data.flareCommand.getOffset(), data.flareCommand.getSize());
+
+	const uint32_t groupSize = 64;
+	glDispatchCompute((_flareBodies.size()+groupSize-1)/groupSize, 1, 1);
+	// Instances are read by the vertex shader, the instance count by the draw
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT|GL_COMMAND_BARRIER_BIT);
+}
+
+void RendererGL::renderEntityFlares(const DynamicData &data)
+{
+	if (_flareBodies.empty()) return;
+
+	glViewport(0,0, _renderWidth, _renderHeight);
 	// Only depth test
 	glDepthMask(GL_FALSE);
 	glDepthFunc(GL_LESS);
@@ -956,18 +2097,123 @@ void RendererGL::renderEntityFlares(
 
 	glBindFramebuffer(GL_FRAMEBUFFER, _hdrFBO);
 
-	_pipelineFlare.bind();
+	_pipelineCulledFlare.bind();
 
 	glBindSampler(1, 0);
 	glBindTextureUnit(1, _flareTex);
 
-	for (const auto &h : flares)
+	// Visible flares and their count were written by cullFlares()
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, _flareBodyBuffer.getId(),
+		data.flareInstances.getOffset(), data.flareInstances.getSize());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _flareCullBuffer.getId());
+	_flareDraw.multiDraw(false, data.flareCommand.getOffset(), 1);
+}
+
+void RendererGL::cullStars(const DynamicData &data)
+{
+	if (_starCount == 0) return;
+
+	_pipelineStarCull.bind();
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		data.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+	glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+		data.starCullUBO.getOffset(),
+		sizeof(StarCullUBO));
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _starBuffer.getId(),
+		_stars.getOffset(), _stars.getSize());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, _starBuffer.getId(),
+		data.starInstances.getOffset(), data.starInstances.getSize());
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, _starCommandBuffer.getId(),
+		data.starCommand.getOffset(), data.starCommand.getSize());
+
+	const uint32_t groupSize = 64;
+	glDispatchCompute((_starCount+groupSize-1)/groupSize, 1, 1);
+	// Instances are read by the vertex shader, the instance count by the draw
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT|GL_COMMAND_BARRIER_BIT);
+}
+
+void RendererGL::renderStars(const DynamicData &data)
+{
+	if (_starCount == 0) return;
+
+	// Same state as entity flares, behind the bodies drawn before
+	glViewport(0,0, _renderWidth, _renderHeight);
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LESS);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, _hdrFBO);
+
+	_pipelineCulledFlare.bind();
+
+	glBindSampler(1, 0);
+	glBindTextureUnit(1, _flareTex);
+
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, _starBuffer.getId(),
+		data.starInstances.getOffset(), data.starInstances.getSize());
+	glBindBuffer(GL_DRAW_INDIRECT_BUFFER, _starCommandBuffer.getId());
+	_flareDraw.multiDraw(false, data.starCommand.getOffset(), 1);
+}
+
+void RendererGL::computeMinorBodies(const DynamicData &data)
+{
+	if (_minorBodyGroups.empty()) return;
+
+	_pipelineMinorBodyCompute.bind();
+	for (size_t i=0;i<_minorBodyGroups.size();++i)
 	{
+		const auto &group = _minorBodyGroups[i];
 		glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
-			data.bodyUBOs.at(h).getOffset(),
-			sizeof(BodyUBO));
+			data.minorBodyUBOs[i].getOffset(),
+			sizeof(MinorBodyUBO));
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _minorBodyBuffer.getId(),
+			group.elements.getOffset(), group.elements.getSize());
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, _minorBodyBuffer.getId(),
+			group.positions.getOffset(), group.positions.getSize());
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 2, _minorBodyAnomalyBuffer.getId(),
+			data.minorBodyAnomalies[i].getOffset(), data.minorBodyAnomalies[i].getSize());
+
+		const uint32_t groupSize = 64;
+		glDispatchCompute((group.count+groupSize-1)/groupSize, 1, 1);
+	}
+	// Positions are read by vertex shader
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void RendererGL::renderMinorBodyFlares(const DynamicData &data)
+{
+	if (_minorBodyGroups.empty()) return;
+
+	// Same state as entity flares
+	glViewport(0,0, _renderWidth, _renderHeight);
+	glDepthMask(GL_FALSE);
+	glDepthFunc(GL_LESS);
+	glBlendEquation(GL_FUNC_ADD);
+	glBlendFunc(GL_ONE, GL_ONE);
+
+	glBindFramebuffer(GL_FRAMEBUFFER, _hdrFBO);
+
+	_pipelineMinorBodyFlare.bind();
+
+	glBindSampler(1, 0);
+	glBindTextureUnit(1, _flareTex);
+
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+		data.sceneUBO.getOffset(),
+		sizeof(SceneUBO));
+
+	for (size_t i=0;i<_minorBodyGroups.size();++i)
+	{
+		const auto &group = _minorBodyGroups[i];
+		glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
+			data.minorBodyUBOs[i].getOffset(),
+			sizeof(MinorBodyUBO));
+		glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, _minorBodyBuffer.getId(),
+			group.positions.getOffset(), group.positions.getSize());
 
-		_flareDraw.draw();
+		_flareDraw.draw(false, group.count);
 	}
 }
 
@@ -976,7 +2222,7 @@ void RendererGL::renderTranslucent(
 	const DynamicData &data)
 {
 	// Viewport
-	glViewport(0,0, _windowWidth, _windowHeight);
+	glViewport(0,0, _renderWidth, _renderHeight);
 	// Only depth test
 	glDepthMask(GL_FALSE);
 	glDepthFunc(GL_LESS);
@@ -994,7 +2240,7 @@ void RendererGL::renderTranslucent(
 			sizeof(SceneUBO));
 		// Bind Entity UBO
 		glBindBufferRange(GL_UNIFORM_BUFFER, 1, _uboBuffer.getId(),
-			data.bodyUBOs.at(h).getOffset(),
+			getBodyUBOOffset(data, h),
 			sizeof(BodyUBO));
 
 		const bool hasRing = h.getParam().hasRing();
@@ -1136,6 +2382,54 @@ void RendererGL::renderBloom(const DynamicData &data)
 	}
 }
 
+void RendererGL::computeBloomDownsample(const DynamicData &data)
+{
+	_pipelineBloomDownsample.bind();
+
+	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
+			data.sceneUBO.getOffset(),
+			sizeof(SceneUBO));
+	glBindTextureUnit(1, _hdrMSRendertarget);
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, _bloomCounterBuffer.getId(),
+		_bloomCounter.getOffset(), _bloomCounter.getSize());
+	// Image i is highpass mipmap i+1, mipmap 0 isn't needed
+	for (int i=0;i<_bloomDepth;++i)
+	{
+		glBindImageTexture(i, _highpassRendertargets, i+1, GL_FALSE, 0,
+			GL_READ_WRITE, GL_RGBA16F);
+	}
+
+	// Each group reduces a 64x64 tile down to one texel
+	const int tileSize = 64;
+	glDispatchCompute(
+		(_windowWidth+tileSize-1)/tileSize,
+		(_windowHeight+tileSize-1)/tileSize, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
+}
+
+void RendererGL::computeBloomUpsample()
+{
+	_pipelineBloomUpsample.bind();
+
+	const vector<GLuint> samplers = {_rendertargetSampler, _rendertargetSampler};
+	glBindSamplers(0, samplers.size(), samplers.data());
+	const int groupSize = 16;
+	for (int i=_bloomDepth-1;i>=0;--i)
+	{
+		// Bloom level i has the size of highpass mipmap i+1
+		const vector<GLuint> texs = {_highpassViews[i+1],
+			(i+1 < _bloomDepth)?_bloomViews[i+1]:_bloomBlackTex};
+		glBindTextures(0, texs.size(), texs.data());
+		glBindImageTexture(0, _bloomRendertargets, i, GL_FALSE, 0,
+			GL_WRITE_ONLY, GL_RGBA16F);
+		glDispatchCompute(
+			(mipmapSize(_windowWidth,  i+1)+groupSize-1)/groupSize,
+			(mipmapSize(_windowHeight, i+1)+groupSize-1)/groupSize, 1);
+		// Read by the next level or by the tonemap
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	}
+}
+
 void RendererGL::renderTonemap(const DynamicData &data, const bool bloom)
 {
 	// Viewport
@@ -1191,13 +2485,16 @@ void RendererGL::renderSunFlare(
 
 	// Bind Scene UBO
 	glBindBufferRange(GL_UNIFORM_BUFFER, 0, _uboBuffer.getId(),
-		data.bodyUBOs.at(_sun).getOffset(),
+		getBodyUBOOffset(data, _sun),
 		sizeof(BodyUBO));
 
 	// Bind textures
 	glBindSampler(1, 0);
 	glBindTextureUnit(1, _flareTex);
 
+	glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, _sunVisibilityBuffer.getId(),
+		_sunVisibility.getOffset(), _sunVisibility.getSize());
+
 	_flareDraw.draw();
 }
 
@@ -1207,6 +2504,107 @@ void RendererGL::renderGui()
 	_gui.display(_windowWidth, _windowHeight);
 }
 
+void RendererGL::initHierarchy()
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	map<EntityHandle, int> indices;
+	for (size_t i=0;i<hierarchy.size();++i)
+		indices[hierarchy[i]] = i;
+
+	_hierarchyParents.assign(hierarchy.size(), -1);
+	_subtreeEnd.resize(hierarchy.size());
+	_subtreeBounds.resize(hierarchy.size());
+	for (size_t i=0;i<hierarchy.size();++i)
+	{
+		const EntityHandle parent = hierarchy[i].getParent();
+		if (parent.exists()) _hierarchyParents[i] = indices[parent];
+		_subtreeEnd[i] = i+1+hierarchy[i].getAllChildren().size();
+	}
+}
+
+/// Smallest sphere containing two spheres (radius < 0 for an empty sphere)
+static void mergeSphere(dvec3 &center, double &radius,
+	const dvec3 &otherCenter, const double otherRadius)
+{
+	if (otherRadius < 0) return;
+	if (radius < 0)
+	{
+		center = otherCenter;
+		radius = otherRadius;
+		return;
+	}
+	const double d = distance(center, otherCenter);
+	if (d+otherRadius <= radius) return;
+	if (d+radius <= otherRadius)
+	{
+		center = otherCenter;
+		radius = otherRadius;
+		return;
+	}
+	const double newRadius = (d+radius+otherRadius)/2;
+	center += (otherCenter-center)*((newRadius-radius)/d);
+	radius = newRadius;
+}
+
+void RendererGL::refitSubtreeBounds()
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	for (size_t i=0;i<hierarchy.size();++i)
+	{
+		const EntityHandle &h = hierarchy[i];
+		const EntityParam &param = h.getParam();
+		SubtreeBounds &b = _subtreeBounds[i];
+		b.center = h.getState().getPosition();
+		b.radius = -1;
+		b.maxBodyRadius = 0;
+		b.hasStar = false;
+		if (param.isBody())
+		{
+			const float radius = param.getModel().getRadius();
+			b.radius = radius+(param.hasRing()?param.getRing().getOuterDistance():0);
+			b.maxBodyRadius = radius;
+			b.hasStar = param.isStar();
+		}
+	}
+
+	// Children come after their parent, so they are complete when merged
+	for (int i=hierarchy.size()-1;i>=0;--i)
+	{
+		const int parent = _hierarchyParents[i];
+		if (parent == -1) continue;
+		const SubtreeBounds &child = _subtreeBounds[i];
+		SubtreeBounds &b = _subtreeBounds[parent];
+		mergeSphere(b.center, b.radius, child.center, child.radius);
+		b.maxBodyRadius = std::max(b.maxBodyRadius, child.maxBodyRadius);
+		b.hasStar = b.hasStar || child.hasStar;
+	}
+}
+
+void RendererGL::cullHierarchy(
+	const dvec3 &viewPos,
+	vector<EntityHandle> &candidates)
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	size_t i = 0;
+	while (i < hierarchy.size())
+	{
+		const SubtreeBounds &b = _subtreeBounds[i];
+		const double minDist = distance(b.center, viewPos) - b.radius;
+		if (b.radius >= 0 && (b.hasStar || minDist <= _texLoadDistance*b.maxBodyRadius))
+		{
+			// Bodies may be close or need loading, test them one by one
+			const EntityHandle &h = hierarchy[i];
+			if (h.getParam().isBody()) candidates.push_back(h);
+			++i;
+		}
+		else
+		{
+			// No bodies, or all far enough to be flares only
+			i = _subtreeEnd[i];
+		}
+	}
+}
+
 void RendererGL::loadTextures(const vector<EntityHandle> &texLoadEntities)
 {
 	// Texture loading
@@ -1222,8 +2620,11 @@ void RendererGL::loadTextures(const vector<EntityHandle> &texLoadEntities)
 			data.night = _streamer.createTex(param.getNight().getFilename());
 		if (param.hasSpecular())
 			data.specular = _streamer.createTex(param.getSpecular().getFilename());
+		if (param.hasHeightmap())
+			data.height = _streamer.createTex(param.getHeightmap().getFilename());
 
 		data.texLoaded = true;
+		_texLoadedBodies.insert(h);
 	}
 }
 
@@ -1236,14 +2637,48 @@ void RendererGL::unloadTextures(const vector<EntityHandle> &texUnloadEntities)
 
 		// Reset variables
 		data.texLoaded = false;
+		_texLoadedBodies.erase(h);
 		_streamer.deleteTex(data.diffuse);
 		_streamer.deleteTex(data.cloud);
 		_streamer.deleteTex(data.night);
 		_streamer.deleteTex(data.specular);
+		_streamer.deleteTex(data.height);
 		data.diffuse = 0;
 		data.cloud = 0;
 		data.night = 0;
 		data.specular = 0;
+		data.height = 0;
+	}
+}
+
+void RendererGL::updateTextureImportance(const RenderInfo &info)
+{
+	const float f = tan(info.fovy/2.0);
+	for (const auto &h : _texLoadedBodies)
+	{
+		const auto &data = _bodyData[h];
+
+		const auto &param = h.getParam();
+		const auto &state = h.getState();
+		const dvec3 toView = info.viewPos - state.getPosition();
+		const double dist = length(toView);
+		if (dist == 0.0) continue;
+
+		// Entity rotation
+		const vec3 north = vec3(0,0,1);
+		const vec3 rotAxis = param.getModel().getRotationAxis();
+		const quat q = rotate(quat(), 
+			(float)acos(dot(north, rotAxis)), 
+			cross(north, rotAxis))*
+			rotate(quat(), state.getRotationAngle(), north);
+
+		// View direction in model space
+		const vec3 viewDir = inverse(q)*vec3(toView/dist);
+		const float screenSize = 
+			param.getModel().getRadius()/(dist*f)*_windowHeight;
+
+		for (auto tex : {data.diffuse, data.cloud, data.night, data.specular, data.height})
+			_streamer.setImportance(tex, viewDir, screenSize);
 	}
 }
 
@@ -1253,11 +2688,93 @@ void RendererGL::uploadLoadedTextures()
 	_streamer.update();
 }
 
-RendererGL::BodyUBO RendererGL::getBodyUBO(
+void RendererGL::readTextureFeedback(DynamicData &data)
+{
+	const int cells = FEEDBACK_COLUMNS*FEEDBACK_ROWS;
+	vector<uint32_t> feedback(FEEDBACK_SLOTS*cells);
+	_feedbackBuffer.read(data.feedback, feedback.data());
+
+	for (size_t i=0;i<data.feedbackBodies.size();++i)
+	{
+		const auto &h = data.feedbackBodies[i];
+		const auto &bodyData = _bodyData[h];
+		if (!bodyData.texLoaded) continue;
+		const uint32_t *grid = feedback.data()+i*cells;
+		// Heights are sampled where the diffuse texture is
+		for (auto tex : {bodyData.diffuse, bodyData.night, bodyData.specular, bodyData.height})
+			_streamer.setFeedback(tex, grid, FEEDBACK_COLUMNS, FEEDBACK_ROWS);
+		// Clouds are sampled with an offset
+		_streamer.setFeedback(bodyData.cloud, grid, FEEDBACK_COLUMNS, FEEDBACK_ROWS,
+			h.getState().getCloudDisp());
+	}
+
+	// Clear grids that were written to
+	if (!data.feedbackBodies.empty())
+	{
+		fill(feedback.begin(), feedback.end(), 0);
+		_feedbackBuffer.write(data.feedback, feedback.data());
+	}
+	data.feedbackBodies.clear();
+}
+
+void RendererGL::assignFeedbackSlots(
+	const vector<EntityHandle> &closeEntities,
+	DynamicData &data)
+{
+	data.feedbackBodies.clear();
+	for (const auto &h : closeEntities)
+	{
+		if ((int)data.feedbackBodies.size() >= FEEDBACK_SLOTS) break;
+		if (!_bodyData[h].texLoaded) continue;
+		_bodyData[h].ubo.feedbackSlot = data.feedbackBodies.size();
+		data.feedbackBodies.push_back(h);
+	}
+}
+
+uint32_t RendererGL::getBodyUBOOffset(const DynamicData &data, const EntityHandle &h)
+{
+	const int slot = _bodyData[h].uboSlot;
+	if (slot < 0) throw runtime_error("Body has no UBO this frame");
+	return data.bodyUBOs.getOffset()+slot*_bodyUBOStride;
+}
+
+void RendererGL::initBodyUBO(const EntityParam &params, BodyUBO &ubo)
+{
+	ubo.K = params.hasAtmo()
+		?params.getAtmo().getScatteringConstant()
+		:vec4(0.0);
+
+	if (params.hasSpecular())
+	{
+		auto &spec = params.getSpecular();
+		ubo.mask0ColorHardness = vec4(spec.getMask0().color, spec.getMask0().hardness);
+		ubo.mask1ColorHardness = vec4(spec.getMask1().color, spec.getMask1().hardness);
+	}
+
+	if (params.hasRing())
+	{
+		auto &ring = params.getRing();
+		ubo.ringInner = ring.getInnerDistance();
+		ubo.ringOuter = ring.getOuterDistance();
+	}
+
+	ubo.nightTexIntensity = params.hasNight()
+		?params.getNight().getIntensity():0.0;
+	ubo.starBrightness = params.isStar()
+		?params.getStar().getBrightness():0.0;
+	ubo.radius = params.getModel().getRadius();
+	ubo.atmoHeight = params.hasAtmo()?params.getAtmo().getMaxHeight():0.0;
+	ubo.feedbackSlot = -1;
+	ubo.heightScale = params.hasHeightmap()?
+		params.getHeightmap().getScale()/params.getModel().getRadius():0.0;
+	ubo.firstPatch = 0;
+}
+
+void RendererGL::updateBodyUBO(
 	const float fovy, const float exp,
 	const dvec3 &viewPos, const mat4 &projMat, const mat4 &viewMat,
 	const EntityState &state, const EntityParam &params,
-	const BodyData &data)
+	BodyUBO &ubo)
 {
 	const vec3 bodyPos = state.getPosition() - viewPos;
 
@@ -1295,67 +2812,39 @@ RendererGL::BodyUBO RendererGL::getBodyUBO(
 		const mat4 lookAtFar = mat4(mat3(sideflip*right, -newTowards, up));
 		const mat4 lookAtNear = mat4(mat3(-sideflip*right, newTowards, up));
 
+		// Ring meshes are in units of the outer distance
+		const mat4 ringScale = scale(mat4(), vec3(params.getRing().getOuterDistance()));
+
 		const mat4 ringFarMat = 
 			translate(mat4(), bodyPos)*
-			lookAtFar;
+			lookAtFar*ringScale;
 
 		const mat4 ringNearMat =
 			translate(mat4(), bodyPos)*
-			lookAtNear;
+			lookAtNear*ringScale;
 
 		return make_pair(ringFarMat, ringNearMat);
 	}();
 
-	// Flare
-	const vec4 clip = projMat*viewMat*vec4(bodyPos,1.0);
-	const vec3 screen = vec3(vec2((clip)/clip.w),0.999);
-	const bool visible = clip.w > 0;
-
+	// Flare, only drawn from the UBO for stars (see cullFlares())
 	mat4 flareMat = mat4(0);
 	vec4 flareColor = vec4(0);
 
-	if (visible)
+	const vec4 clip = projMat*viewMat*vec4(bodyPos,1.0);
+	if (params.isStar() && clip.w > 0)
 	{
+		const vec3 screen = vec3(vec2((clip)/clip.w),0.999);
 		const float dist = length(bodyPos);
 		const float radius = params.getModel().getRadius();
-		float flareSize = 0.0;
-		if (params.isStar())
-		{
-			const float visibility = getSunVisibility();
-			const auto star = params.getStar();
-			flareSize = clamp(radius*radius/(dist*dist)*
-				star.getBrightness()/star.getFlareAttenuation(),
-				star.getFlareMinSize(), star.getFlareMaxSize()*exp)*
-				visibility;
-
-			flareColor = vec4(vec3(clamp(
-					(dist/radius-star.getFlareFadeInStart())/
-					(star.getFlareFadeInEnd()-star.getFlareFadeInStart()),
-					0.f,1.f)), 1.f);
-		}
-		else
-		{
-			// Smooth transition to detailed entity to flare
-			const float fadeIn = clamp((dist/radius-_flareMinDistance)/
-				(_flareOptimalDistance-_flareMinDistance),0.f,1.f);
-			flareSize = fadeIn*(4.f/(float)_windowHeight);
-
-			// Angle between view and light 
-			const float phaseAngle = acos(dot(
-				(vec3)normalize(state.getPosition()), 
-				normalize(bodyPos)));
-			// Illumination compared to fully lit disk
-			const float phase = 
-				(1-phaseAngle/pi<float>())*cos(phaseAngle)+
-				(1/pi<float>())*sin(phaseAngle);
-			
-			const float cutDist = dist*0.00008f;
-			
-			flareColor = vec4(
-				clamp(20.f*radius*radius*phase/(cutDist*cutDist),0.f,10.f)*
-				params.getModel().getMeanColor()
-				,1.0);
-		}
+		const auto star = params.getStar();
+		const float flareSize = clamp(radius*radius/(dist*dist)*
+			star.getBrightness()/star.getFlareAttenuation(),
+			star.getFlareMinSize(), star.getFlareMaxSize()*exp);
+
+		flareColor = vec4(vec3(clamp(
+				(dist/radius-star.getFlareFadeInStart())/
+				(star.getFlareFadeInEnd()-star.getFlareFadeInStart()),
+				0.f,1.f)), 1.f);
 		flareMat = translate(mat4(), screen)*
 			scale(mat4(), vec3(_windowHeight/(float)_windowWidth,1.0,0.0)*flareSize);
 	}
@@ -1366,7 +2855,6 @@ RendererGL::BodyUBO RendererGL::getBodyUBO(
 	// Light direction
 	const vec3 lightDir = vec3(normalize(-state.getPosition()));
 
-	BodyUBO ubo{};
 	ubo.modelMat = modelMat;
 	ubo.atmoMat = atmoMat;
 	ubo.ringFarMat = ringMatrices.first;
@@ -1375,37 +2863,74 @@ RendererGL::BodyUBO RendererGL::getBodyUBO(
 	ubo.flareColor = flareColor;
 	ubo.bodyPos = viewMat*vec4(bodyPos, 1.0);
 	ubo.lightDir = viewMat*vec4(lightDir,0.0);
-	ubo.K = params.hasAtmo()
-		?params.getAtmo().getScatteringConstant()
-		:vec4(0.0);
-
-	if (params.hasSpecular())
-	{
-		auto &spec = params.getSpecular();
-		ubo.mask0ColorHardness = vec4(spec.getMask0().color, spec.getMask0().hardness);
-		ubo.mask1ColorHardness = vec4(spec.getMask1().color, spec.getMask1().hardness);
-	}
 
 	if (params.hasRing())
 	{
-		auto &ring = params.getRing();
-		ubo.ringNormal = vec4(viewNormalMat*ring.getNormal(), 0.0);
-		ubo.ringInner = ring.getInnerDistance();
-		ubo.ringOuter = ring.getOuterDistance();
+		ubo.ringNormal = vec4(viewNormalMat*params.getRing().getNormal(), 0.0);
 	}
 
 	ubo.cloudDisp = state.getCloudDisp();
-	ubo.nightTexIntensity = params.hasNight()
-		?params.getNight().getIntensity():0.0;
-	ubo.starBrightness = params.isStar()
-		?params.getStar().getBrightness():0.0;
-	ubo.radius = params.getModel().getRadius();
-	ubo.atmoHeight = params.hasAtmo()?params.getAtmo().getMaxHeight():0.0;
-
-	return ubo;
+	ubo.feedbackSlot = -1;
 }
 
 vector<pair<string,uint64_t>> RendererGL::getProfilerTimes()
 {
-	return _profiler.get();
+	return _profilerTimes;
+}
+
+uint64_t RendererGL::getProfilerFrameCount()
+{
+	return _profiler.getReadFrames();
+}
+
+vector<Renderer::ProfilerStats> RendererGL::getProfilerStats()
+{
+	vector<ProfilerStats> result;
+	for (const auto &s : _profiler.getStats())
+		result.push_back({s.name, s.depth, s.last, s.min, s.avg, s.p99});
+	return result;
+}
+
+bool RendererGL::writeProfilerTrace(const string &filename)
+{
+	ofstream out(filename.c_str());
+	if (!out) return false;
+
+	// CPU scopes of the time span of the GPU frames kept
+	out << fixed << setprecision(3);
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	out << "\n  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+		"\"args\": {\"name\": \"roche\"}}";
+	const uint64_t origin = _profiler.getHistoryStart();
+	_profiler.writeTraceEvents(out, origin);
+	CPUProfiler::writeTraceEvents(out, origin);
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+vector<pair<string,double>> RendererGL::getStreamingStats()
+{
+	const DDSStreamer::Stats s = _streamer.getStats();
+	vector<pair<string,double>> stats = {
+		{"Bytes read", (double)s.bytesRead},
+		{"Bytes read per second", s.bytesReadPerSecond},
+		{"Tiles uploaded", (double)s.tilesUploaded},
+		{"Bytes uploaded", (double)s.bytesUploaded},
+		{"Tiles waiting for staging", (double)s.waitingTiles},
+		{"Tiles starved of staging", (double)s.starvedTiles},
+		{"Tiles in loading queues", (double)s.queuedTiles},
+		{"Tiles over upload budget", (double)s.deferredTiles},
+		{"Staging bytes used", (double)s.stagingUsed},
+		{"Staging bytes", (double)s.stagingSize},
+		{"Upload batches in flight", (double)s.batchesInFlight},
+		{"Mean tile latency (ms)", s.meanLatency}
+	};
+	for (int i=0;i<DDSStreamer::LATENCY_BUCKETS;++i)
+	{
+		const string label = (i < DDSStreamer::LATENCY_BUCKETS-1)?
+			"Tiles under " + to_string(1<<i) + "ms":
+			"Tiles over " + to_string(1<<(i-1)) + "ms";
+		stats.push_back({label, (double)s.latencyHistogram[i]});
+	}
+	return stats;
 }
\ No newline at end of file
@@ -10,11 +10,18 @@
 #include "screenshot.hpp"
 #include "shader_pipeline.hpp"
 #include "gui_gl.hpp"
+#include "terrain.hpp"
+#include "mesh.hpp"
 
 #include <vector>
 #include <map>
+#include <set>
+#include <deque>
 #include <memory>
 #include <utility>
+#include <functional>
+#include <array>
+#include <atomic>
 
 /**
  * OpenGL implementation of Renderer
@@ -25,18 +32,66 @@ class RendererGL : public Renderer
 public:
 	RendererGL() = default;
 	void windowHints() override;
+	void initWindow(GLFWwindow *window, int swapInterval) override;
+	void present() override;
 	void init(const InitInfo &info) override;
+	bool loadStep(const LoadingInfo &info) override;
+	void waitFrame() override;
 	void render(const RenderInfo &info) override;
-	void takeScreenshot(const std::string &filename) override;
+	void takeScreenshot(const std::string &filename, int tiles) override;
+	bool isCapturing() override;
+	size_t getPendingScreenshots() override;
+	bool isBusy() override;
+	bool setScreenshotPipe(const std::string &command) override;
 	void destroy() override;
 
 	std::vector<std::pair<std::string,uint64_t>> getProfilerTimes() override;
+	uint64_t getProfilerFrameCount() override;
+	std::vector<ProfilerStats> getProfilerStats() override;
+	LatencyStats getLatencyStats() override;
+	bool writeProfilerTrace(const std::string &filename) override;
+	std::vector<std::pair<std::string,double>> getStreamingStats() override;
 private:
+	/// Window of the context
+	GLFWwindow *_win = nullptr;
+
 	/// Buffer ranges of dynamic data
 	struct DynamicData
 	{
 		BufferRange sceneUBO;
-		std::map<EntityHandle, BufferRange> bodyUBOs;
+		/// UBOs of the bodies drawn this frame, packed by slot
+		BufferRange bodyUBOs;
+		std::vector<BufferRange> minorBodyUBOs;
+		/// Mean anomalies at the reference epoch and radii of each minor body group
+		std::vector<BufferRange> minorBodyAnomalies;
+		/// Reference epoch minorBodyAnomalies were computed at, by group
+		std::vector<double> minorBodyEpochs;
+		/// Texture feedback grids written by body shaders
+		BufferRange feedback;
+		/// Body of each feedback grid
+		std::vector<EntityHandle> feedbackBodies;
+		/// BodyUBOs of the bodies drawn this frame by slot (multi-draw)
+		BufferRange bodySSBO;
+		/// Texture handles of the bodies drawn this frame by slot (multi-draw)
+		BufferRange bodyTexSSBO;
+		/// Indirect commands of body draws (multi-draw)
+		BufferRange bodyCommands;
+		/// Terrain patches of the bodies drawn this frame
+		BufferRange terrainPatches;
+		/// Flare culling parameters
+		BufferRange flareCullUBO;
+		/// Positions of _flareBodies relative to view
+		BufferRange flarePositions;
+		/// Visible flares written by the culling shader
+		BufferRange flareInstances;
+		/// Indirect command drawing flareInstances
+		BufferRange flareCommand;
+		/// Star culling parameters
+		BufferRange starCullUBO;
+		/// Visible catalog stars written by the culling shader
+		BufferRange starInstances;
+		/// Indirect command drawing starInstances
+		BufferRange starCommand;
 	};
 
 	/// Dynamic parameters for the scene to be loaded in a UBO
@@ -58,6 +113,9 @@ private:
 		float logDepthFarPlane;
 		/// C precision balance coefficient for log depth
 		float logDepthC;
+		float padding;
+		/// Fraction of the HDR rendertarget size rendered to
+		glm::vec2 renderScale;
 	};
 
 	/// Dynamic parameters for a single body to be loaded in a UBO
@@ -101,6 +159,93 @@ private:
 		float radius;
 		/// Atmospheric height
 		float atmoHeight;
+		/// Texture feedback grid to write to (-1 for none)
+		int feedbackSlot;
+		/// Height of white areas of the heightmap in body radii
+		float heightScale;
+		/// Index of the first terrain patch of the body this frame
+		uint32_t firstPatch;
+		float padding[2];
+	};
+
+	/// Bindless texture handles of a body, read by shaders with its BodyUBO
+	struct BodyTexHandles
+	{
+		GLuint64 diffuse;
+		GLuint64 cloud;
+		GLuint64 night;
+		GLuint64 specular;
+		GLuint64 atmo;
+		GLuint64 ringOcclusion;
+		/// Residency maps of diffuse, cloud, night and specular
+		GLuint64 residency[4];
+		GLuint64 height;
+		/// Residency map of height
+		GLuint64 heightResidency;
+	};
+
+	/// Dynamic parameters for a group of minor bodies to be loaded in a UBO
+	struct MinorBodyUBO
+	{
+		/// Parent position relative to view
+		glm::vec4 parentPos;
+		/// Parent position in world space
+		glm::vec4 parentWorldPos;
+		/// Mean color of bodies
+		glm::vec4 color;
+		/// Flare size in clip space
+		glm::vec2 flareSize;
+		/// Seconds since the reference epoch of the group
+		float epochOffset;
+		/// Number of bodies in the group
+		uint32_t count;
+	};
+
+	/// Dynamic parameters for flare culling to be loaded in a UBO
+	struct FlareCullUBO
+	{
+		/// World space eye position
+		glm::vec4 viewPos;
+		/// Flare size in clip space at full fade in
+		glm::vec2 flareSize;
+		/// Distance in body radii where flares start to fade in
+		float flareMinDistance;
+		/// Distance in body radii where flares are fully visible
+		float flareOptimalDistance;
+		/// Number of bodies to cull
+		uint32_t count;
+		float padding[3];
+	};
+
+	/// Dynamic parameters for star culling to be loaded in a UBO
+	struct StarCullUBO
+	{
+		/// Star size in clip space of the faintest stars
+		glm::vec2 flareSize;
+		/// Brightness of the faintest stars
+		float intensity;
+		/// Faintest magnitude drawn
+		float magnitudeLimit;
+		/// Number of stars to cull
+		uint32_t count;
+		float padding[3];
+	};
+
+	/// Flare written by the culling shader (std430)
+	struct FlareInstance
+	{
+		/// Center in NDC (xy) and size (zw)
+		glm::vec4 position;
+		glm::vec4 color;
+	};
+
+	/// Orbit of a minor body read by the propagation compute shader (std430)
+	struct MinorBodySSBO
+	{
+		/// Periapsis direction scaled by semi-major axis, w is eccentricity
+		glm::vec4 periapsisEcc;
+		/// Semi-minor axis direction scaled by semi-minor axis, w is mean motion
+		glm::vec4 minorMeanMotion;
 	};
 
 	/// Generates the vertex and index data and fill the static VBOs
@@ -115,14 +260,29 @@ private:
 	void createVertexArray();
 	/// Create FBOs and attachments
 	void createRendertargets();
-	/// Create and load shaders
+	/// (Re)creates the HDR multisampled rendertarget and depth with _msaaSamples
+	void createHdrRendertargets();
+	/// Create and load shaders, compilation isn't waited for
 	void createShaders();
+	/**
+	 * Finishes the pipelines whose compilation is done, without blocking
+	 * @return true once all pipelines are finished
+	 */
+	bool finishShaders();
 	/// Create Screenshot object
 	void createScreenshot();
-	/// Create atmo lookup textures for all entities with atmosphere
+	/// Create atmo lookup textures from the tables generated at startup
 	void createAtmoLookups();
-	/// Create ring textures for all entities with rings
+	/// Create ring textures from the profiles loaded at startup
 	void createRingTextures();
+	/// Load minor body tables into SSBOs
+	void createMinorBodies();
+	/// Loads the star catalog in GPU buffers
+	void createStars();
+	/// Sets the default pipeline state
+	void initState();
+	/// Draws the loading screen to the default framebuffer
+	void renderLoading(const LoadingInfo &info);
 
 	/** Renders opaque parts of detailed entities to HDR rendertarget
 	 * @param closeEntities id of entities to render
@@ -131,13 +291,30 @@ private:
 	void renderHdr(
 		const std::vector<EntityHandle> &closeEntities, 
 		const DynamicData &data);
-	/** Renders flares to HDR rendertarget
-	 * @param flares id of entities to render as flares
-	 * @param buffer ranges to use for rendering
+	/** Culls flares of bodies and writes the visible ones with their count
+	 * @param data buffer ranges to use for culling
 	 */
-	void renderEntityFlares(
-		const std::vector<EntityHandle> &flares,
-		const DynamicData &data);
+	void cullFlares(const DynamicData &data);
+	/** Renders flares culled by cullFlares() to HDR rendertarget
+	 * @param data buffer ranges to use for rendering
+	 */
+	void renderEntityFlares(const DynamicData &data);
+	/** Computes positions of all minor bodies
+	 * @param data buffer ranges to use for computing
+	 */
+	void computeMinorBodies(const DynamicData &data);
+	/** Writes the visible catalog stars as flare instances
+	 * @param data buffer ranges to use for culling
+	 */
+	void cullStars(const DynamicData &data);
+	/** Renders the catalog stars culled by cullStars()
+	 * @param data buffer ranges to use for rendering
+	 */
+	void renderStars(const DynamicData &data);
+	/** Renders minor bodies as flares to HDR rendertarget, one draw per group
+	 * @param data buffer ranges to use for rendering
+	 */
+	void renderMinorBodyFlares(const DynamicData &data);
 	/** Renders translucent parts of detailed entities to HDR rendertarget
 	 * @param translucentEntities id of entities to render
 	 * @param buffer ranges to use for rendering
@@ -157,6 +334,15 @@ private:
 	 * @param data buffer ranges to use for rendering
 	 */
 	void renderBloom(const DynamicData &data);
+	/** Generates all the smaller highpass mipmaps from the HDR rendertarget
+	 * in a single compute dispatch
+	 * @param data buffer ranges to use for rendering
+	 */
+	void computeBloomDownsample(const DynamicData &data);
+	/** Generates bloom rendertarget from highpass mipmaps, with one compute
+	 * dispatch per level doing the upsample, add and blur
+	 */
+	void computeBloomUpsample();
 	/** Tonemaps and resolves HDR rendertarget to screen
 	 * @param data buffer ranges to use for rendering
 	 * @param bloom whether to use bloom or not
@@ -168,6 +354,18 @@ private:
 	void renderSunFlare(const DynamicData &data);
 	/** Renders Gui elements */
 	void renderGui();
+	/// Precomputes parents and subtree ranges of the entity hierarchy
+	void initHierarchy();
+	/// Recomputes the subtree bounding spheres from current positions
+	void refitSubtreeBounds();
+	/** Walks the entity hierarchy, skipping subtrees that need no per-body test
+	 * (their flares are culled on the GPU)
+	 * @param viewPos World space eye position
+	 * @param candidates bodies close enough to be tested one by one
+	 */
+	void cullHierarchy(
+		const glm::dvec3 &viewPos,
+		std::vector<EntityHandle> &candidates);
 	/** Sets the textures of entities to be loaded asynchronouly
 	 * @param entities entities whose textures to load
 	 */
@@ -176,20 +374,81 @@ private:
 	 * @param entities palanets whose textures to unload
 	 */
 	void unloadTextures(const std::vector<EntityHandle> &entities);
+	/** Tells the streamer which side of bodies with loaded textures is seen
+	 * and how big they are on screen
+	 * @param info render info of the frame
+	 */
+	void updateTextureImportance(const RenderInfo &info);
 	/// Sets loaded textures to be uploaded to the GL
 	void uploadLoadedTextures();
+	/** Gives the texture feedback written by the GPU (when this frame's 
+	 * buffers were last used) to the streamer and clears it
+	 * @param data buffer ranges of the current frame
+	 */
+	void readTextureFeedback(DynamicData &data);
+	/** Picks the closest bodies with sparse textures to write feedback
+	 * @param closeEntities rendered entities sorted from front to back
+	 * @param data buffer ranges of the current frame
+	 */
+	void assignFeedbackSlots(
+		const std::vector<EntityHandle> &closeEntities,
+		DynamicData &data);
+
+	/** Returns the resident bindless handle of a texture
+	 * @param tex GL texture, 0 gives a null handle
+	 * @param sampler GL sampler, 0 to use the texture's own sampling state
+	 */
+	GLuint64 getTextureHandle(GLuint tex, GLuint sampler);
 
-	/// Saves the current screen to a file
-	void saveScreenshot();
+	/// Reads the current screen back to a free PBO as a screenshot tile
+	void readScreenTile();
+	/// Gives screenshot tiles done reading back to the Screenshot object
+	void pollScreenReadbacks();
+	/// Adapts the HDR pass resolution and MSAA to the last GPU frame time
+	void updateRenderScale();
 
 	/// Measures time between GL calls
 	GPUProfilerGL _profiler;
 
 	// Screenshot info
-	/// Signals Screenshot object to save
-	bool _takeScreen = false;
-	/// Screenshot filename
-	std::string _screenFilename = "";
+	/// Screenshot requested, tiles are rendered in successive frames
+	struct ScreenCapture
+	{
+		/// Image in the Screenshot object
+		Screenshot::Image image;
+		/// Number of tiles along each side
+		int tiles;
+		/// Next tile to read back, row by row from the bottom left
+		int nextTile;
+	};
+	/// Screenshots requested, the first one being rendered
+	std::deque<ScreenCapture> _screenCaptures;
+	/// PBO a screen tile is read back to
+	struct ScreenReadback
+	{
+		/// PBO of window size
+		GLuint buffer = 0;
+		/// Persistent mapping of the PBO
+		const uint8_t *data = nullptr;
+		/// Signaled when the readback is done
+		Fence fence;
+		/// Whether the fence is pending
+		bool reading = false;
+		/// Whether pixels are in use, until copied by a Screenshot thread
+		std::atomic<bool> busy{false};
+		/// Order of the readback, tiles are given in this order
+		uint64_t sequence = 0;
+		/// Image the tile belongs to
+		Screenshot::Image image = 0;
+		/// Tile position in the image in pixels
+		int x = 0;
+		int y = 0;
+	};
+	/// Number of screen tiles read back at the same time
+	static const int SCREEN_READBACKS = 3;
+	std::array<ScreenReadback, SCREEN_READBACKS> _screenReadbacks;
+	/// Number of screen tiles read back so far
+	uint64_t _screenReadbackCount = 0;
 	/// Preferred GL screenshot format
 	Screenshot::Format _screenBestFormat = Screenshot::Format::RGBA8;
 	/// Preferred GL screenshot format (GL enum)
@@ -199,12 +458,33 @@ private:
 
 	/// Samples per pixel of HDR rendertarget
 	int _msaaSamples = 1;
+	/// Samples per pixel from the settings, never exceeded
+	int _maxMsaaSamples = 1;
 	/// Max texture width/height to be loaded and displayed (-1 means no limit)
 	int _maxTexSize = -1;
 	/// Window width in pixels
 	int _windowWidth = 1;
 	/// Window height in pixels
 	int _windowHeight = 1;
+
+	// Dynamic resolution
+	/// GPU frame time to hold in ms (0 to always render at full resolution)
+	float _targetFrameTime = 0.0;
+	/// Smallest HDR pass resolution scale
+	float _minRenderScale = 0.5;
+	/// Current HDR pass resolution scale
+	float _renderScale = 1.0;
+	/// HDR pass width in pixels, in the bottom left of the rendertargets
+	int _renderWidth = 1;
+	/// HDR pass height in pixels
+	int _renderHeight = 1;
+	/// Consecutive frames asking for less MSAA at the smallest scale
+	int _msaaDownFrames = 0;
+	/// Consecutive frames asking for more MSAA at full scale
+	int _msaaUpFrames = 0;
+	/// GPU times of the last frame measured, by label
+	std::vector<std::pair<std::string,uint64_t>> _profilerTimes;
+
 	/// Far plane distance
 	float _logDepthFarPlane = 5e9;
 	/// Logarithmic depth balance coefficient
@@ -222,26 +502,104 @@ private:
 	/// Distance at which a body's textures will be unloaded
 	float _texUnloadDistance;
 
+	// Terrain
+	/// Selects the patches of close bodies
+	TerrainQuadtree _terrain;
+	/// Selects faces split once, for bodies whose patches don't fit
+	TerrainQuadtree _terrainCoarse;
+	/// Max number of terrain patches drawn in a frame
+	static const int MAX_TERRAIN_PATCHES = 16384;
+	/// Max number of patches selected by _terrainCoarse (6 faces split once)
+	static const int MAX_COARSE_TERRAIN_PATCHES = 24;
+	/// Whether bodies were drawn with coarse patches last frame
+	bool _terrainOverflow = false;
+
 	/// Buffer containing vertex data
 	Buffer _vertexBuffer;
 	/// Buffer containing index data
 	Buffer _indexBuffer;
 	/// Buffer containing UBO data
 	Buffer _uboBuffer;
+	/// Buffer containing minor body orbits and positions
+	Buffer _minorBodyBuffer;
+	/// Buffer containing minor body mean anomalies, by frame
+	Buffer _minorBodyAnomalyBuffer;
+	/// Buffer containing texture feedback grids (read back by the CPU)
+	Buffer _feedbackBuffer;
+	/// Buffer containing BodyUBOs, texture handles and indirect commands
+	Buffer _drawBuffer;
+	/// Buffer containing terrain patches
+	Buffer _terrainBuffer;
+	/// Buffer containing flare colors and culled flares
+	Buffer _flareBodyBuffer;
+	/// Buffer containing flare positions and indirect command
+	Buffer _flareCullBuffer;
+	/// Mean color and radius of _flareBodies
+	BufferRange _flareBodyColors;
+	/// Buffer containing catalog stars and culled stars
+	Buffer _starBuffer;
+	/// Buffer containing star indirect commands
+	Buffer _starCommandBuffer;
+	/// Catalog stars (StarCatalog::Star)
+	BufferRange _stars;
+	/// Number of catalog stars brighter than _starMagnitudeLimit, 0 to
+	/// draw the star map texture instead
+	uint32_t _starCount = 0;
+	/// Bodies whose flares are culled on the GPU (all but stars)
+	std::vector<EntityHandle> _flareBodies;
+	/// Size in bytes between two body UBOs of DynamicData::bodyUBOs
+	uint32_t _bodyUBOStride = 0;
+
+	// Multi-draw
+	/// Whether bodies and flares are drawn with indirect draws and bindless textures
+	bool _multiDraw = false;
+	/// Bindless handles of (texture, sampler) pairs made resident
+	std::map<std::pair<GLuint, GLuint>, GLuint64> _texHandles;
+	/// Streamer generation of _texHandles
+	uint64_t _texHandlesGeneration = 0;
+
+	// Sparse texture feedback
+	/// Whether body shaders write texture feedback
+	bool _sparseFeedback = false;
+
+	/// Splits frame preparation across cores
+	JobSystem *_jobs = nullptr;
+	/// Used when no job system is given, runs jobs on the calling thread
+	JobSystem _serialJobs;
+	/// Max number of bodies writing feedback in a frame
+	static const int FEEDBACK_SLOTS = 8;
+	/// Feedback grid columns (covering u)
+	static const int FEEDBACK_COLUMNS = 128;
+	/// Feedback grid rows (covering v)
+	static const int FEEDBACK_ROWS = 64;
+	/// Default residency map (all levels resident)
+	GLuint _residencyTexDefault = 0;
 	
 	/// Buffer ranges of each frame (multiple buffering)
 	std::vector<DynamicData> _dynamicData;
 	/// Data writing fences of each frame (multiple buffering)
 	std::vector<Fence> _fences;
-
-	/// Vertex Array Object of entities, flares and deferred tris
-	GLuint _vertexArray;
+	/// Time input was sampled for the frame in each slot, 0 once measured
+	std::vector<uint64_t> _frameInputTimes;
+	/// Timestamp queries issued after the last command of the frame in each slot
+	std::vector<GLuint> _frameEndQueries;
+	/// Input to GPU completion latencies of the last frames, in ns
+	std::deque<uint64_t> _latencies;
+	/// Number of frames whose latency has been measured
+	uint64_t _latencyFrames = 0;
+	/// Number of frames kept for latency statistics
+	static const size_t LATENCY_FRAMES = 240;
+	/// Reads the latency of the frame last rendered in the current slot
+	void readFrameLatency();
+
+	/// Vertex Array Objects of entities, flares and deferred tris, by vertex format
+	std::map<VertexFormat, GLuint> _vertexArrays;
 
 	// Rendertargets : 
 	/// Depth stencil attachment of HDR rendertarget
-	GLuint _depthStencilTex;
+	GLuint _depthStencilTex = 0;
 	/// HDR MS rendertarget
-	GLuint _hdrMSRendertarget;
+	GLuint _hdrMSRendertarget = 0;
 	/// Highpass rendertargets (multiple mips)
 	GLuint _highpassRendertargets;
 	/// Bloom rendertargets (multiple mips)
@@ -253,25 +611,36 @@ private:
 	std::vector<GLuint> _highpassViews;
 	/// Texture views to individual bloom rendertarget mipmaps
 	std::vector<GLuint> _bloomViews;
+	/// Whether bloom is made by compute shaders instead of fullscreen passes
+	bool _computeBloom = false;
+	/// Black texture added to the smallest bloom level by the compute path
+	GLuint _bloomBlackTex = 0;
 
 	/// Rendertarget sampler
 	GLuint _rendertargetSampler;
 
 	// FBOs
 	/// HDR FBO
-	GLuint _hdrFBO;
+	GLuint _hdrFBO = 0;
 	/// Highpass FBOs
 	std::vector<GLuint> _highpassFBOs;
 	/// Bloom FBOs
 	std::vector<GLuint> _bloomFBOs;
 
 	// Pipelines
-	/// Body without atmo
-	ShaderPipeline _pipelineBodyBare;
-	/// Body with atmo
-	ShaderPipeline _pipelineBodyAtmo;
-	/// Body with atmo and rings
-	ShaderPipeline _pipelineBodyAtmoRing;
+	/// Features a body shader variant is compiled with, one bit each
+	enum BodyFeature : uint32_t
+	{
+		BODY_ATMO = 1,
+		BODY_RING = 2,
+		BODY_CLOUDS = 4,
+		BODY_NIGHT = 8,
+		BODY_SPECULAR = 16
+	};
+	/// Returns the BodyFeature mask of a body other than a star
+	static uint32_t getBodyFeatures(const EntityParam &param);
+	/// Body shader variants, by feature mask (only the masks of existing bodies)
+	std::map<uint32_t, ShaderPipeline> _bodyPipelines;
 	/// Star map
 	ShaderPipeline _pipelineStarMap;
 	/// Atmosphere
@@ -292,8 +661,24 @@ private:
 	ShaderPipeline _pipelineBlurH;
 	/// Bloom reconstitution
 	ShaderPipeline _pipelineBloomAdd;
+	/// Highpass and downsample chain for compute bloom
+	ShaderPipeline _pipelineBloomDownsample;
+	/// Upsample, add and blur for compute bloom
+	ShaderPipeline _pipelineBloomUpsample;
 	/// Flares
 	ShaderPipeline _pipelineFlare;
+	/// Flares culled on the GPU
+	ShaderPipeline _pipelineCulledFlare;
+	/// Flare culling
+	ShaderPipeline _pipelineFlareCull;
+	/// Catalog star culling
+	ShaderPipeline _pipelineStarCull;
+	/// Sun occlusion
+	ShaderPipeline _pipelineSunOcclusion;
+	/// Minor body flares
+	ShaderPipeline _pipelineMinorBodyFlare;
+	/// Minor body propagation
+	ShaderPipeline _pipelineMinorBodyCompute;
 	/// Tonemap and resolve with bloom
 	ShaderPipeline _pipelineTonemapBloom;
 	/// Tonemap and resolve without bloom
@@ -304,6 +689,8 @@ private:
 	uint32_t _frameId;
 	/// Number of frames to multi-buffer
 	uint32_t _bufferFrames;
+	/// Most frames in flight, fewer than the frames of GPU profiler queries
+	static const uint32_t MAX_FRAMES_IN_FLIGHT = 4;
 
 	const EntityCollection* _entityCollection;
 
@@ -316,6 +703,10 @@ private:
 		DrawCommand ringDraw;
 		/// Whether the textures have been loaded or onot
 		bool texLoaded = false;
+		/// Slot of body in this frame's UBO arrays, -1 if not drawn
+		int uboSlot = -1;
+		/// UBO data, static fields are only set once
+		BodyUBO ubo{};
 
 		/// Diffuse texture
 		DDSStreamer::Handle diffuse{};
@@ -325,6 +716,10 @@ private:
 		DDSStreamer::Handle night{};
 		/// Specular mask texture
 		DDSStreamer::Handle specular{};
+		/// Terrain heightmap
+		DDSStreamer::Handle height{};
+		/// Number of terrain patches drawn this frame
+		uint32_t patchCount = 0;
 
 		/// Atmospheric lookup table GL texture
 		GLuint atmoLookupTable = 0;
@@ -335,15 +730,20 @@ private:
 		BodyData() = default;
 	};
 
-	/** Fills DynamicEntityUBO structure from entity parameters and state
+	/** Fills the fields of a body UBO that don't change between frames
+	 * @param params Fixed entity parameters
+	 * @param ubo UBO data to fill
+	 */
+	void initBodyUBO(const EntityParam &params, BodyUBO &ubo);
+	/** Updates the fields of a body UBO that depend on the view and state
+	 * (called from jobs, no GL calls)
 	 * @param viewPos World space eye position
 	 * @param viewMat View matrix (not accounting translation)
 	 * @param state Dynamic entity state
 	 * @param params Fixed entity parameters
-	 * @param data Entity data for rendering
-	 * @returns UBO data
+	 * @param ubo UBO data to update
 	 */
-	BodyUBO getBodyUBO(
+	void updateBodyUBO(
 		float fovy,
 		float exp,
 		const glm::dvec3 &viewPos,
@@ -351,20 +751,94 @@ private:
 		const glm::mat4 &viewMat,
 		const EntityState &state, 
 		const EntityParam &params, 
-		const BodyData &data);
+		BodyUBO &ubo);
+	/** Returns the offset in the UBO buffer of a body's UBO
+	 * @param data buffer ranges of the current frame
+	 * @param h body drawn this frame
+	 */
+	uint32_t getBodyUBOOffset(const DynamicData &data, const EntityHandle &h);
+
+	/** Returns the handles of the textures sampled by a body's shaders
+	 * @param data body data
+	 */
+	BodyTexHandles getBodyTexHandles(const BodyData &data);
 
-	float getSunVisibility();
+	/** Computes the visible fraction of the sun from the depth of the opaque pass
+	 * @param data buffer ranges to use for computing
+	 */
+	void computeSunOcclusion(const DynamicData &data);
 
 	/// Rendering data for all bodies
 	std::map<EntityHandle, BodyData> _bodyData;
+
+	/// Rendering data of a group of minor bodies
+	struct MinorBodyGroup
+	{
+		/// Entity all bodies orbit
+		EntityHandle parent;
+		/// Mean color of bodies
+		glm::vec3 color;
+		/// Number of bodies
+		uint32_t count = 0;
+		/// Orbits of bodies
+		BufferRange elements;
+		/// Positions relative to parent, written by compute shader
+		BufferRange positions;
+		/// Mean motions (radians per second) of bodies
+		std::vector<double> meanMotions;
+		/// Mean anomalies at epoch 0 of bodies (radians)
+		std::vector<double> m0s;
+		/// Radii of bodies
+		std::vector<float> radii;
+		/// Highest mean motion of bodies
+		double maxMeanMotion = 0.0;
+		/// Epoch the mean anomalies given to the compute shader are reduced
+		/// at, so that it only sees a small time offset in single precision
+		double referenceEpoch = 0.0;
+	};
+	/// Mean anomaly the fastest body of a group moves by before its
+	/// reference epoch is moved (radians)
+	static constexpr double MINOR_BODY_REBASE_ANGLE = 16.0;
+	/// All groups of minor bodies
+	std::vector<MinorBodyGroup> _minorBodyGroups;
 	/// Index of sun in main entity collection
 	EntityHandle _sun;
+	/// Bodies whose textures are loaded
+	std::set<EntityHandle> _texLoadedBodies;
+	/// Bodies with a UBO this frame, by slot
+	std::vector<EntityHandle> _uboEntities;
 
-	GLuint _sunOcclusionQueries[2] = {0, 0};
-	int _occlusionQueryResults[2] = {0, 1};
+	/// Bounding sphere of the bodies of a subtree of the entity hierarchy
+	struct SubtreeBounds
+	{
+		/// World space center
+		glm::dvec3 center;
+		/// Radius, negative if the subtree has no bodies
+		double radius;
+		/// Largest body radius (without rings) of the subtree
+		double maxBodyRadius;
+		/// Whether the subtree contains a star
+		bool hasStar;
+	};
+	/// Subtree bounds by hierarchy index (@see EntityCollection::getHierarchy())
+	std::vector<SubtreeBounds> _subtreeBounds;
+	/// Hierarchy index of the parent of each entity, -1 for roots
+	std::vector<int> _hierarchyParents;
+	/// End of the subtree of each entity in the hierarchy (exclusive)
+	std::vector<int> _subtreeEnd;
+
+	/// Buffer containing the visible fraction of the sun
+	Buffer _sunVisibilityBuffer;
+	BufferRange _sunVisibility;
+	/// Buffer containing the bloom downsample group counter
+	Buffer _bloomCounterBuffer;
+	BufferRange _bloomCounter;
 
 	DDSStreamer::Handle _starMapTexHandle{};
 	float _starMapIntensity = 1.0;
+	/// Packed star catalog, empty to use the star map texture
+	std::string _starCatalogFilename;
+	float _starMagnitudeLimit = 6.5;
 
 	// Textures
 	/// Default diffuse texture
@@ -375,6 +849,8 @@ private:
 	GLuint _nightTexDefault;
 	/// Default specular mask texture
 	GLuint _specularTexDefault;
+	/// Default heightmap (flat)
+	GLuint _heightTexDefault;
 
 	/// Flare texture (white dot)
 	GLuint _flareTex;
@@ -391,8 +867,10 @@ private:
 	float _textureAnisotropy;
 
 	// Meshes
-	/// Sphere draw command (for celestial bodies and atmospheres)
+	/// Sphere draw command (for stars and atmospheres)
 	DrawCommand _sphereDraw;
+	/// Terrain patch grid, drawn once per patch with instancing
+	DrawCommand _patchDraw;
 	/// Flare mesh (Circle)
 	DrawCommand _flareDraw;
 	/// Fullscreen triangle for covering the whole screen
@@ -404,4 +882,34 @@ private:
 	GuiGL _gui;
 	Gui::FontSize _mainFontBig;
 	Gui::FontSize _mainFontMedium;
+	/// Whether the gui can display text (glyph atlas uploaded)
+	bool _guiReady = false;
+
+	// Startup
+	/// Initialization step run on the GL thread
+	struct InitStage
+	{
+		/// Creates resources
+		std::function<void()> function;
+		/// Startup tasks that must be done before
+		std::vector<TaskGraph::Task> tasks;
+		/// Polled before running the stage, until it returns true (optional)
+		std::function<bool()> ready;
+	};
+	/// Pipelines created by createShaders() and not finished yet
+	std::vector<ShaderPipeline*> _compilingPipelines;
+	/// Stages left, run in order by loadStep()
+	std::deque<InitStage> _initStages;
+	/// Total number of stages
+	size_t _initStageCount = 0;
+	/// Runs CPU side initialization work
+	TaskGraph *_startup = nullptr;
+	/// Used when no startup tasks are given
+	TaskGraph _ownStartup;
+	/// Width/height of atmo lookup tables
+	static const int ATMO_LOOKUP_SIZE = 128;
+	/// Atmo lookup tables generated by startup tasks
+	std::map<EntityHandle, std::vector<float>> _atmoTables;
+	/// Ring profiles loaded by startup tasks
+	std::map<EntityHandle, RingProfile> _ringProfiles;
 };
\ No newline at end of file
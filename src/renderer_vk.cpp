@@ -0,0 +1,2802 @@
+#include "renderer_vk.hpp"
+#include "ddsloader.hpp"
+#include "mesh.hpp"
+#include "cpu_profiler.hpp"
+
+#include <GLFW/glfw3.h>
+
+#include <stdexcept>
+#include <cstring>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <array>
+#include <limits>
+#include <functional>
+#include <chrono>
+#include <thread>
+
+#include <glm/gtc/quaternion.hpp>
+#include <glm/gtc/constants.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+using namespace glm;
+using namespace std;
+
+/// Descriptor writes of a set, the infos staying valid until update()
+class DescriptorWritesVK
+{
+public:
+	DescriptorWritesVK(VkDevice device, VkDescriptorSet set) :
+		_device{device}, _set{set} {}
+	void buffer(uint32_t binding, VkDescriptorType type, VkBuffer buffer,
+		VkDeviceSize offset, VkDeviceSize range)
+	{
+		_buffers.push_back({buffer, offset, range});
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = _set;
+		write.dstBinding = binding;
+		write.descriptorCount = 1;
+		write.descriptorType = type;
+		write.pBufferInfo = &_buffers.back();
+		_writes.push_back(write);
+	}
+	void image(uint32_t binding, VkSampler sampler, VkImageView view,
+		VkImageLayout layout=VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL)
+	{
+		_images.push_back({sampler, view, layout});
+		VkWriteDescriptorSet write{};
+		write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		write.dstSet = _set;
+		write.dstBinding = binding;
+		write.descriptorCount = 1;
+		write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		write.pImageInfo = &_images.back();
+		_writes.push_back(write);
+	}
+	void update()
+	{
+		vkUpdateDescriptorSets(_device, _writes.size(), _writes.data(), 0, nullptr);
+	}
+private:
+	VkDevice _device;
+	VkDescriptorSet _set;
+	std::deque<VkDescriptorBufferInfo> _buffers;
+	std::deque<VkDescriptorImageInfo> _images;
+	std::vector<VkWriteDescriptorSet> _writes;
+};
+
+static VkDescriptorSet allocateSetVK(VkDevice device, VkDescriptorPool pool,
+	VkDescriptorSetLayout layout)
+{
+	VkDescriptorSetAllocateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	info.descriptorPool = pool;
+	info.descriptorSetCount = 1;
+	info.pSetLayouts = &layout;
+	VkDescriptorSet set;
+	checkVK(vkAllocateDescriptorSets(device, &info, &set), "descriptor set allocation");
+	return set;
+}
+
+static VkDescriptorPool createDescriptorPoolVK(VkDevice device, const uint32_t sets,
+	const uint32_t uniformBuffers, const uint32_t images, const uint32_t storageBuffers)
+{
+	const VkDescriptorPoolSize sizes[] = {
+		{VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, uniformBuffers},
+		{VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, images},
+		{VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, storageBuffers}};
+	VkDescriptorPoolCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	info.maxSets = sets;
+	info.poolSizeCount = 3;
+	info.pPoolSizes = sizes;
+	VkDescriptorPool pool;
+	checkVK(vkCreateDescriptorPool(device, &info, nullptr, &pool),
+		"descriptor pool creation");
+	return pool;
+}
+
+/// Returns the name of a SPIR-V file, as compiled by cmake/CompileSPIRV.cmake
+static string spirvFilename(const string &shader, const vector<string> &defines={})
+{
+	string filename = "shaders/spirv/" + shader;
+	for (const string &define : defines) filename += "." + define;
+	return filename + ".spv";
+}
+
+/// Sets the vertex input of PackedVertex meshes of a format
+static void setVertexInputVK(PipelineStateVK &state, const VertexFormat format)
+{
+	const bool compact = (format == VertexFormat::COMPACT);
+	state.bindings = {{0, sizeof(PackedVertex), VK_VERTEX_INPUT_RATE_VERTEX}};
+	state.attributes = {
+		{0, 0, compact?VK_FORMAT_R16G16B16A16_SNORM:VK_FORMAT_R16G16B16A16_SFLOAT,
+			(uint32_t)offsetof(PackedVertex, position)},
+		{1, 0, compact?VK_FORMAT_R16G16_UNORM:VK_FORMAT_R16G16_SFLOAT,
+			(uint32_t)offsetof(PackedVertex, uv)},
+		// Normals, octahedral encoded (decoded by the vertex shader)
+		{2, 0, VK_FORMAT_R16G16_SNORM, (uint32_t)offsetof(PackedVertex, normal)}};
+}
+
+static VkDeviceSize alignVK(const VkDeviceSize size, const VkDeviceSize alignment)
+{
+	return (size+alignment-1)/alignment*alignment;
+}
+
+/// Sets a viewport flipped to keep GL's orientation of clip space, and its scissor
+static void setViewportVK(VkCommandBuffer cmd, const uint32_t width, const uint32_t height)
+{
+	const VkViewport viewport{0.f, (float)height, (float)width, -(float)height, 0.f, 1.f};
+	const VkRect2D scissor{{0, 0}, {width, height}};
+	vkCmdSetViewport(cmd, 0, 1, &viewport);
+	vkCmdSetScissor(cmd, 0, 1, &scissor);
+}
+
+void RendererVK::windowHints()
+{
+	glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+}
+
+void RendererVK::initWindow(GLFWwindow *window, int swapInterval)
+{
+	_win = window;
+	_swapInterval = swapInterval;
+	if (!glfwVulkanSupported())
+		throw runtime_error("Vulkan isn't supported on this system");
+	createDevice();
+}
+
+void RendererVK::createDevice()
+{
+	// Instance with the extensions of the window system
+	VkApplicationInfo appInfo{};
+	appInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+	appInfo.pApplicationName = "Roche";
+	appInfo.pEngineName = "Roche";
+	appInfo.apiVersion = VK_API_VERSION_1_2;
+
+	uint32_t windowExtensionCount = 0;
+	const char **windowExtensions = glfwGetRequiredInstanceExtensions(&windowExtensionCount);
+	VkInstanceCreateInfo instanceInfo{};
+	instanceInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+	instanceInfo.pApplicationInfo = &appInfo;
+	instanceInfo.enabledExtensionCount = windowExtensionCount;
+	instanceInfo.ppEnabledExtensionNames = windowExtensions;
+	checkVK(vkCreateInstance(&instanceInfo, nullptr, &_ctx.instance), "instance creation");
+	checkVK(glfwCreateWindowSurface(_ctx.instance, _win, nullptr, &_surface),
+		"window surface creation");
+
+	// Discrete GPUs first, among the ones that can present to the window
+	uint32_t deviceCount = 0;
+	vkEnumeratePhysicalDevices(_ctx.instance, &deviceCount, nullptr);
+	vector<VkPhysicalDevice> devices(deviceCount);
+	vkEnumeratePhysicalDevices(_ctx.instance, &deviceCount, devices.data());
+	int bestScore = -1;
+	for (const VkPhysicalDevice device : devices)
+	{
+		VkPhysicalDeviceProperties properties;
+		vkGetPhysicalDeviceProperties(device, &properties);
+		VkPhysicalDeviceFeatures features;
+		vkGetPhysicalDeviceFeatures(device, &features);
+		if (properties.apiVersion < VK_API_VERSION_1_2 ||
+			!features.tessellationShader || !features.textureCompressionBC)
+			continue;
+
+		uint32_t familyCount = 0;
+		vkGetPhysicalDeviceQueueFamilyProperties(device, &familyCount, nullptr);
+		vector<VkQueueFamilyProperties> families(familyCount);
+		vkGetPhysicalDeviceQueueFamilyProperties(device, &familyCount, families.data());
+		int graphicsFamily = -1;
+		int transferFamily = -1;
+		for (uint32_t i=0;i<familyCount;++i)
+		{
+			const VkQueueFlags flags = families[i].queueFlags;
+			VkBool32 present = VK_FALSE;
+			vkGetPhysicalDeviceSurfaceSupportKHR(device, i, _surface, &present);
+			if (graphicsFamily == -1 && present &&
+				(flags & VK_QUEUE_GRAPHICS_BIT) && (flags & VK_QUEUE_COMPUTE_BIT))
+				graphicsFamily = i;
+			// Dedicated transfer queues run the DMA engines
+			if (transferFamily == -1 && (flags & VK_QUEUE_TRANSFER_BIT) &&
+				!(flags & (VK_QUEUE_GRAPHICS_BIT|VK_QUEUE_COMPUTE_BIT)))
+				transferFamily = i;
+		}
+		if (graphicsFamily == -1) continue;
+
+		const int score =
+			(properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU)?1:0;
+		if (score > bestScore)
+		{
+			bestScore = score;
+			_ctx.physicalDevice = device;
+			_ctx.graphicsFamily = graphicsFamily;
+			_ctx.transferFamily = (transferFamily == -1)?graphicsFamily:transferFamily;
+		}
+	}
+	if (!_ctx.physicalDevice)
+	{
+		throw runtime_error("No Vulkan 1.2 device with tessellation shaders and "
+			"BC textures can present to the window");
+	}
+	vkGetPhysicalDeviceProperties(_ctx.physicalDevice, &_ctx.properties);
+	vkGetPhysicalDeviceMemoryProperties(_ctx.physicalDevice, &_ctx.memoryProperties);
+
+	// Extensions
+	uint32_t extensionCount = 0;
+	vkEnumerateDeviceExtensionProperties(_ctx.physicalDevice, nullptr,
+		&extensionCount, nullptr);
+	vector<VkExtensionProperties> available(extensionCount);
+	vkEnumerateDeviceExtensionProperties(_ctx.physicalDevice, nullptr,
+		&extensionCount, available.data());
+	auto hasExtension = [&](const char *name){
+		return any_of(available.begin(), available.end(),
+			[name](const VkExtensionProperties &e){
+				return strcmp(e.extensionName, name) == 0;});
+	};
+	vector<const char*> extensions = {VK_KHR_SWAPCHAIN_EXTENSION_NAME};
+	_ctx.calibratedTimestamps = hasExtension(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+	if (_ctx.calibratedTimestamps)
+		extensions.push_back(VK_EXT_CALIBRATED_TIMESTAMPS_EXTENSION_NAME);
+
+	// Features, timeline semaphores are core in 1.2
+	VkPhysicalDeviceFeatures supported;
+	vkGetPhysicalDeviceFeatures(_ctx.physicalDevice, &supported);
+	_ctx.features = VkPhysicalDeviceFeatures{};
+	_ctx.features.tessellationShader = VK_TRUE;
+	_ctx.features.textureCompressionBC = VK_TRUE;
+	_ctx.features.samplerAnisotropy = supported.samplerAnisotropy;
+	_ctx.features.fillModeNonSolid = supported.fillModeNonSolid;
+	VkPhysicalDeviceVulkan12Features features12{};
+	features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	features12.timelineSemaphore = VK_TRUE;
+
+	const float priority = 1.f;
+	vector<VkDeviceQueueCreateInfo> queueInfos;
+	for (const uint32_t family : {_ctx.graphicsFamily, _ctx.transferFamily})
+	{
+		if (!queueInfos.empty() && queueInfos.back().queueFamilyIndex == family) break;
+		VkDeviceQueueCreateInfo queueInfo{};
+		queueInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		queueInfo.queueFamilyIndex = family;
+		queueInfo.queueCount = 1;
+		queueInfo.pQueuePriorities = &priority;
+		queueInfos.push_back(queueInfo);
+	}
+
+	VkDeviceCreateInfo deviceInfo{};
+	deviceInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+	deviceInfo.pNext = &features12;
+	deviceInfo.queueCreateInfoCount = queueInfos.size();
+	deviceInfo.pQueueCreateInfos = queueInfos.data();
+	deviceInfo.enabledExtensionCount = extensions.size();
+	deviceInfo.ppEnabledExtensionNames = extensions.data();
+	deviceInfo.pEnabledFeatures = &_ctx.features;
+	checkVK(vkCreateDevice(_ctx.physicalDevice, &deviceInfo, nullptr, &_ctx.device),
+		"device creation");
+	vkGetDeviceQueue(_ctx.device, _ctx.graphicsFamily, 0, &_ctx.graphicsQueue);
+	vkGetDeviceQueue(_ctx.device, _ctx.transferFamily, 0, &_ctx.transferQueue);
+
+	// sRGB swapchain, the tonemap output is linear like with the GL framebuffer
+	uint32_t formatCount = 0;
+	vkGetPhysicalDeviceSurfaceFormatsKHR(_ctx.physicalDevice, _surface,
+		&formatCount, nullptr);
+	vector<VkSurfaceFormatKHR> formats(formatCount);
+	vkGetPhysicalDeviceSurfaceFormatsKHR(_ctx.physicalDevice, _surface,
+		&formatCount, formats.data());
+	auto it = find_if(formats.begin(), formats.end(), [](const VkSurfaceFormatKHR &f){
+		return f.format == VK_FORMAT_B8G8R8A8_SRGB || f.format == VK_FORMAT_R8G8B8A8_SRGB;});
+	if (it == formats.end())
+		throw runtime_error("The window surface has no 8 bit sRGB format");
+	_swapchainFormat = it->format;
+	_screenFormat = (_swapchainFormat == VK_FORMAT_B8G8R8A8_SRGB)?
+		Screenshot::Format::BGRA8:Screenshot::Format::RGBA8;
+}
+
+void RendererVK::createSwapchain()
+{
+	VkSurfaceCapabilitiesKHR caps;
+	checkVK(vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_ctx.physicalDevice,
+		_surface, &caps), "surface capabilities query");
+	// Minimized window, nothing can be presented until it is restored
+	while (caps.currentExtent.width == 0 || caps.currentExtent.height == 0)
+	{
+		glfwWaitEvents();
+		vkGetPhysicalDeviceSurfaceCapabilitiesKHR(_ctx.physicalDevice, _surface, &caps);
+	}
+	_swapchainExtent = caps.currentExtent;
+	if (_swapchainExtent.width == numeric_limits<uint32_t>::max())
+	{
+		_swapchainExtent.width = glm::clamp((uint32_t)_windowWidth,
+			caps.minImageExtent.width, caps.maxImageExtent.width);
+		_swapchainExtent.height = glm::clamp((uint32_t)_windowHeight,
+			caps.minImageExtent.height, caps.maxImageExtent.height);
+	}
+
+	// FIFO waits for vertical syncs, the others don't
+	uint32_t modeCount = 0;
+	vkGetPhysicalDeviceSurfacePresentModesKHR(_ctx.physicalDevice, _surface,
+		&modeCount, nullptr);
+	vector<VkPresentModeKHR> modes(modeCount);
+	vkGetPhysicalDeviceSurfacePresentModesKHR(_ctx.physicalDevice, _surface,
+		&modeCount, modes.data());
+	VkPresentModeKHR presentMode = VK_PRESENT_MODE_FIFO_KHR;
+	if (_swapInterval == 0)
+	{
+		for (const VkPresentModeKHR mode :
+			{VK_PRESENT_MODE_MAILBOX_KHR, VK_PRESENT_MODE_IMMEDIATE_KHR})
+		{
+			if (find(modes.begin(), modes.end(), mode) != modes.end())
+			{
+				presentMode = mode;
+				break;
+			}
+		}
+	}
+
+	uint32_t imageCount = caps.minImageCount+1;
+	if (caps.maxImageCount > 0) imageCount = std::min(imageCount, caps.maxImageCount);
+
+	// Screenshots copy the swapchain images
+	_swapchainReadable = caps.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+	VkSwapchainCreateInfoKHR info{};
+	info.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+	info.surface = _surface;
+	info.minImageCount = imageCount;
+	info.imageFormat = _swapchainFormat;
+	info.imageColorSpace = VK_COLOR_SPACE_SRGB_NONLINEAR_KHR;
+	info.imageExtent = _swapchainExtent;
+	info.imageArrayLayers = 1;
+	info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT|
+		(_swapchainReadable?VK_IMAGE_USAGE_TRANSFER_SRC_BIT:0);
+	info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	info.preTransform = caps.currentTransform;
+	info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+	info.presentMode = presentMode;
+	info.clipped = VK_TRUE;
+	checkVK(vkCreateSwapchainKHR(_ctx.device, &info, nullptr, &_swapchain),
+		"swapchain creation");
+
+	vkGetSwapchainImagesKHR(_ctx.device, _swapchain, &imageCount, nullptr);
+	_swapchainImages.resize(imageCount);
+	vkGetSwapchainImagesKHR(_ctx.device, _swapchain, &imageCount, _swapchainImages.data());
+
+	for (const VkImage image : _swapchainImages)
+	{
+		VkImageViewCreateInfo viewInfo{};
+		viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+		viewInfo.image = image;
+		viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+		viewInfo.format = _swapchainFormat;
+		viewInfo.subresourceRange = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1};
+		VkImageView view;
+		checkVK(vkCreateImageView(_ctx.device, &viewInfo, nullptr, &view),
+			"swapchain image view creation");
+		_swapchainViews.push_back(view);
+
+		VkFramebufferCreateInfo framebufferInfo{};
+		framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+		framebufferInfo.renderPass = _postPass;
+		framebufferInfo.attachmentCount = 1;
+		framebufferInfo.pAttachments = &view;
+		framebufferInfo.width = _swapchainExtent.width;
+		framebufferInfo.height = _swapchainExtent.height;
+		framebufferInfo.layers = 1;
+		VkFramebuffer framebuffer;
+		checkVK(vkCreateFramebuffer(_ctx.device, &framebufferInfo, nullptr, &framebuffer),
+			"swapchain framebuffer creation");
+		_swapchainFramebuffers.push_back(framebuffer);
+
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		VkSemaphore semaphore;
+		checkVK(vkCreateSemaphore(_ctx.device, &semaphoreInfo, nullptr, &semaphore),
+			"semaphore creation");
+		_renderFinished.push_back(semaphore);
+	}
+	_swapchainOutdated = false;
+}
+
+void RendererVK::destroySwapchain()
+{
+	for (const VkFramebuffer framebuffer : _swapchainFramebuffers)
+		vkDestroyFramebuffer(_ctx.device, framebuffer, nullptr);
+	for (const VkImageView view : _swapchainViews)
+		vkDestroyImageView(_ctx.device, view, nullptr);
+	for (const VkSemaphore semaphore : _renderFinished)
+		vkDestroySemaphore(_ctx.device, semaphore, nullptr);
+	if (_swapchain) vkDestroySwapchainKHR(_ctx.device, _swapchain, nullptr);
+	_swapchainFramebuffers.clear();
+	_swapchainViews.clear();
+	_renderFinished.clear();
+	_swapchainImages.clear();
+	_swapchain = VK_NULL_HANDLE;
+}
+
+void RendererVK::createRenderPasses()
+{
+	const VkFormat hdrFormat = VK_FORMAT_R16G16B16A16_SFLOAT;
+	const VkFormat depthFormat = VK_FORMAT_D32_SFLOAT;
+
+	auto createPass = [this](
+		const vector<VkAttachmentDescription> &attachments,
+		const VkImageLayout depthLayout,
+		const vector<VkSubpassDependency> &dependencies)
+	{
+		const VkAttachmentReference colorRef{0, VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL};
+		const VkAttachmentReference depthRef{1, depthLayout};
+		VkSubpassDescription subpass{};
+		subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
+		subpass.colorAttachmentCount = 1;
+		subpass.pColorAttachments = &colorRef;
+		subpass.pDepthStencilAttachment = (attachments.size() > 1)?&depthRef:nullptr;
+
+		VkRenderPassCreateInfo info{};
+		info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
+		info.attachmentCount = attachments.size();
+		info.pAttachments = attachments.data();
+		info.subpassCount = 1;
+		info.pSubpasses = &subpass;
+		info.dependencyCount = dependencies.size();
+		info.pDependencies = dependencies.data();
+		VkRenderPass pass;
+		checkVK(vkCreateRenderPass(_ctx.device, &info, nullptr, &pass),
+			"render pass creation");
+		return pass;
+	};
+
+	VkAttachmentDescription color{};
+	color.format = hdrFormat;
+	color.samples = _msaaSamples;
+	color.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	color.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	VkAttachmentDescription depth = color;
+	depth.format = depthFormat;
+
+	// Opaque: cleared, depth read by the sun occlusion and the translucent pass
+	color.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	color.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	color.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	color.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	depth.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	depth.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	depth.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	depth.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	const VkPipelineStageFlags attachmentStages =
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT|
+		VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT|
+		VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+	const VkAccessFlags attachmentAccess =
+		VK_ACCESS_COLOR_ATTACHMENT_READ_BIT|VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT|
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT|
+		VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+	_opaquePass = createPass({color, depth},
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL, {
+		// Previous frame's tonemap and sun occlusion are done reading
+		{VK_SUBPASS_EXTERNAL, 0,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT|VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT|
+			attachmentStages, attachmentStages,
+			0, attachmentAccess, 0},
+		{0, VK_SUBPASS_EXTERNAL,
+			attachmentStages, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT|attachmentStages,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT|VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT,
+			VK_ACCESS_SHADER_READ_BIT|attachmentAccess, 0}});
+
+	// Translucent: blended on the opaque pass, color read by the tonemap
+	color.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	color.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+	color.finalLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	depth.loadOp = VK_ATTACHMENT_LOAD_OP_LOAD;
+	depth.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	depth.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	depth.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+	_translucentPass = createPass({color, depth},
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL, {
+		{VK_SUBPASS_EXTERNAL, 0,
+			attachmentStages, attachmentStages,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, attachmentAccess, 0},
+		{0, VK_SUBPASS_EXTERNAL,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+			VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, VK_ACCESS_SHADER_READ_BIT, 0}});
+
+	// Post: cleared swapchain image, waited for by the acquire semaphore
+	VkAttachmentDescription swapchain{};
+	swapchain.format = _swapchainFormat;
+	swapchain.samples = VK_SAMPLE_COUNT_1_BIT;
+	swapchain.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+	swapchain.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+	swapchain.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+	swapchain.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+	swapchain.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	swapchain.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	_postPass = createPass({swapchain},
+		VK_IMAGE_LAYOUT_UNDEFINED, {
+		{VK_SUBPASS_EXTERNAL, 0,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT,
+			0, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT, 0}});
+}
+
+void RendererVK::createSlots()
+{
+	const VkDevice device = _ctx.device;
+
+	// Dynamic buffer of a slot: scene UBO, body UBOs, terrain patches, flares
+	const VkDeviceSize uboAlignment = _ctx.properties.limits.minUniformBufferOffsetAlignment;
+	const VkDeviceSize alignment = std::max(uboAlignment,
+		_ctx.properties.limits.minStorageBufferOffsetAlignment);
+	_bodyUBOStride = alignVK(sizeof(BodyUBO), uboAlignment);
+	_sceneUBOOffset = 0;
+	_bodyUBOsOffset = alignVK(sizeof(SceneUBO), alignment);
+	_patchesOffset = alignVK(_bodyUBOsOffset+
+		_entityCollection->getBodies().size()*_bodyUBOStride, alignment);
+	_flaresOffset = alignVK(_patchesOffset+
+		MAX_TERRAIN_PATCHES*sizeof(TerrainPatch), alignment);
+	const VkDeviceSize size = _flaresOffset+
+		std::max<size_t>(_flareBodies.size(), 1)*sizeof(FlareInstance);
+
+	_slots.resize(_bufferFrames);
+	for (FrameSlot &slot : _slots)
+	{
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		poolInfo.queueFamilyIndex = _ctx.graphicsFamily;
+		checkVK(vkCreateCommandPool(device, &poolInfo, nullptr, &slot.pool),
+			"frame command pool creation");
+		VkCommandBufferAllocateInfo allocInfo{};
+		allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		allocInfo.commandPool = slot.pool;
+		allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		allocInfo.commandBufferCount = 1;
+		checkVK(vkAllocateCommandBuffers(device, &allocInfo, &slot.cmd),
+			"frame command buffer allocation");
+
+		// Sun occlusion set
+		slot.descriptorPool = createDescriptorPoolVK(device, 1, 2, 1, 1);
+
+		// Signaled so that the first wait on each slot returns
+		VkFenceCreateInfo fenceInfo{};
+		fenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+		checkVK(vkCreateFence(device, &fenceInfo, nullptr, &slot.fence),
+			"frame fence creation");
+		VkSemaphoreCreateInfo semaphoreInfo{};
+		semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+		checkVK(vkCreateSemaphore(device, &semaphoreInfo, nullptr, &slot.imageAvailable),
+			"semaphore creation");
+
+		slot.dynamic = BufferVK(_ctx, size,
+			VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT|VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	}
+}
+
+void RendererVK::createJobSlots(const size_t jobs)
+{
+	const VkDevice device = _ctx.device;
+	while (_jobSlots.size() < jobs)
+	{
+		vector<JobSlot> slots(_bufferFrames);
+		for (JobSlot &slot : slots)
+		{
+			VkCommandPoolCreateInfo poolInfo{};
+			poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+			poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+			poolInfo.queueFamilyIndex = _ctx.graphicsFamily;
+			checkVK(vkCreateCommandPool(device, &poolInfo, nullptr, &slot.pool),
+				"job command pool creation");
+			VkCommandBufferAllocateInfo allocInfo{};
+			allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+			allocInfo.commandPool = slot.pool;
+			allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+			allocInfo.commandBufferCount = 1;
+			checkVK(vkAllocateCommandBuffers(device, &allocInfo, &slot.cmd),
+				"job command buffer allocation");
+			// One set per body, for opaque or translucent parts
+			slot.descriptorPool = createDescriptorPoolVK(device,
+				JOB_BODIES, JOB_BODIES*2, JOB_BODIES*7, JOB_BODIES);
+		}
+		_jobSlots.push_back(std::move(slots));
+	}
+}
+
+void RendererVK::createMeshes()
+{
+	// Flare
+	const int detail = 8;
+	auto flareMesh = generateFlareMesh(detail);
+
+	// Sphere
+	const int entityMeridians = 32;
+	const int entityRings = 32;
+	auto sphereMesh = generateSphere(entityMeridians, entityRings);
+
+	// Terrain patch
+	const int patchGridSize = 4;
+	auto patchMesh = generateGrid(patchGridSize);
+
+	// All meshes in the same buffers, drawn at their vertex offset
+	vector<PackedVertex> vertices;
+	vector<Index> indices;
+	auto add = [&](const Mesh &mesh)
+	{
+		DrawVK draw;
+		draw.vertexOffset = vertices.size()*sizeof(PackedVertex);
+		draw.firstIndex = indices.size();
+		draw.indexCount = mesh.getIndices().size();
+		const vector<PackedVertex> packed = mesh.getPackedVertices();
+		vertices.insert(vertices.end(), packed.begin(), packed.end());
+		indices.insert(indices.end(), mesh.getIndices().begin(), mesh.getIndices().end());
+		return draw;
+	};
+
+	_flareDraw = add(flareMesh);
+	_sphereDraw = add(sphereMesh);
+	_patchDraw = add(patchMesh);
+
+	// Ring models
+	for (const auto &h: _entityCollection->getBodies())
+	{
+		const EntityParam param = h.getParam();
+		if (param.hasRing())
+		{
+			const float near = param.getRing().getInnerDistance();
+			const float far = param.getRing().getOuterDistance();
+			const int ringMeridians = 32;
+			_bodyData[h].ringDraw = add(generateRingMesh(ringMeridians, near, far));
+		}
+	}
+
+	const VkMemoryPropertyFlags deviceLocal = VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
+	_vertexBuffer = BufferVK(_ctx, vertices.size()*sizeof(PackedVertex),
+		VK_BUFFER_USAGE_VERTEX_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, deviceLocal);
+	_vertexBuffer.write(0, vertices.size()*sizeof(PackedVertex), vertices.data());
+	_indexBuffer = BufferVK(_ctx, indices.size()*sizeof(Index),
+		VK_BUFFER_USAGE_INDEX_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT, deviceLocal);
+	_indexBuffer.write(0, indices.size()*sizeof(Index), indices.data());
+}
+
+void RendererVK::createBuffers()
+{
+	// Sun visibility, only accessed by shaders
+	const float sunVisibility = 1.0;
+	_sunVisibilityBuffer = BufferVK(_ctx, sizeof(float),
+		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT|VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	_sunVisibilityBuffer.write(0, sizeof(float), &sunVisibility);
+}
+
+void RendererVK::createRendertargets()
+{
+	ImageVK::Info info{};
+	info.width = _windowWidth;
+	info.height = _windowHeight;
+	info.samples = _msaaSamples;
+
+	// Resolved by the tonemap
+	info.format = VK_FORMAT_R16G16B16A16_SFLOAT;
+	info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT|VK_IMAGE_USAGE_SAMPLED_BIT;
+	_hdrRendertarget = ImageVK(_ctx, info);
+
+	// Sampled by the sun occlusion
+	info.format = VK_FORMAT_D32_SFLOAT;
+	info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT|VK_IMAGE_USAGE_SAMPLED_BIT;
+	info.aspect = VK_IMAGE_ASPECT_DEPTH_BIT;
+	_depthRendertarget = ImageVK(_ctx, info);
+
+	const VkImageView attachments[] = {
+		_hdrRendertarget.getView(), _depthRendertarget.getView()};
+	VkFramebufferCreateInfo framebufferInfo{};
+	framebufferInfo.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
+	framebufferInfo.renderPass = _opaquePass;
+	framebufferInfo.attachmentCount = 2;
+	framebufferInfo.pAttachments = attachments;
+	framebufferInfo.width = _windowWidth;
+	framebufferInfo.height = _windowHeight;
+	framebufferInfo.layers = 1;
+	checkVK(vkCreateFramebuffer(_ctx.device, &framebufferInfo, nullptr, &_hdrFramebuffer),
+		"HDR framebuffer creation");
+
+	// Rendertarget sampler
+	_rendertargetSampler = createSamplerVK(_ctx, false);
+}
+
+void RendererVK::createTextures()
+{
+	// Default textures
+	auto create1PixTex = [this](const array<uint8_t, 4> pixColor,
+		const VkImageViewType viewType)
+	{
+		ImageVK::Info info{};
+		info.viewType = viewType;
+		info.format = VK_FORMAT_R8G8B8A8_UNORM;
+		info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		ImageVK image(_ctx, info);
+		image.upload(pixColor.data(), 4, false, {4});
+		return image;
+	};
+	_diffuseTexDefault = create1PixTex({0,0,0,255}, VK_IMAGE_VIEW_TYPE_2D);
+	_blackTexDefault = create1PixTex({0,0,0,0}, VK_IMAGE_VIEW_TYPE_2D);
+	_ringTexDefault = create1PixTex({0,0,0,0}, VK_IMAGE_VIEW_TYPE_1D);
+
+	// Samplers
+	const float requestedAnisotropy = 16.f;
+	_bodyTexSampler = createSamplerVK(_ctx, true,
+		VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+		std::min(requestedAnisotropy, _ctx.properties.limits.maxSamplerAnisotropy));
+	_atmoSampler = createSamplerVK(_ctx, true,
+		VK_SAMPLER_ADDRESS_MODE_MIRRORED_REPEAT, VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE);
+	_ringSampler = createSamplerVK(_ctx, true);
+}
+
+void RendererVK::createFlare()
+{
+	DDSLoader flareFile("tex/star_glow.DDS");
+	const int mips = flareFile.getMipmapCount();
+
+	// Levels one after the other
+	vector<uint8_t> data;
+	vector<VkDeviceSize> levelSizes;
+	for (int i=0;i<mips;++i)
+	{
+		const vector<uint8_t> level = flareFile.getImageData(i);
+		data.insert(data.end(), level.begin(), level.end());
+		levelSizes.push_back(flareFile.getImageSize(i));
+	}
+
+	ImageVK::Info info{};
+	info.format = DDSFormatToVK(flareFile.getFormat());
+	info.width = flareFile.getWidth(0);
+	info.height = flareFile.getHeight(0);
+	info.levels = mips;
+	info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	_flareTex = ImageVK(_ctx, info);
+	_flareTex.upload(data.data(), data.size(), false, levelSizes);
+	_flareSampler = createSamplerVK(_ctx, true,
+		VK_SAMPLER_ADDRESS_MODE_REPEAT, VK_SAMPLER_ADDRESS_MODE_REPEAT);
+}
+
+void RendererVK::createLayouts()
+{
+	const VkDevice device = _ctx.device;
+	const VkDescriptorType ubo = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	const VkDescriptorType tex = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	const VkDescriptorType ssbo = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+
+	auto create = [device](const vector<pair<uint32_t, VkDescriptorType>> &bindings,
+		const VkShaderStageFlags stages)
+	{
+		vector<VkDescriptorSetLayoutBinding> layoutBindings;
+		for (const auto &b : bindings)
+		{
+			VkDescriptorSetLayoutBinding binding{};
+			binding.binding = b.first;
+			binding.descriptorType = b.second;
+			binding.descriptorCount = 1;
+			binding.stageFlags = stages;
+			layoutBindings.push_back(binding);
+		}
+		LayoutVK layout;
+		VkDescriptorSetLayoutCreateInfo setInfo{};
+		setInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+		setInfo.bindingCount = layoutBindings.size();
+		setInfo.pBindings = layoutBindings.data();
+		checkVK(vkCreateDescriptorSetLayout(device, &setInfo, nullptr, &layout.set),
+			"descriptor set layout creation");
+		VkPipelineLayoutCreateInfo pipelineInfo{};
+		pipelineInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+		pipelineInfo.setLayoutCount = 1;
+		pipelineInfo.pSetLayouts = &layout.set;
+		checkVK(vkCreatePipelineLayout(device, &pipelineInfo, nullptr, &layout.pipeline),
+			"pipeline layout creation");
+		return layout;
+	};
+
+	// Same bindings as the GL renderer, except where buffers and samplers
+	// shared a binding number
+	const VkShaderStageFlags graphics = VK_SHADER_STAGE_ALL_GRAPHICS;
+	_bodyLayout = create({{0, ubo}, {1, ubo}, {2, tex}, {3, tex}, {4, tex},
+		{5, tex}, {6, tex}, {7, tex}, {12, tex}, {13, ssbo}}, graphics);
+	_starMapLayout = create({{0, ubo}, {1, tex}}, graphics);
+	_translucentLayout = create({{0, ubo}, {1, ubo}, {2, tex}, {3, tex}, {4, tex}},
+		graphics);
+	_flareLayout = create({{1, tex}, {2, ssbo}}, graphics);
+	_sunFlareLayout = create({{0, ubo}, {1, tex}, {3, ssbo}}, graphics);
+	_tonemapLayout = create({{0, ubo}, {1, tex}, {2, tex}}, graphics);
+	_sunOcclusionLayout = create({{0, ubo}, {1, ubo}, {2, tex}, {3, ssbo}},
+		VK_SHADER_STAGE_COMPUTE_BIT);
+}
+
+void RendererVK::createPipelines()
+{
+	const VkDevice device = _ctx.device;
+
+	// Line variants for wireframe, if the device can draw them
+	auto create = [&](PipelineStateVK state, const LayoutVK &layout,
+		const VkRenderPass renderPass)
+	{
+		PipelineVK pipeline;
+		pipeline.fill = createPipelineVK(device, state, layout.pipeline, renderPass);
+		if (_ctx.features.fillModeNonSolid)
+		{
+			state.polygonMode = VK_POLYGON_MODE_LINE;
+			pipeline.line = createPipelineVK(device, state, layout.pipeline, renderPass);
+		}
+		return pipeline;
+	};
+
+	// Quad patches on the HDR rendertarget, same defines for all stages
+	auto patches = [&](const vector<pair<VkShaderStageFlagBits, string>> &shaders,
+		const vector<string> &defines, const VertexFormat format)
+	{
+		PipelineStateVK state{};
+		for (const auto &shader : shaders)
+			state.shaders.push_back({shader.first, spirvFilename(shader.second, defines)});
+		setVertexInputVK(state, format);
+		state.topology = VK_PRIMITIVE_TOPOLOGY_PATCH_LIST;
+		state.patchControlPoints = 4;
+		state.cullMode = VK_CULL_MODE_BACK_BIT;
+		state.samples = _msaaSamples;
+		state.depthTest = true;
+		return state;
+	};
+
+	const auto vert = VK_SHADER_STAGE_VERTEX_BIT;
+	const auto tesc = VK_SHADER_STAGE_TESSELLATION_CONTROL_BIT;
+	const auto tese = VK_SHADER_STAGE_TESSELLATION_EVALUATION_BIT;
+	const auto frag = VK_SHADER_STAGE_FRAGMENT_BIT;
+	const vector<pair<VkShaderStageFlagBits, string>> bodyShaders = {
+		{vert, "body.vert"}, {tesc, "body.tesc"}, {tese, "body.tese"}, {frag, "body.frag"}};
+
+	// One variant per combination of features found among the bodies
+	_bodyPipelines.clear();
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const EntityParam &param = h.getParam();
+		if (param.isStar()) continue;
+		const uint32_t features = getBodyFeatures(param);
+		if (_bodyPipelines.count(features)) continue;
+
+		vector<string> defines = {"IS_TERRAIN"};
+		if (features & BODY_ATMO) defines.push_back("HAS_ATMO");
+		if (features & BODY_RING) defines.push_back("HAS_RING");
+		if (features & BODY_CLOUDS) defines.push_back("HAS_CLOUDS");
+		if (features & BODY_NIGHT) defines.push_back("HAS_NIGHT");
+		if (features & BODY_SPECULAR) defines.push_back("HAS_SPECULAR");
+		PipelineStateVK state = patches(bodyShaders, defines, VertexFormat::COMPACT);
+		state.depthWrite = true;
+		_bodyPipelines[features] = create(state, _bodyLayout, _opaquePass);
+	}
+
+	PipelineStateVK sun = patches(bodyShaders, {"IS_STAR"}, VertexFormat::COMPACT);
+	sun.depthWrite = true;
+	_pipelineSun = create(sun, _bodyLayout, _opaquePass);
+
+	// Star map, depth tested only
+	_pipelineStarMap = create(patches({{vert, "starmap.vert"}, {tesc, "starmap.tesc"},
+		{tese, "starmap.tese"}, {frag, "starmap.frag"}}, {}, VertexFormat::COMPACT),
+		_starMapLayout, _opaquePass);
+
+	// Atmospheres and rings, blended on the opaque objects
+	auto translucent = [&](const string &fragShader, const string &define,
+		const VertexFormat format)
+	{
+		PipelineStateVK state = patches({{vert, "body.vert"}, {tesc, "body.tesc"},
+			{tese, "body.tese"}, {frag, fragShader}}, {define}, format);
+		state.blend = true;
+		state.srcFactor = VK_BLEND_FACTOR_ONE;
+		state.dstFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+		return create(state, _translucentLayout, _translucentPass);
+	};
+	_pipelineAtmo = translucent("atmo.frag", "IS_ATMO", VertexFormat::COMPACT);
+	_pipelineRingFar = translucent("ring.frag", "IS_FAR_RING", VertexFormat::HALF);
+	_pipelineRingNear = translucent("ring.frag", "IS_NEAR_RING", VertexFormat::HALF);
+
+	// Flares, blending add
+	PipelineStateVK flare{};
+	flare.shaders = {
+		{vert, spirvFilename("flare.vert", {"IS_CULLED_FLARE"})},
+		{frag, spirvFilename("flare.frag", {"IS_CULLED_FLARE"})}};
+	setVertexInputVK(flare, VertexFormat::COMPACT);
+	flare.samples = _msaaSamples;
+	flare.depthTest = true;
+	flare.blend = true;
+	flare.srcFactor = VK_BLEND_FACTOR_ONE;
+	flare.dstFactor = VK_BLEND_FACTOR_ONE;
+	_pipelineCulledFlare = create(flare, _flareLayout, _translucentPass);
+
+	// Sun flare on top of the tonemapped image
+	flare.shaders = {
+		{vert, spirvFilename("flare.vert")},
+		{frag, spirvFilename("flare.frag")}};
+	flare.samples = VK_SAMPLE_COUNT_1_BIT;
+	flare.depthTest = false;
+	_pipelineFlare = createPipelineVK(device, flare, _sunFlareLayout.pipeline, _postPass);
+
+	// Tonemap, fullscreen triangle without vertex data
+	PipelineStateVK tonemap{};
+	tonemap.shaders = {
+		{vert, spirvFilename("deferred.vert")},
+		{frag, spirvFilename("tonemap.frag")}};
+	_pipelineTonemap = createPipelineVK(device, tonemap, _tonemapLayout.pipeline, _postPass);
+
+	// Sun occlusion
+	VkComputePipelineCreateInfo computeInfo{};
+	computeInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+	computeInfo.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+	computeInfo.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+	computeInfo.stage.module = loadShaderModuleVK(device,
+		spirvFilename("sun_occlusion.comp"));
+	computeInfo.stage.pName = "main";
+	computeInfo.layout = _sunOcclusionLayout.pipeline;
+	const VkResult result = vkCreateComputePipelines(device, VK_NULL_HANDLE, 1,
+		&computeInfo, nullptr, &_pipelineSunOcclusion);
+	vkDestroyShaderModule(device, computeInfo.stage.module, nullptr);
+	checkVK(result, "sun occlusion pipeline creation");
+}
+
+uint32_t RendererVK::getBodyFeatures(const EntityParam &param)
+{
+	uint32_t features = 0;
+	if (param.hasAtmo()) features |= BODY_ATMO;
+	if (param.hasRing()) features |= BODY_RING;
+	if (param.hasClouds()) features |= BODY_CLOUDS;
+	if (param.hasNight()) features |= BODY_NIGHT;
+	if (param.hasSpecular()) features |= BODY_SPECULAR;
+	return features;
+}
+
+void RendererVK::createScreenshot()
+{
+	// Swapchain images are copied to host visible buffers, read once the
+	// frame's fence is signaled
+	const VkDeviceSize size = 4*_windowWidth*_windowHeight;
+	for (auto &readback : _screenReadbacks)
+	{
+		readback.buffer = BufferVK(_ctx, size, VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	}
+
+	// Encoding is much slower than copying, keep cores for the simulation
+	_screenshot.init(std::max((int)thread::hardware_concurrency()/2, 1));
+}
+
+void RendererVK::createAtmoLookups()
+{
+	for (auto &p : _atmoTables)
+	{
+		// Atmospheric scattering lookup texture
+		const int size = ATMO_LOOKUP_SIZE;
+		ImageVK::Info info{};
+		info.format = VK_FORMAT_R32G32_SFLOAT;
+		info.width = size;
+		info.height = size;
+		info.levels = mipLevelsVK(size);
+		info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|
+			VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+		ImageVK &tex = _bodyData[p.first].atmoLookupTable;
+		tex = ImageVK(_ctx, info);
+		tex.upload(p.second.data(), p.second.size()*sizeof(float), true);
+	}
+	_atmoTables.clear();
+}
+
+void RendererVK::createRingTextures()
+{
+	for (const auto &p : _ringProfiles)
+	{
+		const RingProfile &profile = p.second;
+		const size_t size = profile.getSampleCount();
+		auto &data = _bodyData[p.first];
+
+		ImageVK::Info info{};
+		info.viewType = VK_IMAGE_VIEW_TYPE_1D;
+		info.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+		info.width = size;
+		info.levels = mipLevelsVK(size);
+		info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|
+			VK_IMAGE_USAGE_TRANSFER_SRC_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+
+		// RGB float textures can't be sampled everywhere, padded to RGBA
+		const vector<float> &scattering = profile.getScattering();
+		vector<float> padded(size*4, 1.f);
+		for (size_t i=0;i<size;++i)
+			copy(scattering.begin()+i*3, scattering.begin()+i*3+3, padded.begin()+i*4);
+		data.ringTex1 = ImageVK(_ctx, info);
+		data.ringTex1.upload(padded.data(), padded.size()*sizeof(float), true);
+
+		data.ringTex2 = ImageVK(_ctx, info);
+		data.ringTex2.upload(profile.getColor().data(),
+			profile.getColor().size()*sizeof(float), true);
+	}
+	_ringProfiles.clear();
+}
+
+void RendererVK::init(const InitInfo &info)
+{
+	this->_entityCollection = info.collection;
+	this->_maxTexSize = info.maxTexSize;
+	this->_windowWidth = info.windowWidth;
+	this->_windowHeight = info.windowHeight;
+
+	// The sun occlusion reads the depth as a multisampled texture, so there
+	// are at least 2 samples
+	const auto &limits = _ctx.properties.limits;
+	const VkSampleCountFlags supportedSamples =
+		limits.framebufferColorSampleCounts&
+		limits.framebufferDepthSampleCounts&
+		limits.sampledImageColorSampleCounts&
+		limits.sampledImageDepthSampleCounts;
+	_msaaSamples = VK_SAMPLE_COUNT_4_BIT;
+	for (int samples=VK_SAMPLE_COUNT_64_BIT;samples>=VK_SAMPLE_COUNT_2_BIT;samples/=2)
+	{
+		if (samples <= std::max(info.msaa, 2) && (supportedSamples & samples))
+		{
+			_msaaSamples = (VkSampleCountFlagBits)samples;
+			break;
+		}
+	}
+
+	// Settings of RendererGL features this renderer doesn't have
+	vector<string> unsupported;
+	if (!info.starCatalogFilename.empty()) unsupported.push_back("star catalog");
+	if (!_entityCollection->getMinorBodies().empty()) unsupported.push_back("minor bodies");
+	if (info.sparseTextures) unsupported.push_back("sparse textures");
+	if (info.texBudget > 0) unsupported.push_back("texture budget");
+	if (info.targetFrameTime > 0) unsupported.push_back("dynamic resolution");
+	if (!unsupported.empty())
+	{
+		cerr << "Not supported by the Vulkan renderer, ignored: ";
+		for (size_t i=0;i<unsupported.size();++i)
+			cerr << ((i > 0)?", ":"") << unsupported[i];
+		cerr << endl;
+	}
+
+	this->_jobs = info.jobs?info.jobs:&_serialJobs;
+	initHierarchy();
+
+	// Patches are split when larger than half their distance, up to ~1/10000 of a face
+	this->_terrain = TerrainQuadtree(0.5, 14);
+	this->_terrainCoarse = TerrainQuadtree(0.5, 1);
+
+	// Find the sun
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		if (h.getParam().isStar()) _sun = h;
+	}
+
+	this->_bufferFrames = glm::clamp(info.framesInFlight, 1, (int)MAX_FRAMES_IN_FLIGHT);
+
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		this->_bodyData[h] = BodyData();
+		initBodyUBO(h.getParam(), this->_bodyData[h].ubo);
+	}
+
+	// Flares of all bodies except stars are culled by cullFlares()
+	_flareBodies.clear();
+	_flareBodyColors.clear();
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const EntityParam &param = h.getParam();
+		if (param.isStar()) continue;
+		_flareBodies.push_back(h);
+		_flareBodyColors.push_back(vec4(
+			param.getModel().getMeanColor(), param.getModel().getRadius()));
+	}
+
+	// The loading screen is drawn from the first loadStep()
+	createRenderPasses();
+	createSwapchain();
+	createSlots();
+	_profiler.init(_ctx, _bufferFrames);
+	_gui.setContext(_ctx, _postPass, _bufferFrames);
+
+	// CPU side work runs on the startup tasks, the render thread creates the
+	// other resources in the meantime and uploads task results when done
+	if (info.startup)
+	{
+		this->_startup = info.startup;
+	}
+	else
+	{
+		_ownStartup.init(0);
+		this->_startup = &_ownStartup;
+	}
+
+	// Gui
+	Gui::Font f = _gui.loadFont("fonts/Lato-Regular.ttf");
+	_mainFontBig = _gui.loadFontSize(f, 40.f);
+	_mainFontMedium = _gui.loadFontSize(f, 20.f);
+	const TaskGraph::Task glyphTask = _startup->add("Glyphs", [this]{
+		_gui.rasterize();
+	});
+
+	// Atmospheric scattering lookup tables and ring profiles, one task per body
+	vector<TaskGraph::Task> atmoTasks;
+	vector<TaskGraph::Task> ringTasks;
+	for (const auto &h : _entityCollection->getBodies())
+	{
+		const EntityParam &param = h.getParam();
+		if (param.hasAtmo())
+		{
+			vector<float> &table = _atmoTables[h];
+			atmoTasks.push_back(_startup->add("Atmo " + param.getName(),
+				[this, h, &table]{
+					const EntityParam &param = h.getParam();
+					table = param.getAtmo().getCachedLookupTable(
+						ATMO_LOOKUP_SIZE, param.getModel().getRadius(), "cache", _jobs);
+				}));
+		}
+		if (param.hasRing())
+		{
+			RingProfile &profile = _ringProfiles[h];
+			ringTasks.push_back(_startup->add("Ring " + param.getName(),
+				[h, &profile]{
+					profile = h.getParam().getRing().loadProfile();
+				}));
+		}
+	}
+
+	const bool syncTexLoading = info.syncTexLoading;
+	const int streamThreads = info.streamThreads;
+	const string starMapFilename = info.starMapFilename;
+	const float starMapIntensity = info.starMapIntensity;
+
+	// Pipelines are created from precompiled SPIR-V, after the glyph atlas
+	// so that the loading screen shows progress
+	_initStages = {
+		{[this]{ createMeshes();}, {}},
+		{[this]{ createBuffers();}, {}},
+		{[this]{ _gui.init(); _guiReady = true;}, {glyphTask}},
+		{[this]{ createLayouts();}, {}},
+		{[this]{ createPipelines();}, {}},
+		{[this]{ createRendertargets();}, {}},
+		{[this]{ createTextures();}, {}},
+		{[this]{ createFlare();}, {}},
+		{[this]{ createScreenshot();}, {}},
+		{[this]{ createAtmoLookups();}, atmoTasks},
+		{[this]{ createRingTextures();}, ringTasks},
+		{[=]{
+			// Streamer init, tiles uploaded on the transfer queue
+			_streamer.init(_ctx, _bufferFrames, !syncTexLoading, 512*512*200,
+				_maxTexSize, streamThreads);
+
+			// Create starMap texture
+			_starMapTexHandle = _streamer.createTex(starMapFilename);
+			_starMapIntensity = starMapIntensity;
+		}, {}}};
+	_initStageCount = _initStages.size();
+}
+
+bool RendererVK::loadStep(const LoadingInfo &info)
+{
+	// Run stages for about a frame so that the loading screen stays responsive
+	const auto start = chrono::steady_clock::now();
+	const auto frameTime = chrono::milliseconds(16);
+	while (!_initStages.empty() && chrono::steady_clock::now()-start < frameTime)
+	{
+		const InitStage &stage = _initStages.front();
+		// Rethrows errors of failed tasks
+		const bool ready = all_of(stage.tasks.begin(), stage.tasks.end(),
+			[this](const TaskGraph::Task t){ return _startup->isDone(t);});
+		if (!ready) break;
+		stage.function();
+		_initStages.pop_front();
+	}
+
+	renderLoading(info);
+	return _initStages.empty();
+}
+
+void RendererVK::renderLoading(const LoadingInfo &info)
+{
+	beginFrame();
+	acquireImage();
+
+	FrameSlot &slot = _slots[_frameId];
+	VkClearValue clear{};
+	clear.color = {{0.f, 0.f, 0.f, 1.f}};
+	VkRenderPassBeginInfo begin{};
+	begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	begin.renderPass = _postPass;
+	begin.framebuffer = _swapchainFramebuffers[_imageIndex];
+	begin.renderArea = {{0, 0}, _swapchainExtent};
+	begin.clearValueCount = 1;
+	begin.pClearValues = &clear;
+	vkCmdBeginRenderPass(slot.cmd, &begin, VK_SUBPASS_CONTENTS_INLINE);
+
+	if (_guiReady)
+	{
+		const int left = _windowWidth/8;
+		int top = _windowHeight/3;
+		_gui.setText(_mainFontBig, left, top, "Roche", 255, 255, 255, 255);
+		top += 40;
+		const size_t done = _initStageCount-_initStages.size();
+		const string progress = _initStages.empty()?"Loaded":
+			"Loading... " + to_string(done) + "/" + to_string(_initStageCount);
+		_gui.setText(_mainFontMedium, left, top, progress, 180, 180, 180, 255);
+		top += 20;
+		for (const string &line : info.lines)
+		{
+			top += 24;
+			_gui.setText(_mainFontMedium, left, top, line, 255, 255, 255, 255);
+		}
+		setViewportVK(slot.cmd, _swapchainExtent.width, _swapchainExtent.height);
+		_gui.setCommandBuffer(slot.cmd, _frameId);
+		_gui.display(_windowWidth, _windowHeight);
+	}
+
+	vkCmdEndRenderPass(slot.cmd);
+	submitFrame();
+}
+
+void RendererVK::destroy()
+{
+	if (!_ctx.device)
+	{
+		if (_surface) vkDestroySurfaceKHR(_ctx.instance, _surface, nullptr);
+		_surface = VK_NULL_HANDLE;
+		_ctx.destroy();
+		return;
+	}
+	vkDeviceWaitIdle(_ctx.device);
+
+	// Tiles given to the Screenshot threads are read from the readback buffers
+	for (const auto &readback : _screenReadbacks)
+	{
+		while (!readback.reading && readback.busy)
+			this_thread::sleep_for(chrono::milliseconds(1));
+	}
+
+	_streamer.destroy();
+	_gui.destroy();
+	_profiler.destroy();
+
+	const VkDevice device = _ctx.device;
+	for (auto &p : _bodyPipelines)
+	{
+		for (const VkPipeline pipeline : {p.second.fill, p.second.line})
+			if (pipeline) vkDestroyPipeline(device, pipeline, nullptr);
+	}
+	_bodyPipelines.clear();
+	for (PipelineVK *p : {&_pipelineSun, &_pipelineStarMap, &_pipelineAtmo,
+		&_pipelineRingFar, &_pipelineRingNear, &_pipelineCulledFlare})
+	{
+		for (const VkPipeline pipeline : {p->fill, p->line})
+			if (pipeline) vkDestroyPipeline(device, pipeline, nullptr);
+		*p = PipelineVK();
+	}
+	for (VkPipeline *pipeline : {&_pipelineTonemap, &_pipelineFlare, &_pipelineSunOcclusion})
+	{
+		if (*pipeline) vkDestroyPipeline(device, *pipeline, nullptr);
+		*pipeline = VK_NULL_HANDLE;
+	}
+	for (LayoutVK *layout : {&_bodyLayout, &_starMapLayout, &_translucentLayout,
+		&_flareLayout, &_sunFlareLayout, &_tonemapLayout, &_sunOcclusionLayout})
+	{
+		if (layout->pipeline) vkDestroyPipelineLayout(device, layout->pipeline, nullptr);
+		if (layout->set) vkDestroyDescriptorSetLayout(device, layout->set, nullptr);
+		*layout = LayoutVK();
+	}
+	for (VkSampler *sampler : {&_bodyTexSampler, &_atmoSampler, &_ringSampler,
+		&_flareSampler, &_rendertargetSampler})
+	{
+		if (*sampler) vkDestroySampler(device, *sampler, nullptr);
+		*sampler = VK_NULL_HANDLE;
+	}
+
+	for (auto &slots : _jobSlots)
+	{
+		for (JobSlot &slot : slots)
+		{
+			vkDestroyDescriptorPool(device, slot.descriptorPool, nullptr);
+			vkDestroyCommandPool(device, slot.pool, nullptr);
+		}
+	}
+	_jobSlots.clear();
+	for (FrameSlot &slot : _slots)
+	{
+		vkDestroyDescriptorPool(device, slot.descriptorPool, nullptr);
+		vkDestroyCommandPool(device, slot.pool, nullptr);
+		vkDestroyFence(device, slot.fence, nullptr);
+		vkDestroySemaphore(device, slot.imageAvailable, nullptr);
+	}
+	_slots.clear();
+
+	for (auto &readback : _screenReadbacks) readback.buffer = BufferVK();
+	_bodyData.clear();
+	_diffuseTexDefault = ImageVK();
+	_blackTexDefault = ImageVK();
+	_ringTexDefault = ImageVK();
+	_flareTex = ImageVK();
+	_vertexBuffer = BufferVK();
+	_indexBuffer = BufferVK();
+	_sunVisibilityBuffer = BufferVK();
+
+	if (_hdrFramebuffer) vkDestroyFramebuffer(device, _hdrFramebuffer, nullptr);
+	_hdrFramebuffer = VK_NULL_HANDLE;
+	_hdrRendertarget = ImageVK();
+	_depthRendertarget = ImageVK();
+	destroySwapchain();
+	for (VkRenderPass *pass : {&_opaquePass, &_translucentPass, &_postPass})
+	{
+		if (*pass) vkDestroyRenderPass(device, *pass, nullptr);
+		*pass = VK_NULL_HANDLE;
+	}
+
+	vkDestroySurfaceKHR(_ctx.instance, _surface, nullptr);
+	_surface = VK_NULL_HANDLE;
+	_ctx.destroy();
+}
+
+void RendererVK::waitFrame()
+{
+	const uint32_t lastFrame = (_frameId+_bufferFrames-1)%_bufferFrames;
+	CPUProfiler::Scope scope("Latency wait");
+	checkVK(vkWaitForFences(_ctx.device, 1, &_slots[lastFrame].fence, VK_TRUE, UINT64_MAX),
+		"frame fence wait");
+}
+
+void RendererVK::readFrameLatency()
+{
+	FrameSlot &slot = _slots[_frameId];
+	const uint64_t inputTime = slot.inputTime;
+	if (inputTime == 0) return;
+	slot.inputTime = 0;
+
+	// Read back by the profiler when the frame was begun in this slot
+	const uint64_t cpuEnd = _profiler.getLastFrameEnd();
+	if (cpuEnd <= inputTime) return;
+
+	_latencies.push_back(cpuEnd-inputTime);
+	++_latencyFrames;
+	if (_latencies.size() > LATENCY_FRAMES) _latencies.pop_front();
+}
+
+Renderer::LatencyStats RendererVK::getLatencyStats()
+{
+	LatencyStats stats{};
+	if (_latencies.empty()) return stats;
+	vector<uint64_t> sorted(_latencies.begin(), _latencies.end());
+	sort(sorted.begin(), sorted.end());
+	uint64_t sum = 0;
+	for (const uint64_t l : sorted) sum += l;
+	stats.frames = _latencyFrames;
+	stats.last = _latencies.back();
+	stats.min = sorted.front();
+	stats.avg = sum/sorted.size();
+	stats.p99 = sorted[std::min(sorted.size()-1, sorted.size()*99/100)];
+	stats.max = sorted.back();
+	return stats;
+}
+
+void RendererVK::takeScreenshot(const string &filename, int tiles)
+{
+	if (!_swapchainReadable)
+	{
+		cerr << "Swapchain images can't be read back, no screenshot taken" << endl;
+		return;
+	}
+	tiles = std::max(tiles, 1);
+	const Screenshot::Image image = _screenshot.begin(filename,
+		_windowWidth*tiles, _windowHeight*tiles, tiles*tiles);
+	_screenCaptures.push_back({image, tiles, 0});
+}
+
+bool RendererVK::isCapturing()
+{
+	return !_screenCaptures.empty();
+}
+
+size_t RendererVK::getPendingScreenshots()
+{
+	return _screenshot.getPendingCount();
+}
+
+bool RendererVK::isBusy()
+{
+	return isCapturing() || getPendingScreenshots() > 0 || !_streamer.isIdle();
+}
+
+bool RendererVK::setScreenshotPipe(const string &command)
+{
+	if (command.empty())
+	{
+		_screenshot.closePipe();
+		return true;
+	}
+	return _screenshot.openPipe(command);
+}
+
+static bool sphereInFrontOfPlaneVK(const vec3 &sphereCenter, float radius, const vec4 &plane)
+{
+	return dot(sphereCenter, vec3(plane))+plane.w < radius;
+}
+
+void RendererVK::render(const RenderInfo &info)
+{
+	// GUI
+	const uint8_t textFade = clamp(info.entityNameFade,0.f,1.f)*255;
+	_gui.setText(_mainFontBig, 5, 25, info.focusedEntityName, 
+		textFade, textFade, textFade, textFade);
+	_gui.setText(_mainFontMedium, 2, _windowHeight-8, info.currentTime, 
+		255, 255, 255, 255);
+
+	const float closeBodyMinSizePixels = 1;
+	this->_closeBodyMaxDistance =_windowHeight/(closeBodyMinSizePixels*tan(info.fovy/2));
+	this->_flareMinDistance = _closeBodyMaxDistance*0.35;
+	this->_flareOptimalDistance = _closeBodyMaxDistance*1.0;
+	this->_texLoadDistance = _closeBodyMaxDistance*1.4;
+	this->_texUnloadDistance = _closeBodyMaxDistance*1.6;
+
+	CPUProfiler::Scope scope("Render");
+
+	if (info.bloom && !_bloomWarned)
+	{
+		cerr << "Bloom is not supported by the Vulkan renderer" << endl;
+		_bloomWarned = true;
+	}
+
+	// Projection and view matrices
+	mat4 projMat = perspective(info.fovy, _windowWidth/(float)_windowHeight, 0.f,1.f);
+
+	// Big screenshots zoom on one tile of the view each frame
+	const bool screenTile = !_screenCaptures.empty() && _screenCaptures.front().tiles > 1;
+	if (screenTile)
+	{
+		const int tiles = _screenCaptures.front().tiles;
+		const int tile = _screenCaptures.front().nextTile;
+		projMat = 
+			translate(mat4(), vec3(tiles-1-2*(tile%tiles), tiles-1-2*(tile/tiles), 0))*
+			scale(mat4(), vec3(tiles, tiles, 1))*projMat;
+	}
+	mat4 viewMat = mat4(info.viewDir);
+
+	// Frustum construction
+	const float f = tan(info.fovy/2.0);
+	const float aspect = _windowWidth/(float)_windowHeight;
+
+	// (Don't need far plane)
+	array<vec4, 5> frustum = {
+		vec4(0,0,1,0), // near plane
+		vec4(normalize(vec3( 1, 0, f*aspect)), 0), // Side planes
+		vec4(normalize(vec3(-1, 0, f*aspect)), 0),
+		vec4(normalize(vec3(0,  1, f)), 0),
+		vec4(normalize(vec3(0, -1, f)), 0)
+	};
+
+	// Bounding spheres of subtrees from this frame's positions
+	CPUProfiler::begin("Culling");
+	refitSubtreeBounds();
+
+	// Subtrees far from the view only contain flares (culled by cullFlares()),
+	// the others have their bodies tested one by one
+	vector<EntityHandle> candidates;
+	cullHierarchy(info.viewPos, candidates);
+
+	// Entity classification, lists of each chunk merged in candidate order
+	struct Classification
+	{
+		vector<EntityHandle> close;
+		vector<EntityHandle> translucent;
+		vector<EntityHandle> texLoad;
+		/// Bodies needing a UBO this frame
+		vector<EntityHandle> ubo;
+	};
+
+	const size_t classificationGrain = 64;
+	vector<Classification> chunks(
+		_jobs->getChunkCount(candidates.size(), classificationGrain));
+
+	_jobs->parallelFor(candidates.size(), classificationGrain,
+		[&](const size_t begin, const size_t end, const size_t chunk)
+	{
+		Classification &lists = chunks[chunk];
+		for (size_t i=begin;i<end;++i)
+		{
+			const EntityHandle &h = candidates[i];
+			const auto &data = _bodyData.at(h);
+			const auto &param = h.getParam();
+			const auto &state = h.getState();
+			const float radius = param.getModel().getRadius();
+			const float maxRadius = radius+(param.hasRing()?
+				param.getRing().getOuterDistance():0);
+			const dvec3 pos = state.getPosition();
+			const double dist = distance(info.viewPos, pos)/radius;
+
+			// Focused bodies and unloading are handled below
+			if (dist < _texLoadDistance && !data.texLoaded)
+			{
+				lists.texLoad.push_back(h);
+			}
+
+			// Frustum test
+			const vec3 viewSpacePos = vec3(viewMat*vec4(pos - info.viewPos,1.0));
+			bool visible = true;
+			for (vec4 plane : frustum)
+			{
+				visible = visible && sphereInFrontOfPlaneVK(viewSpacePos, maxRadius, plane);
+			}
+
+			// Render entities inside the frustum
+			if (visible)
+			{
+				// Render if is range, always render sun
+				if (dist < _closeBodyMaxDistance || param.isStar())
+				{
+					lists.close.push_back(h);
+					lists.ubo.push_back(h);
+					// Entity atmospheres
+					if (param.hasAtmo() || param.hasRing())
+					{
+						lists.translucent.push_back(h);
+					}
+				}
+			}
+		}
+	});
+
+	vector<EntityHandle> closeEntities;
+	vector<EntityHandle> translucentEntities;
+
+	vector<EntityHandle> texLoadEntities;
+	vector<EntityHandle> texUnloadEntities;
+
+	for (const auto &h : _uboEntities) _bodyData[h].uboSlot = -1;
+	_uboEntities.clear();
+
+	for (const auto &lists : chunks)
+	{
+		closeEntities.insert(closeEntities.end(), lists.close.begin(), lists.close.end());
+		translucentEntities.insert(translucentEntities.end(),
+			lists.translucent.begin(), lists.translucent.end());
+		texLoadEntities.insert(texLoadEntities.end(),
+			lists.texLoad.begin(), lists.texLoad.end());
+		_uboEntities.insert(_uboEntities.end(), lists.ubo.begin(), lists.ubo.end());
+	}
+	for (size_t i=0;i<_uboEntities.size();++i)
+		_bodyData[_uboEntities[i]].uboSlot = i;
+	// The sun's UBO is used by its flare and the sun occlusion
+	if (_sun.exists() && _bodyData[_sun].uboSlot == -1)
+	{
+		_bodyData[_sun].uboSlot = _uboEntities.size();
+		_uboEntities.push_back(_sun);
+	}
+
+	// Focused bodies are always loaded, the others unloaded when far enough
+	for (const auto &h : info.focusedEntitiesId)
+	{
+		auto it = _bodyData.find(h);
+		if (it != _bodyData.end() && !it->second.texLoaded &&
+			find(texLoadEntities.begin(), texLoadEntities.end(), h) == texLoadEntities.end())
+			texLoadEntities.push_back(h);
+	}
+	for (const auto &h : _texLoadedBodies)
+	{
+		const double dist = distance(info.viewPos, h.getState().getPosition())/
+			h.getParam().getModel().getRadius();
+		const bool focused = count(
+			info.focusedEntitiesId.begin(), 
+			info.focusedEntitiesId.end(), h)>0;
+		if (!focused && dist > _texUnloadDistance)
+		{
+			// Textures need to be unloaded
+			texUnloadEntities.push_back(h);
+		}
+	}
+	CPUProfiler::end();
+
+	// Manage stream textures
+	CPUProfiler::begin("Texture creation/deletion");
+	loadTextures(texLoadEntities);
+	unloadTextures(texUnloadEntities);
+	CPUProfiler::end();
+	CPUProfiler::begin("Texture updating");
+	updateTextureImportance(info);
+	_streamer.update();
+	CPUProfiler::end();
+
+	const float exp = pow(2, info.exposure);
+
+	// View sampled again from the latest input, everything written for the
+	// GPU from here on uses it while culling uses the view of the frame
+	dvec3 viewPos = info.viewPos;
+	uint64_t inputTime = info.inputTime;
+	if (info.latchView)
+	{
+		mat3 viewDir = info.viewDir;
+		inputTime = info.latchView(viewPos, viewDir);
+		viewMat = mat4(viewDir);
+	}
+
+	// Scene uniform update
+	SceneUBO sceneUBO{};
+	sceneUBO.projMat = projMat;
+	sceneUBO.viewMat = viewMat;
+	sceneUBO.starMapMat = viewMat*scale(mat4(), vec3(-1));
+	sceneUBO.starMapIntensity = _starMapIntensity;
+
+	sceneUBO.ambientColor = info.ambientColor;
+	sceneUBO.exposure = exp;
+	sceneUBO.logDepthFarPlane = (1.0/log2(_logDepthC*_logDepthFarPlane + 1.0));
+	sceneUBO.logDepthC = _logDepthC;
+	// Always rendered at window size
+	sceneUBO.renderScale = vec2(1.0);
+
+	// Entity uniform update and terrain patch selection
+	vector<vector<TerrainPatch>> bodyPatches(_uboEntities.size());
+	vector<TerrainQuadtree::View> bodyViews(_uboEntities.size());
+	CPUProfiler::begin("Body update");
+	_jobs->parallelFor(_uboEntities.size(), 1,
+		[&](const size_t begin, const size_t end, size_t)
+	{
+		for (size_t i=begin;i<end;++i)
+		{
+			const EntityHandle &h = _uboEntities[i];
+			const EntityParam &param = h.getParam();
+			BodyUBO &ubo = _bodyData.at(h).ubo;
+			updateBodyUBO(info.fovy, exp, viewPos, projMat, viewMat, 
+				h.getState(), param, ubo);
+			// Stars are drawn as spheres
+			if (param.isStar()) continue;
+			TerrainQuadtree::View view{};
+			view.modelViewMat = viewMat*ubo.modelMat;
+			view.radius = param.getModel().getRadius();
+			view.maxHeight = ubo.heightScale;
+			view.frustum = frustum;
+			bodyViews[i] = view;
+			_terrain.select(view, bodyPatches[i]);
+		}
+	});
+
+	CPUProfiler::end();
+
+	// Patches of all bodies packed in slot order, a body whose patches don't
+	// fit with room left for the coarse patches of the next ones is drawn
+	// with coarse patches itself
+	size_t remainingBodies = 0;
+	for (const auto &h : _uboEntities)
+	{
+		if (!h.getParam().isStar()) ++remainingBodies;
+	}
+	vector<TerrainPatch> patches;
+	size_t coarseBodies = 0;
+	size_t truncatedBodies = 0;
+	for (size_t i=0;i<_uboEntities.size();++i)
+	{
+		auto &data = _bodyData[_uboEntities[i]];
+		vector<TerrainPatch> &selected = bodyPatches[i];
+		data.ubo.firstPatch = patches.size();
+		data.patchCount = 0;
+		if (_uboEntities[i].getParam().isStar()) continue;
+		--remainingBodies;
+		if (patches.size()+selected.size()+
+			remainingBodies*MAX_COARSE_TERRAIN_PATCHES > MAX_TERRAIN_PATCHES)
+		{
+			selected.clear();
+			_terrainCoarse.select(bodyViews[i], selected);
+			++coarseBodies;
+		}
+		// Only with more bodies than coarse patches fit
+		const size_t count = std::min(selected.size(),
+			(size_t)MAX_TERRAIN_PATCHES-patches.size());
+		if (count < selected.size()) ++truncatedBodies;
+		data.patchCount = count;
+		patches.insert(patches.end(), selected.begin(), selected.begin()+count);
+	}
+	if (coarseBodies > 0 && !_terrainOverflow)
+	{
+		cerr << "Terrain patch buffer full (" << MAX_TERRAIN_PATCHES <<
+			" patches), " << coarseBodies << " bodies drawn with coarse patches";
+		if (truncatedBodies > 0)
+			cerr << ", " << truncatedBodies << " of them partially";
+		cerr << endl;
+	}
+	_terrainOverflow = coarseBodies > 0;
+
+	// Waits for the slot, the previous frame in it is done and its end time
+	// is available
+	beginFrame();
+	readFrameLatency();
+	FrameSlot &slot = _slots[_frameId];
+	slot.inputTime = inputTime;
+	acquireImage();
+
+	auto closerFun = [&](const EntityHandle &i, const EntityHandle &j)
+	{
+		const float distI = distance(i.getState().getPosition(), viewPos);
+		const float distJ = distance(j.getState().getPosition(), viewPos);
+		return distI < distJ;
+	};
+
+	auto fartherFun = [&](const EntityHandle &i, const EntityHandle &j)
+	{
+		return !closerFun(i,j);
+	};
+
+	// Entity sorting from front to back
+	sort(closeEntities.begin(), closeEntities.end(), closerFun);
+
+	// Atmosphere sorting from back to front
+	sort(translucentEntities.begin(), translucentEntities.end(), fartherFun);
+
+	// Dynamic data, the slot's buffer is coherent and not in use anymore
+	uint8_t *dynamic = slot.dynamic.getPtr();
+	memcpy(dynamic+_sceneUBOOffset, &sceneUBO, sizeof(SceneUBO));
+	for (size_t i=0;i<_uboEntities.size();++i)
+	{
+		memcpy(dynamic+_bodyUBOsOffset+i*_bodyUBOStride,
+			&_bodyData[_uboEntities[i]].ubo, sizeof(BodyUBO));
+	}
+	if (!patches.empty())
+		memcpy(dynamic+_patchesOffset, patches.data(), patches.size()*sizeof(TerrainPatch));
+
+	CPUProfiler::begin("Flare culling");
+	const uint32_t flareCount = cullFlares(viewPos, projMat, viewMat);
+	CPUProfiler::end();
+
+	// Secondary command buffers of each pass, in execution order. Each scope
+	// has at least one job so that the same scopes are measured every frame
+	typedef function<void(VkCommandBuffer, VkDescriptorPool)> Record;
+	vector<RecordJob> jobs;
+	auto addScope = [&](const string &name, const RecordJob &pass,
+		const vector<Record> &records)
+	{
+		const uint32_t beginQuery = _profiler.begin(name);
+		const uint32_t endQuery = _profiler.end();
+		for (size_t i=0;i<records.size();++i)
+		{
+			RecordJob job = pass;
+			job.beginQuery = (i == 0)?beginQuery:GPUProfilerVK::NO_QUERY;
+			job.endQuery = (i+1 == records.size())?endQuery:GPUProfilerVK::NO_QUERY;
+			job.record = records[i];
+			jobs.push_back(job);
+		}
+	};
+	// Bodies split between the threads, within the descriptor pools of jobs
+	auto splitRecords = [this](const vector<EntityHandle> &entities,
+		const function<void(VkCommandBuffer, VkDescriptorPool,
+			const vector<EntityHandle>&)> &record)
+	{
+		const size_t count = entities.size();
+		const size_t jobCount = std::max({(count+JOB_BODIES-1)/JOB_BODIES,
+			std::min(count, (size_t)_jobs->getThreadCount()), (size_t)1});
+		vector<Record> records;
+		for (size_t j=0;j<jobCount;++j)
+		{
+			const vector<EntityHandle> range(
+				entities.begin()+j*count/jobCount, entities.begin()+(j+1)*count/jobCount);
+			records.push_back([record, range](VkCommandBuffer cmd, VkDescriptorPool pool)
+			{
+				record(cmd, pool, range);
+			});
+		}
+		return records;
+	};
+
+	const bool wireframe = info.wireframe;
+	const uint32_t fullFrameBegin = _profiler.begin("Full frame");
+
+	const RecordJob opaque{_opaquePass, _hdrFramebuffer,
+		(uint32_t)_windowWidth, (uint32_t)_windowHeight};
+	addScope("Bodies", opaque, splitRecords(closeEntities,
+		[this, wireframe](VkCommandBuffer cmd, VkDescriptorPool pool,
+			const vector<EntityHandle> &entities)
+		{
+			recordBodies(cmd, pool, entities, wireframe);
+		}));
+	addScope("Stars", opaque, {[this, wireframe](VkCommandBuffer cmd, VkDescriptorPool pool)
+	{
+		recordStarMap(cmd, pool, wireframe);
+	}});
+	const size_t opaqueJobs = jobs.size();
+
+	const uint32_t sunOcclusionBegin = _profiler.begin("Sun occlusion");
+	const uint32_t sunOcclusionEnd = _profiler.end();
+
+	const RecordJob translucent{_translucentPass, _hdrFramebuffer,
+		(uint32_t)_windowWidth, (uint32_t)_windowHeight};
+	addScope("Flares", translucent, {[=](VkCommandBuffer cmd, VkDescriptorPool pool)
+	{
+		recordFlares(cmd, pool, flareCount, wireframe);
+	}});
+	addScope("Translucent objects", translucent, splitRecords(translucentEntities,
+		[this, wireframe](VkCommandBuffer cmd, VkDescriptorPool pool,
+			const vector<EntityHandle> &entities)
+		{
+			recordTranslucent(cmd, pool, entities, wireframe);
+		}));
+	const size_t translucentJobs = jobs.size()-opaqueJobs;
+
+	const RecordJob post{_postPass, _swapchainFramebuffers[_imageIndex],
+		_swapchainExtent.width, _swapchainExtent.height};
+	addScope("Tonemapping", post, {[this](VkCommandBuffer cmd, VkDescriptorPool pool)
+	{
+		recordTonemap(cmd, pool);
+	}});
+	addScope("Sun Flare", post, {[this](VkCommandBuffer cmd, VkDescriptorPool pool)
+	{
+		recordSunFlare(cmd, pool);
+	}});
+	if (!screenTile)
+	{
+		addScope("GUI", post, {[this](VkCommandBuffer cmd, VkDescriptorPool)
+		{
+			_gui.setCommandBuffer(cmd, _frameId);
+			_gui.display(_windowWidth, _windowHeight);
+		}});
+	}
+	const uint32_t fullFrameEnd = _profiler.end();
+
+	CPUProfiler::begin("Recording");
+	const vector<VkCommandBuffer> secondaries = recordJobs(jobs);
+	CPUProfiler::end();
+
+	auto range = [&](const size_t begin, const size_t count)
+	{
+		return vector<VkCommandBuffer>(secondaries.begin()+begin,
+			secondaries.begin()+begin+count);
+	};
+	_profiler.write(slot.cmd, fullFrameBegin);
+	executePass(slot.cmd, _opaquePass, _hdrFramebuffer, _windowWidth, _windowHeight,
+		range(0, opaqueJobs));
+	_profiler.write(slot.cmd, sunOcclusionBegin);
+	recordSunOcclusion(slot.cmd);
+	_profiler.write(slot.cmd, sunOcclusionEnd);
+	executePass(slot.cmd, _translucentPass, _hdrFramebuffer, _windowWidth, _windowHeight,
+		range(opaqueJobs, translucentJobs));
+	executePass(slot.cmd, _postPass, _swapchainFramebuffers[_imageIndex],
+		_swapchainExtent.width, _swapchainExtent.height,
+		range(opaqueJobs+translucentJobs, jobs.size()-opaqueJobs-translucentJobs));
+
+	pollScreenReadbacks();
+	if (!_screenCaptures.empty()) readScreenTile();
+
+	_profiler.write(slot.cmd, fullFrameEnd);
+	_profiler.write(slot.cmd, _profiler.getFrameEndQuery());
+	_profiler.endFrame();
+	submitFrame();
+}
+
+void RendererVK::beginFrame()
+{
+	const VkDevice device = _ctx.device;
+	FrameSlot &slot = _slots[_frameId];
+	CPUProfiler::begin("Sync wait");
+	checkVK(vkWaitForFences(device, 1, &slot.fence, VK_TRUE, UINT64_MAX),
+		"frame fence wait");
+	CPUProfiler::end();
+
+	// Command buffers and descriptor sets of the previous frame in the slot
+	checkVK(vkResetCommandPool(device, slot.pool, 0), "frame command pool reset");
+	checkVK(vkResetDescriptorPool(device, slot.descriptorPool, 0),
+		"frame descriptor pool reset");
+	for (auto &slots : _jobSlots)
+	{
+		checkVK(vkResetCommandPool(device, slots[_frameId].pool, 0),
+			"job command pool reset");
+		checkVK(vkResetDescriptorPool(device, slots[_frameId].descriptorPool, 0),
+			"job descriptor pool reset");
+	}
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	checkVK(vkBeginCommandBuffer(slot.cmd, &beginInfo), "frame command buffer begin");
+
+	// Results of the previous frame in the slot, done on the GPU
+	if (_profiler.beginFrame(slot.cmd, _frameId))
+	{
+		_profilerTimes.clear();
+		for (const auto &scope : _profiler.getLastFrame())
+			_profilerTimes.push_back({scope.name, scope.duration});
+	}
+}
+
+void RendererVK::acquireImage()
+{
+	const FrameSlot &slot = _slots[_frameId];
+	while (true)
+	{
+		// Window resized or surface changed since the last frame
+		if (_swapchainOutdated)
+		{
+			vkDeviceWaitIdle(_ctx.device);
+			destroySwapchain();
+			createSwapchain();
+		}
+		const VkResult result = vkAcquireNextImageKHR(_ctx.device, _swapchain,
+			UINT64_MAX, slot.imageAvailable, VK_NULL_HANDLE, &_imageIndex);
+		if (result == VK_ERROR_OUT_OF_DATE_KHR)
+		{
+			_swapchainOutdated = true;
+			continue;
+		}
+		// Still presentable, recreated before the next frame
+		if (result == VK_SUBOPTIMAL_KHR) _swapchainOutdated = true;
+		else checkVK(result, "swapchain image acquisition");
+		return;
+	}
+}
+
+void RendererVK::submitFrame()
+{
+	FrameSlot &slot = _slots[_frameId];
+	checkVK(vkEndCommandBuffer(slot.cmd), "frame command buffer recording");
+
+	// Textures completed by the streamer were uploaded by batches up to
+	// this serial, already done so the wait doesn't stall
+	vector<VkSemaphore> waitSemaphores = {slot.imageAvailable};
+	vector<VkPipelineStageFlags> waitStages = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
+	vector<uint64_t> waitValues = {0};
+	const uint64_t serial = _streamer.getCompletedSerial();
+	if (serial > 0)
+	{
+		waitSemaphores.push_back(_streamer.getSemaphore());
+		waitStages.push_back(VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+		waitValues.push_back(serial);
+	}
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.waitSemaphoreValueCount = waitValues.size();
+	timelineInfo.pWaitSemaphoreValues = waitValues.data();
+
+	VkSubmitInfo submit{};
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.pNext = &timelineInfo;
+	submit.waitSemaphoreCount = waitSemaphores.size();
+	submit.pWaitSemaphores = waitSemaphores.data();
+	submit.pWaitDstStageMask = waitStages.data();
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &slot.cmd;
+	submit.signalSemaphoreCount = 1;
+	submit.pSignalSemaphores = &_renderFinished[_imageIndex];
+	checkVK(vkResetFences(_ctx.device, 1, &slot.fence), "frame fence reset");
+	checkVK(vkQueueSubmit(_ctx.graphicsQueue, 1, &submit, slot.fence), "frame submission");
+
+	slot.frame = ++_frameCount;
+	_imagePending = true;
+	_frameId = (_frameId+1)%_bufferFrames;
+}
+
+void RendererVK::present()
+{
+	if (!_imagePending) return;
+	_imagePending = false;
+
+	VkPresentInfoKHR info{};
+	info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+	info.waitSemaphoreCount = 1;
+	info.pWaitSemaphores = &_renderFinished[_imageIndex];
+	info.swapchainCount = 1;
+	info.pSwapchains = &_swapchain;
+	info.pImageIndices = &_imageIndex;
+	const VkResult result = vkQueuePresentKHR(_ctx.graphicsQueue, &info);
+	if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR)
+		_swapchainOutdated = true;
+	else checkVK(result, "presentation");
+}
+
+vector<VkCommandBuffer> RendererVK::recordJobs(const vector<RecordJob> &jobs)
+{
+	createJobSlots(jobs.size());
+	vector<VkCommandBuffer> cmds(jobs.size());
+	_jobs->parallelFor(jobs.size(), 1,
+		[&](const size_t begin, const size_t end, size_t)
+	{
+		for (size_t i=begin;i<end;++i)
+		{
+			const RecordJob &job = jobs[i];
+			const JobSlot &slot = _jobSlots[i][_frameId];
+
+			VkCommandBufferInheritanceInfo inheritance{};
+			inheritance.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+			inheritance.renderPass = job.renderPass;
+			inheritance.subpass = 0;
+			inheritance.framebuffer = job.framebuffer;
+			VkCommandBufferBeginInfo beginInfo{};
+			beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+			beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT|
+				VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+			beginInfo.pInheritanceInfo = &inheritance;
+			checkVK(vkBeginCommandBuffer(slot.cmd, &beginInfo), "job command buffer begin");
+
+			setViewportVK(slot.cmd, job.width, job.height);
+			_profiler.write(slot.cmd, job.beginQuery);
+			job.record(slot.cmd, slot.descriptorPool);
+			_profiler.write(slot.cmd, job.endQuery);
+
+			checkVK(vkEndCommandBuffer(slot.cmd), "job command buffer recording");
+			cmds[i] = slot.cmd;
+		}
+	});
+	return cmds;
+}
+
+void RendererVK::executePass(VkCommandBuffer cmd, const VkRenderPass renderPass,
+	const VkFramebuffer framebuffer, const uint32_t width, const uint32_t height,
+	const vector<VkCommandBuffer> &secondaries)
+{
+	// Cleared like the GL default framebuffer and HDR FBO (ignored when loaded)
+	VkClearValue clears[2]{};
+	clears[0].color = {{0.f, 0.f, 0.f, (renderPass == _postPass)?1.f:0.f}};
+	clears[1].depthStencil = {1.f, 0};
+
+	VkRenderPassBeginInfo begin{};
+	begin.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+	begin.renderPass = renderPass;
+	begin.framebuffer = framebuffer;
+	begin.renderArea = {{0, 0}, {width, height}};
+	begin.clearValueCount = (renderPass == _postPass)?1:2;
+	begin.pClearValues = clears;
+	vkCmdBeginRenderPass(cmd, &begin, VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS);
+	if (!secondaries.empty())
+		vkCmdExecuteCommands(cmd, secondaries.size(), secondaries.data());
+	vkCmdEndRenderPass(cmd);
+}
+
+void RendererVK::bindMesh(VkCommandBuffer cmd, const DrawVK &draw)
+{
+	static_assert(sizeof(Index) == 4, "Index buffer bound with 32 bit indices");
+	const VkBuffer vertexBuffer = _vertexBuffer.getBuffer();
+	vkCmdBindVertexBuffers(cmd, 0, 1, &vertexBuffer, &draw.vertexOffset);
+	vkCmdBindIndexBuffer(cmd, _indexBuffer.getBuffer(), 0, VK_INDEX_TYPE_UINT32);
+}
+
+void RendererVK::recordBodies(VkCommandBuffer cmd, VkDescriptorPool pool,
+	const vector<EntityHandle> &entities, const bool wireframe)
+{
+	const VkBuffer dynamic = _slots[_frameId].dynamic.getBuffer();
+	const VkDescriptorType ubo = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	const VkImageView black = _blackTexDefault.getView();
+
+	// Entity rendering, front to back so pipelines are only bound on change
+	VkPipeline boundPipeline = VK_NULL_HANDLE;
+	const DrawVK *boundMesh = nullptr;
+	for (const auto &h : entities)
+	{
+		const auto &data = _bodyData.at(h);
+		const EntityParam &param = h.getParam();
+		const bool star = param.isStar();
+		// Terrain patches are drawn with instancing
+		if (!star && data.patchCount == 0) continue;
+
+		const VkPipeline pipeline = star?_pipelineSun.get(wireframe):
+			_bodyPipelines.at(getBodyFeatures(param)).get(wireframe);
+		if (pipeline != boundPipeline)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+			boundPipeline = pipeline;
+		}
+		const DrawVK &draw = star?_sphereDraw:_patchDraw;
+		if (&draw != boundMesh)
+		{
+			bindMesh(cmd, draw);
+			boundMesh = &draw;
+		}
+
+		const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _bodyLayout.set);
+		DescriptorWritesVK writes(_ctx.device, set);
+		writes.buffer(0, ubo, dynamic, _sceneUBOOffset, sizeof(SceneUBO));
+		writes.buffer(1, ubo, dynamic, getBodyUBOOffset(h), sizeof(BodyUBO));
+		writes.image(2, _bodyTexSampler,
+			_streamer.getCompleteView(data.diffuse, _diffuseTexDefault.getView()));
+		writes.image(3, _bodyTexSampler, _streamer.getCompleteView(data.cloud, black));
+		writes.image(4, _bodyTexSampler, _streamer.getCompleteView(data.night, black));
+		writes.image(5, _bodyTexSampler, _streamer.getCompleteView(data.specular, black));
+		writes.image(6, _atmoSampler, data.atmoLookupTable.getView()?
+			data.atmoLookupTable.getView():black);
+		writes.image(7, _ringSampler, data.ringTex2.getView()?
+			data.ringTex2.getView():_ringTexDefault.getView());
+		writes.image(12, _bodyTexSampler, _streamer.getCompleteView(data.height, black));
+		writes.buffer(13, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, dynamic, _patchesOffset,
+			MAX_TERRAIN_PATCHES*sizeof(TerrainPatch));
+		writes.update();
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			_bodyLayout.pipeline, 0, 1, &set, 0, nullptr);
+
+		vkCmdDrawIndexed(cmd, draw.indexCount, star?1:data.patchCount,
+			draw.firstIndex, 0, 0);
+	}
+}
+
+void RendererVK::recordStarMap(VkCommandBuffer cmd, VkDescriptorPool pool,
+	const bool wireframe)
+{
+	// Don't render if star map texture not loaded
+	if (!_streamer.isComplete(_starMapTexHandle)) return;
+
+	const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _starMapLayout.set);
+	DescriptorWritesVK writes(_ctx.device, set);
+	writes.buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		_slots[_frameId].dynamic.getBuffer(), _sceneUBOOffset, sizeof(SceneUBO));
+	writes.image(1, _bodyTexSampler,
+		_streamer.getCompleteView(_starMapTexHandle, VK_NULL_HANDLE));
+	writes.update();
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_pipelineStarMap.get(wireframe));
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_starMapLayout.pipeline, 0, 1, &set, 0, nullptr);
+	bindMesh(cmd, _sphereDraw);
+	vkCmdDrawIndexed(cmd, _sphereDraw.indexCount, 1, _sphereDraw.firstIndex, 0, 0);
+}
+
+void RendererVK::recordSunOcclusion(VkCommandBuffer cmd)
+{
+	if (!_sun.exists()) return;
+
+	// The previous frame's sun flare is done reading the visibility
+	VkBufferMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.buffer = _sunVisibilityBuffer.getBuffer();
+	barrier.size = VK_WHOLE_SIZE;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+
+	const VkBuffer dynamic = _slots[_frameId].dynamic.getBuffer();
+	const VkDescriptorSet set = allocateSetVK(_ctx.device,
+		_slots[_frameId].descriptorPool, _sunOcclusionLayout.set);
+	DescriptorWritesVK writes(_ctx.device, set);
+	writes.buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, dynamic,
+		_sceneUBOOffset, sizeof(SceneUBO));
+	writes.buffer(1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, dynamic,
+		getBodyUBOOffset(_sun), sizeof(BodyUBO));
+	writes.image(2, _rendertargetSampler, _depthRendertarget.getView(),
+		VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL);
+	writes.buffer(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _sunVisibilityBuffer.getBuffer(),
+		0, VK_WHOLE_SIZE);
+	writes.update();
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_COMPUTE, _pipelineSunOcclusion);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_COMPUTE,
+		_sunOcclusionLayout.pipeline, 0, 1, &set, 0, nullptr);
+	// A single group samples the whole disk
+	vkCmdDispatch(cmd, 1, 1, 1);
+
+	// Read by the sun flare vertex shader
+	barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+	barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+		VK_PIPELINE_STAGE_VERTEX_SHADER_BIT, 0, 0, nullptr, 1, &barrier, 0, nullptr);
+}
+
+uint32_t RendererVK::cullFlares(const dvec3 &viewPos,
+	const mat4 &projMat, const mat4 &viewMat)
+{
+	if (_flareBodies.empty()) return 0;
+
+	// Same as flare_cull.comp, visible flares of each chunk appended in order
+	const mat4 viewProjMat = projMat*viewMat;
+	const vec2 flareSize = vec2(_windowHeight/(float)_windowWidth, 1.0)*(4.f/_windowHeight);
+	const size_t grain = 1024;
+	vector<vector<FlareInstance>> chunks(_jobs->getChunkCount(_flareBodies.size(), grain));
+	_jobs->parallelFor(_flareBodies.size(), grain,
+		[&](const size_t begin, const size_t end, const size_t chunk)
+	{
+		vector<FlareInstance> &visible = chunks[chunk];
+		for (size_t i=begin;i<end;++i)
+		{
+			const dvec3 worldPos = _flareBodies[i].getState().getPosition();
+			const vec3 bodyPos = vec3(worldPos - viewPos);
+			const vec4 body = _flareBodyColors[i];
+			const float radius = body.w;
+			const float dist = length(bodyPos);
+
+			// Smooth transition from detailed body to flare
+			const float fadeIn = clamp((dist/radius-_flareMinDistance)/
+				(_flareOptimalDistance-_flareMinDistance), 0.f, 1.f);
+			if (fadeIn <= 0.f) continue;
+
+			// Frustum culling, keeping flares overlapping the screen edges
+			const vec4 clip = viewProjMat*vec4(bodyPos, 1.0);
+			if (clip.w <= 0) continue;
+			const vec2 screen = vec2(clip)/clip.w;
+			const vec2 size = fadeIn*flareSize;
+			if (any(greaterThan(abs(screen), vec2(1.0)+size))) continue;
+
+			// Illumination compared to fully lit disk, the light being at the origin
+			const vec3 lightToBody = vec3(worldPos);
+			const float phaseAngle = acos(clamp(
+				dot(normalize(lightToBody), bodyPos/dist), -1.f, 1.f));
+			const float phase = (1-phaseAngle/pi<float>())*cos(phaseAngle) +
+				(1/pi<float>())*sin(phaseAngle);
+			const float cutDist = dist*0.00008;
+			const float brightness = clamp(
+				20.f*radius*radius*phase/(cutDist*cutDist), 0.f, 10.f);
+
+			visible.push_back({vec4(screen, size), vec4(brightness*vec3(body), 1.0)});
+		}
+	});
+
+	FlareInstance *instances = (FlareInstance*)(_slots[_frameId].dynamic.getPtr()+
+		_flaresOffset);
+	uint32_t count = 0;
+	for (const auto &visible : chunks)
+	{
+		copy(visible.begin(), visible.end(), instances+count);
+		count += visible.size();
+	}
+	return count;
+}
+
+void RendererVK::recordFlares(VkCommandBuffer cmd, VkDescriptorPool pool,
+	const uint32_t count, const bool wireframe)
+{
+	if (count == 0) return;
+
+	const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _flareLayout.set);
+	DescriptorWritesVK writes(_ctx.device, set);
+	writes.image(1, _flareSampler, _flareTex.getView());
+	// Visible flares written by cullFlares()
+	writes.buffer(2, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+		_slots[_frameId].dynamic.getBuffer(), _flaresOffset, count*sizeof(FlareInstance));
+	writes.update();
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_pipelineCulledFlare.get(wireframe));
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_flareLayout.pipeline, 0, 1, &set, 0, nullptr);
+	bindMesh(cmd, _flareDraw);
+	vkCmdDrawIndexed(cmd, _flareDraw.indexCount, count, _flareDraw.firstIndex, 0, 0);
+}
+
+void RendererVK::recordTranslucent(VkCommandBuffer cmd, VkDescriptorPool pool,
+	const vector<EntityHandle> &entities, const bool wireframe)
+{
+	const VkBuffer dynamic = _slots[_frameId].dynamic.getBuffer();
+	const VkImageView ringDefault = _ringTexDefault.getView();
+
+	for (const auto &h : entities)
+	{
+		const bool hasRing = h.getParam().hasRing();
+		const bool hasAtmo = h.getParam().hasAtmo();
+
+		const auto &data = _bodyData.at(h);
+
+		const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _translucentLayout.set);
+		DescriptorWritesVK writes(_ctx.device, set);
+		writes.buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, dynamic,
+			_sceneUBOOffset, sizeof(SceneUBO));
+		writes.buffer(1, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, dynamic,
+			getBodyUBOOffset(h), sizeof(BodyUBO));
+		writes.image(2, _atmoSampler, hasAtmo?
+			data.atmoLookupTable.getView():_blackTexDefault.getView());
+		writes.image(3, _ringSampler, hasRing?data.ringTex1.getView():ringDefault);
+		writes.image(4, _ringSampler, hasRing?data.ringTex2.getView():ringDefault);
+		writes.update();
+		vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+			_translucentLayout.pipeline, 0, 1, &set, 0, nullptr);
+
+		// Far rings
+		if (hasRing)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				_pipelineRingFar.get(wireframe));
+			bindMesh(cmd, data.ringDraw);
+			vkCmdDrawIndexed(cmd, data.ringDraw.indexCount, 1, data.ringDraw.firstIndex, 0, 0);
+		}
+
+		// Atmosphere
+		if (hasAtmo)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				_pipelineAtmo.get(wireframe));
+			bindMesh(cmd, _sphereDraw);
+			vkCmdDrawIndexed(cmd, _sphereDraw.indexCount, 1, _sphereDraw.firstIndex, 0, 0);
+		}
+
+		// Near rings
+		if (hasRing)
+		{
+			vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+				_pipelineRingNear.get(wireframe));
+			bindMesh(cmd, data.ringDraw);
+			vkCmdDrawIndexed(cmd, data.ringDraw.indexCount, 1, data.ringDraw.firstIndex, 0, 0);
+		}
+	}
+}
+
+void RendererVK::recordTonemap(VkCommandBuffer cmd, VkDescriptorPool pool)
+{
+	const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _tonemapLayout.set);
+	DescriptorWritesVK writes(_ctx.device, set);
+	writes.buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		_slots[_frameId].dynamic.getBuffer(), _sceneUBOOffset, sizeof(SceneUBO));
+	writes.image(1, _rendertargetSampler, _hdrRendertarget.getView());
+	// Unused without bloom
+	writes.image(2, _rendertargetSampler, _blackTexDefault.getView());
+	writes.update();
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineTonemap);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_tonemapLayout.pipeline, 0, 1, &set, 0, nullptr);
+	// Fullscreen triangle
+	vkCmdDraw(cmd, 3, 1, 0, 0);
+}
+
+void RendererVK::recordSunFlare(VkCommandBuffer cmd, VkDescriptorPool pool)
+{
+	if (!_sun.exists()) return;
+
+	const VkDescriptorSet set = allocateSetVK(_ctx.device, pool, _sunFlareLayout.set);
+	DescriptorWritesVK writes(_ctx.device, set);
+	writes.buffer(0, VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,
+		_slots[_frameId].dynamic.getBuffer(), getBodyUBOOffset(_sun), sizeof(BodyUBO));
+	writes.image(1, _flareSampler, _flareTex.getView());
+	writes.buffer(3, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, _sunVisibilityBuffer.getBuffer(),
+		0, VK_WHOLE_SIZE);
+	writes.update();
+
+	vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS, _pipelineFlare);
+	vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_GRAPHICS,
+		_sunFlareLayout.pipeline, 0, 1, &set, 0, nullptr);
+	bindMesh(cmd, _flareDraw);
+	vkCmdDrawIndexed(cmd, _flareDraw.indexCount, 1, _flareDraw.firstIndex, 0, 0);
+}
+
+void RendererVK::initHierarchy()
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	map<EntityHandle, int> indices;
+	for (size_t i=0;i<hierarchy.size();++i)
+		indices[hierarchy[i]] = i;
+
+	_hierarchyParents.assign(hierarchy.size(), -1);
+	_subtreeEnd.resize(hierarchy.size());
+	_subtreeBounds.resize(hierarchy.size());
+	for (size_t i=0;i<hierarchy.size();++i)
+	{
+		const EntityHandle parent = hierarchy[i].getParent();
+		if (parent.exists()) _hierarchyParents[i] = indices[parent];
+		_subtreeEnd[i] = i+1+hierarchy[i].getAllChildren().size();
+	}
+}
+
+/// Smallest sphere containing two spheres (radius < 0 for an empty sphere)
+static void mergeSphere(dvec3 &center, double &radius,
+	const dvec3 &otherCenter, const double otherRadius)
+{
+	if (otherRadius < 0) return;
+	if (radius < 0)
+	{
+		center = otherCenter;
+		radius = otherRadius;
+		return;
+	}
+	const double d = distance(center, otherCenter);
+	if (d+otherRadius <= radius) return;
+	if (d+radius <= otherRadius)
+	{
+		center = otherCenter;
+		radius = otherRadius;
+		return;
+	}
+	const double newRadius = (d+radius+otherRadius)/2;
+	center += (otherCenter-center)*((newRadius-radius)/d);
+	radius = newRadius;
+}
+
+void RendererVK::refitSubtreeBounds()
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	for (size_t i=0;i<hierarchy.size();++i)
+	{
+		const EntityHandle &h = hierarchy[i];
+		const EntityParam &param = h.getParam();
+		SubtreeBounds &b = _subtreeBounds[i];
+		b.center = h.getState().getPosition();
+		b.radius = -1;
+		b.maxBodyRadius = 0;
+		b.hasStar = false;
+		if (param.isBody())
+		{
+			const float radius = param.getModel().getRadius();
+			b.radius = radius+(param.hasRing()?param.getRing().getOuterDistance():0);
+			b.maxBodyRadius = radius;
+			b.hasStar = param.isStar();
+		}
+	}
+
+	// Children come after their parent, so they are complete when merged
+	for (int i=hierarchy.size()-1;i>=0;--i)
+	{
+		const int parent = _hierarchyParents[i];
+		if (parent == -1) continue;
+		const SubtreeBounds &child = _subtreeBounds[i];
+		SubtreeBounds &b = _subtreeBounds[parent];
+		mergeSphere(b.center, b.radius, child.center, child.radius);
+		b.maxBodyRadius = std::max(b.maxBodyRadius, child.maxBodyRadius);
+		b.hasStar = b.hasStar || child.hasStar;
+	}
+}
+
+void RendererVK::cullHierarchy(
+	const dvec3 &viewPos,
+	vector<EntityHandle> &candidates)
+{
+	const auto &hierarchy = _entityCollection->getHierarchy();
+	size_t i = 0;
+	while (i < hierarchy.size())
+	{
+		const SubtreeBounds &b = _subtreeBounds[i];
+		const double minDist = distance(b.center, viewPos) - b.radius;
+		if (b.radius >= 0 && (b.hasStar || minDist <= _texLoadDistance*b.maxBodyRadius))
+		{
+			// Bodies may be close or need loading, test them one by one
+			const EntityHandle &h = hierarchy[i];
+			if (h.getParam().isBody()) candidates.push_back(h);
+			++i;
+		}
+		else
+		{
+			// No bodies, or all far enough to be flares only
+			i = _subtreeEnd[i];
+		}
+	}
+}
+
+void RendererVK::loadTextures(const vector<EntityHandle> &texLoadEntities)
+{
+	// Texture loading
+	for (const auto &h : texLoadEntities)
+	{
+		const EntityParam param = h.getParam();
+		auto &data = _bodyData[h];
+		// Textures & samplers
+		data.diffuse = _streamer.createTex(param.getModel().getDiffuseFilename());
+		if (param.hasClouds())
+			data.cloud = _streamer.createTex(param.getClouds().getFilename());
+		if (param.hasNight())
+			data.night = _streamer.createTex(param.getNight().getFilename());
+		if (param.hasSpecular())
+			data.specular = _streamer.createTex(param.getSpecular().getFilename());
+		if (param.hasHeightmap())
+			data.height = _streamer.createTex(param.getHeightmap().getFilename());
+
+		data.texLoaded = true;
+		_texLoadedBodies.insert(h);
+	}
+}
+
+void RendererVK::unloadTextures(const vector<EntityHandle> &texUnloadEntities)
+{
+	// Texture unloading
+	for (const auto &h : texUnloadEntities)
+	{
+		auto &data = _bodyData[h];
+
+		// Reset variables
+		data.texLoaded = false;
+		_texLoadedBodies.erase(h);
+		_streamer.deleteTex(data.diffuse);
+		_streamer.deleteTex(data.cloud);
+		_streamer.deleteTex(data.night);
+		_streamer.deleteTex(data.specular);
+		_streamer.deleteTex(data.height);
+		data.diffuse = 0;
+		data.cloud = 0;
+		data.night = 0;
+		data.specular = 0;
+		data.height = 0;
+	}
+}
+
+void RendererVK::updateTextureImportance(const RenderInfo &info)
+{
+	const float f = tan(info.fovy/2.0);
+	for (const auto &h : _texLoadedBodies)
+	{
+		const auto &data = _bodyData[h];
+
+		const auto &param = h.getParam();
+		const auto &state = h.getState();
+		const dvec3 toView = info.viewPos - state.getPosition();
+		const double dist = length(toView);
+		if (dist == 0.0) continue;
+
+		// Entity rotation
+		const vec3 north = vec3(0,0,1);
+		const vec3 rotAxis = param.getModel().getRotationAxis();
+		const quat q = rotate(quat(), 
+			(float)acos(dot(north, rotAxis)), 
+			cross(north, rotAxis))*
+			rotate(quat(), state.getRotationAngle(), north);
+
+		// View direction in model space
+		const vec3 viewDir = inverse(q)*vec3(toView/dist);
+		const float screenSize = 
+			param.getModel().getRadius()/(dist*f)*_windowHeight;
+
+		for (auto tex : {data.diffuse, data.cloud, data.night, data.specular, data.height})
+			_streamer.setImportance(tex, viewDir, screenSize);
+	}
+}
+
+VkDeviceSize RendererVK::getBodyUBOOffset(const EntityHandle &h) const
+{
+	const int slot = _bodyData.at(h).uboSlot;
+	if (slot < 0) throw runtime_error("Body has no UBO this frame");
+	return _bodyUBOsOffset+slot*_bodyUBOStride;
+}
+
+void RendererVK::initBodyUBO(const EntityParam &params, BodyUBO &ubo)
+{
+	ubo.K = params.hasAtmo()
+		?params.getAtmo().getScatteringConstant()
+		:vec4(0.0);
+
+	if (params.hasSpecular())
+	{
+		auto &spec = params.getSpecular();
+		ubo.mask0ColorHardness = vec4(spec.getMask0().color, spec.getMask0().hardness);
+		ubo.mask1ColorHardness = vec4(spec.getMask1().color, spec.getMask1().hardness);
+	}
+
+	if (params.hasRing())
+	{
+		auto &ring = params.getRing();
+		ubo.ringInner = ring.getInnerDistance();
+		ubo.ringOuter = ring.getOuterDistance();
+	}
+
+	ubo.nightTexIntensity = params.hasNight()
+		?params.getNight().getIntensity():0.0;
+	ubo.starBrightness = params.isStar()
+		?params.getStar().getBrightness():0.0;
+	ubo.radius = params.getModel().getRadius();
+	ubo.atmoHeight = params.hasAtmo()?params.getAtmo().getMaxHeight():0.0;
+	ubo.feedbackSlot = -1;
+	ubo.heightScale = params.hasHeightmap()?
+		params.getHeightmap().getScale()/params.getModel().getRadius():0.0;
+	ubo.firstPatch = 0;
+}
+
+void RendererVK::updateBodyUBO(
+	const float fovy, const float exp,
+	const dvec3 &viewPos, const mat4 &projMat, const mat4 &viewMat,
+	const EntityState &state, const EntityParam &params,
+	BodyUBO &ubo)
+{
+	const vec3 bodyPos = state.getPosition() - viewPos;
+
+	// Entity rotation
+	const vec3 north = vec3(0,0,1);
+	const vec3 rotAxis = params.getModel().getRotationAxis();
+	const quat q = rotate(quat(), 
+		(float)acos(dot(north, rotAxis)), 
+		cross(north, rotAxis))*
+		rotate(quat(), state.getRotationAngle(), north);
+
+	// Model matrix
+	const mat4 modelMat = 
+		translate(mat4(), bodyPos)*
+		mat4_cast(q)*
+		scale(mat4(), vec3(params.getModel().getRadius()));
+
+	// Atmosphere matrix
+	const mat4 atmoMat = (params.hasAtmo())?
+		translate(mat4(), bodyPos)*
+		mat4_cast(q)*
+		scale(mat4(), -vec3(params.getModel().getRadius()+params.getAtmo().getMaxHeight())):
+		mat4(0.0);
+
+	// Ring matrices
+	pair<mat4, mat4> ringMatrices = [&]{
+		if (!params.hasRing()) return make_pair(mat4(0),mat4(0));
+
+		const vec3 towards = normalize(bodyPos);
+		const vec3 up = params.getRing().getNormal();
+		const float sideflip = (dot(towards, up)<0)?1.f:-1.f;
+		const vec3 right = normalize(cross(towards, up));
+		const vec3 newTowards = cross(right, up);
+
+		const mat4 lookAtFar = mat4(mat3(sideflip*right, -newTowards, up));
+		const mat4 lookAtNear = mat4(mat3(-sideflip*right, newTowards, up));
+
+		// Ring meshes are in units of the outer distance
+		const mat4 ringScale = scale(mat4(), vec3(params.getRing().getOuterDistance()));
+
+		const mat4 ringFarMat = 
+			translate(mat4(), bodyPos)*
+			lookAtFar*ringScale;
+
+		const mat4 ringNearMat =
+			translate(mat4(), bodyPos)*
+			lookAtNear*ringScale;
+
+		return make_pair(ringFarMat, ringNearMat);
+	}();
+
+	// Flare, only drawn from the UBO for stars (see cullFlares())
+	mat4 flareMat = mat4(0);
+	vec4 flareColor = vec4(0);
+
+	const vec4 clip = projMat*viewMat*vec4(bodyPos,1.0);
+	if (params.isStar() && clip.w > 0)
+	{
+		const vec3 screen = vec3(vec2((clip)/clip.w),0.999);
+		const float dist = length(bodyPos);
+		const float radius = params.getModel().getRadius();
+		const auto star = params.getStar();
+		const float flareSize = clamp(radius*radius/(dist*dist)*
+			star.getBrightness()/star.getFlareAttenuation(),
+			star.getFlareMinSize(), star.getFlareMaxSize()*exp);
+
+		flareColor = vec4(vec3(clamp(
+				(dist/radius-star.getFlareFadeInStart())/
+				(star.getFlareFadeInEnd()-star.getFlareFadeInStart()),
+				0.f,1.f)), 1.f);
+		flareMat = translate(mat4(), screen)*
+			scale(mat4(), vec3(_windowHeight/(float)_windowWidth,1.0,0.0)*flareSize);
+	}
+
+	const mat3 viewNormalMat = transpose(inverse(mat3(viewMat)));
+	
+
+	// Light direction
+	const vec3 lightDir = vec3(normalize(-state.getPosition()));
+
+	ubo.modelMat = modelMat;
+	ubo.atmoMat = atmoMat;
+	ubo.ringFarMat = ringMatrices.first;
+	ubo.ringNearMat = ringMatrices.second;
+	ubo.flareMat = flareMat;
+	ubo.flareColor = flareColor;
+	ubo.bodyPos = viewMat*vec4(bodyPos, 1.0);
+	ubo.lightDir = viewMat*vec4(lightDir,0.0);
+
+	if (params.hasRing())
+	{
+		ubo.ringNormal = vec4(viewNormalMat*params.getRing().getNormal(), 0.0);
+	}
+
+	ubo.cloudDisp = state.getCloudDisp();
+	ubo.feedbackSlot = -1;
+}
+
+
+void RendererVK::readScreenTile()
+{
+	// The window is being resized, tiles are only read at window size
+	if (_swapchainExtent.width != (uint32_t)_windowWidth ||
+		_swapchainExtent.height != (uint32_t)_windowHeight) return;
+
+	// Without a free buffer, the same tile is rendered again next frame
+	auto it = find_if(_screenReadbacks.begin(), _screenReadbacks.end(),
+		[](const ScreenReadback &r){ return !r.busy;});
+	if (it == _screenReadbacks.end()) return;
+
+	ScreenCapture &capture = _screenCaptures.front();
+	ScreenReadback &readback = *it;
+	readback.busy = true;
+	readback.reading = true;
+	readback.frame = _frameCount+1;
+	readback.slot = _frameId;
+	readback.sequence = _screenReadbackCount++;
+	readback.image = capture.image;
+	readback.x = (capture.nextTile%capture.tiles)*_windowWidth;
+	readback.y = (capture.nextTile/capture.tiles)*_windowHeight;
+
+	// Copy of the presented image, picked up once the slot's fence is signaled
+	const VkCommandBuffer cmd = _slots[_frameId].cmd;
+	const VkImage image = _swapchainImages[_imageIndex];
+	imageBarrierVK(cmd, image, VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_PRESENT_SRC_KHR, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT);
+	VkBufferImageCopy region{};
+	region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1};
+	region.imageExtent = {(uint32_t)_windowWidth, (uint32_t)_windowHeight, 1};
+	vkCmdCopyImageToBuffer(cmd, image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+		readback.buffer.getBuffer(), 1, &region);
+	imageBarrierVK(cmd, image, VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+	VkMemoryBarrier hostBarrier{};
+	hostBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+	hostBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	hostBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT,
+		0, 1, &hostBarrier, 0, nullptr, 0, nullptr);
+
+	if (++capture.nextTile == capture.tiles*capture.tiles)
+		_screenCaptures.pop_front();
+}
+
+void RendererVK::pollScreenReadbacks()
+{
+	// Tiles are given in readback order, so that piped images stay in order
+	while (true)
+	{
+		auto it = _screenReadbacks.end();
+		for (auto r=_screenReadbacks.begin();r!=_screenReadbacks.end();++r)
+		{
+			if (r->reading && (it == _screenReadbacks.end() || r->sequence < it->sequence))
+				it = r;
+		}
+		if (it == _screenReadbacks.end()) return;
+		// Done if the slot was reused since, or its fence is signaled
+		const FrameSlot &slot = _slots[it->slot];
+		if (slot.frame == it->frame &&
+			vkGetFenceStatus(_ctx.device, slot.fence) != VK_SUCCESS) return;
+		ScreenReadback &readback = *it;
+		readback.reading = false;
+		// Copied by a Screenshot thread straight from the mapping
+		atomic<bool> *busy = &readback.busy;
+		_screenshot.addTile(readback.image, readback.x, readback.y,
+			_windowWidth, _windowHeight, _screenFormat, readback.buffer.getPtr(),
+			[busy]{ *busy = false;}, true);
+	}
+}
+
+vector<pair<string,uint64_t>> RendererVK::getProfilerTimes()
+{
+	return _profilerTimes;
+}
+
+uint64_t RendererVK::getProfilerFrameCount()
+{
+	return _profiler.getReadFrames();
+}
+
+vector<Renderer::ProfilerStats> RendererVK::getProfilerStats()
+{
+	vector<ProfilerStats> result;
+	for (const auto &s : _profiler.getStats())
+		result.push_back({s.name, s.depth, s.last, s.min, s.avg, s.p99});
+	return result;
+}
+
+bool RendererVK::writeProfilerTrace(const string &filename)
+{
+	ofstream out(filename.c_str());
+	if (!out) return false;
+
+	// CPU scopes of the time span of the GPU frames kept
+	out << fixed << setprecision(3);
+	out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+	out << "\n  {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 0, "
+		"\"args\": {\"name\": \"roche\"}}";
+	const uint64_t origin = _profiler.getHistoryStart();
+	_profiler.writeTraceEvents(out, origin);
+	CPUProfiler::writeTraceEvents(out, origin);
+	out << "\n]}\n";
+	return (bool)out;
+}
+
+vector<pair<string,double>> RendererVK::getStreamingStats()
+{
+	const StreamerVK::Stats s = _streamer.getStats();
+	vector<pair<string,double>> stats = {
+		{"Bytes read", (double)s.bytesRead},
+		{"Bytes read per second", s.bytesReadPerSecond},
+		{"Tiles uploaded", (double)s.tilesUploaded},
+		{"Bytes uploaded", (double)s.bytesUploaded},
+		{"Tiles waiting for staging", (double)s.waitingTiles},
+		{"Tiles starved of staging", (double)s.starvedTiles},
+		{"Tiles in loading queues", (double)s.queuedTiles},
+		{"Tiles over upload budget", (double)s.deferredTiles},
+		{"Staging bytes used", (double)s.stagingUsed},
+		{"Staging bytes", (double)s.stagingSize},
+		{"Upload batches in flight", (double)s.batchesInFlight},
+		{"Mean tile latency (ms)", s.meanLatency}
+	};
+	for (int i=0;i<StreamerVK::LATENCY_BUCKETS;++i)
+	{
+		const string label = (i < StreamerVK::LATENCY_BUCKETS-1)?
+			"Tiles under " + to_string(1<<i) + "ms":
+			"Tiles over " + to_string(1<<(i-1)) + "ms";
+		stats.push_back({label, (double)s.latencyHistogram[i]});
+	}
+	return stats;
+}
@@ -0,0 +1,745 @@
+#pragma once
+
+#include "renderer.hpp"
+#include "vk_util.hpp"
+#include "vk_profiler.hpp"
+#include "vk_stream.hpp"
+#include "screenshot.hpp"
+#include "gui_vk.hpp"
+#include "terrain.hpp"
+#include "mesh.hpp"
+#include "ring_profile.hpp"
+
+#include <vector>
+#include <map>
+#include <set>
+#include <deque>
+#include <memory>
+#include <utility>
+#include <functional>
+#include <array>
+#include <atomic>
+
+/**
+ * Vulkan implementation of Renderer
+ *
+ * Same passes as RendererGL without bloom, dynamic resolution, minor bodies,
+ * catalog stars and sparse textures. Bodies, flares, translucent objects and
+ * post processing are recorded by the job system in secondary command
+ * buffers, each job having its own pools in each frame slot. Textures are
+ * streamed by StreamerVK on the transfer queue.
+ * @see Renderer
+ */
+class RendererVK : public Renderer
+{
+public:
+	RendererVK() = default;
+	void windowHints() override;
+	void initWindow(GLFWwindow *window, int swapInterval) override;
+	void present() override;
+	void init(const InitInfo &info) override;
+	bool loadStep(const LoadingInfo &info) override;
+	void waitFrame() override;
+	void render(const RenderInfo &info) override;
+	void takeScreenshot(const std::string &filename, int tiles) override;
+	bool isCapturing() override;
+	size_t getPendingScreenshots() override;
+	bool isBusy() override;
+	bool setScreenshotPipe(const std::string &command) override;
+	void destroy() override;
+
+	std::vector<std::pair<std::string,uint64_t>> getProfilerTimes() override;
+	uint64_t getProfilerFrameCount() override;
+	std::vector<ProfilerStats> getProfilerStats() override;
+	LatencyStats getLatencyStats() override;
+	bool writeProfilerTrace(const std::string &filename) override;
+	std::vector<std::pair<std::string,double>> getStreamingStats() override;
+private:
+	/// Window of the surface
+	GLFWwindow *_win = nullptr;
+	/// Vertical syncs waited per frame, -1 leaves it to the driver
+	int _swapInterval = -1;
+
+	/// Dynamic parameters for the scene to be loaded in a UBO
+	struct SceneUBO
+	{
+		/// Projection matrix
+		glm::mat4 projMat;
+		/// View matrix
+		glm::mat4 viewMat;
+		/// Star map matrix
+		glm::mat4 starMapMat;
+		/// Star map intensity
+		float starMapIntensity;
+		/// Ambient light coefficient
+		float ambientColor;
+		/// Exposure factor
+		float exposure;
+		/// Far plane coefficient for log depth
+		float logDepthFarPlane;
+		/// C precision balance coefficient for log depth
+		float logDepthC;
+		float padding;
+		/// Fraction of the HDR rendertarget size rendered to
+		glm::vec2 renderScale;
+	};
+
+	/// Dynamic parameters for a single body to be loaded in a UBO
+	struct BodyUBO
+	{
+		/// Model matrix of the body
+		glm::mat4 modelMat;
+		/// Model matrix of the atmosphere
+		glm::mat4 atmoMat;
+		/// Model matrix of the far half ring
+		glm::mat4 ringFarMat;
+		/// Model matrix of the near half ring
+		glm::mat4 ringNearMat;
+		/// flare matrix
+		glm::mat4 flareMat;
+		/// flare color
+		glm::vec4 flareColor;
+		/// Entity position in view space
+		glm::vec4 bodyPos;
+		/// Light direction in view space
+		glm::vec4 lightDir;
+		/// Scattering constants
+		glm::vec4 K;
+		/// Specular reflection parameters (xyz color w hardness) of mask 0
+		glm::vec4 mask0ColorHardness;
+		/// Specular reflection parameters (xyz color w hardness) of mask 1
+		glm::vec4 mask1ColorHardness;
+		/// Ring plane normal vector
+		glm::vec4 ringNormal;
+		/// Ring inner edge distance from center of body
+		float ringInner;
+		/// Ring outer edge distance from center of body
+		float ringOuter;
+		/// Brightness coefficient if body is a star
+		float starBrightness;
+		/// Rate of cloud displacement
+		float cloudDisp;
+		/// Intensity factor of night emission texture
+		float nightTexIntensity;
+		/// Radius of body
+		float radius;
+		/// Atmospheric height
+		float atmoHeight;
+		/// Texture feedback grid to write to (always -1, no sparse textures)
+		int feedbackSlot;
+		/// Height of white areas of the heightmap in body radii
+		float heightScale;
+		/// Index of the first terrain patch of the body this frame
+		uint32_t firstPatch;
+		float padding[2];
+	};
+
+	/// Flare read by the culled flare shader (std430)
+	struct FlareInstance
+	{
+		/// Center in NDC (xy) and size (zw)
+		glm::vec4 position;
+		glm::vec4 color;
+	};
+
+	/// Indexed mesh in the static vertex and index buffers
+	struct DrawVK
+	{
+		VkDeviceSize vertexOffset = 0;
+		uint32_t firstIndex = 0;
+		uint32_t indexCount = 0;
+	};
+
+	/// Pipeline drawing faces, and the same one drawing lines for wireframe
+	struct PipelineVK
+	{
+		VkPipeline fill = VK_NULL_HANDLE;
+		/// VK_NULL_HANDLE if the device can't draw lines
+		VkPipeline line = VK_NULL_HANDLE;
+		VkPipeline get(bool wireframe) const { return (wireframe && line)?line:fill;}
+	};
+
+	/// Descriptor set layout of a group of pipelines, and their pipeline layout
+	struct LayoutVK
+	{
+		VkDescriptorSetLayout set = VK_NULL_HANDLE;
+		VkPipelineLayout pipeline = VK_NULL_HANDLE;
+	};
+
+	/// Resources of a frame slot (multiple buffering)
+	struct FrameSlot
+	{
+		VkCommandPool pool = VK_NULL_HANDLE;
+		/// Primary command buffer of the frame
+		VkCommandBuffer cmd = VK_NULL_HANDLE;
+		/// Descriptor sets bound in the primary command buffer
+		VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+		/// Signaled when the GPU is done with the frame
+		VkFence fence = VK_NULL_HANDLE;
+		/// Signaled when the swapchain image of the frame is acquired
+		VkSemaphore imageAvailable = VK_NULL_HANDLE;
+		/// Scene UBO, body UBOs, terrain patches and flare instances
+		BufferVK dynamic;
+		/// Number of the frame last submitted in the slot
+		uint64_t frame = 0;
+		/// Time input was sampled for the frame, 0 once measured
+		uint64_t inputTime = 0;
+	};
+
+	/// Pools a recording job uses in a frame slot
+	struct JobSlot
+	{
+		VkCommandPool pool = VK_NULL_HANDLE;
+		/// Secondary command buffer
+		VkCommandBuffer cmd = VK_NULL_HANDLE;
+		VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	};
+
+	/// Secondary command buffer recorded by a job
+	struct RecordJob
+	{
+		/// Render pass and framebuffer the commands are executed in
+		VkRenderPass renderPass;
+		VkFramebuffer framebuffer;
+		/// Viewport size
+		uint32_t width;
+		uint32_t height;
+		/// Timestamps written before and after the commands (NO_QUERY for none)
+		uint32_t beginQuery;
+		uint32_t endQuery;
+		/// Records the commands, allocating descriptor sets from the pool
+		std::function<void(VkCommandBuffer, VkDescriptorPool)> record;
+	};
+
+	/// Entity data only for rendering
+	struct BodyData
+	{
+		/// Ring mesh
+		DrawVK ringDraw;
+		/// Whether the textures have been loaded or not
+		bool texLoaded = false;
+		/// Slot of body in this frame's UBO arrays, -1 if not drawn
+		int uboSlot = -1;
+		/// UBO data, static fields are only set once
+		BodyUBO ubo{};
+
+		/// Diffuse texture
+		StreamerVK::Handle diffuse = 0;
+		/// Cloud texture
+		StreamerVK::Handle cloud = 0;
+		/// Emissive night texture
+		StreamerVK::Handle night = 0;
+		/// Specular mask texture
+		StreamerVK::Handle specular = 0;
+		/// Terrain heightmap
+		StreamerVK::Handle height = 0;
+		/// Number of terrain patches drawn this frame
+		uint32_t patchCount = 0;
+
+		/// Atmospheric lookup table
+		ImageVK atmoLookupTable;
+		/// Ring texture 1
+		ImageVK ringTex1;
+		/// Ring texture 2
+		ImageVK ringTex2;
+		BodyData() = default;
+	};
+
+	/// Creates the device and its queues for the window surface
+	void createDevice();
+	/// Creates the swapchain with the window size, and its framebuffers
+	void createSwapchain();
+	/// Destroys the swapchain and its framebuffers, once the device is idle
+	void destroySwapchain();
+	/// Creates the render passes of the HDR rendertargets and of the swapchain
+	void createRenderPasses();
+	/// Creates the command buffers, synchronization and dynamic buffers of slots
+	void createSlots();
+	/// Creates the pools of recording jobs up to the given number of jobs
+	void createJobSlots(size_t jobs);
+	/// Generates the vertex and index data and fill the static buffers
+	void createMeshes();
+	/// Creates the sun visibility buffer and the flare colors
+	void createBuffers();
+	/// Creates the HDR multisampled rendertarget, depth and their framebuffer
+	void createRendertargets();
+	/// Creates default textures and samplers
+	void createTextures();
+	/// Creates flare textures
+	void createFlare();
+	/// Creates descriptor set layouts and pipeline layouts
+	void createLayouts();
+	/// Creates pipelines from the SPIR-V shaders
+	void createPipelines();
+	/// Create Screenshot object and readback buffers
+	void createScreenshot();
+	/// Create atmo lookup textures from the tables generated at startup
+	void createAtmoLookups();
+	/// Create ring textures from the profiles loaded at startup
+	void createRingTextures();
+	/// Draws the loading screen to the swapchain
+	void renderLoading(const LoadingInfo &info);
+
+	/** Waits for the current slot to be done on the GPU and starts its
+	 * primary command buffer
+	 */
+	void beginFrame();
+	/** Acquires the next swapchain image, recreating the swapchain if it is
+	 * out of date
+	 */
+	void acquireImage();
+	/// Ends and submits the primary command buffer of the current slot
+	void submitFrame();
+	/** Records the secondary command buffers of jobs in parallel
+	 * @param jobs jobs to record, in execution order
+	 * @return command buffers of jobs
+	 */
+	std::vector<VkCommandBuffer> recordJobs(const std::vector<RecordJob> &jobs);
+	/** Begins a render pass executing secondary command buffers
+	 * @param cmd primary command buffer
+	 * @param renderPass render pass
+	 * @param framebuffer framebuffer
+	 * @param width width of the render area
+	 * @param height height of the render area
+	 * @param secondaries command buffers to execute
+	 */
+	void executePass(VkCommandBuffer cmd, VkRenderPass renderPass,
+		VkFramebuffer framebuffer, uint32_t width, uint32_t height,
+		const std::vector<VkCommandBuffer> &secondaries);
+
+	/** Records opaque parts of detailed entities
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 * @param entities entities to record, from front to back
+	 * @param wireframe whether to draw lines
+	 */
+	void recordBodies(VkCommandBuffer cmd, VkDescriptorPool pool,
+		const std::vector<EntityHandle> &entities, bool wireframe);
+	/** Records the star map
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 * @param wireframe whether to draw lines
+	 */
+	void recordStarMap(VkCommandBuffer cmd, VkDescriptorPool pool, bool wireframe);
+	/** Computes the visible fraction of the sun from the depth of the opaque pass
+	 * @param cmd primary command buffer, outside of render passes
+	 */
+	void recordSunOcclusion(VkCommandBuffer cmd);
+	/** Writes the visible flares of bodies to the current slot
+	 * @param viewPos World space eye position
+	 * @param projMat projection matrix
+	 * @param viewMat view matrix (not accounting translation)
+	 * @return number of visible flares
+	 */
+	uint32_t cullFlares(const glm::dvec3 &viewPos,
+		const glm::mat4 &projMat, const glm::mat4 &viewMat);
+	/** Records the flares culled by cullFlares()
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 * @param count number of visible flares
+	 * @param wireframe whether to draw lines
+	 */
+	void recordFlares(VkCommandBuffer cmd, VkDescriptorPool pool, uint32_t count,
+		bool wireframe);
+	/** Records translucent parts of detailed entities
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 * @param entities entities to record, from back to front
+	 * @param wireframe whether to draw lines
+	 */
+	void recordTranslucent(VkCommandBuffer cmd, VkDescriptorPool pool,
+		const std::vector<EntityHandle> &entities, bool wireframe);
+	/** Records tonemapping and resolve of HDR rendertarget to the swapchain
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 */
+	void recordTonemap(VkCommandBuffer cmd, VkDescriptorPool pool);
+	/** Records sun flare on top of the screen
+	 * @param cmd secondary command buffer
+	 * @param pool descriptor pool of the job
+	 */
+	void recordSunFlare(VkCommandBuffer cmd, VkDescriptorPool pool);
+	/** Binds the static vertex buffer at a mesh's vertices and the index buffer
+	 * @param cmd command buffer
+	 * @param draw mesh
+	 */
+	void bindMesh(VkCommandBuffer cmd, const DrawVK &draw);
+
+	/// Precomputes parents and subtree ranges of the entity hierarchy
+	void initHierarchy();
+	/// Recomputes the subtree bounding spheres from current positions
+	void refitSubtreeBounds();
+	/** Walks the entity hierarchy, skipping subtrees that need no per-body test
+	 * (their flares are culled one by one by cullFlares())
+	 * @param viewPos World space eye position
+	 * @param candidates bodies close enough to be tested one by one
+	 */
+	void cullHierarchy(
+		const glm::dvec3 &viewPos,
+		std::vector<EntityHandle> &candidates);
+	/** Sets the textures of entities to be loaded asynchronouly
+	 * @param entities entities whose textures to load
+	 */
+	void loadTextures(const std::vector<EntityHandle> &entities);
+	/** Sets the textures of entities to be unloaded asynchronouly
+	 * @param entities entities whose textures to unload
+	 */
+	void unloadTextures(const std::vector<EntityHandle> &entities);
+	/** Tells the streamer which side of bodies with loaded textures is seen
+	 * and how big they are on screen
+	 * @param info render info of the frame
+	 */
+	void updateTextureImportance(const RenderInfo &info);
+
+	/// Copies the current swapchain image to a free readback buffer as a screenshot tile
+	void readScreenTile();
+	/// Gives screenshot tiles done reading back to the Screenshot object
+	void pollScreenReadbacks();
+	/// Reads the latency of the frame last rendered in the current slot
+	void readFrameLatency();
+
+	/** Fills the fields of a body UBO that don't change between frames
+	 * @param params Fixed entity parameters
+	 * @param ubo UBO data to fill
+	 */
+	void initBodyUBO(const EntityParam &params, BodyUBO &ubo);
+	/** Updates the fields of a body UBO that depend on the view and state
+	 * (called from jobs, no Vulkan calls)
+	 * @param viewPos World space eye position
+	 * @param viewMat View matrix (not accounting translation)
+	 * @param state Dynamic entity state
+	 * @param params Fixed entity parameters
+	 * @param ubo UBO data to update
+	 */
+	void updateBodyUBO(
+		float fovy,
+		float exp,
+		const glm::dvec3 &viewPos,
+		const glm::mat4 &projMat,
+		const glm::mat4 &viewMat,
+		const EntityState &state,
+		const EntityParam &params,
+		BodyUBO &ubo);
+	/** Returns the offset in the dynamic buffer of a body's UBO
+	 * @param h body drawn this frame
+	 */
+	VkDeviceSize getBodyUBOOffset(const EntityHandle &h) const;
+
+	/// Features a body shader variant is compiled with, one bit each
+	enum BodyFeature : uint32_t
+	{
+		BODY_ATMO = 1,
+		BODY_RING = 2,
+		BODY_CLOUDS = 4,
+		BODY_NIGHT = 8,
+		BODY_SPECULAR = 16
+	};
+	/// Returns the BodyFeature mask of a body other than a star
+	static uint32_t getBodyFeatures(const EntityParam &param);
+
+	/// Device, queues and properties shared with the streamer and the GUI
+	ContextVK _ctx;
+	/// Surface of the window
+	VkSurfaceKHR _surface = VK_NULL_HANDLE;
+
+	// Swapchain
+	VkSwapchainKHR _swapchain = VK_NULL_HANDLE;
+	VkFormat _swapchainFormat = VK_FORMAT_B8G8R8A8_SRGB;
+	VkExtent2D _swapchainExtent{};
+	std::vector<VkImage> _swapchainImages;
+	std::vector<VkImageView> _swapchainViews;
+	std::vector<VkFramebuffer> _swapchainFramebuffers;
+	/// Signaled when each swapchain image is rendered, waited by presentation
+	std::vector<VkSemaphore> _renderFinished;
+	/// Swapchain image of the current frame
+	uint32_t _imageIndex = 0;
+	/// Whether the image of _imageIndex is rendered and not presented yet
+	bool _imagePending = false;
+	/// Whether swapchain images can be copied to readback buffers
+	bool _swapchainReadable = false;
+	/// Whether the swapchain must be recreated before the next acquire
+	bool _swapchainOutdated = false;
+
+	// Render passes
+	/// Clears the HDR rendertargets, opaque objects
+	VkRenderPass _opaquePass = VK_NULL_HANDLE;
+	/// Flares and translucent objects on the HDR rendertarget (depth read only)
+	VkRenderPass _translucentPass = VK_NULL_HANDLE;
+	/// Tonemapping, sun flare and GUI on the swapchain
+	VkRenderPass _postPass = VK_NULL_HANDLE;
+	/// HDR rendertarget and depth, for the opaque and translucent passes
+	VkFramebuffer _hdrFramebuffer = VK_NULL_HANDLE;
+
+	// Rendertargets
+	/// HDR MS rendertarget
+	ImageVK _hdrRendertarget;
+	/// Depth of HDR rendertarget, sampled by the sun occlusion
+	ImageVK _depthRendertarget;
+	/// Samples per pixel of HDR rendertarget
+	VkSampleCountFlagBits _msaaSamples = VK_SAMPLE_COUNT_4_BIT;
+
+	// Frames
+	/// Number of frames to multi-buffer
+	uint32_t _bufferFrames = 1;
+	/// Most frames in flight
+	static const uint32_t MAX_FRAMES_IN_FLIGHT = 4;
+	/// Current frame slot
+	uint32_t _frameId = 0;
+	/// Number of frames submitted
+	uint64_t _frameCount = 0;
+	/// Frame slots
+	std::vector<FrameSlot> _slots;
+	/// Pools of each recording job, by job then slot
+	std::vector<std::vector<JobSlot>> _jobSlots;
+	/// Bodies recorded by a job, for descriptor pool sizes
+	static const size_t JOB_BODIES = 32;
+
+	// Offsets in FrameSlot::dynamic
+	VkDeviceSize _sceneUBOOffset = 0;
+	VkDeviceSize _bodyUBOsOffset = 0;
+	VkDeviceSize _patchesOffset = 0;
+	VkDeviceSize _flaresOffset = 0;
+	/// Size in bytes between two body UBOs
+	VkDeviceSize _bodyUBOStride = 0;
+
+	// Layouts
+	/// Bodies and stars
+	LayoutVK _bodyLayout;
+	/// Star map
+	LayoutVK _starMapLayout;
+	/// Atmospheres and rings
+	LayoutVK _translucentLayout;
+	/// Culled flares
+	LayoutVK _flareLayout;
+	/// Sun flare
+	LayoutVK _sunFlareLayout;
+	/// Tonemapping
+	LayoutVK _tonemapLayout;
+	/// Sun occlusion compute shader
+	LayoutVK _sunOcclusionLayout;
+
+	// Pipelines
+	/// Body shader variants, by feature mask (only the masks of existing bodies)
+	std::map<uint32_t, PipelineVK> _bodyPipelines;
+	/// Star
+	PipelineVK _pipelineSun;
+	/// Star map
+	PipelineVK _pipelineStarMap;
+	/// Atmosphere
+	PipelineVK _pipelineAtmo;
+	/// Far half ring
+	PipelineVK _pipelineRingFar;
+	/// Near half ring
+	PipelineVK _pipelineRingNear;
+	/// Flares culled by cullFlares()
+	PipelineVK _pipelineCulledFlare;
+	/// Tonemap and resolve without bloom
+	VkPipeline _pipelineTonemap = VK_NULL_HANDLE;
+	/// Sun flare
+	VkPipeline _pipelineFlare = VK_NULL_HANDLE;
+	/// Sun occlusion
+	VkPipeline _pipelineSunOcclusion = VK_NULL_HANDLE;
+
+	// Buffers
+	/// Buffer containing vertex data
+	BufferVK _vertexBuffer;
+	/// Buffer containing index data
+	BufferVK _indexBuffer;
+	/// Buffer containing the visible fraction of the sun
+	BufferVK _sunVisibilityBuffer;
+
+	// Meshes
+	/// Sphere (for stars and atmospheres)
+	DrawVK _sphereDraw;
+	/// Terrain patch grid, drawn once per patch with instancing
+	DrawVK _patchDraw;
+	/// Flare mesh (Circle)
+	DrawVK _flareDraw;
+
+	// Textures
+	/// Default diffuse texture
+	ImageVK _diffuseTexDefault;
+	/// Default cloud, night, specular and height texture (transparent black)
+	ImageVK _blackTexDefault;
+	/// Default ring texture, bound to bodies without rings
+	ImageVK _ringTexDefault;
+	/// Flare texture (white dot)
+	ImageVK _flareTex;
+	/// Sampler for body textures
+	VkSampler _bodyTexSampler = VK_NULL_HANDLE;
+	/// Sampler for atmospheric lookup table
+	VkSampler _atmoSampler = VK_NULL_HANDLE;
+	/// Sampler for ring textures
+	VkSampler _ringSampler = VK_NULL_HANDLE;
+	/// Sampler of the flare texture
+	VkSampler _flareSampler = VK_NULL_HANDLE;
+	/// Sampler for rendertargets
+	VkSampler _rendertargetSampler = VK_NULL_HANDLE;
+
+	/// Measures time between commands
+	GPUProfilerVK _profiler;
+	/// GPU times of the last frame measured, by label
+	std::vector<std::pair<std::string,uint64_t>> _profilerTimes;
+	/// Input to GPU completion latencies of the last frames, in ns
+	std::deque<uint64_t> _latencies;
+	/// Number of frames whose latency has been measured
+	uint64_t _latencyFrames = 0;
+	/// Number of frames kept for latency statistics
+	static const size_t LATENCY_FRAMES = 240;
+
+	// Screenshot info
+	/// Screenshot requested, tiles are rendered in successive frames
+	struct ScreenCapture
+	{
+		/// Image in the Screenshot object
+		Screenshot::Image image;
+		/// Number of tiles along each side
+		int tiles;
+		/// Next tile to read back, row by row from the bottom left
+		int nextTile;
+	};
+	/// Screenshots requested, the first one being rendered
+	std::deque<ScreenCapture> _screenCaptures;
+	/// Buffer a screen tile is read back to
+	struct ScreenReadback
+	{
+		/// Host visible buffer of window size
+		BufferVK buffer;
+		/// Frame the copy was submitted in
+		uint64_t frame = 0;
+		/// Slot of the frame the copy was submitted in
+		uint32_t slot = 0;
+		/// Whether the copy is pending
+		bool reading = false;
+		/// Whether pixels are in use, until copied by a Screenshot thread
+		std::atomic<bool> busy{false};
+		/// Order of the readback, tiles are given in this order
+		uint64_t sequence = 0;
+		/// Image the tile belongs to
+		Screenshot::Image image = 0;
+		/// Tile position in the image in pixels
+		int x = 0;
+		int y = 0;
+	};
+	/// Number of screen tiles read back at the same time
+	static const int SCREEN_READBACKS = 3;
+	std::array<ScreenReadback, SCREEN_READBACKS> _screenReadbacks;
+	/// Number of screen tiles read back so far
+	uint64_t _screenReadbackCount = 0;
+	/// Screenshot format of the swapchain
+	Screenshot::Format _screenFormat = Screenshot::Format::BGRA8;
+	/// Screenshot object
+	Screenshot _screenshot;
+
+	/// Max texture width/height to be loaded and displayed (-1 means no limit)
+	int _maxTexSize = -1;
+	/// Window width in pixels
+	int _windowWidth = 1;
+	/// Window height in pixels
+	int _windowHeight = 1;
+	/// Whether bloom was asked for, it isn't supported
+	bool _bloomWarned = false;
+
+	/// Far plane distance
+	float _logDepthFarPlane = 5e9;
+	/// Logarithmic depth balance coefficient
+	float _logDepthC = 1.0;
+
+	// Constants for distance based loading
+	/// Max distance at which a body is considered 'close' (detailed render)
+	float _closeBodyMaxDistance;
+	/// Min distance at which a body is considered 'far' (flare render)
+	float _flareMinDistance;
+	/// Optimal distance at which a body is considered 'far' (no flare fade in)
+	float _flareOptimalDistance;
+	/// Distance at which a body's textures will be loaded
+	float _texLoadDistance;
+	/// Distance at which a body's textures will be unloaded
+	float _texUnloadDistance;
+
+	// Terrain
+	/// Selects the patches of close bodies
+	TerrainQuadtree _terrain;
+	/// Selects faces split once, for bodies whose patches don't fit
+	TerrainQuadtree _terrainCoarse;
+	/// Max number of terrain patches drawn in a frame
+	static const int MAX_TERRAIN_PATCHES = 16384;
+	/// Max number of patches selected by _terrainCoarse (6 faces split once)
+	static const int MAX_COARSE_TERRAIN_PATCHES = 24;
+	/// Whether bodies were drawn with coarse patches last frame
+	bool _terrainOverflow = false;
+
+	/// Splits frame preparation and recording across cores
+	JobSystem *_jobs = nullptr;
+	/// Used when no job system is given, runs jobs on the calling thread
+	JobSystem _serialJobs;
+
+	const EntityCollection* _entityCollection;
+	/// Rendering data for all bodies
+	std::map<EntityHandle, BodyData> _bodyData;
+	/// Index of sun in main entity collection
+	EntityHandle _sun;
+	/// Bodies whose textures are loaded
+	std::set<EntityHandle> _texLoadedBodies;
+	/// Bodies with a UBO this frame, by slot
+	std::vector<EntityHandle> _uboEntities;
+	/// Bodies whose flares are culled by cullFlares() (all but stars)
+	std::vector<EntityHandle> _flareBodies;
+	/// Mean color and radius of _flareBodies
+	std::vector<glm::vec4> _flareBodyColors;
+
+	/// Bounding sphere of the bodies of a subtree of the entity hierarchy
+	struct SubtreeBounds
+	{
+		/// World space center
+		glm::dvec3 center;
+		/// Radius, negative if the subtree has no bodies
+		double radius;
+		/// Largest body radius (without rings) of the subtree
+		double maxBodyRadius;
+		/// Whether the subtree contains a star
+		bool hasStar;
+	};
+	/// Subtree bounds by hierarchy index (@see EntityCollection::getHierarchy())
+	std::vector<SubtreeBounds> _subtreeBounds;
+	/// Hierarchy index of the parent of each entity, -1 for roots
+	std::vector<int> _hierarchyParents;
+	/// End of the subtree of each entity in the hierarchy (exclusive)
+	std::vector<int> _subtreeEnd;
+
+	StreamerVK::Handle _starMapTexHandle = 0;
+	float _starMapIntensity = 1.0;
+
+	/// Stream texture loader
+	StreamerVK _streamer;
+
+	GuiVK _gui;
+	Gui::FontSize _mainFontBig;
+	Gui::FontSize _mainFontMedium;
+	/// Whether the gui can display text (glyph atlas uploaded)
+	bool _guiReady = false;
+
+	// Startup
+	/// Initialization step run on the render thread
+	struct InitStage
+	{
+		/// Creates resources
+		std::function<void()> function;
+		/// Startup tasks that must be done before
+		std::vector<TaskGraph::Task> tasks;
+	};
+	/// Stages left, run in order by loadStep()
+	std::deque<InitStage> _initStages;
+	/// Total number of stages
+	size_t _initStageCount = 0;
+	/// Runs CPU side initialization work
+	TaskGraph *_startup = nullptr;
+	/// Used when no startup tasks are given
+	TaskGraph _ownStartup;
+	/// Width/height of atmo lookup tables
+	static const int ATMO_LOOKUP_SIZE = 128;
+	/// Atmo lookup tables generated by startup tasks
+	std::map<EntityHandle, std::vector<float>> _atmoTables;
+	/// Ring profiles loaded by startup tasks
+	std::map<EntityHandle, RingProfile> _ringProfiles;
+};
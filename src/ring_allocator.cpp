@@ -0,0 +1,80 @@
+#include "ring_allocator.hpp"
+
+#include <stdexcept>
+
+using namespace std;
+
+RingAllocator::RingAllocator(const size_t capacity, const size_t alignment) :
+	_capacity{capacity},
+	_alignment{(alignment>0)?alignment:1}
+{
+
+}
+
+RingAllocator::Range RingAllocator::allocate(const size_t size)
+{
+	const size_t alignedSize = ((size+_alignment-1)/_alignment)*_alignment;
+	if (alignedSize > _capacity)
+		throw runtime_error("Range larger than ring buffer");
+
+	Range range{};
+	range.id = _firstId+_allocations.size();
+
+	if (_allocations.empty())
+	{
+		// Everything is free, start over
+		_head = 0;
+	}
+	const size_t tail = _allocations.empty()?_capacity:_allocations.front().begin;
+	const bool wrapped = !_allocations.empty() && _head <= tail;
+
+	size_t begin = _head;
+	size_t offset = _head;
+	if (wrapped)
+	{
+		// Free space is between head and tail
+		if (_head+alignedSize > tail) return range;
+	}
+	else if (_head+alignedSize > _capacity)
+	{
+		// Skip the end of the buffer, the range starts at 0
+		if (!_allocations.empty() && alignedSize > tail) return range;
+		offset = 0;
+	}
+
+	_head = offset+alignedSize;
+	_allocations.push_back({begin, _head, false});
+	range.offset = offset;
+	return range;
+}
+
+void RingAllocator::release(const uint64_t id)
+{
+	if (id < _firstId || id >= _firstId+_allocations.size())
+		throw runtime_error("Releasing an unknown range");
+	_allocations[id-_firstId].released = true;
+
+	// Reclaim memory of the oldest ranges
+	while (!_allocations.empty() && _allocations.front().released)
+	{
+		_allocations.pop_front();
+		++_firstId;
+	}
+}
+
+size_t RingAllocator::getCapacity() const
+{
+	return _capacity;
+}
+
+size_t RingAllocator::getMaxSize() const
+{
+	return (_capacity/_alignment)*_alignment;
+}
+
+size_t RingAllocator::getUsed() const
+{
+	if (_allocations.empty()) return 0;
+	const size_t tail = _allocations.front().begin;
+	return (_head > tail)?_head-tail:_capacity-tail+_head;
+}
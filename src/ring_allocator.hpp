@@ -0,0 +1,75 @@
+#pragma once
+
+#include <deque>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Suballocates variable size ranges of a buffer used as a ring
+ *
+ * Ranges are handed out one after the other and wrap around at the end of
+ * the buffer. They may be released in any order, but memory is only reused
+ * once all the ranges allocated before have been released too, so the cost
+ * of an allocation or release doesn't depend on the buffer size.
+ */
+class RingAllocator
+{
+public:
+	/// An allocated range
+	struct Range
+	{
+		/// Allocation id, to be given to release()
+		uint64_t id = 0;
+		/// Offset in bytes from the start of the buffer, -1 if allocation failed
+		int64_t offset = -1;
+	};
+
+	RingAllocator() = default;
+	/**
+	 * @param capacity size in bytes of the buffer
+	 * @param alignment alignment in bytes of range offsets
+	 */
+	RingAllocator(size_t capacity, size_t alignment);
+
+	/**
+	 * Allocates a range
+	 * @param size size in bytes of the range
+	 * @return allocated range, with an offset of -1 if there is not enough
+	 * contiguous free space at the moment
+	 */
+	Range allocate(size_t size);
+	/**
+	 * Releases a range so that its memory can be reused
+	 * @param id allocation id of the range
+	 */
+	void release(uint64_t id);
+
+	/// Returns the size in bytes of the buffer
+	size_t getCapacity() const;
+	/// Returns the size in bytes of the largest range that can be allocated
+	size_t getMaxSize() const;
+	/// Returns the number of bytes from the oldest range alive to the newest one
+	size_t getUsed() const;
+
+private:
+	/// Range in the ring
+	struct Allocation
+	{
+		/// Start of range (including padding at the end of the buffer)
+		size_t begin;
+		/// End of range
+		size_t end;
+		bool released;
+	};
+
+	/// Size in bytes of the buffer
+	size_t _capacity = 0;
+	/// Alignment of offsets
+	size_t _alignment = 1;
+	/// Allocations alive, from oldest to newest
+	std::deque<Allocation> _allocations;
+	/// Id of _allocations.front()
+	uint64_t _firstId = 0;
+	/// Offset of next allocation
+	size_t _head = 0;
+};
@@ -0,0 +1,211 @@
+#include "ring_profile.hpp"
+#include "mapped_file.hpp"
+
+#include <fstream>
+#include <memory>
+#include <cstring>
+#include <cmath>
+#include <stdexcept>
+
+using namespace std;
+
+/**
+ * Parses a decimal number starting at p, stops at end
+ * @return false if the characters aren't a valid number
+ */
+static bool parseFloat(const char *&p, const char *end, float &value)
+{
+	// Exact powers of ten for the common case
+	static const double POW10[] = {
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+		1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+')) negative = (*p++ == '-');
+
+	// Up to 19 significant digits fit in the mantissa, the others only
+	// shift the exponent
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	bool anyDigit = false;
+	for (;p < end && *p >= '0' && *p <= '9';++p)
+	{
+		anyDigit = true;
+		if (digits < 19)
+		{
+			mantissa = mantissa*10+(*p-'0');
+			if (mantissa) ++digits;
+		}
+		else ++exponent;
+	}
+	if (p < end && *p == '.')
+	{
+		for (++p;p < end && *p >= '0' && *p <= '9';++p)
+		{
+			anyDigit = true;
+			if (digits < 19)
+			{
+				mantissa = mantissa*10+(*p-'0');
+				if (mantissa) ++digits;
+				--exponent;
+			}
+		}
+	}
+	if (!anyDigit) return false;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		++p;
+		bool negativeExp = false;
+		if (p < end && (*p == '-' || *p == '+')) negativeExp = (*p++ == '-');
+		if (p >= end || *p < '0' || *p > '9') return false;
+		int e = 0;
+		for (;p < end && *p >= '0' && *p <= '9';++p)
+			if (e < 10000) e = e*10+(*p-'0');
+		exponent += negativeExp?-e:e;
+	}
+
+	double v = (double)mantissa;
+	if (exponent >= 0 && exponent <= 22) v *= POW10[exponent];
+	else if (exponent < 0 && exponent >= -22) v /= POW10[-exponent];
+	else v *= pow(10.0, exponent);
+	value = (float)(negative?-v:v);
+	return true;
+}
+
+vector<float> RingProfile::parseFile(const string &filename)
+{
+	unique_ptr<MappedFile> file;
+	try
+	{
+		file.reset(new MappedFile(filename));
+	}
+	catch (const runtime_error &)
+	{
+		throw runtime_error("Can't open ring file " + filename);
+	}
+
+	const char *p = (const char*)file->getData();
+	const char *end = p+file->getSize();
+
+	vector<float> values;
+	// Profiles are written with a few characters per value
+	values.reserve(file->getSize()/8);
+	while (p < end)
+	{
+		if ((unsigned char)*p <= ' ')
+		{
+			++p;
+			continue;
+		}
+		float value;
+		if (!parseFloat(p, end, value) || (p < end && (unsigned char)*p > ' '))
+			throw runtime_error("Invalid value in ring file " + filename);
+		values.push_back(value);
+	}
+	return values;
+}
+
+RingProfile RingProfile::loadText(
+	const string &backscatFilename,
+	const string &forwardscatFilename,
+	const string &unlitFilename,
+	const string &transparencyFilename,
+	const string &colorFilename)
+{
+	const vector<float> backscat = parseFile(backscatFilename);
+	const vector<float> forwardscat = parseFile(forwardscatFilename);
+	const vector<float> unlit = parseFile(unlitFilename);
+	const vector<float> transparency = parseFile(transparencyFilename);
+	const vector<float> color = parseFile(colorFilename);
+
+	const size_t size = backscat.size();
+
+	// Check sizes
+	if (size == 0 ||
+		size != forwardscat.size() ||
+		size != unlit.size() ||
+		size != transparency.size() ||
+		size*3 != color.size())
+	{
+		throw runtime_error("Ring texture sizes don't match");
+	}
+
+	// Assemble values into two textures (back, forward and unlit, then color+transparency)
+	RingProfile profile;
+	profile._sampleCount = size;
+	profile._scattering.resize(size*3);
+	profile._color.resize(size*4);
+	for (size_t i=0;i<size;++i)
+	{
+		profile._scattering[i*3+0] = backscat[i];
+		profile._scattering[i*3+1] = forwardscat[i];
+		profile._scattering[i*3+2] = unlit[i];
+		profile._color[i*4+0] = color[i*3+0];
+		profile._color[i*4+1] = color[i*3+1];
+		profile._color[i*4+2] = color[i*3+2];
+		profile._color[i*4+3] = transparency[i];
+	}
+	return profile;
+}
+
+RingProfile RingProfile::loadPacked(const string &filename)
+{
+	MappedFile file(filename);
+	const uint8_t *data = file.getData();
+
+	Header header;
+	if (file.getSize() < sizeof(Header))
+		throw runtime_error("Truncated ring profile : " + filename);
+	memcpy(&header, data, sizeof(Header));
+	if (strncmp(header.magic, "RRNG", 4))
+		throw runtime_error("Not a ring profile : " + filename);
+	if (header.version != VERSION)
+		throw runtime_error("Unsupported ring profile version : " + filename);
+	const size_t size = header.sampleCount;
+	if (size == 0 || file.getSize() != sizeof(Header)+size*7*sizeof(float))
+		throw runtime_error("Truncated ring profile : " + filename);
+
+	RingProfile profile;
+	profile._sampleCount = size;
+	profile._scattering.resize(size*3);
+	profile._color.resize(size*4);
+	data += sizeof(Header);
+	memcpy(profile._scattering.data(), data, size*3*sizeof(float));
+	data += size*3*sizeof(float);
+	memcpy(profile._color.data(), data, size*4*sizeof(float));
+	return profile;
+}
+
+void RingProfile::savePacked(const string &filename) const
+{
+	ofstream out(filename, ios::binary);
+	if (!out)
+		throw runtime_error("Can't write ring profile " + filename);
+
+	Header header{};
+	memcpy(header.magic, "RRNG", 4);
+	header.version = VERSION;
+	header.sampleCount = _sampleCount;
+	out.write((const char*)&header, sizeof(Header));
+	out.write((const char*)_scattering.data(), _scattering.size()*sizeof(float));
+	out.write((const char*)_color.data(), _color.size()*sizeof(float));
+	if (!out)
+		throw runtime_error("Can't write ring profile " + filename);
+}
+
+size_t RingProfile::getSampleCount() const
+{
+	return _sampleCount;
+}
+
+const vector<float> &RingProfile::getScattering() const
+{
+	return _scattering;
+}
+
+const vector<float> &RingProfile::getColor() const
+{
+	return _color;
+}
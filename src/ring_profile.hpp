@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Radial profiles of a ring system, from inner to outer edge, assembled as
+ * the two ring textures expect them
+ *
+ * Profiles come either from five text files of whitespace separated values
+ * or from a single packed file written by ring_pack, which can be uploaded
+ * without any parsing. Packed layout (little endian):
+ * - Header
+ * - Scattering samples (3 floats each)
+ * - Color samples (4 floats each)
+ */
+class RingProfile
+{
+public:
+	/// Packed file header
+	struct Header
+	{
+		/// "RRNG"
+		char magic[4];
+		uint32_t version;
+		/// Number of samples of each profile
+		uint32_t sampleCount;
+		uint32_t padding;
+	};
+
+	/// Current packed format version
+	static const uint32_t VERSION = 1;
+
+	RingProfile() = default;
+	/**
+	 * Assembles profiles from text files
+	 * @param backscatFilename backscattering brightness amount
+	 * @param forwardscatFilename forward scattering brightness amount
+	 * @param unlitFilename unlit side brightness amount
+	 * @param transparencyFilename transparency amount
+	 * @param colorFilename ring color (3 values per sample)
+	 */
+	static RingProfile loadText(
+		const std::string &backscatFilename,
+		const std::string &forwardscatFilename,
+		const std::string &unlitFilename,
+		const std::string &transparencyFilename,
+		const std::string &colorFilename);
+	/**
+	 * Loads profiles from a packed file
+	 * @param filename packed file path
+	 */
+	static RingProfile loadPacked(const std::string &filename);
+	/**
+	 * Writes profiles to a packed file
+	 * @param filename packed file path
+	 */
+	void savePacked(const std::string &filename) const;
+	/**
+	 * Parses all the values of a text profile file
+	 * @param filename text file path
+	 */
+	static std::vector<float> parseFile(const std::string &filename);
+
+	/// Returns the number of samples of each profile
+	size_t getSampleCount() const;
+	/// Returns backscattering, forward scattering and unlit brightness (RGB)
+	const std::vector<float> &getScattering() const;
+	/// Returns color and transparency (RGBA)
+	const std::vector<float> &getColor() const;
+
+private:
+	size_t _sampleCount = 0;
+	std::vector<float> _scattering;
+	std::vector<float> _color;
+};
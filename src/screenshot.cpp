@@ -1,101 +1,197 @@
 #include "screenshot.hpp"
+#include "cpu_profiler.hpp"
 
 #include <iostream>
-#include <memory>
+#include <algorithm>
+#include <cstring>
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "thirdparty/stb_image_write.h"
 
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define PIPE_MODE "wb"
+#else
+#define PIPE_MODE "w"
+#endif
+
 using namespace std;
 
-Screenshot::Screenshot()
+Screenshot::~Screenshot()
 {
-	_t = thread([this]{
-		while (true)
-		{
-			{
-				unique_lock<mutex> lk(_mtx);
-				_cond.wait(lk, [&]{return _killThread || _save;});
-				if (_killThread) return;
-			}
+	{
+		lock_guard<mutex> lk(_mtx);
+		_killThread = true;
+	}
+	_cond.notify_all();
+
+	for (auto &t : _threads)
+		t.join();
+
+	if (_pipe) pclose(_pipe);
+}
+
+void Screenshot::init(int threads)
+{
+	if (threads <= 0)
+		threads = max((int)thread::hardware_concurrency(), 1);
+
+	for (int i=0;i<threads;++i)
+		_threads.emplace_back(&Screenshot::work, this);
+}
+
+size_t Screenshot::getPendingCount()
+{
+	lock_guard<mutex> lk(_mtx);
+	return _images.size();
+}
+
+bool Screenshot::openPipe(const string &command)
+{
+	lock_guard<mutex> lk(_mtx);
+	if (_pipe) return false;
+	_pipe = popen(command.c_str(), PIPE_MODE);
+	_pipeImages = 0;
+	_pipeWritten = 0;
+	_closePipe = false;
+	return _pipe != nullptr;
+}
 
-			// Create temp buffer for operations
-			vector<uint8_t> buffer(4*_width*_height);
+void Screenshot::closePipe()
+{
+	lock_guard<mutex> lk(_mtx);
+	if (!_pipe) return;
+	if (_pipeWritten == _pipeImages)
+	{
+		pclose(_pipe);
+		_pipe = nullptr;
+	}
+	else _closePipe = true;
+}
 
-			// Flip upside down
-			for (int i=0;i<_height;++i)
+Screenshot::Image Screenshot::begin(
+	const string &filename,
+	const int width,
+	const int height,
+	const int tiles)
+{
+	lock_guard<mutex> lk(_mtx);
+	const Image image = _nextImage++;
+	ImageInfo &info = _images[image];
+	info.filename = filename;
+	info.width = width;
+	info.height = height;
+	info.remainingTiles = tiles;
+	info.pipeIndex = filename.empty()?_pipeImages++:0;
+	return image;
+}
+
+void Screenshot::addTile(
+	const Image image,
+	const int x, const int y,
+	const int width, const int height,
+	const Format format,
+	const uint8_t *data,
+	const function<void()> &release,
+	const bool topDown)
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		_jobs.push_back([=]{
+			// Map nodes don't move, tiles of the same image are copied
+			// concurrently without holding the lock
+			ImageInfo *info;
 			{
-				memcpy(buffer.data()+i*_width*4, 
-					_data.data()+(_height-i-1)*_width*4, 
-					_width*4);
+				lock_guard<mutex> lk(_mtx);
+				info = &_images.at(image);
+				// Allocated by the first tile, not by the rendering thread
+				if (info->data.empty()) info->data.resize(4*info->width*info->height);
 			}
 
-			// Flip GL_BGRA to GL_RGBA
-			if (_format == Format::BGRA8)
+			// Flip upside down into place
+			const int w = min(width, info->width-x);
+			for (int i=0;i<height && y+i < info->height;++i)
 			{
-				for (int i=0;i<_width*_height*4;i+=4)
+				uint8_t *row = info->data.data()+
+					((info->height-(y+i)-1)*info->width+x)*4;
+				const int srcRow = topDown?height-1-i:i;
+				memcpy(row, data+srcRow*width*4, w*4);
+
+				// Flip GL_BGRA to GL_RGBA
+				if (format == Format::BGRA8)
 				{
-					swap(buffer[i+0], buffer[i+2]);
+					for (int j=0;j<w*4;j+=4)
+					{
+						swap(row[j+0], row[j+2]);
+					}
 				}
 			}
+			release();
 
-			// Save screenshot
-			if (!stbi_write_png(_filename.c_str(), 
-				_width, _height, 4,
-				buffer.data(), _width*4))
 			{
-				cout << "WARNING : Can't save screenshot " << 
-					_filename << endl;
+				lock_guard<mutex> lk(_mtx);
+				if (--info->remainingTiles > 0) return;
 			}
 
+			// Save screenshot
+			if (info->filename.empty())
 			{
-				lock_guard<mutex> lk(_mtx);
-				_save = false;
+				writePipe(*info);
+			}
+			else if (!stbi_write_png(info->filename.c_str(), 
+				info->width, info->height, 4,
+				info->data.data(), info->width*4))
+			{
+				cout << "WARNING : Can't save screenshot " << 
+					info->filename << endl;
 			}
-		}
-	});
-}
 
-Screenshot::~Screenshot()
-{
-	{
-		lock_guard<mutex> lk(_mtx);
-		_killThread = true;
+			lock_guard<mutex> lk(_mtx);
+			_images.erase(image);
+		});
 	}
 	_cond.notify_one();
-
-	_t.join();
 }
 
-bool Screenshot::isSaving()
+void Screenshot::writePipe(const ImageInfo &info)
 {
+	unique_lock<mutex> lk(_mtx);
+	// Jobs are run in order, so earlier images are already being copied by
+	// other workers
+	_pipeCond.wait(lk, [&]{ return _pipeWritten == info.pipeIndex;});
+	if (_pipe)
 	{
-		unique_lock<mutex> lk(_mtx, defer_lock);
-		if (lk.try_lock())
-		{
-			return _save;
-		}
+		lk.unlock();
+		const size_t size = info.data.size();
+		if (fwrite(info.data.data(), 1, size, _pipe) != size)
+			cout << "WARNING : Can't write frame to pipe" << endl;
+		lk.lock();
 	}
-	return true;
+	++_pipeWritten;
+	if (_closePipe && _pipeWritten == _pipeImages)
+	{
+		pclose(_pipe);
+		_pipe = nullptr;
+		_closePipe = false;
+	}
+	_pipeCond.notify_all();
 }
 
-void Screenshot::save(
-	const string &filename,
-	const int width,
-	const int height,
-	const Format format,
-	const vector<uint8_t> &data)
+void Screenshot::work()
 {
-	if (isSaving()) return;
-
+	CPUProfiler::setThreadName("Screenshot");
+	while (true)
 	{
-		lock_guard<mutex> lk(_mtx);
-		_save = true;
-		_filename = filename;
-		_width = width;
-		_height = height;
-		_format = format;
-		_data = data;
+		function<void()> job;
+		{
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [this]{ return _killThread || !_jobs.empty();});
+			if (_jobs.empty()) return;
+			job = move(_jobs.front());
+			_jobs.pop_front();
+		}
+		CPUProfiler::Scope scope("Screenshot job");
+		job();
 	}
-	_cond.notify_one();
-}
\ No newline at end of file
+}
@@ -2,13 +2,26 @@
 
 #include <string>
 #include <vector>
+#include <deque>
+#include <map>
 #include <thread>
 #include <condition_variable>
 #include <mutex>
+#include <functional>
 #include <utility>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
 
 /**
- * Asynchronously saves images to file system
+ * Asynchronously assembles and saves images to file system
+ *
+ * An image is made of one or more tiles, given as they are read back. Tiles
+ * are copied into the image by worker threads and the image is encoded by a
+ * worker thread once its last tile is copied, so several images can be
+ * encoded at the same time while the calling thread keeps rendering.
+ * Images without a filename are written as raw RGBA to a pipe instead, in
+ * the order they were started, to feed a video encoder.
  */
 class Screenshot
 {
@@ -18,45 +31,106 @@ public:
 	{
 		RGBA8, BGRA8
 	};
+	/// Image id
+	typedef size_t Image;
 
-	Screenshot();
+	Screenshot() = default;
+	Screenshot(const Screenshot &) = delete;
+	Screenshot &operator=(const Screenshot &) = delete;
+	/// Waits for the tiles already given to be saved
 	~Screenshot();
-	/// Check whether an image is currently being saved
-	bool isSaving();
-	/** Asynchronously saves an image to file system
-	 * @param filename file to save to
+	/**
+	 * Starts the worker threads
+	 * @param threads number of worker threads, 0 for the number of cores
+	 */
+	void init(int threads);
+	/// Returns the number of images started and not saved yet
+	size_t getPendingCount();
+	/** Starts a command receiving images without filename on its standard input
+	 * @param command shell command
+	 * @return false if the command can't be started or the previous one
+	 * still has images to write
+	 */
+	bool openPipe(const std::string &command);
+	/// Closes the pipe once the images started before are written
+	void closePipe();
+	/** Starts an image, saved once all of its tiles are given
+	 * @param filename file to save to, empty to write it to the pipe
 	 * @param width width of the image in pixels
 	 * @param height height of the image in pixels
-	 * @param format @see Format
-	 * @param data pixel data of the image
+	 * @param tiles number of tiles covering the image
+	 * @return id of the image
 	 */
-	void save(
-		const std::string &filename, 
+	Image begin(
+		const std::string &filename,
 		int width,
 		int height,
+		int tiles);
+	/** Queues a tile of an image to be copied, pixel rows are bottom-up
+	 * unless topDown is set
+	 * @param image id returned by begin()
+	 * @param x left of the tile in the image in pixels
+	 * @param y bottom of the tile in the image in pixels (from the bottom)
+	 * @param width width of the tile in pixels
+	 * @param height height of the tile in pixels
+	 * @param format @see Format
+	 * @param data pixel data of the tile, must stay valid until release is called
+	 * @param release called from a worker thread once data isn't read anymore
+	 * @param topDown whether the first row of data is the top one
+	 */
+	void addTile(
+		Image image,
+		int x, int y,
+		int width, int height,
 		Format format,
-		const std::vector<uint8_t> &data);
+		const uint8_t *data,
+		const std::function<void()> &release,
+		bool topDown=false);
 
 private:
-	/// Image saving thread
-	std::thread _t;
-	/// Synchronizes _save and _killThread
+	/// Image being assembled
+	struct ImageInfo
+	{
+		/// Where to save the image
+		std::string filename;
+		/// Width of the image in pixels
+		int width;
+		/// Height of the image in pixels
+		int height;
+		/// Tiles not copied yet
+		int remainingTiles;
+		/// Order among the images written to the pipe
+		size_t pipeIndex;
+		/// RGBA pixel data of the image, top-down rows
+		std::vector<uint8_t> data;
+	};
+
+	/// Worker thread function
+	void work();
+	/// Writes an image to the pipe after the ones started before it
+	void writePipe(const ImageInfo &info);
+
+	std::vector<std::thread> _threads;
+	/// Images started and not saved yet
+	std::map<Image, ImageInfo> _images;
+	/// Id of the next image
+	Image _nextImage = 0;
+	/// Tile copies and encodings waiting for a worker
+	std::deque<std::function<void()>> _jobs;
+	/// Command receiving raw images, nullptr if none
+	FILE *_pipe = nullptr;
+	/// Number of images started for the pipe
+	size_t _pipeImages = 0;
+	/// Number of images written to the pipe
+	size_t _pipeWritten = 0;
+	/// Whether the pipe is closed after the last image started
+	bool _closePipe = false;
+	/// Signals threads to terminate themselves once jobs are done
+	bool _killThread = false;
+	/// Synchronizes everything above, except _threads and image pixels
 	std::mutex _mtx;
-	/// Waits on _save and _killThread
+	/// Wakes workers up when a job is queued
 	std::condition_variable _cond;
-	/// Signals the thread to save an image
-	bool _save = false;
-	/// Signals the thread to terminate itself
-	bool _killThread = false;
-
-	/// Where to save the image
-	std::string _filename = "";
-	/// Width of the image in pixels
-	int _width = 0;
-	/// Height of the image in pixels
-	int _height = 0;
-	/// Format of the image
-	Format _format = Format::RGBA8;
-	/// Pixel data of the image
-	std::vector<uint8_t> _data;
-};
\ No newline at end of file
+	/// Wakes workers waiting for their turn to write to the pipe
+	std::condition_variable _pipeCond;
+};
@@ -2,7 +2,12 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <iomanip>
 #include <algorithm>
+#include <functional>
+#include <cstring>
+#include <cstdint>
 
 using namespace std;
 
@@ -14,30 +19,62 @@ ShaderPipeline::ShaderPipeline(GLuint id)
 ShaderPipeline::ShaderPipeline(ShaderPipeline &&pipeline)
 {
 	_id = pipeline._id;
+	_pending = move(pipeline._pending);
 	pipeline._id = 0;
+	pipeline._pending.clear();
 }
 
 ShaderPipeline &ShaderPipeline::operator=(ShaderPipeline &&pipeline)
 {
-	if (_id && pipeline._id != _id) glDeleteProgramPipelines(1, &_id);
+	if (&pipeline == this) return *this;
+	release();
 	_id = pipeline._id;
+	_pending = move(pipeline._pending);
 	pipeline._id = 0;
+	pipeline._pending.clear();
 	return *this;
 }
 
 ShaderPipeline::~ShaderPipeline()
 {
+	release();
+}
+
+void ShaderPipeline::release()
+{
+	for (const auto &stage : _pending)
+	{
+		glDeleteShader(stage.shader);
+		glDeleteProgram(stage.program);
+	}
+	_pending.clear();
 	if (_id) glDeleteProgramPipelines(1, &_id);
+	_id = 0;
 }
 
 void ShaderPipeline::bind()
 {
+	if (!_pending.empty()) finish();
 	glBindProgramPipeline(_id);
 }
 
+bool ShaderPipeline::isReady() const
+{
+	if (!GLEW_KHR_parallel_shader_compile) return true;
+	for (const auto &stage : _pending)
+	{
+		GLint done = GL_FALSE;
+		glGetProgramiv(stage.program, GL_COMPLETION_STATUS_KHR, &done);
+		if (!done) return false;
+	}
+	return true;
+}
+
 ShaderFactory::ShaderFactory()
 {
 	setVersion(450);
+	// Let the driver use as many threads as it wants
+	if (GLEW_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
 }
 
 void ShaderFactory::setVersion(int version)
@@ -75,6 +112,32 @@ void ShaderFactory::setSandbox(const string &filename)
 	_sandbox = loadSource(_folder, filename);
 }
 
+void ShaderFactory::setCacheFolder(const string &folder)
+{
+	GLint formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+	_cacheFolder = (formats > 0)?folder:"";
+
+	_driver = 
+		string((const char*)glGetString(GL_VENDOR)) + "\n" +
+		string((const char*)glGetString(GL_RENDERER)) + "\n" +
+		string((const char*)glGetString(GL_VERSION)) + "\n";
+}
+
+/// Returns whether the shader compiled successfully and error log
+static pair<bool, string> checkShader(const GLuint shader)
+{
+	GLint success = 0;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+
+	string log;
+	int length = 2048;
+	log.resize(length);
+	glGetShaderInfoLog(shader, log.size(), &length, &log[0]);
+	log.resize(length);
+	return make_pair(success!=0, log);
+}
+
 /// Returns whether the shader program compiled successfully and error log
 static pair<bool, string> checkShaderProgram(const GLuint program)
 {
@@ -89,24 +152,165 @@ static pair<bool, string> checkShaderProgram(const GLuint program)
 	return make_pair(success!=0, log);
 }
 
-/// Creates a shader and check errors
-static GLuint createShader(const GLenum type, const string &source)
+/// Starts compiling and linking a separable shader program, without waiting
+static void startShader(const GLenum type, const string &source,
+	GLuint &shader, GLuint &program)
 {
 	const char *cstr = source.c_str();
 
-	const GLuint program = glCreateShaderProgramv(type, 1, &cstr);
+	// Same as glCreateShaderProgramv, but the binary can be retrieved
+	shader = glCreateShader(type);
+	glShaderSource(shader, 1, &cstr, nullptr);
+	glCompileShader(shader);
+
+	program = glCreateProgram();
+	glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glAttachShader(program, shader);
+	// Linking fails if compilation did, the compile log is checked after
+	glLinkProgram(program);
+}
+
+/// Waits for a shader program and checks errors
+static void finishShader(const GLuint shader, const GLuint program)
+{
+	const auto compileRes = checkShader(shader);
 	const auto res = checkShaderProgram(program);
+	if (!compileRes.first)
+		throw runtime_error(string("Can't create shader : ") + compileRes.second);
 	if (!res.first)
 		throw runtime_error(string("Can't create shader : ") + res.second);
-	else
+
+	const string log = compileRes.second + res.second;
+	if (!log.empty())
+		cout << "Warning: " << log << endl;
+}
+
+/// Program binary cache file header
+struct BinaryHeader
+{
+	/// "RSHB"
+	char magic[4];
+	uint32_t version;
+	/// Driver binary format
+	uint32_t format;
+	/// Size of the key stored after the header
+	uint32_t keySize;
+	/// Size of the binary stored after the key
+	uint32_t binarySize;
+};
+
+static const uint32_t BINARY_VERSION = 1;
+
+/// Returns a program from a cache file, 0 if missing or not for this key
+static GLuint loadBinary(const string &filename, const string &key)
+{
+	ifstream in(filename, ios::binary);
+	BinaryHeader header;
+	in.read((char*)&header, sizeof(header));
+	if (!in || strncmp(header.magic, "RSHB", 4) || header.version != BINARY_VERSION ||
+		header.keySize != key.size())
+		return 0;
+
+	// The full key rules out hash collisions
+	string fileKey(header.keySize, '\0');
+	in.read(&fileKey[0], fileKey.size());
+	if (!in || fileKey != key) return 0;
+	vector<char> binary(header.binarySize);
+	in.read(binary.data(), binary.size());
+	if (!in) return 0;
+
+	const GLuint program = glCreateProgram();
+	glProgramParameteri(program, GL_PROGRAM_SEPARABLE, GL_TRUE);
+	glProgramBinary(program, header.format, binary.data(), binary.size());
+	// Drivers may reject binaries after an update with the same strings
+	GLint success = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &success);
+	if (!success)
 	{
-		if (!res.second.empty())
-			cout << "Warning: " << res.second << endl;
+		glDeleteProgram(program);
+		return 0;
 	}
-
 	return program;
 }
 
+/// Writes the binary of a program to a cache file
+static void saveBinary(const string &filename, const string &key, const GLuint program)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	vector<char> binary(length);
+	GLenum format = 0;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	// Not being able to write the cache only costs the compilation next time
+	ofstream out(filename, ios::binary);
+	if (!out) return;
+	BinaryHeader header{};
+	memcpy(header.magic, "RSHB", 4);
+	header.version = BINARY_VERSION;
+	header.format = format;
+	header.keySize = key.size();
+	header.binarySize = length;
+	out.write((const char*)&header, sizeof(header));
+	out.write(key.data(), key.size());
+	out.write(binary.data(), length);
+}
+
+GLuint ShaderFactory::createProgram(const GLenum type, const string &filename,
+	const string &source, ShaderPipeline::PendingStage &stage)
+{
+	string key = "";
+	string cacheFilename = "";
+	if (!_cacheFolder.empty())
+	{
+		key = _driver + to_string(type) + "\n" + source;
+		stringstream ss;
+		ss << _cacheFolder << "shader_" << hex << setw(16) << setfill('0') <<
+			(uint64_t)hash<string>()(key) << ".bin";
+		cacheFilename = ss.str();
+
+		const GLuint cached = loadBinary(cacheFilename, key);
+		if (cached) return cached;
+	}
+
+	stage.type = type;
+	startShader(type, source, stage.shader, stage.program);
+	stage.filename = filename;
+	stage.cacheFilename = cacheFilename;
+	stage.cacheKey = move(key);
+	return 0;
+}
+
+GLbitfield shaderTypeToStage(GLenum type);
+
+void ShaderPipeline::finish()
+{
+	while (!_pending.empty())
+	{
+		const PendingStage stage = _pending.back();
+		_pending.pop_back();
+
+		try
+		{
+			finishShader(stage.shader, stage.program);
+		}
+		catch (const runtime_error &e)
+		{
+			glDeleteShader(stage.shader);
+			glDeleteProgram(stage.program);
+			throw runtime_error("Error in file " + stage.filename + " : " + e.what());
+		}
+		glDetachShader(stage.program, stage.shader);
+		glDeleteShader(stage.shader);
+
+		if (!stage.cacheFilename.empty())
+			saveBinary(stage.cacheFilename, stage.cacheKey, stage.program);
+		glUseProgramStages(_id, shaderTypeToStage(stage.type), stage.program);
+	}
+}
+
 static string formatDefine(const string &define)
 {
 	return "#define " + define + "\n";
@@ -142,6 +346,8 @@ ShaderPipeline ShaderFactory::createPipeline(
 
 	const std::string preSource = _versionHeader + definesStr + _sandbox;
 
+	ShaderPipeline pipeline(pipelineId);
+
 	// Load sources from filenames
 	for (auto stageFilename : stageFilenames)
 	{
@@ -163,16 +369,12 @@ ShaderPipeline ShaderFactory::createPipeline(
 
 		const GLenum type = stageFilename.first;
 		const string finalSource = preSource + source;
-		try
-		{
-			const GLuint shadId = createShader(type, finalSource);
+		ShaderPipeline::PendingStage stage;
+		const GLuint shadId = createProgram(type, filename, finalSource, stage);
+		if (shadId)
 			glUseProgramStages(pipelineId, shaderTypeToStage(type), shadId);
-		}
-		catch (const runtime_error &e)
-		{
-			throw runtime_error("Error in file " + filename + " : " + e.what());
-		}
-		
+		else
+			pipeline._pending.push_back(stage);
 	}
-	return ShaderPipeline(pipelineId);
+	return pipeline;
 }
\ No newline at end of file
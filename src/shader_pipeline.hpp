@@ -9,6 +9,11 @@
 /**
  * Shader Pipeline generated from ShaderFactory.
  * call bind() to make subsequent draw or dispatch calls use this pipeline.
+ *
+ * Stages not found in the binary cache are still being compiled by the
+ * driver when the pipeline is created. isReady() tells without blocking
+ * whether they are done (with KHR_parallel_shader_compile), finish() waits
+ * for them and checks errors, and is called by the first bind() otherwise.
  */
 class ShaderPipeline
 {
@@ -27,8 +32,40 @@ public:
 
 	/// Use pipeline for subsequent draw calls or compute dispatchs
 	void bind();
+	/**
+	 * Indicates whether finish() won't wait for the driver. Always true
+	 * without KHR_parallel_shader_compile, as compilation can't be queried
+	 */
+	bool isReady() const;
+	/**
+	 * Waits for the stages being compiled and adds them to the pipeline
+	 * @throw runtime_error if a stage doesn't compile
+	 */
+	void finish();
+
 private:
+	friend class ShaderFactory;
+
+	/// Stage compiled asynchronously
+	struct PendingStage
+	{
+		GLenum type;
+		/// Source filename, for errors
+		std::string filename;
+		GLuint shader;
+		GLuint program;
+		/// Binary cache file to write, empty if the cache is disabled
+		std::string cacheFilename;
+		/// Key stored in the cache file
+		std::string cacheKey;
+	};
+
+	/// Deletes objects of stages not finished
+	void release();
+
 	GLuint _id = 0; /// OpenGL pipeline ID
+	/// Stages not added to the pipeline yet
+	std::vector<PendingStage> _pending;
 };
 
 /**
@@ -45,7 +82,15 @@ public:
 	/// Sets sandbox file to be prepended to all source files
 	void setSandbox(const std::string &filename);
 	/**
-	 * Creates Shader Pipeline from source files
+	 * Sets folder where compiled program binaries are cached, so that later
+	 * runs don't compile shaders again. Needs a current context, ignored if
+	 * the driver has no binary format
+	 * @param folder cache folder, empty to disable the cache
+	 */
+	void setCacheFolder(const std::string &folder);
+	/**
+	 * Creates Shader Pipeline from source files, all the compilations
+	 * being started without waiting for them
 	 * @param stageFilenames pairs of stages and source filenames
 	 * @param defines constants to be defined in the source files
 	 * @return new Shader Pipeline
@@ -55,6 +100,18 @@ public:
 		const std::vector<std::string> &defines = {});
 
 private:
+	/**
+	 * Creates the separable program of a stage from the cache, or starts
+	 * compiling it
+	 * @param type shader stage
+	 * @param filename source filename, for errors
+	 * @param source full source code
+	 * @return program id if loaded from the cache, else 0 and the stage
+	 * being compiled
+	 */
+	GLuint createProgram(GLenum type, const std::string &filename,
+		const std::string &source, ShaderPipeline::PendingStage &stage);
+
 	/// GLSL version header
 	std::string _versionHeader = "";
 	/// Base folder
@@ -63,5 +120,9 @@ private:
 	std::string _sandbox = "";
 	/// filename->source map for caching
 	std::map<std::string, std::string> _sourceCache; 
+	/// Program binary cache folder, empty if disabled
+	std::string _cacheFolder = "";
+	/// Vendor, renderer and version strings, binaries are only valid for them
+	std::string _driver = "";
 };
 
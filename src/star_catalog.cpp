@@ -0,0 +1,95 @@
+#include "star_catalog.hpp"
+#include "mapped_file.hpp"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/packing.hpp>
+
+#include <fstream>
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+using namespace std;
+using namespace glm;
+
+StarCatalog StarCatalog::loadText(const string &filename)
+{
+	ifstream in(filename);
+	if (!in) throw runtime_error("Can't open star catalog " + filename);
+
+	StarCatalog catalog;
+	float ra, dec, magnitude, colorIndex;
+	while (in >> ra >> dec >> magnitude >> colorIndex)
+	{
+		// Same convention as the rotation axes of entities
+		const float a = radians(ra);
+		const float d = radians(dec);
+		Star star;
+		star.direction[0] = -sin(a)*cos(d);
+		star.direction[1] =  cos(a)*cos(d);
+		star.direction[2] =  sin(d);
+		star.magnitudeColor = packHalf2x16(vec2(magnitude, colorIndex));
+		catalog._stars.push_back(star);
+	}
+	if (!in.eof())
+		throw runtime_error("Invalid value in star catalog " + filename);
+
+	stable_sort(catalog._stars.begin(), catalog._stars.end(),
+		[](const Star &a, const Star &b){ return getMagnitude(a) < getMagnitude(b);});
+	return catalog;
+}
+
+StarCatalog StarCatalog::loadPacked(const string &filename)
+{
+	MappedFile file(filename);
+	const uint8_t *data = file.getData();
+
+	Header header;
+	if (file.getSize() < sizeof(Header))
+		throw runtime_error("Truncated star catalog : " + filename);
+	memcpy(&header, data, sizeof(Header));
+	if (strncmp(header.magic, "RSTR", 4))
+		throw runtime_error("Not a star catalog : " + filename);
+	if (header.version != VERSION)
+		throw runtime_error("Unsupported star catalog version : " + filename);
+	const size_t count = header.starCount;
+	if (file.getSize() != sizeof(Header)+count*sizeof(Star))
+		throw runtime_error("Truncated star catalog : " + filename);
+
+	StarCatalog catalog;
+	catalog._stars.resize(count);
+	memcpy(catalog._stars.data(), data+sizeof(Header), count*sizeof(Star));
+	return catalog;
+}
+
+void StarCatalog::savePacked(const string &filename) const
+{
+	ofstream out(filename, ios::binary);
+	if (!out)
+		throw runtime_error("Can't write star catalog " + filename);
+
+	Header header{};
+	memcpy(header.magic, "RSTR", 4);
+	header.version = VERSION;
+	header.starCount = _stars.size();
+	out.write((const char*)&header, sizeof(Header));
+	out.write((const char*)_stars.data(), _stars.size()*sizeof(Star));
+	if (!out)
+		throw runtime_error("Can't write star catalog " + filename);
+}
+
+const vector<StarCatalog::Star> &StarCatalog::getStars() const
+{
+	return _stars;
+}
+
+size_t StarCatalog::getCountBrighterThan(const float magnitude) const
+{
+	return partition_point(_stars.begin(), _stars.end(),
+		[=](const Star &s){ return getMagnitude(s) < magnitude;})-_stars.begin();
+}
+
+float StarCatalog::getMagnitude(const Star &star)
+{
+	return unpackHalf2x16(star.magnitudeColor).x;
+}
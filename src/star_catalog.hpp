@@ -0,0 +1,72 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Background stars, sorted from brightest to faintest so that the stars
+ * above a magnitude limit are a prefix of the list
+ *
+ * Catalogs come either from a text file of four whitespace separated values
+ * per star (right ascension and declination in degrees, visual magnitude and
+ * B-V color index) or from a packed file written by star_pack, which can be
+ * uploaded without any parsing. Packed layout (little endian):
+ * - Header
+ * - Stars
+ */
+class StarCatalog
+{
+public:
+	/// Packed file header
+	struct Header
+	{
+		/// "RSTR"
+		char magic[4];
+		uint32_t version;
+		/// Number of stars
+		uint32_t starCount;
+		uint32_t padding;
+	};
+
+	/// Star as stored in packed files and read by the culling shader (std430 vec4)
+	struct Star
+	{
+		/// Unit direction, in the frame of rotation axes
+		float direction[3];
+		/// Visual magnitude (low half) and B-V color index (high half) as
+		/// half floats
+		uint32_t magnitudeColor;
+	};
+
+	/// Current packed format version
+	static const uint32_t VERSION = 1;
+
+	StarCatalog() = default;
+	/**
+	 * Parses a text catalog
+	 * @param filename text file path
+	 */
+	static StarCatalog loadText(const std::string &filename);
+	/**
+	 * Loads a packed catalog
+	 * @param filename packed file path
+	 */
+	static StarCatalog loadPacked(const std::string &filename);
+	/**
+	 * Writes a packed catalog
+	 * @param filename packed file path
+	 */
+	void savePacked(const std::string &filename) const;
+
+	/// Returns all stars, brightest first
+	const std::vector<Star> &getStars() const;
+	/// Returns the number of stars brighter than a magnitude
+	size_t getCountBrighterThan(float magnitude) const;
+	/// Returns the visual magnitude of a star
+	static float getMagnitude(const Star &star);
+
+private:
+	std::vector<Star> _stars;
+};
@@ -0,0 +1,169 @@
+#include "task_graph.hpp"
+#include "cpu_profiler.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+
+using namespace std;
+
+TaskGraph::~TaskGraph()
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		_killThread = true;
+	}
+	_cond.notify_all();
+	for (auto &t : _threads)
+		t.join();
+}
+
+void TaskGraph::init(int threads)
+{
+	if (threads <= 0)
+		threads = max((int)thread::hardware_concurrency(), 1);
+
+	for (int i=0;i<threads;++i)
+		_threads.emplace_back(&TaskGraph::work, this);
+}
+
+TaskGraph::Task TaskGraph::add(const string &name, const Function &function,
+	const vector<Task> &dependencies)
+{
+	Task task;
+	{
+		lock_guard<mutex> lk(_mtx);
+		task = _tasks.size();
+		for (const Task dep : dependencies)
+		{
+			if (dep >= task)
+				throw runtime_error("Task " + name + " depends on an unknown task");
+		}
+
+		TaskInfo info{name, function, State::WAITING, 0, {}, nullptr};
+		for (const Task dep : dependencies)
+		{
+			TaskInfo &d = _tasks[dep];
+			if (d.state != State::DONE)
+			{
+				d.dependents.push_back(task);
+				++info.remaining;
+			}
+			else if (d.error && !info.error)
+			{
+				info.error = d.error;
+			}
+		}
+		_tasks.push_back(move(info));
+
+		TaskInfo &t = _tasks[task];
+		if (t.remaining == 0)
+		{
+			if (t.error)
+			{
+				finish(task, t.error);
+			}
+			else
+			{
+				t.state = State::READY;
+				_ready.push_back(task);
+			}
+		}
+	}
+	_cond.notify_one();
+	_doneCond.notify_all();
+	return task;
+}
+
+bool TaskGraph::isDone(const Task task)
+{
+	lock_guard<mutex> lk(_mtx);
+	const TaskInfo &t = _tasks.at(task);
+	if (t.state != State::DONE) return false;
+	if (t.error) rethrow_exception(t.error);
+	return true;
+}
+
+void TaskGraph::wait(const Task task)
+{
+	unique_lock<mutex> lk(_mtx);
+	if (task >= _tasks.size()) throw runtime_error("Waiting for an unknown task");
+	_doneCond.wait(lk, [&]{ return _tasks[task].state == State::DONE;});
+	if (_tasks[task].error) rethrow_exception(_tasks[task].error);
+}
+
+size_t TaskGraph::getTaskCount()
+{
+	lock_guard<mutex> lk(_mtx);
+	return _tasks.size();
+}
+
+size_t TaskGraph::getDoneCount()
+{
+	lock_guard<mutex> lk(_mtx);
+	return _doneCount;
+}
+
+void TaskGraph::work()
+{
+	CPUProfiler::setThreadName("Startup task");
+	while (true)
+	{
+		Task task;
+		Function function;
+		{
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [this]{ return _killThread || !_ready.empty();});
+			if (_killThread) return;
+			task = _ready.front();
+			_ready.pop_front();
+			_tasks[task].state = State::RUNNING;
+			// _tasks may grow while the task runs
+			function = _tasks[task].function;
+		}
+
+		exception_ptr error;
+		try
+		{
+			CPUProfiler::Scope scope("Startup task");
+			function();
+		}
+		catch (...)
+		{
+			error = current_exception();
+		}
+
+		{
+			lock_guard<mutex> lk(_mtx);
+			finish(task, error);
+		}
+		_cond.notify_all();
+		_doneCond.notify_all();
+	}
+}
+
+void TaskGraph::finish(const Task task, const exception_ptr error)
+{
+	TaskInfo &t = _tasks[task];
+	t.state = State::DONE;
+	t.error = error;
+	t.function = nullptr;
+	++_doneCount;
+	for (const Task dep : t.dependents)
+	{
+		TaskInfo &d = _tasks[dep];
+		if (error && !d.error) d.error = error;
+		if (--d.remaining == 0)
+		{
+			if (d.error)
+			{
+				// Skipped
+				finish(dep, d.error);
+			}
+			else
+			{
+				d.state = State::READY;
+				_ready.push_back(dep);
+			}
+		}
+	}
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <cstddef>
+
+/**
+ * Runs independent startup tasks on worker threads, each one as soon as the
+ * tasks it depends on are done
+ *
+ * Unlike JobSystem loops, tasks are long and heterogeneous (file parsing,
+ * table generation...) and the thread adding them doesn't wait: it keeps
+ * polling isDone() while doing its own work, such as GL uploads that need
+ * the task results. A task whose dependency failed isn't run and fails with
+ * the same exception.
+ */
+class TaskGraph
+{
+public:
+	/// Task id, in the order tasks are added
+	typedef size_t Task;
+	typedef std::function<void()> Function;
+
+	TaskGraph() = default;
+	TaskGraph(const TaskGraph &) = delete;
+	TaskGraph &operator=(const TaskGraph &) = delete;
+	/// Waits for running tasks, tasks not started yet are dropped
+	~TaskGraph();
+	/**
+	 * Starts the worker threads
+	 * @param threads number of worker threads, 0 for the number of cores
+	 */
+	void init(int threads);
+	/**
+	 * Adds a task, started as soon as its dependencies are done
+	 * @param name task name, for progress display
+	 * @param function work of the task
+	 * @param dependencies tasks to wait for, added before this one
+	 * @return id of the task
+	 */
+	Task add(const std::string &name, const Function &function,
+		const std::vector<Task> &dependencies = {});
+	/**
+	 * Indicates whether a task is done, without waiting.
+	 * Rethrows the exception thrown by the task if it failed.
+	 */
+	bool isDone(Task task);
+	/// Waits for a task to be done, rethrows its exception if it failed
+	void wait(Task task);
+	/// Returns the number of tasks added
+	size_t getTaskCount();
+	/// Returns the number of tasks done
+	size_t getDoneCount();
+
+private:
+	enum class State
+	{
+		WAITING, READY, RUNNING, DONE
+	};
+
+	struct TaskInfo
+	{
+		std::string name;
+		Function function;
+		State state;
+		/// Number of dependencies not done yet
+		size_t remaining;
+		/// Tasks depending on this one
+		std::vector<Task> dependents;
+		/// Exception thrown by the task or one of its dependencies
+		std::exception_ptr error;
+	};
+
+	/// Worker thread function
+	void work();
+	/// Marks a task as done and makes its dependents ready, _mtx held
+	void finish(Task task, std::exception_ptr error);
+
+	std::vector<std::thread> _threads;
+	std::vector<TaskInfo> _tasks;
+	/// Ready tasks, in the order they became ready
+	std::deque<Task> _ready;
+	size_t _doneCount = 0;
+	/// Signals threads to terminate themselves
+	bool _killThread = false;
+	/// Synchronizes everything above, except _threads
+	std::mutex _mtx;
+	/// Wakes workers up when a task is ready
+	std::condition_variable _cond;
+	/// Wakes waiting threads up when a task is done
+	std::condition_variable _doneCond;
+};
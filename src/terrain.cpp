@@ -0,0 +1,113 @@
+#include "terrain.hpp"
+
+#include <algorithm>
+
+using namespace glm;
+using namespace std;
+
+/// Face axes (u, v, normal), same as CUBE_FACES in sandbox.shad
+const mat3 CUBE_FACES[6] = {
+	mat3(vec3( 0, 1, 0), vec3( 0, 0, 1), vec3( 1, 0, 0)),
+	mat3(vec3( 0,-1, 0), vec3( 0, 0, 1), vec3(-1, 0, 0)),
+	mat3(vec3(-1, 0, 0), vec3( 0, 0, 1), vec3( 0, 1, 0)),
+	mat3(vec3( 1, 0, 0), vec3( 0, 0, 1), vec3( 0,-1, 0)),
+	mat3(vec3( 0, 1, 0), vec3(-1, 0, 0), vec3( 0, 0, 1)),
+	mat3(vec3( 0, 1, 0), vec3( 1, 0, 0), vec3( 0, 0,-1))
+};
+
+/// Faces are split at least once so that the texture seam lies on patch edges
+const int MIN_LEVEL = 1;
+
+TerrainQuadtree::TerrainQuadtree(const float lodFactor, const int maxLevel) :
+	_lodFactor{lodFactor},
+	_maxLevel{maxLevel}
+{
+
+}
+
+void TerrainQuadtree::select(const View &view, vector<TerrainPatch> &patches) const
+{
+	// View position in unit sphere space
+	const vec3 localViewPos = vec3(inverse(view.modelViewMat)*vec4(0,0,0,1));
+	for (int face=0;face<6;++face)
+	{
+		selectPatch(view, localViewPos, face, vec2(-1), 2.f, 0, patches);
+	}
+}
+
+void TerrainQuadtree::selectPatch(
+	const View &view,
+	const vec3 &localViewPos,
+	const int face,
+	const vec2 origin,
+	const float size,
+	const int level,
+	vector<TerrainPatch> &patches) const
+{
+	// 3x3 points of the patch projected on the sphere, at max height
+	vec3 points[9];
+	for (int i=0;i<3;++i)
+	{
+		for (int j=0;j<3;++j)
+		{
+			const vec2 f = origin+vec2(j, i)*(size*0.5f);
+			points[i*3+j] = normalize(CUBE_FACES[face]*vec3(f, 1.f))*
+				(1.f+view.maxHeight);
+		}
+	}
+
+	// Bounding sphere around the center point
+	const vec3 center = points[4];
+	float radius = 0.0;
+	for (const vec3 &p : points)
+		radius = std::max(radius, distance(center, p));
+	// Account for the curvature between points and the lowest terrain
+	radius = std::max(radius*1.2f, radius+view.maxHeight);
+
+	if (level >= MIN_LEVEL)
+	{
+		// Frustum culling
+		const vec3 viewCenter = vec3(view.modelViewMat*vec4(center, 1.0));
+		for (const vec4 &plane : view.frustum)
+		{
+			if (dot(viewCenter, vec3(plane))+plane.w >= radius*view.radius) return;
+		}
+		// Horizon culling
+		if (isBelowHorizon(localViewPos, points)) return;
+	}
+
+	// Split while the patch looks large
+	const float dist = std::max(distance(localViewPos, center)-radius, 1e-6f);
+	const float patchSize = distance(points[0], points[8]);
+	if (level < MIN_LEVEL || (level < _maxLevel && patchSize > _lodFactor*dist))
+	{
+		const float half = size*0.5f;
+		for (int i=0;i<2;++i)
+		{
+			for (int j=0;j<2;++j)
+			{
+				selectPatch(view, localViewPos, face,
+					origin+vec2(j, i)*half, half, level+1, patches);
+			}
+		}
+		return;
+	}
+
+	patches.push_back({vec4(origin, size, face)});
+}
+
+bool TerrainQuadtree::isBelowHorizon(
+	const vec3 &localViewPos, const vec3 points[9]) const
+{
+	// Occluded by the unit sphere if past the horizon plane and inside the
+	// cone of the sphere seen from the view
+	const float horizon = dot(localViewPos, localViewPos)-1.f;
+	if (horizon <= 0.0) return false;
+	for (int i=0;i<9;++i)
+	{
+		const vec3 toPoint = points[i]-localViewPos;
+		const float d = -dot(toPoint, localViewPos);
+		if (d <= horizon || d*d <= horizon*dot(toPoint, toPoint)) return false;
+	}
+	return true;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <vector>
+#include <array>
+
+#include <glm/glm.hpp>
+
+/// Square patch of a cube face, drawn as an instance of the patch grid (std430)
+struct TerrainPatch
+{
+	/// Corner in face coordinates (xy, from -1 to 1), size (z) and face index (w)
+	glm::vec4 originSize;
+};
+
+/**
+ * Selects the terrain patches of a body with a cube-sphere quadtree
+ *
+ * Each face of a cube projected on the unit sphere is split in four as long
+ * as its patches are large compared to their distance to the view, so that
+ * the number of triangles follows what is on screen. Patches outside of the
+ * frustum or fully below the horizon are dropped along with their children.
+ */
+class TerrainQuadtree
+{
+public:
+	/// Selection parameters
+	struct View
+	{
+		/// Body model matrix relative to view (unit sphere to view space)
+		glm::mat4 modelViewMat;
+		/// Radius of the body in view space units
+		float radius;
+		/// Highest displacement in body radii
+		float maxHeight;
+		/// View space planes of the frustum (pointing outwards)
+		std::array<glm::vec4, 5> frustum;
+	};
+
+	TerrainQuadtree() = default;
+	/**
+	 * @param lodFactor a patch is split when its size is larger than its
+	 * distance to the view times this factor
+	 * @param maxLevel maximum depth of the quadtree
+	 */
+	TerrainQuadtree(float lodFactor, int maxLevel);
+	/**
+	 * Appends the visible patches to draw
+	 * @param view selection parameters
+	 * @param patches output patches
+	 */
+	void select(const View &view, std::vector<TerrainPatch> &patches) const;
+
+private:
+	/// Visits a patch and its children
+	void selectPatch(const View &view, const glm::vec3 &localViewPos, int face,
+		glm::vec2 origin, float size, int level,
+		std::vector<TerrainPatch> &patches) const;
+	/// Returns whether the patch is fully hidden by the body
+	bool isBelowHorizon(const glm::vec3 &localViewPos, const glm::vec3 points[9]) const;
+
+	float _lodFactor = 1.0;
+	int _maxLevel = 10;
+};
@@ -0,0 +1,45 @@
+#include "texture_info.hpp"
+
+#include <SHAUN/sweeper.hpp>
+#include <SHAUN/parser.hpp>
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+int clampLevels(const int levels, const int size, const int maxSize)
+{
+	int maxRows = maxSize/(size*2);
+	int maxLevel = (int)floor(log2(maxRows))+1;
+	return max(1,min(levels, maxLevel));
+}
+
+TexInfo parseInfoFile(const string &filename, int maxSize)
+{
+	try
+	{
+		shaun::object obj = shaun::parse_file(filename);
+		shaun::sweeper swp(obj);
+
+		TexInfo info{};
+		info.size = swp("size").value<shaun::number>();
+		info.levels = swp("levels").value<shaun::number>();
+		string prefix = swp("prefix").value<shaun::string>();
+		string separator = swp("separator").value<shaun::string>();
+		string suffix = swp("suffix").value<shaun::string>();
+		info.prefix = prefix;
+		info.separator = separator;
+		info.suffix = suffix;
+		info.rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
+
+		info.levels = clampLevels(info.levels, info.size, maxSize);
+		return info;
+	} 
+	catch (shaun::parse_error &e)
+	{
+		cout << e << endl;
+		return {};
+	}
+}
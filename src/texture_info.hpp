@@ -0,0 +1,31 @@
+#pragma once
+
+#include <string>
+
+/// Layout of a stream texture folder, as described by its info.sn file
+struct TexInfo
+{
+	/// Tile width/height
+	int size = 0;
+	/// Number of levels, 0 if the file is missing or invalid
+	int levels = 0;
+	std::string prefix = "";
+	std::string separator = "";
+	std::string suffix = "";
+	bool rowColumnOrder = false;
+};
+
+/**
+ * Returns the number of tile levels of a texture that fit in a maximum size
+ * @param levels number of levels of the texture
+ * @param size tile width/height
+ * @param maxSize maximum texture width
+ */
+int clampLevels(int levels, int size, int maxSize);
+
+/**
+ * Reads the info file of a stream texture folder
+ * @param filename info.sn file
+ * @param maxSize maximum texture width, levels are clamped to it
+ */
+TexInfo parseInfoFile(const std::string &filename, int maxSize);
@@ -1,104 +1,155 @@
 #include <SHAUN/parser.hpp>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <iterator>
 
 namespace shaun
 {
 
+/**
+ * Parses a SHAUN document in place, from a buffer holding all of it
+ *
+ * Tokens are read as ranges of the buffer and only copied once into the
+ * tree nodes, which are created in place and moved into their parent.
+ * Line and column of errors are computed from the position when thrown.
+ */
 class parser
 {
 public:
     using char_type = char;
 
     parser() = delete;
-    parser(const std::string& str);
-    parser(std::istream& iss);
-
-    ~parser();
+    parser(const char * begin, const char * end);
 
     object parse();
 
 private:
 
+    int peek() const;
+    bool good() const;
+    void forward();
     void skipws();
     void skip_comment();
-    void forward();
-    
+    void take_to(char c);
 
-    object parse_object();
-    std::pair<std::string, shaun*> parse_variable();
+    void parse_object(object& obj);
     std::string parse_name();
-    shaun* parse_value();
-    string parse_string();
-    number parse_number();
-    boolean parse_boolean();
-    list parse_list();
+    std::shared_ptr<shaun> parse_value();
+    std::shared_ptr<string> parse_string();
+    std::shared_ptr<number> parse_number();
+    std::shared_ptr<boolean> parse_boolean();
+    std::shared_ptr<list> parse_list();
     void parse_null();
 
-    template<typename T> int signum(T val);
-    
-    std::istream * iss_;
-    size_t line_;
-    size_t column_;
-    bool new_iss;
+    [[noreturn]] void error(const std::string& str) const;
+    size_t column_of(const char * p) const;
+
+    const char * begin_;
+    const char * end_;
+    const char * p_;
 };
 
-#define PARSE_ERROR(str) throw parse_error(line_, column_, #str)
+#define PARSE_ERROR(str) error(#str)
 #define PARSE_ASSERT(cond, str) if (!(cond)) PARSE_ERROR(str)
-#define TAKE_TO(c) while (iss_->good() && iss_->peek() != c) forward()
 
+/// Sets the "C" numeric locale for number parsing, restores the previous one
+class numeric_locale
+{
+public:
+    numeric_locale()
+    {
+        // The returned string may be overwritten by the next call
+        const char * old = setlocale(LC_NUMERIC, NULL);
+        if (old) old_ = old;
+        setlocale(LC_NUMERIC, "C");
+    }
+
+    ~numeric_locale()
+    {
+        if (!old_.empty()) setlocale(LC_NUMERIC, old_.c_str());
+    }
 
-  parser::parser(const std::string& str)
+private:
+    std::string old_;
+};
+
+  parser::parser(const char * begin, const char * end)
+    : begin_(begin), end_(end), p_(begin)
   {
-    new_iss = true;
-    iss_ = new std::istringstream(str);
   }
 
-  parser::parser(std::istream& iss)
+    int parser::peek() const
+    {
+        return (p_ < end_)?(unsigned char)*p_:EOF;
+    }
+
+    bool parser::good() const
+    {
+        return p_ < end_;
+    }
+
+    void parser::forward()
+    {
+        if (p_ < end_) ++p_;
+    }
+
+    void parser::take_to(char c)
+    {
+        while (p_ < end_ && *p_ != c) ++p_;
+    }
+
+    void parser::error(const std::string& str) const
     {
-      new_iss = false;
-        iss_ = &iss;
+        size_t line = 0;
+        for (const char * c = begin_;c < p_;++c)
+            if (*c == '\n') ++line;
+        throw parse_error(line, column_of(p_), str);
     }
 
-  parser::~parser()
+    size_t parser::column_of(const char * p) const
     {
-      if (new_iss)
-        delete iss_;
+        const char * line_start = p;
+        while (line_start > begin_ && line_start[-1] != '\n') --line_start;
+        return p-line_start;
     }
 
     object parser::parse()
     {
         // Changing the locale for "C" number parsing system
-        // the old locale is saved to be restored after the
-        // parsing, as some applications use a different one
-        char * old_locale = setlocale(LC_NUMERIC, NULL);
-        setlocale(LC_NUMERIC, "C");
+        // the old locale is restored after the parsing, as
+        // some applications use a different one
+        numeric_locale locale;
 
-        // init the parsing state
-        line_ = column_ = 0;
-        
-        // loop through the whole stream
-        while (iss_->good())
+        // loop through the whole buffer
+        while (good())
         {
             skipws();
 
-            char_type c = iss_->peek();
+            int c = peek();
             if (c == '{')
             {
-        setlocale(LC_NUMERIC, old_locale);
-                return parse_object();
+                object parsed;
+                parse_object(parsed);
+                return parsed;
             }
             else if (isalpha(c))
             {
                 object parsed;
 
-                while (iss_->good())
+                while (good())
                 {
-                    auto sh = parse_variable();
-                    parsed.add<const shaun&>(sh.first, *sh.second);
-                    delete sh.second;
+                    PARSE_ASSERT(isalpha(peek()), invalid variable name);
+                    std::string name = parse_name();
+                    skipws();
+                    PARSE_ASSERT(peek() == ':', expected variable separator ':');
+                    forward();
+                    skipws();
+                    parsed.variables_.emplace(std::move(name), parse_value());
                     skipws();
                 }
 
-        setlocale(LC_NUMERIC, old_locale);
                 return parsed;
             }
             else
@@ -109,19 +160,17 @@ private:
             forward();
         }
 
-        PARSE_ERROR("couldn't parse this string");
-        
-
+        PARSE_ERROR(could not parse this string);
     }
 
     void parser::skipws()
     {
-        while (iss_->good() && (isspace(iss_->peek())
-                            || iss_->peek() == ','
-                            || iss_->peek() == '('
-                            || iss_->peek() == '/'))
+        while (good() && (isspace(peek())
+                            || peek() == ','
+                            || peek() == '('
+                            || peek() == '/'))
         {
-            switch (iss_->peek())
+            switch (peek())
             {
                 case '(':
                 case '/': skip_comment();
@@ -134,19 +183,19 @@ private:
 
     void parser::skip_comment()
     {
-        switch (iss_->peek())
+        switch (peek())
         {
             case '(':
-                TAKE_TO(')');
+                take_to(')');
                 break;
             case '/':
                 forward();
-                if (iss_->peek() == '/') { TAKE_TO('\n'); return; }
-                if (iss_->peek() == '*')
+                if (peek() == '/') { take_to('\n'); return; }
+                if (peek() == '*')
                 {
-                    while (iss_->good() && iss_->peek() != '/')
+                    while (good() && peek() != '/')
                     {
-                        TAKE_TO('*');
+                        take_to('*');
                         forward();
                     }
                     return;
@@ -155,133 +204,111 @@ private:
         }
     }
 
-    void parser::forward()
-    {
-        ++column_;
-        if (iss_->peek() == '\n')
-        {
-            ++line_;
-            column_ = 0;
-        }
-
-        iss_->ignore();
-    }
-
-    object parser::parse_object()
+    void parser::parse_object(object& obj)
     {
-        PARSE_ASSERT(iss_->peek() == '{', expected object value);
-        object obj;
+        PARSE_ASSERT(peek() == '{', expected object value);
 
         forward();
         skipws();
 
-        while (iss_->good() && iss_->peek() != '}')
+        while (good() && peek() != '}')
         {
-          auto sh = parse_variable();
-            obj.add<const shaun&>(sh.first, *sh.second);
-              delete sh.second;
-            skipws();
-        }
+            PARSE_ASSERT(isalpha(peek()), invalid variable name);
+            std::string name = parse_name();
 
-        forward();
-        return obj;
-    }
+            skipws();
+            PARSE_ASSERT(peek() == ':', expected variable separator ':');
+            forward();
+            skipws();
 
-    std::pair<std::string, shaun*> parser::parse_variable()
-    {
-        PARSE_ASSERT(isalpha(iss_->peek()), invalid variable name);
-        
-        std::string name = parse_name();
+            // The first of duplicate names is kept
+            obj.variables_.emplace(std::move(name), parse_value());
+            skipws();
+        }
 
-        skipws();
-        PARSE_ASSERT(iss_->peek() == ':', expected variable separator ':');
         forward();
-        skipws();
-
-        return std::make_pair(name, parse_value());
     }
 
     std::string parser::parse_name()
     {
-        PARSE_ASSERT(isalpha(iss_->peek()) || iss_->peek() == '_', names must start with a letter or '_');
-        std::string ret;
-        char_type c;
-        while (isalnum(c = iss_->peek()) || c == '_')
-        {
-            ret.push_back(c);
-            forward();
-        }
+        PARSE_ASSERT(isalpha(peek()) || peek() == '_', names must start with a letter or '_');
+        const char * start = p_;
+        while (p_ < end_ && (isalnum((unsigned char)*p_) || *p_ == '_')) ++p_;
 
-        PARSE_ASSERT(ret != "true" && ret != "false"
+        const size_t size = p_-start;
+        PARSE_ASSERT(!(size == 4 && !strncmp(start, "true", 4))
+            && !(size == 5 && !strncmp(start, "false", 5))
             , true or false are invalid names);
-        return ret;
+        return std::string(start, size);
     }
 
-    shaun* parser::parse_value()
+    std::shared_ptr<shaun> parser::parse_value()
     {
-        shaun * ret = 0;
-
-        char_type c = iss_->peek();
+        int c = peek();
         if (c == '"')
-        {
-            ret = new string(parse_string());
-        }
-        
+            return parse_string();
+
         if (isdigit(c) || c == '-' || c == '.')
-        {
-            ret = new number(parse_number());
-        }
-        
+            return parse_number();
+
         if (c == '{')
         {
-            ret = new object(parse_object());
+            auto obj = std::make_shared<object>();
+            parse_object(*obj);
+            return obj;
         }
-        
+
         if (c == 't' || c == 'f')
-        {
-            ret = new boolean(parse_boolean());
-        }
-        
+            return parse_boolean();
+
         if (c == '[')
-        {
-            ret = new list(parse_list());
-        }
+            return parse_list();
 
         if (c == 'n')
         {
             parse_null();
-            ret = new null();
+            return std::make_shared<null>();
         }
-        
-        if (ret)
-          return ret;
 
         std::string err = "illegal character:  ";
-        err[err.size() - 1] = c;
-        throw parse_error(line_, column_, err);
+        err[err.size() - 1] = (char)c;
+        error(err);
     }
 
-    string parser::parse_string()
+    std::shared_ptr<string> parser::parse_string()
     {
-        PARSE_ASSERT(iss_->peek() == '"', expected string value);
-        size_t start_col = column_;
+        PARSE_ASSERT(peek() == '"', expected string value);
+        const size_t start_col = column_of(p_);
         forward();
 
-        std::string str;
+        // Common case, a single line without escaped characters
+        const char * start = p_;
+        while (p_ < end_ && *p_ != '"' && *p_ != '\n' && *p_ != '\\') ++p_;
+        if (p_ < end_ && *p_ == '"')
+        {
+            auto ret = std::make_shared<string>(std::string(start, p_-start));
+            forward();
+            return ret;
+        }
+
+        std::string str(start, p_-start);
+        bool nows = false;
+        for (const char * s = start;s < p_;++s)
+            if (!isspace((unsigned char)*s)) nows = true;
+
         char_type c = '\0';
         bool get_line = false;
-        bool nows     = false;
 
         // get a normal string OR the first line of a multiline string
-        while (iss_->good() && (c = iss_->peek()) != '\n' && c != '"')
+        while (good() && (c = *p_) != '\n' && c != '"')
         {
-            if (!isspace(c)) nows = true;
+            if (!isspace((unsigned char)c)) nows = true;
 
             // skipped characters
             if (c == '\\')
             {
               forward();
-              str.push_back(iss_->peek());
+              if (good()) str.push_back(*p_);
             }
             else
             {
@@ -295,11 +322,12 @@ private:
         {
             str.resize(0);
         }
-        
+
         if (c == '\n') forward();
 
         // this loop for multiline strings
-        while (iss_->good() && (c = iss_->peek()) != '"')
+        size_t column = 0;
+        while (good() && (c = *p_) != '"')
         {
             // each new line resets the "spaces counter"
             if (c == '\n')
@@ -307,13 +335,14 @@ private:
                 str.push_back(c);
                 get_line = false;
             }
-            else if (column_ >= start_col || get_line || !isspace(c))
+            else if (column >= start_col || get_line || !isspace((unsigned char)c))
             {
                 // skipped characters
                 if (c == '\\')
                 {
                   forward();
-                  str.push_back(iss_->peek());
+                  ++column;
+                  if (good()) str.push_back(*p_);
                 }
                 else
                   str.push_back(c);
@@ -321,97 +350,104 @@ private:
                 get_line = true;
             }
 
+            column = (*p_ == '\n')?0:column+1;
             forward();
         }
 
         // discard last new line, if existing
         if (str.size() > 0 && str[str.size() - 1] == '\n') str.resize(str.size() - 1);
 
-        PARSE_ASSERT(iss_->good(), unexpected EOF while parsing string);
+        PARSE_ASSERT(good(), unexpected EOF while parsing string);
 
-        forward();        
+        forward();
 
-        return string(str);
+        return std::make_shared<string>(str);
     }
 
-    number parser::parse_number()
+    std::shared_ptr<number> parser::parse_number()
     {
-        std::string num;
-        std::string unit;
-        char_type c;
-        while (iss_->good() && ((c = iss_->peek()) == 'E'
-            || c == 'e'
-            || c == '-'
-            || isdigit(c)
-            || c == '.'
-            || c == '+'))
+        const char * start = p_;
+        while (p_ < end_ && (*p_ == 'E'
+            || *p_ == 'e'
+            || *p_ == '-'
+            || isdigit((unsigned char)*p_)
+            || *p_ == '.'
+            || *p_ == '+'))
         {
-            num.push_back(c);
-            forward();
+            ++p_;
         }
 
-        size_t before_unit = iss_->tellg();
+        // strtod needs a terminated string, and mustn't read further
+        // characters as a hexadecimal or infinite number would
+        const size_t size = p_-start;
+        char small[64];
+        std::string large;
+        const char * num = small;
+        if (size < sizeof(small))
+        {
+            memcpy(small, start, size);
+            small[size] = '\0';
+        }
+        else
+        {
+            large.assign(start, size);
+            num = large.c_str();
+        }
+
+        const char * before_unit = p_;
+        std::string unit;
         skipws();
-        try
+        if (isalpha(peek()) || peek() == '_')
         {
-            unit = parse_name();
+            const char * unit_start = p_;
+            while (p_ < end_ && (isalnum((unsigned char)*p_) || *p_ == '_')) ++p_;
+            unit.assign(unit_start, p_-unit_start);
         }
-        catch (...)
+        if (unit.empty() || unit == "true" || unit == "false")
         {
             unit = "none";
-            iss_->seekg(before_unit, iss_->beg);
+            p_ = before_unit;
         }
         skipws();
 
-        try
-        {
-            double dbl = std::stod(num);
-                if (iss_->peek() == ':')
-                {
-                    iss_->seekg(before_unit, iss_->beg);
-                    return number(dbl, "");
-                }
-                else
-                {
-                    return number(dbl, unit);
-                }
-        }
-        catch (const std::invalid_argument&)
+        char * num_end;
+        errno = 0;
+        const double dbl = strtod(num, &num_end);
+        if (num_end == num) PARSE_ERROR(invalid number format);
+        if (errno == ERANGE) PARSE_ERROR(error parsing a number);
+
+        if (peek() == ':')
         {
-            PARSE_ERROR(invalid number format);
+            p_ = before_unit;
+            return std::make_shared<number>(dbl, "");
         }
-        catch (...)
+        else
         {
-            PARSE_ERROR(error parsing a number);
+            return std::make_shared<number>(dbl, unit);
         }
     }
 
-    boolean parser::parse_boolean()
+    std::shared_ptr<boolean> parser::parse_boolean()
     {
-        std::string ret;
-        char_type c;
-        while (isalpha(c = iss_->peek()))
-        {
-            ret.push_back(c);
-            forward();
-        }
+        const char * start = p_;
+        while (p_ < end_ && isalpha((unsigned char)*p_)) ++p_;
 
-        PARSE_ASSERT(ret == "true" || ret == "false", expected boolean value);
-        return boolean(ret == "true");
+        const size_t size = p_-start;
+        const bool is_true = (size == 4 && !strncmp(start, "true", 4));
+        PARSE_ASSERT(is_true || (size == 5 && !strncmp(start, "false", 5)), expected boolean value);
+        return std::make_shared<boolean>(is_true);
     }
 
-    list parser::parse_list()
+    std::shared_ptr<list> parser::parse_list()
     {
-        PARSE_ASSERT(iss_->peek() == '[', expected list value);
-        list ret;
+        PARSE_ASSERT(peek() == '[', expected list value);
+        auto ret = std::make_shared<list>();
 
         forward();
         skipws();
-        while (iss_->good() && iss_->peek() != ']')
+        while (good() && peek() != ']')
         {
-          shaun * sh = parse_value();
-            ret.push_back(*sh);
-              delete sh;
+            ret->elements_.push_back(parse_value());
             skipws();
         }
 
@@ -421,38 +457,41 @@ private:
 
     void parser::parse_null()
     {
-      std::string ret;
-      char_type c;
-      while (isalpha(c = iss_->peek()))
-      {
-        ret.push_back(c);
-        forward();
-      }
+      const char * start = p_;
+      while (p_ < end_ && isalpha((unsigned char)*p_)) ++p_;
 
-      PARSE_ASSERT(ret == "null", expected null value);
-    }
-
-    template<typename T> int parser::signum(T val)
-    {
-        return (T(0) < val) - (val < T(0));
+      PARSE_ASSERT(p_-start == 4 && !strncmp(start, "null", 4), expected null value);
     }
 
     object parse(const std::string& str)
     {
-        parser p(str);
+        parser p(str.data(), str.data()+str.size());
         return p.parse();
     }
 
     object parse(std::istream& str)
     {
-        parser p(str);
-        return p.parse();
+        const std::string buffer((std::istreambuf_iterator<char>(str)),
+            std::istreambuf_iterator<char>());
+        return parse(buffer);
     }
 
     object parse_file(const std::string& str)
     {
-      std::ifstream file(str, std::ios::binary);
-        return parser(file).parse();
+        // Read at once, parsed in place
+        std::ifstream file(str, std::ios::binary);
+        std::string buffer;
+        if (file.seekg(0, std::ios::end))
+        {
+            const std::streamoff size = file.tellg();
+            file.seekg(0, std::ios::beg);
+            if (size > 0)
+            {
+                buffer.resize((size_t)size);
+                file.read(&buffer[0], size);
+                buffer.resize((size_t)file.gcount());
+            }
+        }
+        return parse(buffer);
     }
 } // namespace
-
@@ -101,6 +101,11 @@ sweeper& sweeper::at(size_t i)
 
 sweeper& sweeper::operator[](size_t i)
 {
+  // Out of range items are common with optional lists, they are handled
+  // without going through exceptions
+  if (root_->type() != Type::list || i >= static_cast<list*>(root_)->size())
+    return null_sweeper;
+
   try
   {
     return at(i);
@@ -119,6 +124,22 @@ sweeper& sweeper::get(const std::string& path)
 
 sweeper& sweeper::operator()(const std::string& path)
 {
+  // Single names are looked up without going through exceptions, as
+  // optional values are missing most of the time
+  if (path.find_first_of(":[") == std::string::npos)
+  {
+    if (root_->type() != Type::object)
+      return null_sweeper;
+
+    const object::map& variables = static_cast<object*>(root_)->variables_;
+    const object::const_iterator it = variables.find(path);
+    if (it == variables.end())
+      return null_sweeper;
+
+    next_.reset(new sweeper(*it->second));
+    return *next_;
+  }
+
   try
   {
     return get(path);
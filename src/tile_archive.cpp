@@ -0,0 +1,202 @@
+#include "tile_archive.hpp"
+
+#include <zlib.h>
+
+#include <cstring>
+#include <cstddef>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+TileArchive::TileArchive(const string &filename) :
+	_filename{filename},
+	_file{make_shared<MappedFile>(filename)}
+{
+	const uint8_t *data = _file->getData();
+	const size_t fileSize = _file->getSize();
+
+	// Version 1 headers end before the compression field
+	const size_t baseSize = offsetof(Header, compression);
+	if (fileSize < baseSize)
+		throw runtime_error("Truncated tile archive : " + _filename);
+	memcpy(&_header, data, baseSize);
+	if (strncmp(_header.magic, "RTEX", 4))
+		throw runtime_error("Not a tile archive : " + _filename);
+	if (_header.version != 1 && _header.version != VERSION)
+		throw runtime_error("Unsupported tile archive version : " + _filename);
+	const size_t headerSize = (_header.version == 1)?baseSize:sizeof(Header);
+	if (fileSize < headerSize)
+		throw runtime_error("Truncated tile archive : " + _filename);
+	memcpy(&_header, data, headerSize);
+	if (getCompression() != Compression::NONE &&
+		getCompression() != Compression::DEFLATE)
+		throw runtime_error("Unsupported tile archive compression : " + _filename);
+	if (_header.levels == 0 || _header.levels > 16 ||
+		(int)_header.tileCount != getTileCount(_header.levels))
+		throw runtime_error("Invalid tile count : " + _filename);
+
+	const size_t indexEnd = headerSize+_header.tileCount*sizeof(Entry);
+	if (fileSize < indexEnd)
+		throw runtime_error("Truncated tile archive : " + _filename);
+	_entries.resize(_header.tileCount);
+	memcpy(_entries.data(), data+headerSize, _header.tileCount*sizeof(Entry));
+
+	// Check order and bounds once so that reads don't have to
+	const bool compressed = getCompression() == Compression::DEFLATE;
+	_firstOffsets.reserve(_entries.size());
+	for (size_t i=0;i<_entries.size();++i)
+	{
+		const Entry &e = _entries[i];
+		if (getTileIndex(e.level, e.column, e.row) != (int)i)
+			throw runtime_error("Tile archive index out of order : " + _filename);
+		const size_t tableSize = compressed?e.mipmapCount*sizeof(uint32_t):0;
+		if (e.mipmapCount == 0 || e.offset < indexEnd ||
+			e.offset+e.size > fileSize || e.size < tableSize)
+			throw runtime_error("Invalid tile archive entry : " + _filename);
+
+		_firstOffsets.push_back(_offsets.size());
+		uint64_t offset = e.offset+tableSize;
+		for (uint32_t m=0;m<e.mipmapCount;++m)
+		{
+			_offsets.push_back(offset);
+			if (compressed)
+			{
+				uint32_t storedSize;
+				memcpy(&storedSize, data+e.offset+m*sizeof(uint32_t), sizeof(uint32_t));
+				offset += storedSize;
+			}
+			else offset += getImageSize(i, m);
+		}
+		_offsets.push_back(offset);
+		if (offset > e.offset+e.size)
+			throw runtime_error("Invalid tile archive entry : " + _filename);
+	}
+}
+
+int TileArchive::getTileCount(const int levels)
+{
+	// One tail tile, then 2*4^(i-1) tiles for level i
+	return getTileIndex(levels, 0, 0);
+}
+
+int TileArchive::getTileIndex(const int level, const int column, const int row)
+{
+	if (level == 0) return 0;
+	const int rows = 1<<(level-1);
+	// Tiles of levels 1..level-1: 2*(4^(level-1)-1)/3
+	const int levelStart = 1+2*((1<<(2*(level-1)))-1)/3;
+	return levelStart+column*rows+row;
+}
+
+int TileArchive::getTileSize() const
+{
+	return _header.tileSize;
+}
+
+int TileArchive::getLevels() const
+{
+	return _header.levels;
+}
+
+DDSLoader::Format TileArchive::getFormat() const
+{
+	return (DDSLoader::Format)_header.format;
+}
+
+TileArchive::Compression TileArchive::getCompression() const
+{
+	return (Compression)_header.compression;
+}
+
+int TileArchive::getMipmapCount(const int tile) const
+{
+	return _entries[tile].mipmapCount;
+}
+
+int TileArchive::getWidth(const int tile, const int mipmapLevel) const
+{
+	return max(1, (int)_entries[tile].width>>mipmapLevel);
+}
+
+int TileArchive::getHeight(const int tile, const int mipmapLevel) const
+{
+	return max(1, (int)_entries[tile].height>>mipmapLevel);
+}
+
+size_t TileArchive::getImageSize(const int tile, const int mipmapLevel) const
+{
+	if (mipmapLevel >= getMipmapCount(tile) || mipmapLevel < 0)
+	{
+		throw runtime_error("Mipmap level out of range");
+	}
+	return DDSLoader::computeImageSize(getFormat(),
+		getWidth(tile, mipmapLevel), getHeight(tile, mipmapLevel));
+}
+
+size_t TileArchive::getOffsetIndex(const int tile, const int mipmapLevel) const
+{
+	if (mipmapLevel >= getMipmapCount(tile) || mipmapLevel < 0)
+	{
+		throw runtime_error("Mipmap level out of range");
+	}
+	return _firstOffsets[tile]+mipmapLevel;
+}
+
+size_t TileArchive::getStoredSize(const int tile, const int mipmapLevel) const
+{
+	const size_t i = getOffsetIndex(tile, mipmapLevel);
+	return _offsets[i+1]-_offsets[i];
+}
+
+void TileArchive::writeImageData(const int tile, const int mipmapLevel,
+	void *ptr) const
+{
+	const size_t size = getImageSize(tile, mipmapLevel);
+	const uint8_t *src = _file->getData()+_offsets[getOffsetIndex(tile, mipmapLevel)];
+	if (getCompression() == Compression::NONE)
+	{
+		memcpy(ptr, src, size);
+		return;
+	}
+
+	// Inflated to memory of the thread first, as zlib reads back its output
+	thread_local vector<uint8_t> shuffled;
+	shuffled.resize(size);
+	uLongf inflatedSize = size;
+	if (uncompress(shuffled.data(), &inflatedSize, src,
+			getStoredSize(tile, mipmapLevel)) != Z_OK || inflatedSize != size)
+		throw runtime_error("Corrupted tile in archive : " + _filename);
+
+	// Blocks are put back together in order
+	const size_t blockSize = DDSLoader::computeImageSize(getFormat(), 4, 4);
+	const size_t blocks = size/blockSize;
+	uint8_t *dst = (uint8_t*)ptr;
+	for (size_t b=0;b<blocks;++b)
+	{
+		uint8_t block[16];
+		for (size_t k=0;k<blockSize;++k) block[k] = shuffled[k*blocks+b];
+		memcpy(dst+b*blockSize, block, blockSize);
+	}
+}
+
+vector<uint8_t> TileArchive::compressImage(const DDSLoader::Format format,
+	const vector<uint8_t> &data, const int level)
+{
+	// Byte k of each block after byte k-1 of all the blocks
+	const size_t blockSize = DDSLoader::computeImageSize(format, 4, 4);
+	const size_t blocks = data.size()/blockSize;
+	vector<uint8_t> shuffled(data.size());
+	for (size_t b=0;b<blocks;++b)
+	{
+		for (size_t k=0;k<blockSize;++k)
+			shuffled[k*blocks+b] = data[b*blockSize+k];
+	}
+
+	uLongf size = compressBound(shuffled.size());
+	vector<uint8_t> compressed(size);
+	if (compress2(compressed.data(), &size, shuffled.data(), shuffled.size(), level) != Z_OK)
+		throw runtime_error("Can't compress image");
+	compressed.resize(size);
+	return compressed;
+}
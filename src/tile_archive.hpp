@@ -0,0 +1,162 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstdint>
+
+#include "ddsloader.hpp"
+#include "mapped_file.hpp"
+
+/**
+ * Single file archive holding all the DDS tiles of a stream texture
+ *
+ * Layout (little endian):
+ * - Header
+ * - Entry for each tile: position, size and mipmap count of its payload
+ * - Payloads: the mipmap levels of a tile as stored in its DDS file, without
+ * the DDS header, each payload starting on an ALIGNMENT boundary
+ *
+ * Payloads of deflate compressed archives start with the compressed size of
+ * each mipmap level (uint32_t), followed by one zlib stream per level. Before
+ * compression, the bytes of the blocks of a level are shuffled so that byte k
+ * of every block is stored together (endpoints apart from indices), which
+ * compresses much better than interleaved blocks.
+ *
+ * Tiles are stored by level (0 being the single tail tile, as in the texture
+ * folders), then by column, then by row.
+ */
+class TileArchive
+{
+public:
+	/// Compression of tile payloads
+	enum class Compression
+	{
+		NONE, DEFLATE
+	};
+
+	/// Archive file header
+	struct Header
+	{
+		/// "RTEX"
+		char magic[4];
+		uint32_t version;
+		/// Width/height in pixels of the tiles of levels above 0
+		uint32_t tileSize;
+		/// Number of levels
+		uint32_t levels;
+		/// DDSLoader::Format of all the tiles
+		uint32_t format;
+		/// Number of tile entries following the header
+		uint32_t tileCount;
+		/// Compression of the payloads (from version 2)
+		uint32_t compression;
+		uint32_t padding;
+	};
+
+	/// Tile index entry
+	struct Entry
+	{
+		uint32_t level;
+		uint32_t column;
+		uint32_t row;
+		uint32_t mipmapCount;
+		/// Size in pixels of the largest mipmap level
+		uint32_t width;
+		uint32_t height;
+		/// Offset in bytes of the payload from the start of the file
+		uint64_t offset;
+		/// Size in bytes of the payload
+		uint64_t size;
+	};
+
+	/// Current format version
+	static const uint32_t VERSION = 2;
+	/// Alignment in bytes of payloads
+	static const uint32_t ALIGNMENT = 4096;
+
+	TileArchive() = default;
+	/**
+	 * Maps an archive file and checks its index
+	 * @param filename archive path
+	 */
+	explicit TileArchive(const std::string &filename);
+
+	/**
+	 * Returns the number of tile entries of a texture
+	 * @param levels number of levels of the texture
+	 */
+	static int getTileCount(int levels);
+	/**
+	 * Returns the index of a tile
+	 * @param level level of the tile (0 for the tail)
+	 * @param column column of the tile in its level
+	 * @param row row of the tile in its level
+	 */
+	static int getTileIndex(int level, int column, int row);
+
+	/// Returns the width/height of tiles of levels above 0
+	int getTileSize() const;
+	/// Returns the number of levels
+	int getLevels() const;
+	/// Returns the block compression format
+	DDSLoader::Format getFormat() const;
+	/// Returns the compression of the payloads
+	Compression getCompression() const;
+
+	/// Returns the number of mipmaps of a tile
+	int getMipmapCount(int tile) const;
+	/// Returns the width of a given mipmap level of a tile
+	int getWidth(int tile, int mipmapLevel) const;
+	/// Returns the height of a given mipmap level of a tile
+	int getHeight(int tile, int mipmapLevel) const;
+	/**
+	 * Returns the size in bytes of a mipmap level of a tile
+	 * @param tile tile index
+	 * @param mipmapLevel mipmap level to read from
+	 */
+	size_t getImageSize(int tile, int mipmapLevel) const;
+	/**
+	 * Returns the size in bytes of a mipmap level of a tile in the file
+	 * @param tile tile index
+	 * @param mipmapLevel mipmap level to read from
+	 */
+	size_t getStoredSize(int tile, int mipmapLevel) const;
+	/**
+	 * Writes the image data of a mipmap level of a tile to a pointer,
+	 * decompressing it if needed. The destination is only written to, in
+	 * order, so it can be write-combined memory
+	 * @param tile tile index
+	 * @param mipmapLevel mipmap level to read from
+	 * @param ptr to write to
+	 */
+	void writeImageData(int tile, int mipmapLevel, void *ptr) const;
+
+	/**
+	 * Compresses the image data of a mipmap level as stored in deflate
+	 * compressed archives
+	 * @param format block compression format of the image
+	 * @param data image data
+	 * @param level zlib compression level (1 to 9)
+	 */
+	static std::vector<uint8_t> compressImage(DDSLoader::Format format,
+		const std::vector<uint8_t> &data, int level);
+
+private:
+	/// Returns the index in _offsets of a mipmap level of a tile
+	size_t getOffsetIndex(int tile, int mipmapLevel) const;
+
+	/// Filename
+	std::string _filename = "";
+	/// Mapped archive
+	std::shared_ptr<const MappedFile> _file;
+	/// Archive header
+	Header _header{};
+	/// Tile index
+	std::vector<Entry> _entries;
+	/// Offset from the start of the file of each stored mipmap level, and of
+	/// the end of the last one, tile after tile
+	std::vector<uint64_t> _offsets;
+	/// Index in _offsets of the first mipmap level of each tile
+	std::vector<size_t> _firstOffsets;
+};
@@ -0,0 +1,334 @@
+/**
+ * Times the CPU kernels of the simulation and of loading, without any GL
+ * context, so that optimizations can be compared before and after
+ *
+ * Usage: microbench [output file] [filter]
+ * Results are written as JSON (to stdout without output file or with "-"),
+ * progress to stderr. Only the benchmarks whose name contains the filter are
+ * run. Input files are generated in a temporary folder, except for
+ * config/entities.sn which is read from the working directory if present.
+ */
+
+#include "../entity.hpp"
+#include "../entity_file.hpp"
+#include "../orbit_propagator.hpp"
+#include "../job_system.hpp"
+#include "../ring_profile.hpp"
+#include "../ddsloader.hpp"
+#include "../mesh.hpp"
+
+#include <SHAUN/parser.hpp>
+
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <functional>
+#include <algorithm>
+#include <random>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <cstdio>
+
+using namespace std;
+
+/// Timings of a benchmark, in ns per iteration
+struct Result
+{
+	string name;
+	uint64_t iterations;
+	double min;
+	double median;
+	double mean;
+};
+
+/// Results are summed into this so that timed work isn't optimized out
+static volatile double sink = 0.0;
+
+/// Samples taken per benchmark
+static const int SAMPLES = 15;
+/// Minimum duration of a sample in ns
+static const double SAMPLE_TIME = 1e7;
+
+static double now()
+{
+	return chrono::duration<double, nano>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Times a function
+ * @param name benchmark name
+ * @param function work of one iteration, returns a value depending on the work
+ */
+static Result run(const string &name, const function<double()> &function)
+{
+	// Enough iterations per sample to hide the clock resolution
+	uint64_t iterations = 1;
+	while (true)
+	{
+		const double start = now();
+		for (uint64_t i=0;i<iterations;++i) sink = sink+function();
+		const double elapsed = now()-start;
+		if (elapsed >= SAMPLE_TIME || iterations >= (1ull<<30)) break;
+		iterations = (elapsed <= 0)?iterations*10:
+			std::max(iterations+1, (uint64_t)(iterations*SAMPLE_TIME*1.2/elapsed));
+	}
+
+	vector<double> samples;
+	for (int s=0;s<SAMPLES;++s)
+	{
+		const double start = now();
+		for (uint64_t i=0;i<iterations;++i) sink = sink+function();
+		samples.push_back((now()-start)/iterations);
+	}
+	sort(samples.begin(), samples.end());
+	double sum = 0.0;
+	for (const double t : samples) sum += t;
+	return {name, iterations, samples.front(), samples[SAMPLES/2], sum/SAMPLES};
+}
+
+/// Returns random orbits with eccentricities in [minEcc, maxEcc]
+static vector<Orbit> randomOrbits(size_t count, double minEcc, double maxEcc)
+{
+	// Same orbits at each run
+	mt19937 rng(1234);
+	uniform_real_distribution<double> unit(0.0, 1.0);
+	vector<Orbit> orbits;
+	for (size_t i=0;i<count;++i)
+	{
+		const double ecc = minEcc+(maxEcc-minEcc)*unit(rng);
+		orbits.emplace_back(ecc, 1e8*(1+unit(rng)), 0.1*unit(rng),
+			6.28*unit(rng), 6.28*unit(rng), 3e7*(1+unit(rng)), 6.28*unit(rng));
+	}
+	return orbits;
+}
+
+/// Writes a text profile of whitespace separated values
+static void writeProfile(const string &filename, size_t values)
+{
+	ofstream out(filename.c_str());
+	for (size_t i=0;i<values;++i)
+		out << (i%97)/97.0 << ((i%8 == 7)?"\n":" ");
+}
+
+/// Writes a BC1 DDS file with all of its mipmaps
+static void writeDDS(const string &filename, uint32_t size)
+{
+	uint32_t header[32] = {};
+	memcpy(&header[0], "DDS ", 4);
+	header[1] = 124;
+	// Caps, height, width, pixel format and mipmap count
+	header[2] = 0x1|0x2|0x4|0x1000|0x20000;
+	header[3] = size;
+	header[4] = size;
+	int mipmaps = 0;
+	size_t dataSize = 0;
+	for (uint32_t s=size;s>0;s/=2,++mipmaps)
+		dataSize += std::max(1u, s/4)*std::max(1u, s/4)*8;
+	header[7] = mipmaps;
+	header[19] = 32;
+	header[20] = 0x4;
+	memcpy(&header[21], "DXT1", 4);
+	ofstream out(filename.c_str(), ios::binary);
+	out.write((const char*)header, sizeof(header));
+	const vector<char> data(dataSize, 0);
+	out.write(data.data(), data.size());
+}
+
+/// Returns a star with planets, each with moons
+static vector<EntityParam> generateSystem(int planets, int moons)
+{
+	vector<EntityParam> params;
+	auto add = [&](const string &name, const string &parent, float radius, double sma)
+	{
+		EntityParam param;
+		param.setName(name);
+		param.setParentName(parent);
+		param.setModel(Model(radius, 1e5, glm::vec3(0,0,1), 86400, glm::vec3(1), ""));
+		if (!parent.empty()) param.setOrbit(Orbit(0.05, sma, 0.01, 0, 0, sma/10, 0));
+		params.push_back(param);
+	};
+	add("Star", "", 700000, 0);
+	for (int p=0;p<planets;++p)
+	{
+		const string planet = "Planet" + to_string(p);
+		add(planet, "Star", 6000, 1e8*(p+1));
+		for (int m=0;m<moons;++m)
+			add(planet + "Moon" + to_string(m), planet, 1000, 1e6*(m+1));
+	}
+	return params;
+}
+
+int main(int argc, char **argv)
+{
+	const string output = (argc > 1)?argv[1]:"-";
+	const string filter = (argc > 2)?argv[2]:"";
+
+	// Generated inputs
+	const string tempDir = "cache/";
+	const string profileFile = tempDir + "microbench_profile.txt";
+	const string colorFile = tempDir + "microbench_color.txt";
+	const string packedFile = tempDir + "microbench_profile.bin";
+	const string ddsFile = tempDir + "microbench.dds";
+	const size_t profileSamples = 8192;
+	writeProfile(profileFile, profileSamples);
+	writeProfile(colorFile, profileSamples*3);
+	writeDDS(ddsFile, 2048);
+
+	JobSystem jobs;
+	jobs.init(0);
+
+	vector<pair<string, function<double()>>> benchmarks;
+
+	// Single orbits, one propagator per call
+	for (const double ecc : {0.0167, 0.2056, 0.6, 0.967, 1.0, 2.5})
+	{
+		const Orbit orbit(ecc, 1.5e8, 0.1, 1.0, 2.0, 3.15e7, 0.5);
+		double epoch = 0.0;
+		stringstream name;
+		name << "orbit_compute_position/ecc=" << ecc;
+		benchmarks.push_back({name.str(), [orbit, epoch]() mutable {
+			epoch += 3600;
+			return orbit.computePosition(epoch).x;
+		}});
+	}
+
+	// Batches of orbits by eccentricity band, warm (small steps) and cold starts
+	const size_t batchSize = 10000;
+	const vector<pair<string, pair<double, double>>> bands = {
+		{"low", {0.0, 0.3}}, {"high", {0.9, 0.99}}, {"hyperbolic", {1.1, 3.0}}};
+	for (const auto &band : bands)
+	{
+		for (const bool warm : {true, false})
+		{
+			auto orbits = randomOrbits(batchSize, band.second.first, band.second.second);
+			vector<int> ids(orbits.size());
+			for (size_t i=0;i<ids.size();++i) ids[i] = i;
+			auto propagator = make_shared<OrbitPropagator>();
+			propagator->init(orbits, ids);
+			auto positions = make_shared<vector<glm::dvec3>>(orbits.size());
+			double epoch = 0.0;
+			const double step = warm?60.0:1e7;
+			benchmarks.push_back({
+				"orbit_propagate/" + band.first + (warm?"/warm":"/cold") +
+				"/" + to_string(batchSize),
+				[=]() mutable {
+					epoch += step;
+					propagator->propagate(epoch, positions->data());
+					return (*positions)[0].x;
+				}});
+		}
+	}
+
+	// Atmosphere lookup table, as generated at startup
+	const Atmo atmo(glm::vec4(2, 1.5, 1.0, 0.0), 5, 250, 15.9);
+	benchmarks.push_back({"atmo_lookup_table/128", [&]{
+		return atmo.generateLookupTable(128, 6371)[0];
+	}});
+	benchmarks.push_back({"atmo_lookup_table/128/jobs", [&]{
+		return atmo.generateLookupTable(128, 6371, &jobs)[0];
+	}});
+
+	// Ring profiles
+	benchmarks.push_back({"ring_profile_text/" + to_string(profileSamples), [&]{
+		return RingProfile::loadText(profileFile, profileFile, profileFile,
+			profileFile, colorFile).getScattering()[0];
+	}});
+	RingProfile::loadText(profileFile, profileFile, profileFile,
+		profileFile, colorFile).savePacked(packedFile);
+	benchmarks.push_back({"ring_profile_packed/" + to_string(profileSamples), [&]{
+		return RingProfile::loadPacked(packedFile).getScattering()[0];
+	}});
+
+	// DDS header parsing (file mapping is cached after the first one)
+	benchmarks.push_back({"dds_header/2048", [&]{
+		return DDSLoader(ddsFile).getImageSize(0);
+	}});
+
+	// Entity file parsing
+	const string entitiesFile = "config/entities.sn";
+	if (ifstream(entitiesFile.c_str()))
+	{
+		benchmarks.push_back({"shaun_parse/entities.sn", [&]{
+			shaun::object obj = shaun::parse_file(entitiesFile);
+			return 1.0;
+		}});
+	}
+	else
+	{
+		cerr << "Skipping shaun_parse, " << entitiesFile << " not found" << endl;
+	}
+
+	// Entity collection from parameters
+	const vector<EntityParam> system = generateSystem(20, 10);
+	benchmarks.push_back({"entity_collection_init/" + to_string(system.size()), [&]{
+		EntityCollection collection;
+		collection.init(system);
+		return collection.getAll().size();
+	}});
+
+	// Snapshot of the same parameters, loaded instead of parsing the entity file
+	const string snapshotFile = tempDir + "microbench_entities.bin";
+	const string snapshotSource = "microbench";
+	EntityFile snapshot;
+	snapshot.entities = system;
+	snapshot.saveSnapshot(snapshotFile, snapshotSource);
+	benchmarks.push_back({"entity_snapshot_load/" + to_string(system.size()), [&]{
+		EntityFile loaded;
+		loaded.loadSnapshot(snapshotFile, snapshotSource);
+		return loaded.entities.size();
+	}});
+
+	// Meshes
+	benchmarks.push_back({"generate_sphere/32x32", []{
+		return generateSphere(32, 32).getVertices().size();
+	}});
+	benchmarks.push_back({"generate_sphere/256x256", []{
+		return generateSphere(256, 256).getVertices().size();
+	}});
+	benchmarks.push_back({"generate_ring_mesh/32", []{
+		return generateRingMesh(32, 1.1, 2.3).getVertices().size();
+	}});
+
+	vector<Result> results;
+	for (const auto &b : benchmarks)
+	{
+		if (b.first.find(filter) == string::npos) continue;
+		cerr << b.first << "... " << flush;
+		results.push_back(run(b.first, b.second));
+		cerr << results.back().median << " ns" << endl;
+	}
+
+	remove(profileFile.c_str());
+	remove(colorFile.c_str());
+	remove(packedFile.c_str());
+	remove(snapshotFile.c_str());
+
+	ofstream file;
+	if (output != "-")
+	{
+		file.open(output.c_str());
+		if (!file)
+		{
+			cerr << "Can't write " << output << endl;
+			return 1;
+		}
+	}
+	ostream &out = (output != "-")?file:cout;
+	out << fixed << setprecision(1);
+	out << "{\"threads\": " << jobs.getThreadCount() << ", \"benchmarks\": [";
+	for (size_t i=0;i<results.size();++i)
+	{
+		const Result &r = results[i];
+		out << ((i>0)?",":"") << "\n  {\"name\": \"" << r.name
+			<< "\", \"iterations\": " << r.iterations
+			<< ", \"min_ns\": " << r.min
+			<< ", \"median_ns\": " << r.median
+			<< ", \"mean_ns\": " << r.mean << "}";
+	}
+	out << "\n]}\n";
+	return 0;
+}
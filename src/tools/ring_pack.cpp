@@ -0,0 +1,40 @@
+/**
+ * Packs the five text profiles of a ring system into a single binary file
+ * read by RingProfile::loadPacked()
+ *
+ * Usage: ring_pack <backscat> <forwardscat> <unlit> <transparency> <color> <output file>
+ * The output is used instead of the text files when it is given as the
+ * "packed" file of the ring in entities.sn.
+ */
+
+#include "../ring_profile.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	if (argc < 7)
+	{
+		cerr << "Usage: " << argv[0] <<
+			" <backscat> <forwardscat> <unlit> <transparency> <color> <output file>" << endl;
+		return 1;
+	}
+
+	try
+	{
+		const RingProfile profile = RingProfile::loadText(
+			argv[1], argv[2], argv[3], argv[4], argv[5]);
+		profile.savePacked(argv[6]);
+		cout << profile.getSampleCount() << " samples written to " << argv[6] << endl;
+	}
+	catch (const runtime_error &e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
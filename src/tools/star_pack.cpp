@@ -0,0 +1,39 @@
+/**
+ * Packs a text star catalog into a binary file read by
+ * StarCatalog::loadPacked()
+ *
+ * Usage: star_pack <catalog> <output file>
+ * The catalog has one star per line: right ascension and declination in
+ * degrees, visual magnitude and B-V color index. The output is given as the
+ * "catalog" of the starMap in entities.sn.
+ */
+
+#include "../star_catalog.hpp"
+
+#include <iostream>
+#include <stdexcept>
+#include <string>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+	if (argc < 3)
+	{
+		cerr << "Usage: " << argv[0] << " <catalog> <output file>" << endl;
+		return 1;
+	}
+
+	try
+	{
+		const StarCatalog catalog = StarCatalog::loadText(argv[1]);
+		catalog.savePacked(argv[2]);
+		cout << catalog.getStars().size() << " stars written to " << argv[2] << endl;
+	}
+	catch (const runtime_error &e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
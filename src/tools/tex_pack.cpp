@@ -0,0 +1,189 @@
+/**
+ * Packs a stream texture folder (info.sn + levelN/ DDS tiles) into a single
+ * tile archive read by DDSStreamer
+ *
+ * Usage: tex_pack [-z] <texture folder> [output file]
+ * The output defaults to the folder name followed by ".rtex", which is where
+ * DDSStreamer::createTex() looks for it. With -z, tiles are deflate
+ * compressed, and inflated by the loading threads when streamed.
+ */
+
+#include "../tile_archive.hpp"
+#include "../ddsloader.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <SHAUN/sweeper.hpp>
+#include <SHAUN/parser.hpp>
+
+using namespace std;
+
+struct TexInfo
+{
+	int size = 0;
+	int levels = 0;
+	string prefix = "";
+	string separator = "";
+	string suffix = "";
+	bool rowColumnOrder = false;
+};
+
+TexInfo parseInfoFile(const string &filename)
+{
+	try
+	{
+		shaun::object obj = shaun::parse_file(filename);
+		shaun::sweeper swp(obj);
+
+		TexInfo info{};
+		info.size = swp("size").value<shaun::number>();
+		info.levels = swp("levels").value<shaun::number>();
+		string prefix = swp("prefix").value<shaun::string>();
+		string separator = swp("separator").value<shaun::string>();
+		string suffix = swp("suffix").value<shaun::string>();
+		info.prefix = prefix;
+		info.separator = separator;
+		info.suffix = suffix;
+		info.rowColumnOrder = swp("row_column_order").value<shaun::boolean>();
+		return info;
+	}
+	catch (const shaun::exception &e)
+	{
+		throw runtime_error("Error when parsing " + filename + " :\n" + e.to_string());
+	}
+}
+
+uint64_t align(const uint64_t offset)
+{
+	const uint64_t a = TileArchive::ALIGNMENT;
+	return ((offset+a-1)/a)*a;
+}
+
+void pack(const string &folder, const string &output, const bool compress)
+{
+	const TexInfo info = parseInfoFile(folder + "/info.sn");
+	if (info.levels <= 0 || info.size <= 0)
+		throw runtime_error("Invalid size or levels in " + folder + "/info.sn");
+
+	// Tile files in archive order
+	vector<string> files;
+	vector<TileArchive::Entry> entries;
+	for (int i=0;i<info.levels;++i)
+	{
+		const int rows = (i==0)?1:1<<(i-1);
+		const int columns = (i==0)?1:2*rows;
+		for (int x=0;x<columns;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				files.push_back(folder + "/level" + to_string(i) + "/" +
+					info.prefix+
+					to_string(info.rowColumnOrder?y:x)+
+					info.separator+
+					to_string(info.rowColumnOrder?x:y)+
+					info.suffix);
+				TileArchive::Entry entry{};
+				entry.level = i;
+				entry.column = x;
+				entry.row = y;
+				entries.push_back(entry);
+			}
+		}
+	}
+
+	TileArchive::Header header{};
+	header.magic[0] = 'R'; header.magic[1] = 'T';
+	header.magic[2] = 'E'; header.magic[3] = 'X';
+	header.version = TileArchive::VERSION;
+	header.tileSize = info.size;
+	header.levels = info.levels;
+	header.tileCount = entries.size();
+	header.compression = (uint32_t)(compress?
+		TileArchive::Compression::DEFLATE:TileArchive::Compression::NONE);
+
+	ofstream out(output.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!out) throw runtime_error("Can't open " + output);
+
+	// Index is written last, once offsets are known
+	uint64_t offset = align(sizeof(TileArchive::Header)+
+		entries.size()*sizeof(TileArchive::Entry));
+
+	uint64_t rawSize = 0, storedSize = 0;
+	for (size_t t=0;t<files.size();++t)
+	{
+		const DDSLoader loader(files[t]);
+		if (t == 0) header.format = (uint32_t)loader.getFormat();
+		else if ((uint32_t)loader.getFormat() != header.format)
+			throw runtime_error("Format differs from tail tile : " + files[t]);
+		if (t > 0 && (loader.getWidth(0) != info.size || loader.getHeight(0) != info.size))
+			throw runtime_error("Tile size differs from info.sn : " + files[t]);
+
+		TileArchive::Entry &entry = entries[t];
+		entry.mipmapCount = loader.getMipmapCount();
+		entry.width = loader.getWidth(0);
+		entry.height = loader.getHeight(0);
+		entry.offset = offset;
+		entry.size = 0;
+
+		// Compressed levels follow the table of their sizes
+		vector<uint32_t> storedSizes(compress?entry.mipmapCount:0);
+		entry.size = storedSizes.size()*sizeof(uint32_t);
+		out.seekp(offset+entry.size, ios::beg);
+		for (int m=0;m<loader.getMipmapCount();++m)
+		{
+			const vector<uint8_t> image = loader.getImageData(m);
+			const vector<uint8_t> data = compress?
+				TileArchive::compressImage(loader.getFormat(), image, 9):image;
+			out.write((const char*)data.data(), data.size());
+			if (compress) storedSizes[m] = data.size();
+			entry.size += data.size();
+			rawSize += image.size();
+		}
+		storedSize += entry.size;
+		out.seekp(offset, ios::beg);
+		out.write((const char*)storedSizes.data(), storedSizes.size()*sizeof(uint32_t));
+		offset = align(offset+entry.size);
+	}
+
+	out.seekp(0, ios::beg);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)entries.data(), entries.size()*sizeof(TileArchive::Entry));
+	if (!out) throw runtime_error("Error when writing " + output);
+	out.close();
+
+	// Check that the archive reads back
+	const TileArchive archive(output);
+	cout << "Packed " << files.size() << " tiles into " << output;
+	if (compress) cout << " (" << storedSize << " bytes for " << rawSize << " of tiles)";
+	cout << endl;
+}
+
+int main(int argc, char **argv)
+{
+	const bool compress = argc > 1 && string(argv[1]) == "-z";
+	const int first = compress?2:1;
+	if (argc < first+1)
+	{
+		cerr << "Usage: " << argv[0] << " [-z] <texture folder> [output file]" << endl;
+		return 1;
+	}
+	string folder = argv[first];
+	while (folder.size() > 1 && (folder.back() == '/' || folder.back() == '\\'))
+		folder.pop_back();
+	const string output = (argc > first+1)?argv[first+1]:folder + ".rtex";
+
+	try
+	{
+		pack(folder, output, compress);
+	}
+	catch (const runtime_error &e)
+	{
+		cerr << e.what() << endl;
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,195 @@
+#include "vk_profiler.hpp"
+#include "cpu_profiler.hpp"
+
+#include <cmath>
+
+using namespace std;
+
+void GPUProfilerVK::init(ContextVK &ctx, const uint32_t frames)
+{
+	_ctx = &ctx;
+	_slotScopes.assign(frames, {});
+	_slotMeasured.assign(frames, false);
+
+	uint32_t familyCount = 0;
+	vkGetPhysicalDeviceQueueFamilyProperties(ctx.physicalDevice, &familyCount, nullptr);
+	vector<VkQueueFamilyProperties> families(familyCount);
+	vkGetPhysicalDeviceQueueFamilyProperties(ctx.physicalDevice, &familyCount,
+		families.data());
+	const uint32_t validBits = families[ctx.graphicsFamily].timestampValidBits;
+	_supported = validBits > 0;
+	if (!_supported) return;
+	_timestampMask = (validBits >= 64)?~0ull:((1ull<<validBits)-1);
+
+	VkQueryPoolCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+	info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+	info.queryCount = frames*SLOT_QUERIES;
+	checkVK(vkCreateQueryPool(ctx.device, &info, nullptr, &_pool),
+		"timestamp query pool creation");
+
+	if (ctx.calibratedTimestamps)
+	{
+		_getCalibratedTimestamps = (PFN_vkGetCalibratedTimestampsEXT)
+			vkGetDeviceProcAddr(ctx.device, "vkGetCalibratedTimestampsEXT");
+	}
+	calibrate();
+}
+
+void GPUProfilerVK::destroy()
+{
+	if (_pool) vkDestroyQueryPool(_ctx->device, _pool, nullptr);
+	_pool = VK_NULL_HANDLE;
+}
+
+void GPUProfilerVK::calibrate()
+{
+#ifndef _WIN32
+	if (_getCalibratedTimestamps)
+	{
+		// Both clocks sampled at once, steady_clock is CLOCK_MONOTONIC
+		VkCalibratedTimestampInfoEXT infos[2]{};
+		infos[0].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+		infos[0].timeDomain = VK_TIME_DOMAIN_DEVICE_EXT;
+		infos[1].sType = VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT;
+		infos[1].timeDomain = VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+		uint64_t timestamps[2] = {0, 0};
+		uint64_t deviation = 0;
+		if (_getCalibratedTimestamps(_ctx->device, 2, infos, timestamps,
+			&deviation) == VK_SUCCESS)
+		{
+			const double gpuTime = timestamps[0]*(double)_ctx->properties.limits.timestampPeriod;
+			_clockOffset = (int64_t)timestamps[1]-(int64_t)llround(gpuTime);
+			_calibrationFrames = CALIBRATION_FRAMES;
+			return;
+		}
+	}
+#endif
+	// Without calibrated timestamps, measured once at init from a timestamp
+	// written right before the CPU is woken up
+	if (_calibrationFrames != 0) return;
+	const uint32_t query = SLOT_QUERIES-1;
+	_ctx->submitNow([&](VkCommandBuffer cmd){
+		vkCmdResetQueryPool(cmd, _pool, query, 1);
+		vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, _pool, query);
+	});
+	const uint64_t cpuTime = CPUProfiler::now();
+	uint64_t ticks = 0;
+	vkGetQueryPoolResults(_ctx->device, _pool, query, 1, sizeof(ticks), &ticks,
+		sizeof(ticks), VK_QUERY_RESULT_64_BIT|VK_QUERY_RESULT_WAIT_BIT);
+	const double gpuTime = (ticks&_timestampMask)*(double)_ctx->properties.limits.timestampPeriod;
+	_clockOffset = (int64_t)cpuTime-(int64_t)llround(gpuTime);
+	_calibrationFrames = -1;
+}
+
+uint64_t GPUProfilerVK::toCPUClock(const uint64_t ticks) const
+{
+	const double gpuTime = (ticks&_timestampMask)*(double)_ctx->properties.limits.timestampPeriod;
+	return (uint64_t)((int64_t)llround(gpuTime)+_clockOffset);
+}
+
+bool GPUProfilerVK::beginFrame(VkCommandBuffer cmd, const uint32_t slot)
+{
+	_slot = slot;
+	_stack.clear();
+	_lastFrameEnd = 0;
+	if (!_supported) return false;
+
+	if (_calibrationFrames > 0 && --_calibrationFrames == 0) calibrate();
+
+	// The slot's fence is signaled, results are there unless not written
+	const uint32_t first = slot*SLOT_QUERIES;
+	vector<PendingScope> &pending = _slotScopes[slot];
+	bool read = false;
+	if (!pending.empty() || _slotMeasured[slot])
+	{
+		// Value and availability of each query
+		vector<uint64_t> results(SLOT_QUERIES*2, 0);
+		vkGetQueryPoolResults(_ctx->device, _pool, first, SLOT_QUERIES,
+			results.size()*sizeof(uint64_t), results.data(), 2*sizeof(uint64_t),
+			VK_QUERY_RESULT_64_BIT|VK_QUERY_RESULT_WITH_AVAILABILITY_BIT);
+		auto available = [&](const uint32_t q){ return results[2*q+1] != 0;};
+		auto value = [&](const uint32_t q){ return toCPUClock(results[2*q]);};
+
+		if (_slotMeasured[slot] && available(SLOT_QUERIES-1))
+			_lastFrameEnd = value(SLOT_QUERIES-1);
+
+		vector<Scope> scopes;
+		bool complete = !pending.empty();
+		for (size_t i=0;i<pending.size() && complete;++i)
+		{
+			complete = available(2*i) && available(2*i+1);
+			if (!complete) break;
+			const uint64_t start = value(2*i);
+			const uint64_t end = value(2*i+1);
+			scopes.push_back({pending[i].name, pending[i].depth, pending[i].parent,
+				start, (end>start)?end-start:0});
+		}
+		if (complete)
+		{
+			addFrame(std::move(scopes));
+			read = true;
+		}
+	}
+	pending.clear();
+	_slotMeasured[slot] = false;
+
+	vkCmdResetQueryPool(cmd, _pool, first, SLOT_QUERIES);
+	return read;
+}
+
+uint32_t GPUProfilerVK::begin(const string &name)
+{
+	vector<PendingScope> &pending = _slotScopes[_slot];
+	if (!_supported || pending.size() >= MAX_SCOPES)
+	{
+		_stack.push_back(-1);
+		return NO_QUERY;
+	}
+	PendingScope scope{};
+	scope.name = name;
+	scope.depth = _stack.size();
+	scope.parent = -1;
+	// Innermost measured scope
+	for (auto it=_stack.rbegin();it!=_stack.rend();++it)
+	{
+		if (*it != -1)
+		{
+			scope.parent = *it;
+			break;
+		}
+	}
+	_stack.push_back(pending.size());
+	pending.push_back(scope);
+	return _slot*SLOT_QUERIES+2*(pending.size()-1);
+}
+
+uint32_t GPUProfilerVK::end()
+{
+	const int id = _stack.back();
+	_stack.pop_back();
+	if (id == -1) return NO_QUERY;
+	return _slot*SLOT_QUERIES+2*id+1;
+}
+
+uint32_t GPUProfilerVK::getFrameEndQuery() const
+{
+	if (!_supported) return NO_QUERY;
+	return _slot*SLOT_QUERIES+SLOT_QUERIES-1;
+}
+
+void GPUProfilerVK::write(VkCommandBuffer cmd, const uint32_t query) const
+{
+	if (query == NO_QUERY) return;
+	vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, _pool, query);
+}
+
+void GPUProfilerVK::endFrame()
+{
+	if (_supported) _slotMeasured[_slot] = true;
+}
+
+uint64_t GPUProfilerVK::getLastFrameEnd() const
+{
+	return _lastFrameEnd;
+}
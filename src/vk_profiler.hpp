@@ -0,0 +1,108 @@
+#pragma once
+
+#include "vk_util.hpp"
+#include "gpu_profiler.hpp"
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+/** Measures time intervals on the GPU with Vulkan timestamp queries
+ *
+ * Each frame slot has its own range of queries, read back once the slot's
+ * fence is signaled so that measuring never waits for the GPU. Scopes only
+ * give query indices, the renderer writes them in the command buffers the
+ * work of the scope is recorded in (secondary ones included), in execution
+ * order.
+ */
+class GPUProfilerVK : public GPUProfiler
+{
+public:
+	/// Query index of scopes that aren't measured
+	static const uint32_t NO_QUERY = ~0u;
+
+	GPUProfilerVK() = default;
+	GPUProfilerVK(const GPUProfilerVK &) = delete;
+	GPUProfilerVK &operator=(const GPUProfilerVK &) = delete;
+	/**
+	 * Creates the queries
+	 * @param ctx context of the renderer
+	 * @param frames number of frame slots
+	 */
+	void init(ContextVK &ctx, uint32_t frames);
+	/// Destroys the queries
+	void destroy();
+	/** Starts the frame of a slot whose fence is signaled: reads back the
+	 * frame last recorded in it and resets its queries
+	 * @param cmd primary command buffer of the frame, outside of a render pass
+	 * @param slot frame slot
+	 * @return true if a frame was read back
+	 */
+	bool beginFrame(VkCommandBuffer cmd, uint32_t slot);
+	/** Starts a timer, nested in the timers still running
+	 * @param name name of label
+	 * @return query to write before the commands of the scope
+	 */
+	uint32_t begin(const std::string &name);
+	/** Stops the last started timer still running
+	 * @return query to write after the commands of the scope
+	 */
+	uint32_t end();
+	/// Returns the query to write after the last command of the frame
+	uint32_t getFrameEndQuery() const;
+	/** Writes the timestamp of a query once the commands recorded before
+	 * are done (nothing for NO_QUERY)
+	 * @param cmd command buffer
+	 * @param query query given by begin(), end() or getFrameEndQuery()
+	 */
+	void write(VkCommandBuffer cmd, uint32_t query) const;
+	/// Ends the frame of the timers started since beginFrame()
+	void endFrame();
+	/** Returns the end of the frame read back by the last beginFrame(), on
+	 * the CPUProfiler clock, 0 if it wasn't measured
+	 */
+	uint64_t getLastFrameEnd() const;
+
+private:
+	/// Most scopes measured in a frame
+	static const uint32_t MAX_SCOPES = 32;
+	/// Queries of a frame slot, two per scope and the frame end
+	static const uint32_t SLOT_QUERIES = MAX_SCOPES*2+1;
+	/// Frames between measures of the GPU clock
+	static const int CALIBRATION_FRAMES = 120;
+
+	/// Scope whose queries are written in a frame
+	struct PendingScope
+	{
+		std::string name;
+		int depth;
+		int parent;
+	};
+	/// Measures the offset from the GPU clock to the CPU clock
+	void calibrate();
+	/// Converts a timestamp to the CPUProfiler clock
+	uint64_t toCPUClock(uint64_t ticks) const;
+
+	ContextVK *_ctx = nullptr;
+	VkQueryPool _pool = VK_NULL_HANDLE;
+	/// Whether the graphics queue supports timestamps
+	bool _supported = false;
+	/// Mask of the valid bits of timestamps
+	uint64_t _timestampMask = ~0ull;
+	/// Scopes recorded in each slot, scope i uses queries 2i and 2i+1
+	std::vector<std::vector<PendingScope>> _slotScopes;
+	/// Whether the frame end query of each slot was written
+	std::vector<bool> _slotMeasured;
+	/// Slot being recorded
+	uint32_t _slot = 0;
+	/// Indices of running scopes in the current frame, -1 if not measured
+	std::vector<int> _stack;
+	/// End of the frame last read back, 0 if unknown
+	uint64_t _lastFrameEnd = 0;
+	/// Function of VK_EXT_calibrated_timestamps
+	PFN_vkGetCalibratedTimestampsEXT _getCalibratedTimestamps = nullptr;
+	/// CPU clock minus GPU clock, in ns
+	int64_t _clockOffset = 0;
+	/// Frames until the next clock measure
+	int _calibrationFrames = 0;
+};
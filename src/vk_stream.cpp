@@ -0,0 +1,841 @@
+#include "vk_stream.hpp"
+
+#include "cpu_profiler.hpp"
+#include "texture_info.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include <glm/gtc/constants.hpp>
+
+using namespace std;
+
+void StreamerVK::init(ContextVK &ctx, const int framesInFlight,
+	const bool asynchronous, const size_t stagingSize, const int maxSize, int threads)
+{
+	_ctx = &ctx;
+	_framesInFlight = std::max(framesInFlight, 1);
+	_asynchronous = asynchronous;
+	_rateStart = chrono::steady_clock::now();
+	_maxSize = (maxSize>0)?maxSize:numeric_limits<int>::max();
+
+	_stagingBuffer = BufferVK(ctx, stagingSize, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	// Offsets aligned for any texel block and optimalBufferCopyOffsetAlignment
+	const size_t alignment = 256;
+	_staging = RingAllocator(stagingSize, alignment);
+
+	VkCommandPoolCreateInfo poolInfo{};
+	poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+	poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+	poolInfo.queueFamilyIndex = ctx.transferFamily;
+	checkVK(vkCreateCommandPool(ctx.device, &poolInfo, nullptr, &_pool),
+		"streaming command pool creation");
+
+	VkSemaphoreTypeCreateInfo typeInfo{};
+	typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+	typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+	typeInfo.initialValue = 0;
+	VkSemaphoreCreateInfo semaphoreInfo{};
+	semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	semaphoreInfo.pNext = &typeInfo;
+	checkVK(vkCreateSemaphore(ctx.device, &semaphoreInfo, nullptr, &_semaphore),
+		"streaming semaphore creation");
+
+	// Don't need threading if synchronous
+	if (!_asynchronous) return;
+
+	if (threads <= 0)
+	{
+		// Leave some cores to rendering
+		threads = std::min(std::max((int)thread::hardware_concurrency()/2, 1), 8);
+	}
+
+	for (int i=0;i<threads;++i)
+		_loadInfoQueues.emplace_back(new WorkerQueue());
+	for (int i=0;i<threads;++i)
+		_threads.emplace_back(&StreamerVK::work, this, i);
+}
+
+void StreamerVK::destroy()
+{
+	if (!_threads.empty())
+	{
+		{
+			lock_guard<mutex> lk(_mtx);
+			_killThread = true;
+		}
+		_cond.notify_all();
+		for (auto &t : _threads)
+			t.join();
+		_threads.clear();
+	}
+	if (!_ctx) return;
+
+	_texs.clear();
+	_retired.clear();
+	_batches.clear();
+	_batchCmd = VK_NULL_HANDLE;
+	_stagingBuffer = BufferVK();
+	if (_pool) vkDestroyCommandPool(_ctx->device, _pool, nullptr);
+	if (_semaphore) vkDestroySemaphore(_ctx->device, _semaphore, nullptr);
+	_pool = VK_NULL_HANDLE;
+	_semaphore = VK_NULL_HANDLE;
+	_ctx = nullptr;
+}
+
+StreamerVK::~StreamerVK()
+{
+	destroy();
+}
+
+void StreamerVK::work(const int worker)
+{
+	CPUProfiler::setThreadName("DDS loader "+to_string(worker));
+	while (true)
+	{
+		LoadInfo info{};
+		if (!popJob(worker, info))
+		{
+			unique_lock<mutex> lk(_mtx);
+			_cond.wait(lk, [this]{ return _killThread || _queuedJobs > 0;});
+			if (_killThread) return;
+			continue;
+		}
+
+		CPUProfiler::Scope scope("Tile load");
+		LoadData data = load(info);
+
+		{
+			lock_guard<mutex> lk(_dataMtx);
+			_loadData.push_back(data);
+		}
+	}
+}
+
+bool StreamerVK::popJob(const int worker, LoadInfo &info)
+{
+	const int queues = _loadInfoQueues.size();
+	// Own queue first, then steal from the others
+	for (int i=0;i<queues;++i)
+	{
+		WorkerQueue &queue = *_loadInfoQueues[(worker+i)%queues];
+		lock_guard<mutex> lk(queue.mtx);
+		if (queue.heap.empty()) continue;
+		pop_heap(queue.heap.begin(), queue.heap.end());
+		info = queue.heap.back();
+		queue.heap.pop_back();
+		{
+			lock_guard<mutex> lk(_mtx);
+			--_queuedJobs;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool StreamerVK::LoadInfo::operator<(const LoadInfo &info) const
+{
+	if (priority != info.priority) return priority < info.priority;
+	// Same priority : first created first
+	if (handle != info.handle) return handle > info.handle;
+	return tileId > info.tileId;
+}
+
+void StreamerVK::setTileBounds(LoadInfo &info, const int tileWidth) const
+{
+	// Equirectangular mapping, u along longitude, v from north to south pole
+	const float pi = glm::pi<float>();
+	const float size = tileWidth/(float)info.levelWidth;
+	const float u = info.offsetX/(float)info.levelWidth + size*0.5f;
+	const float v = 2*info.offsetY/(float)info.levelWidth + size;
+	const float theta = 2*pi*u;
+	const float phi = pi*(0.5f-v);
+	info.direction = glm::vec3(cos(phi)*cos(theta), cos(phi)*sin(theta), sin(phi));
+	// Half diagonal (longitude span 2*pi*size, latitude span 2*pi*size)
+	info.angularRadius = std::min(pi, pi*size*sqrt(2.f));
+}
+
+float StreamerVK::computePriority(const LoadInfo &info) const
+{
+	auto it = _importance.find(info.handle);
+	// Unknown view: coarsest first
+	if (it == _importance.end()) return info.level;
+
+	const Importance &imp = it->second;
+
+	// Closest angle between the tile and the view direction
+	const float angle = acos(glm::clamp(glm::dot(info.direction, imp.viewDir), -1.f, 1.f));
+	const float facing = cos(std::max(0.f, angle-info.angularRadius));
+
+	// Same tiers as DDSStreamer::computePriority()
+	const float usefulWidth = 2*glm::pi<float>()*imp.screenSize;
+	const bool useful = info.levelWidth <= usefulWidth*2;
+	const int tier = (!useful)?0:((facing <= 0)?1:2);
+
+	return tier*100 + info.level*2 + facing;
+}
+
+bool StreamerVK::openSource(const string &filename, TexSource &src)
+{
+	src.filename = filename;
+
+	// Tile archive if it has been packed, info file otherwise
+	const string archiveFile = filename + ".rtex";
+	if (ifstream(archiveFile))
+	{
+		try
+		{
+			src.archive = make_shared<TileArchive>(archiveFile);
+		}
+		catch (const runtime_error &e)
+		{
+			cerr << e.what() << endl;
+			return false;
+		}
+		src.size = src.archive->getTileSize();
+		src.levels = clampLevels(src.archive->getLevels(), src.size, _maxSize);
+	}
+	else
+	{
+		TexInfo info = parseInfoFile(filename + "/info.sn", _maxSize);
+		src.size = info.size;
+		src.levels = info.levels;
+		src.prefix = info.prefix;
+		src.separator = info.separator;
+		src.suffix = info.suffix;
+		src.rowColumnOrder = info.rowColumnOrder;
+	}
+
+	// Check if file exists or is valid
+	if (src.levels == 0) return false;
+
+	// Tail loader, the only file opened here; all tiles share its format
+	src.format = src.archive?src.archive->getFormat():
+		DDSLoader(getTileFilename(src, 0, 0, 0)).getFormat();
+
+	// Tiles go through the staging buffer in one piece
+	const size_t tileSize = DDSLoader::computeImageSize(src.format, src.size, src.size);
+	if (tileSize > _staging.getMaxSize())
+	{
+		cerr << "Can't stream " << filename << " : tiles of " << tileSize <<
+			" bytes don't fit in the " << _staging.getCapacity() <<
+			" bytes staging buffer" << endl;
+		return false;
+	}
+
+	// Storage params
+	src.width = min(_maxSize,src.size<<(src.levels-1));
+	src.height = src.width/2;
+	src.mipNumber = mipLevelsVK(src.width);
+	return true;
+}
+
+string StreamerVK::getTileFilename(const TexSource &src,
+	const int level, const int x, const int y)
+{
+	return src.filename + "/level" + to_string(level) + "/" +
+		src.prefix+
+		to_string(src.rowColumnOrder?y:x)+
+		src.separator+
+		to_string(src.rowColumnOrder?x:y)+
+		src.suffix;
+}
+
+vector<StreamerVK::LoadInfo> StreamerVK::genJobs(const Handle h,
+	const TexSource &src)
+{
+	vector<LoadInfo> jobs;
+
+	// Unique for each tile
+	int tileId = 0;
+
+	// Tail mipmaps (level0)
+	const string tailFile = getTileFilename(src, 0, 0, 0);
+	const int tailMipsFile = mipLevelsVK(src.size);
+	const int tailMips = mipLevelsVK(min(_maxSize, src.size));
+	const int skipMips = tailMipsFile-tailMips;
+	for (int i=tailMips-1;i>=0;--i)
+	{
+		LoadInfo tailInfo{};
+		tailInfo.handle = h;
+		tailInfo.filename = tailFile;
+		tailInfo.archive = src.archive;
+		tailInfo.fileLevel = i+skipMips;
+		tailInfo.offsetX = 0;
+		tailInfo.offsetY = 0;
+		tailInfo.level = src.levels-1+i;
+		if (tailInfo.level >= src.mipNumber) continue;
+		// Tail file is size x size/2
+		tailInfo.imageSize = DDSLoader::computeImageSize(src.format,
+			std::max(1, src.size>>tailInfo.fileLevel),
+			std::max(1, (src.size/2)>>tailInfo.fileLevel));
+		tailInfo.tileId = tileId;
+		tailInfo.levelWidth = std::max(1, src.width>>tailInfo.level);
+		// Covers the whole sphere
+		tailInfo.direction = glm::vec3(0,0,1);
+		tailInfo.angularRadius = glm::pi<float>();
+		tailInfo.priority = computePriority(tailInfo);
+		jobs.push_back(tailInfo);
+		tileId += 1;
+	}
+
+	for (int i=1;i<src.levels;++i)
+	{
+		const int rows = 1<<(i-1);
+		const int columns = 2*rows;
+		for (int x=0;x<columns;++x)
+		{
+			for (int y=0;y<rows;++y)
+			{
+				LoadInfo loadInfo = genTileJob(h, src, i, x, y);
+				loadInfo.tileId = tileId;
+				jobs.push_back(loadInfo);
+				tileId += 1;
+			}
+		}
+	}
+	return jobs;
+}
+
+StreamerVK::LoadInfo StreamerVK::genTileJob(const Handle h,
+	const TexSource &src, const int i, const int x, const int y)
+{
+	const int level = src.levels-i-1;
+	LoadInfo loadInfo{};
+	loadInfo.handle = h;
+	loadInfo.filename = getTileFilename(src, i, x, y);
+	loadInfo.archive = src.archive;
+	loadInfo.archiveTile = TileArchive::getTileIndex(i, x, y);
+	loadInfo.fileLevel = 0;
+	loadInfo.offsetX = x*src.size;
+	loadInfo.offsetY = y*src.size;
+	loadInfo.level = level;
+	loadInfo.imageSize =
+		DDSLoader::computeImageSize(src.format, src.size, src.size);
+	loadInfo.levelWidth = src.width>>level;
+	setTileBounds(loadInfo, src.size);
+	loadInfo.priority = computePriority(loadInfo);
+	return loadInfo;
+}
+
+void StreamerVK::submitJobs(const Handle h, const vector<LoadInfo> &jobs)
+{
+	_texs[h].tileUpdated = vector<bool>(jobs.size(), false);
+
+	if (_asynchronous)
+	{
+		const auto now = chrono::steady_clock::now();
+		for (auto info : jobs)
+		{
+			info.requestTime = now;
+			_loadInfoWaiting.push_back(info);
+		}
+		return;
+	}
+
+	// Synchronous mode : load whole texture now
+	for (auto info : jobs)
+	{
+		info.requestTime = chrono::steady_clock::now();
+		while (!acquireRange(info))
+		{
+			// Wait for the GPU to be done with older uploads
+			submitBatch();
+			retireBatches(true);
+		}
+		updateTile(load(info));
+	}
+	transitionUpdatedTextures();
+	submitBatch();
+	while (!_batches.empty()) retireBatches(true);
+	setTexturesAsComplete();
+}
+
+StreamerVK::Handle StreamerVK::createTex(const string &filename)
+{
+	TexSource src;
+	if (!openSource(filename, src)) return 0;
+
+	const Handle h = genHandle();
+	ImageVK::Info info{};
+	info.format = DDSFormatToVK(src.format);
+	info.width = src.width;
+	info.height = src.height;
+	info.levels = src.mipNumber;
+	info.usage = VK_IMAGE_USAGE_SAMPLED_BIT|VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	info.shared = true;
+	Texture &tex = _texs[h];
+	tex.image = ImageVK(*_ctx, info);
+
+	// Ready for copies before the first tile of the batch
+	imageBarrierVK(getBatchCommandBuffer(), tex.image.getImage(),
+		VK_IMAGE_ASPECT_COLOR_BIT,
+		VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+		VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+	tex.lastBatch = _batchSerial;
+
+	submitJobs(h, genJobs(h, src));
+	return h;
+}
+
+VkImageView StreamerVK::getCompleteView(const Handle handle, const VkImageView def) const
+{
+	if (!handle) return def;
+	auto it = _texs.find(handle);
+	if (it == _texs.end() || !it->second.complete) return def;
+	return it->second.image.getView();
+}
+
+bool StreamerVK::isComplete(const Handle handle) const
+{
+	auto it = _texs.find(handle);
+	return it != _texs.end() && it->second.complete;
+}
+
+void StreamerVK::deleteTex(Handle handle)
+{
+	auto it = _texs.find(handle);
+	if (!handle || it == _texs.end()) return;
+	_importance.erase(handle);
+	// Frames in flight may still sample it, and batches copy to it
+	_retired.push_back({std::move(it->second.image), it->second.lastBatch, _frame});
+	_texs.erase(it);
+	_texDeleted.push_back(handle);
+	++_generation;
+}
+
+void StreamerVK::setImportance(Handle handle, const glm::vec3 &viewDir,
+	const float screenSize)
+{
+	if (!handle || !_asynchronous) return;
+	const auto it = _importance.find(handle);
+	if (it != _importance.end())
+	{
+		const Importance &i = it->second;
+		const float ratio = (i.screenSize > 0)?screenSize/i.screenSize:0.f;
+		if (glm::dot(viewDir, i.viewDir) >= IMPORTANCE_COS_ANGLE &&
+			ratio <= IMPORTANCE_SIZE_RATIO && ratio >= 1/IMPORTANCE_SIZE_RATIO)
+			return;
+	}
+	_importance[handle] = {viewDir, screenSize};
+	_importanceChanged = true;
+}
+
+bool StreamerVK::acquireRange(LoadInfo &info)
+{
+	const RingAllocator::Range range = _staging.allocate(info.imageSize);
+	if (range.offset == -1) return false;
+	info.offset = range.offset;
+	info.rangeId = range.id;
+	return true;
+}
+
+VkCommandBuffer StreamerVK::getBatchCommandBuffer()
+{
+	if (_batchCmd) return _batchCmd;
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = _pool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	checkVK(vkAllocateCommandBuffers(_ctx->device, &allocInfo, &_batchCmd),
+		"streaming command buffer allocation");
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(_batchCmd, &beginInfo);
+	return _batchCmd;
+}
+
+void StreamerVK::submitBatch()
+{
+	if (!_batchCmd) return;
+	vkEndCommandBuffer(_batchCmd);
+
+	VkTimelineSemaphoreSubmitInfo timelineInfo{};
+	timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+	timelineInfo.signalSemaphoreValueCount = 1;
+	timelineInfo.pSignalSemaphoreValues = &_batchSerial;
+	VkSubmitInfo submit{};
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.pNext = &timelineInfo;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &_batchCmd;
+	submit.signalSemaphoreCount = 1;
+	submit.pSignalSemaphores = &_semaphore;
+	checkVK(vkQueueSubmit(_ctx->transferQueue, 1, &submit, VK_NULL_HANDLE),
+		"streaming submit");
+
+	UploadBatch batch{};
+	batch.serial = _batchSerial;
+	batch.cmd = _batchCmd;
+	batch.ranges.swap(_batchRanges);
+	_batches.push_back(std::move(batch));
+	_batchCmd = VK_NULL_HANDLE;
+	++_batchSerial;
+}
+
+void StreamerVK::retireBatches(const bool waitOldest)
+{
+	if (waitOldest && !_batches.empty())
+	{
+		VkSemaphoreWaitInfo waitInfo{};
+		waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+		waitInfo.semaphoreCount = 1;
+		waitInfo.pSemaphores = &_semaphore;
+		waitInfo.pValues = &_batches.front().serial;
+		vkWaitSemaphores(_ctx->device, &waitInfo, numeric_limits<uint64_t>::max());
+	}
+	uint64_t value = 0;
+	vkGetSemaphoreCounterValue(_ctx->device, _semaphore, &value);
+	// Batches signal in submission order
+	while (!_batches.empty() && _batches.front().serial <= value)
+	{
+		UploadBatch &batch = _batches.front();
+		for (const uint64_t id : batch.ranges) _staging.release(id);
+		vkFreeCommandBuffers(_ctx->device, _pool, 1, &batch.cmd);
+		_completedSerial = batch.serial;
+		_batches.pop_front();
+	}
+}
+
+void StreamerVK::transitionUpdatedTextures()
+{
+	for (auto &p : _texs)
+	{
+		Texture &tex = p.second;
+		if (tex.ready || !all_of(tex.tileUpdated.begin(), tex.tileUpdated.end(),
+			[](bool b){return b;}))
+			continue;
+		// Sampled once the graphics queue waited for this batch
+		imageBarrierVK(getBatchCommandBuffer(), tex.image.getImage(),
+			VK_IMAGE_ASPECT_COLOR_BIT,
+			VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+			VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0);
+		tex.tileUpdated.clear();
+		tex.lastBatch = _batchSerial;
+		tex.ready = true;
+	}
+}
+
+void StreamerVK::setTexturesAsComplete()
+{
+	for (auto &p : _texs)
+	{
+		Texture &tex = p.second;
+		if (tex.ready && !tex.complete && tex.lastBatch <= _completedSerial)
+			tex.complete = true;
+	}
+}
+
+void StreamerVK::destroyRetiredImages()
+{
+	while (!_retired.empty() && _retired.front().lastBatch <= _completedSerial &&
+		_retired.front().frame+_framesInFlight <= _frame)
+		_retired.pop_front();
+}
+
+void StreamerVK::update()
+{
+	CPUProfiler::Scope scope("Streaming update");
+	++_frame;
+	_stats.tilesUploaded = 0;
+	_stats.bytesUploaded = 0;
+
+	// Read rate over the last second
+	const auto now = chrono::steady_clock::now();
+	const double elapsed = chrono::duration<double>(now-_rateStart).count();
+	if (elapsed >= 1.0)
+	{
+		const uint64_t bytesRead = _bytesRead;
+		_stats.bytesReadPerSecond = (bytesRead-_rateStartBytes)/elapsed;
+		_rateStart = now;
+		_rateStartBytes = bytesRead;
+	}
+
+	retireBatches();
+	destroyRetiredImages();
+
+	if (!_asynchronous)
+	{
+		// Barriers of textures created since the last call
+		submitBatch();
+		return;
+	}
+	auto isDeleted = [this](const LoadInfo &info)
+	{
+		for (Handle h : _texDeleted)
+		{
+			if (h == info.handle)
+			{
+				if (info.offset != -1) _staging.release(info.rangeId);
+				return true;
+			}
+		}
+		return false;
+	};
+	// Invalidate deleted textures from pre-queue
+	_loadInfoWaiting.erase(
+		remove_if(_loadInfoWaiting.begin(), _loadInfoWaiting.end(), isDeleted),
+		_loadInfoWaiting.end());
+	if (!_texDeleted.empty())
+	{
+		// Invalidate deleted textures from currently processing queues
+		for (auto &queue : _loadInfoQueues)
+		{
+			lock_guard<mutex> lk(queue->mtx);
+			const auto it = remove_if(queue->heap.begin(), queue->heap.end(), isDeleted);
+			const int removed = queue->heap.end()-it;
+			queue->heap.erase(it, queue->heap.end());
+			make_heap(queue->heap.begin(), queue->heap.end());
+			lock_guard<mutex> countLk(_mtx);
+			_queuedJobs -= removed;
+		}
+	}
+
+	setTexturesAsComplete();
+
+	if (_importanceChanged)
+	{
+		// Reorder tiles for the new view
+		for (auto &info : _loadInfoWaiting)
+			info.priority = computePriority(info);
+		for (auto &queue : _loadInfoQueues)
+		{
+			lock_guard<mutex> lk(queue->mtx);
+			for (auto &info : queue->heap)
+				info.priority = computePriority(info);
+			make_heap(queue->heap.begin(), queue->heap.end());
+		}
+		_importanceChanged = false;
+	}
+
+	// Most urgent tiles get staging memory first
+	stable_sort(_loadInfoWaiting.begin(), _loadInfoWaiting.end(),
+		[](const LoadInfo &a, const LoadInfo &b){ return b < a; });
+
+	vector<LoadInfo> assigned;
+	vector<LoadInfo> nonAssigned;
+	for (const LoadInfo &info : _loadInfoWaiting)
+	{
+		LoadInfo s = info;
+		if (acquireRange(s)) assigned.push_back(s);
+		else nonAssigned.push_back(info);
+	}
+
+	if (!assigned.empty())
+	{
+		// Submit tiles, spread over all threads so textures load in parallel
+		const size_t queues = _loadInfoQueues.size();
+		vector<vector<LoadInfo>> submitted(queues);
+		for (const auto &info : assigned)
+		{
+			submitted[_nextQueue].push_back(info);
+			_nextQueue = (_nextQueue+1)%queues;
+		}
+		for (size_t i=0;i<queues;++i)
+		{
+			auto &queue = *_loadInfoQueues[i];
+			lock_guard<mutex> lk(queue.mtx);
+			for (const auto &info : submitted[i])
+			{
+				queue.heap.push_back(info);
+				push_heap(queue.heap.begin(), queue.heap.end());
+			}
+		}
+		{
+			lock_guard<mutex> lk(_mtx);
+			_queuedJobs += assigned.size();
+		}
+		_cond.notify_all();
+	}
+	_stats.starvedTiles = nonAssigned.size();
+	_loadInfoWaiting = nonAssigned;
+	_texDeleted.clear();
+
+	// Get loaded tiles, within the same cost budget as DDSStreamer
+	const int maxCost = 20000000;
+	vector<LoadData> data;
+	{
+		lock_guard<mutex> lk(_dataMtx);
+		if (!_loadData.empty())
+		{
+			// Always accept first element
+			auto first = _loadData.begin();
+			data.push_back(*first);
+			int currentCost = getCost(*first);
+			_loadData.erase(first);
+			// Choose next elements with cost
+			_loadData.erase(std::remove_if(_loadData.begin(), _loadData.end(), [&](LoadData &d){
+				currentCost += getCost(d);
+				if (currentCost < maxCost)
+				{
+					data.push_back(d);
+					return true;
+				}
+				return false;
+			}), _loadData.end());
+		}
+		_stats.deferredTiles = _loadData.size();
+	}
+	for (const LoadData &d : data) updateTile(d);
+	transitionUpdatedTextures();
+	submitBatch();
+}
+
+uint64_t StreamerVK::getGeneration() const
+{
+	return _generation;
+}
+
+VkSemaphore StreamerVK::getSemaphore() const
+{
+	return _semaphore;
+}
+
+uint64_t StreamerVK::getCompletedSerial() const
+{
+	return _completedSerial;
+}
+
+bool StreamerVK::isIdle()
+{
+	{
+		lock_guard<mutex> lk(_mtx);
+		if (_queuedJobs > 0) return false;
+	}
+	{
+		lock_guard<mutex> lk(_dataMtx);
+		if (!_loadData.empty()) return false;
+	}
+	if (!_loadInfoWaiting.empty() || !_batches.empty() || _batchCmd ||
+		!_texDeleted.empty())
+		return false;
+	for (const auto &p : _texs)
+		if (!p.second.complete) return false;
+	return true;
+}
+
+StreamerVK::Stats StreamerVK::getStats()
+{
+	Stats stats = _stats;
+	stats.bytesRead = _bytesRead;
+	stats.waitingTiles = _loadInfoWaiting.size();
+	{
+		lock_guard<mutex> lk(_mtx);
+		stats.queuedTiles = _queuedJobs;
+	}
+	stats.stagingUsed = _staging.getUsed();
+	stats.stagingSize = _staging.getCapacity();
+	stats.batchesInFlight = _batches.size();
+	uint64_t uploaded = 0;
+	for (const uint64_t count : stats.latencyHistogram) uploaded += count;
+	stats.meanLatency = (uploaded > 0)?_latencySum/uploaded:0.0;
+	return stats;
+}
+
+int StreamerVK::getCost(const LoadData &data)
+{
+	const int overheadCost = 2000;
+	return overheadCost + data.imageSize;
+}
+
+void StreamerVK::updateTile(const LoadData &d)
+{
+	auto it = _texs.find(d.handle);
+	if (it == _texs.end())
+	{
+		// Texture deleted while loading, range wasn't copied from
+		_staging.release(d.rangeId);
+		return;
+	}
+	Texture &tex = it->second;
+	// Tiles that failed to load are left empty
+	if (d.width > 0)
+	{
+		VkBufferImageCopy region{};
+		region.bufferOffset = d.offset;
+		region.imageSubresource = {VK_IMAGE_ASPECT_COLOR_BIT, (uint32_t)d.level, 0, 1};
+		region.imageOffset = {d.offsetX, d.offsetY, 0};
+		region.imageExtent = {(uint32_t)d.width, (uint32_t)d.height, 1};
+		vkCmdCopyBufferToImage(getBatchCommandBuffer(), _stagingBuffer.getBuffer(),
+			tex.image.getImage(), VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+		tex.lastBatch = _batchSerial;
+	}
+	tex.tileUpdated[d.tileId] = true;
+
+	_stats.tilesUploaded += 1;
+	_stats.bytesUploaded += d.imageSize;
+	const double latency = chrono::duration<double, milli>(
+		chrono::steady_clock::now()-d.requestTime).count();
+	_latencySum += latency;
+	int bucket = 0;
+	while (bucket < LATENCY_BUCKETS-1 && latency >= (1<<bucket)) ++bucket;
+	_stats.latencyHistogram[bucket] += 1;
+	// Released once the batch is done
+	_batchRanges.push_back(d.rangeId);
+}
+
+StreamerVK::LoadData StreamerVK::load(const LoadInfo &info)
+{
+	LoadData s{};
+	int level = info.fileLevel;
+	char *dst = (char*)_stagingBuffer.getPtr()+info.offset;
+	s.handle = info.handle;
+	s.level = info.level;
+	s.offsetX = info.offsetX;
+	s.offsetY = info.offsetY;
+	s.imageSize = info.imageSize;
+	s.offset = info.offset;
+	s.rangeId = info.rangeId;
+	s.tileId = info.tileId;
+	s.requestTime = info.requestTime;
+
+	try
+	{
+		if (info.archive)
+		{
+			const TileArchive &archive = *info.archive;
+			s.width = archive.getWidth(info.archiveTile, level);
+			s.height = archive.getHeight(info.archiveTile, level);
+			if ((int)archive.getImageSize(info.archiveTile, level) != info.imageSize)
+				throw runtime_error("Unexpected tile size");
+			archive.writeImageData(info.archiveTile, level, dst);
+			_bytesRead += archive.getStoredSize(info.archiveTile, level);
+			return s;
+		}
+
+		const DDSLoader loader(info.filename);
+		s.width = loader.getWidth(level);
+		s.height = loader.getHeight(level);
+		if ((int)loader.getImageSize(level) != info.imageSize)
+			throw runtime_error("Unexpected tile size");
+		// Straight from the file mapping to the staging buffer
+		loader.writeImageData(level, dst);
+		_bytesRead += info.imageSize;
+	}
+	catch (const runtime_error &e)
+	{
+		// Tile is skipped, its range is still released after update
+		cerr << "Can't load tile " << info.filename << " : " << e.what() << endl;
+		s.width = 0;
+		s.height = 0;
+	}
+
+	return s;
+}
+
+StreamerVK::Handle StreamerVK::genHandle()
+{
+	static Handle h=0;
+	++h;
+	if (h == 0) ++h;
+	return h;
+}
@@ -0,0 +1,467 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <memory>
+#include <deque>
+#include <array>
+#include <atomic>
+#include <chrono>
+
+#include <glm/glm.hpp>
+
+#include "vk_util.hpp"
+#include "ddsloader.hpp"
+#include "tile_archive.hpp"
+#include "ring_allocator.hpp"
+
+/**
+ * Asynchronously streams textures from file system to Vulkan images
+ *
+ * Same tile layout, priorities and loading threads as DDSStreamer. Loading
+ * threads write tiles straight to a host coherent staging buffer used as a
+ * ring, and each update() records the copies of the tiles loaded since the
+ * last one in a command buffer submitted to the transfer queue. Batches
+ * signal a timeline semaphore with their number, so staging ranges are
+ * released and textures completed by polling a single counter.
+ *
+ * Sparse textures and the residency budget of DDSStreamer aren't supported:
+ * deleted textures are freed once the GPU is done with them.
+ */
+class StreamerVK
+{
+public:
+	/// Handle for keeping track of stream textures
+	typedef uint32_t Handle;
+
+	/// Number of buckets of the tile latency histogram
+	static const int LATENCY_BUCKETS = 14;
+
+	/// Streaming counters, same as DDSStreamer::Stats
+	struct Stats
+	{
+		/// Bytes read from disk since init()
+		uint64_t bytesRead = 0;
+		/// Bytes read from disk per second, over the last second
+		double bytesReadPerSecond = 0.0;
+		/// Tiles uploaded by the last update()
+		int tilesUploaded = 0;
+		/// Bytes uploaded by the last update()
+		uint64_t bytesUploaded = 0;
+		/// Tiles waiting for a staging range
+		int waitingTiles = 0;
+		/// Tiles in the loading threads' queues
+		int queuedTiles = 0;
+		/// Loaded tiles left for the next update() by the upload cost budget
+		int deferredTiles = 0;
+		/// Tiles that didn't get a staging range in the last update()
+		int starvedTiles = 0;
+		/// Bytes of the staging buffer in use
+		size_t stagingUsed = 0;
+		/// Size in bytes of the staging buffer
+		size_t stagingSize = 0;
+		/// Upload batches not done on the GPU yet
+		int batchesInFlight = 0;
+		/// Tiles uploaded since init(), by time from request to upload:
+		/// bucket i counts latencies below 2^i ms, the last one the others
+		std::array<uint64_t, LATENCY_BUCKETS> latencyHistogram{};
+		/// Mean time from request to upload in ms
+		double meanLatency = 0.0;
+	};
+
+	StreamerVK() = default;
+	StreamerVK(const StreamerVK &) = delete;
+	StreamerVK &operator=(const StreamerVK &) = delete;
+	/**
+	 * @param ctx context of the renderer
+	 * @param framesInFlight frames the renderer records ahead of the GPU,
+	 * deleted images are kept for as many update() calls
+	 * @param asynchronous If set, textures won't be immediately complete after
+	 * createTex() returns
+	 * @param stagingSize Size in bytes of the buffer tiles are loaded to
+	 * @param maxSize maximum texture width/height to load
+	 * @param threads number of loading threads (0 picks from the hardware)
+	 */
+	void init(ContextVK &ctx, int framesInFlight, bool asynchronous,
+		size_t stagingSize, int maxSize=0, int threads=0);
+	/// Stops the loading threads and frees all Vulkan objects, once the device is idle
+	void destroy();
+	~StreamerVK();
+
+	/**
+	 * Creates a stream texture, setups streaming of its data and returns its
+	 * matching handle. If a tile archive named filename + ".rtex" exists, it is
+	 * used instead of the texture folder
+	 * @param filename filename to load the texture from
+	 * @return handle of newly created texture, 0 if it can't be streamed
+	 */
+	Handle createTex(const std::string &filename);
+	/**
+	 * Returns the view of a texture if it is usable for rendering
+	 * @param handle handle of texture
+	 * @param def default value to return if the texture does not exist or
+	 * it is incomplete
+	 * @return image view
+	 */
+	VkImageView getCompleteView(Handle handle, VkImageView def) const;
+	/**
+	 * Indicates whether a texture is usable for rendering
+	 * @param handle handle of texture
+	 */
+	bool isComplete(Handle handle) const;
+	/**
+	 * Deletes a stream texture and invalidates all transfer work on it
+	 * @param handle handle of texture to delete
+	 */
+	void deleteTex(Handle handle);
+	/**
+	 * Sets how a texture mapped on a sphere is seen, see
+	 * DDSStreamer::setImportance()
+	 * @param handle handle of texture
+	 * @param viewDir direction from sphere center to viewer, in model space
+	 * @param screenSize on-screen diameter of the sphere in pixels
+	 */
+	void setImportance(Handle handle, const glm::vec3 &viewDir, float screenSize);
+
+	/**
+	 * Submits the copies of the tiles loaded since the last call
+	 */
+	void update();
+	/**
+	 * Returns the streaming counters
+	 */
+	Stats getStats();
+	/**
+	 * Returns whether no tile is being loaded or uploaded, nor any texture
+	 * waiting to be completed or deleted
+	 */
+	bool isIdle();
+	/**
+	 * Returns a number that changes whenever images given by the streamer
+	 * may have been deleted
+	 */
+	uint64_t getGeneration() const;
+	/// Returns the timeline semaphore signaled by upload batches
+	VkSemaphore getSemaphore() const;
+	/**
+	 * Returns the number of the last batch known to be done, for the
+	 * graphics queue to wait on it before sampling completed textures
+	 */
+	uint64_t getCompletedSerial() const;
+
+private:
+	struct LoadInfo
+	{
+		/// Texture handle
+		Handle handle;
+		/// DDS file to load, opened by the loading thread
+		std::string filename;
+		/// Tile archive to load from instead of filename if set
+		std::shared_ptr<const TileArchive> archive;
+		/// Index of tile in archive
+		int archiveTile = 0;
+		/// Mip level in file to load
+		int fileLevel;
+		/// Offset in image to update
+		int offsetX;
+		/// Offset in image to update
+		int offsetY;
+		/// Mip Level of image to update
+		int level;
+		/// Size in bytes of data to update
+		int imageSize;
+		/// Unique id for this tile of this level
+		int tileId;
+		/// Offset in bytes of assigned staging range, -1 if not assigned
+		int64_t offset = -1;
+		/// Allocation id of assigned staging range
+		uint64_t rangeId = 0;
+		/// Width in pixels of the whole mip level
+		int levelWidth;
+		/// Direction of tile center on the sphere, in model space
+		glm::vec3 direction;
+		/// Angle from tile center to its corners (radians)
+		float angularRadius;
+		/// Loading order, higher first
+		float priority = 0.0;
+		/// Time the tile was requested
+		std::chrono::steady_clock::time_point requestTime;
+
+		bool operator<(const LoadInfo &info) const;
+	};
+
+	/// Tile info queue owned by a loading thread, stored as a heap
+	struct WorkerQueue
+	{
+		std::mutex mtx;
+		std::vector<LoadInfo> heap;
+	};
+
+	/// Where the data of a texture comes from
+	struct TexSource
+	{
+		/// Texture folder given to createTex()
+		std::string filename;
+		/// Archive if the texture has been packed
+		std::shared_ptr<const TileArchive> archive;
+		/// Tile width/height
+		int size = 0;
+		/// Number of levels (after clamping to max size)
+		int levels = 0;
+		std::string prefix;
+		std::string separator;
+		std::string suffix;
+		bool rowColumnOrder = false;
+		/// Format of all tiles
+		DDSLoader::Format format = DDSLoader::Format::Undefined;
+		/// Size of the full texture
+		int width = 0;
+		int height = 0;
+		int mipNumber = 0;
+	};
+
+	/// Image of a stream texture and its upload state
+	struct Texture
+	{
+		ImageVK image;
+		/// Whether each tile has been copied, empty once all of them are
+		std::vector<bool> tileUpdated;
+		/// Batch of the last command on the image
+		uint64_t lastBatch = 0;
+		/// Transitioned to be sampled, usable once lastBatch is done
+		bool ready = false;
+		/// Usable texture
+		bool complete = false;
+	};
+
+	/// Deleted image kept until the GPU is done with it
+	struct RetiredImage
+	{
+		ImageVK image;
+		/// Batch of the last command on the image
+		uint64_t lastBatch;
+		/// update() call the image was deleted in
+		uint64_t frame;
+	};
+
+	struct LoadData
+	{
+		/// Texture handle
+		Handle handle;
+		/// Mip level of image to update
+		int level;
+		/// Offset in image to update
+		int offsetX;
+		/// Offset in image to update
+		int offsetY;
+		/// Width of tile
+		int width;
+		/// Height of tile
+		int height;
+		/// Size in bytes of incoming pixel data
+		int imageSize;
+		/// Offset in bytes of staging range
+		int64_t offset;
+		/// Allocation id of staging range
+		uint64_t rangeId;
+		/// Unique id for this tile of this level
+		int tileId;
+		/// Time the tile was requested
+		std::chrono::steady_clock::time_point requestTime;
+	};
+
+	/** Returns an approximation of the time cost of a texture update
+	 * @param info loading info
+	 * @return arbitrary cost for the texture update operation */
+	int getCost(const LoadData &data);
+
+	/**
+	 * Finds the files of a texture
+	 * @param filename texture folder
+	 * @param src output source
+	 * @return false if the texture doesn't exist, is invalid or has tiles
+	 * larger than the staging buffer
+	 */
+	bool openSource(const std::string &filename, TexSource &src);
+	/// Returns the filename of a tile in a texture folder
+	static std::string getTileFilename(const TexSource &src, int level, int x, int y);
+	/// Generates tile infos of a whole texture
+	std::vector<LoadInfo> genJobs(Handle h, const TexSource &src);
+	/// Generates the tile info of a tile of levels above 0
+	LoadInfo genTileJob(Handle h, const TexSource &src, int i, int x, int y);
+	/// Queues tiles of a texture (or loads them now in synchronous mode)
+	void submitJobs(Handle h, const std::vector<LoadInfo> &jobs);
+
+	/**
+	 * Computes the loading priority of a tile from its texture importance
+	 * @param info tile info
+	 * @return priority, higher first
+	 */
+	float computePriority(const LoadInfo &info) const;
+	/**
+	 * Sets the tile position on the sphere
+	 * @param info tile info whose offset, level and level width are set
+	 * @param tileWidth width of tile in pixels
+	 */
+	void setTileBounds(LoadInfo &info, int tileWidth) const;
+
+	/// Transitions images whose tiles have all been copied to be sampled
+	void transitionUpdatedTextures();
+	/// Sets textures whose transition batch is done as complete
+	void setTexturesAsComplete();
+	/// Destroys deleted images the GPU is done with
+	void destroyRetiredImages();
+
+	/**
+	 * Assigns a staging range to a tile
+	 * @param info tile info whose offset and range id are set
+	 * @return false if the staging buffer is full
+	 */
+	bool acquireRange(LoadInfo &info);
+	/// Returns the command buffer of the batch being recorded, starting it if needed
+	VkCommandBuffer getBatchCommandBuffer();
+	/// Submits the batch being recorded to the transfer queue, if any
+	void submitBatch();
+	/**
+	 * Releases the staging ranges of batches done on the GPU
+	 * @param waitOldest wait for the oldest batch if none is done
+	 */
+	void retireBatches(bool waitOldest=false);
+	/**
+	 * Loads an image from disk
+	 * @param info input loading information
+	 * @return output loading data
+	 */
+	LoadData load(const LoadInfo &info);
+
+	/**
+	 * Loading thread main loop
+	 * @param worker index of the thread's own queue
+	 */
+	void work(int worker);
+	/**
+	 * Takes the most urgent tile of the thread's queue, or steals one from
+	 * another thread if it is empty
+	 * @param worker index of the thread's own queue
+	 * @param info output tile info
+	 * @return false if all queues are empty
+	 */
+	bool popJob(int worker, LoadInfo &info);
+
+	/**
+	 * Records the copy of a tile
+	 * @param data data that has been loaded
+	 */
+	void updateTile(const LoadData &data);
+
+	/**
+	 * Generates an unique handle
+	 * @return unique handle
+	 */
+	Handle genHandle();
+
+	ContextVK *_ctx = nullptr;
+	/** Asynchronous flag: if not set, a texture will be complete immediately when
+	 * createTex() returns.*/
+	bool _asynchronous = false;
+	/// Frames the renderer records ahead of the GPU
+	int _framesInFlight = 1;
+
+	/// Maximum width/height of textures
+	int _maxSize = 0;
+	/// Staging ranges and command buffer of a submitted batch
+	struct UploadBatch
+	{
+		/// Batch number, value of the semaphore once done
+		uint64_t serial;
+		VkCommandBuffer cmd;
+		/// Allocation ids of staging ranges
+		std::vector<uint64_t> ranges;
+	};
+
+	/// Host coherent buffer tiles are loaded to
+	BufferVK _stagingBuffer;
+	/// Suballocation of the staging buffer
+	RingAllocator _staging;
+	/// Pool of the batch command buffers, on the transfer queue family
+	VkCommandPool _pool = VK_NULL_HANDLE;
+	/// Timeline semaphore, signaled with the number of each batch
+	VkSemaphore _semaphore = VK_NULL_HANDLE;
+	/// Batches in flight, oldest first
+	std::deque<UploadBatch> _batches;
+	/// Command buffer of the batch being recorded, null if none
+	VkCommandBuffer _batchCmd = VK_NULL_HANDLE;
+	/// Staging ranges copied from since the last submitBatch()
+	std::vector<uint64_t> _batchRanges;
+	/// Number of the batch being recorded
+	uint64_t _batchSerial = 1;
+	/// Number of the last batch done on the GPU
+	uint64_t _completedSerial = 0;
+
+	/// Tile info waiting to be put in the streaming queue
+	std::vector<LoadInfo> _loadInfoWaiting;
+	/// Tile info queues in use by the loading threads
+	std::vector<std::unique_ptr<WorkerQueue>> _loadInfoQueues;
+	/// Queue the next submitted tile goes to
+	size_t _nextQueue = 0;
+	/// Number of tiles in all queues
+	int _queuedJobs = 0;
+	/// Tile data that finished loading
+	std::vector<LoadData> _loadData;
+
+	/// Map of Handle->Texture
+	std::map<Handle, Texture> _texs;
+	/// Deleted images, oldest first
+	std::deque<RetiredImage> _retired;
+	/// Number of update() calls
+	uint64_t _frame = 0;
+	/// Incremented when images are deleted
+	uint64_t _generation = 0;
+
+	/// How a texture is seen from the view
+	struct Importance
+	{
+		/// Direction from sphere center to viewer, in model space
+		glm::vec3 viewDir;
+		/// On-screen diameter of the sphere in pixels
+		float screenSize;
+	};
+	/// Importance of textures as given by setImportance(), only updated when
+	/// it changes enough to reorder tiles
+	std::map<Handle, Importance> _importance;
+	/// Cosine of the view direction change updating an importance
+	static constexpr float IMPORTANCE_COS_ANGLE = 0.996f;
+	/// Screen size ratio updating an importance
+	static constexpr float IMPORTANCE_SIZE_RATIO = 1.2f;
+	/// Whether priorities of queued tiles must be recomputed
+	bool _importanceChanged = false;
+
+	/// Textures deleted since the last update() call
+	std::vector<Handle> _texDeleted;
+
+	/// Synchronizes _queuedJobs and _killThread for idle threads
+	std::mutex _mtx;
+	/// Synchronizes output
+	std::mutex _dataMtx;
+	/// Streaming threads
+	std::vector<std::thread> _threads;
+	/// Signals threads for them to terminate themselves
+	bool _killThread = false;
+	/// Waits on tiles to load or threads to kill
+	std::condition_variable _cond;
+
+	/// Streaming counters
+	Stats _stats{};
+	/// Bytes read by the loading threads
+	std::atomic<uint64_t> _bytesRead{0};
+	/// Sum of latencies in ms of uploaded tiles
+	double _latencySum = 0.0;
+	/// Start of the current bytes per second measure
+	std::chrono::steady_clock::time_point _rateStart;
+	/// Value of _bytesRead at _rateStart
+	uint64_t _rateStartBytes = 0;
+};
@@ -0,0 +1,582 @@
+#include "vk_util.hpp"
+
+#include <stdexcept>
+#include <fstream>
+#include <cstring>
+#include <algorithm>
+
+using namespace std;
+
+void checkVK(const VkResult result, const string &what)
+{
+	if (result != VK_SUCCESS)
+		throw runtime_error("Vulkan error " + to_string(result) + " : " + what);
+}
+
+VkFormat DDSFormatToVK(DDSLoader::Format format)
+{
+	switch (format)
+	{
+		case DDSLoader::Format::BC1:       return VK_FORMAT_BC1_RGBA_UNORM_BLOCK;
+		case DDSLoader::Format::BC1_SRGB:  return VK_FORMAT_BC1_RGBA_SRGB_BLOCK;
+		case DDSLoader::Format::BC2:       return VK_FORMAT_BC2_UNORM_BLOCK;
+		case DDSLoader::Format::BC2_SRGB:  return VK_FORMAT_BC2_SRGB_BLOCK;
+		case DDSLoader::Format::BC3:       return VK_FORMAT_BC3_UNORM_BLOCK;
+		case DDSLoader::Format::BC3_SRGB:  return VK_FORMAT_BC3_SRGB_BLOCK;
+		case DDSLoader::Format::BC4:       return VK_FORMAT_BC4_UNORM_BLOCK;
+		case DDSLoader::Format::BC4_SIGNED:return VK_FORMAT_BC4_SNORM_BLOCK;
+		case DDSLoader::Format::BC5:       return VK_FORMAT_BC5_UNORM_BLOCK;
+		case DDSLoader::Format::BC5_SIGNED:return VK_FORMAT_BC5_SNORM_BLOCK;
+		case DDSLoader::Format::BC6:       return VK_FORMAT_BC6H_UFLOAT_BLOCK;
+		case DDSLoader::Format::BC6_SIGNED:return VK_FORMAT_BC6H_SFLOAT_BLOCK;
+		case DDSLoader::Format::BC7:       return VK_FORMAT_BC7_UNORM_BLOCK;
+		case DDSLoader::Format::BC7_SRGB:  return VK_FORMAT_BC7_SRGB_BLOCK;
+		default: return VK_FORMAT_UNDEFINED;
+	}
+}
+
+uint32_t mipLevelsVK(uint32_t size)
+{
+	uint32_t levels = 1;
+	while (size > 1)
+	{
+		size /= 2;
+		++levels;
+	}
+	return levels;
+}
+
+uint32_t ContextVK::findMemoryType(const uint32_t typeBits,
+	const VkMemoryPropertyFlags flags) const
+{
+	for (uint32_t i=0;i<memoryProperties.memoryTypeCount;++i)
+	{
+		if ((typeBits & (1u<<i)) &&
+			(memoryProperties.memoryTypes[i].propertyFlags & flags) == flags)
+			return i;
+	}
+	throw runtime_error("No Vulkan memory type with properties " + to_string(flags));
+}
+
+void ContextVK::submitNow(const function<void(VkCommandBuffer)> &record)
+{
+	if (!uploadPool)
+	{
+		VkCommandPoolCreateInfo poolInfo{};
+		poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+		poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+		poolInfo.queueFamilyIndex = graphicsFamily;
+		checkVK(vkCreateCommandPool(device, &poolInfo, nullptr, &uploadPool),
+			"upload command pool creation");
+	}
+
+	VkCommandBufferAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+	allocInfo.commandPool = uploadPool;
+	allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+	allocInfo.commandBufferCount = 1;
+	VkCommandBuffer cmd;
+	checkVK(vkAllocateCommandBuffers(device, &allocInfo, &cmd),
+		"upload command buffer allocation");
+
+	VkCommandBufferBeginInfo beginInfo{};
+	beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	vkBeginCommandBuffer(cmd, &beginInfo);
+	record(cmd);
+	vkEndCommandBuffer(cmd);
+
+	VkSubmitInfo submit{};
+	submit.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+	submit.commandBufferCount = 1;
+	submit.pCommandBuffers = &cmd;
+	checkVK(vkQueueSubmit(graphicsQueue, 1, &submit, VK_NULL_HANDLE), "upload submit");
+	vkQueueWaitIdle(graphicsQueue);
+	vkFreeCommandBuffers(device, uploadPool, 1, &cmd);
+}
+
+void ContextVK::destroy()
+{
+	if (device)
+	{
+		if (uploadPool) vkDestroyCommandPool(device, uploadPool, nullptr);
+		vkDestroyDevice(device, nullptr);
+	}
+	if (instance) vkDestroyInstance(instance, nullptr);
+	uploadPool = VK_NULL_HANDLE;
+	device = VK_NULL_HANDLE;
+	instance = VK_NULL_HANDLE;
+}
+
+BufferVK::BufferVK(ContextVK &ctx, const VkDeviceSize size,
+	const VkBufferUsageFlags usage, const VkMemoryPropertyFlags memory) :
+	_ctx{&ctx},
+	_size{size}
+{
+	VkBufferCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	info.size = std::max<VkDeviceSize>(size, 1);
+	// Device local buffers are written through a staging buffer
+	info.usage = usage|((memory & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)?
+		0:VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+	info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	checkVK(vkCreateBuffer(ctx.device, &info, nullptr, &_buffer), "buffer creation");
+
+	VkMemoryRequirements requirements;
+	vkGetBufferMemoryRequirements(ctx.device, _buffer, &requirements);
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = requirements.size;
+	allocInfo.memoryTypeIndex = ctx.findMemoryType(requirements.memoryTypeBits, memory);
+	checkVK(vkAllocateMemory(ctx.device, &allocInfo, nullptr, &_memory),
+		"buffer memory allocation");
+	vkBindBufferMemory(ctx.device, _buffer, _memory, 0);
+
+	if (memory & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		void *ptr = nullptr;
+		checkVK(vkMapMemory(ctx.device, _memory, 0, VK_WHOLE_SIZE, 0, &ptr),
+			"buffer mapping");
+		_ptr = (uint8_t*)ptr;
+	}
+}
+
+BufferVK::BufferVK(BufferVK &&buffer) :
+	_ctx{buffer._ctx},
+	_buffer{buffer._buffer},
+	_memory{buffer._memory},
+	_size{buffer._size},
+	_ptr{buffer._ptr}
+{
+	buffer._buffer = VK_NULL_HANDLE;
+	buffer._memory = VK_NULL_HANDLE;
+	buffer._ptr = nullptr;
+}
+
+BufferVK &BufferVK::operator=(BufferVK &&buffer)
+{
+	if (this == &buffer) return *this;
+	release();
+	_ctx = buffer._ctx;
+	_buffer = buffer._buffer;
+	_memory = buffer._memory;
+	_size = buffer._size;
+	_ptr = buffer._ptr;
+	buffer._buffer = VK_NULL_HANDLE;
+	buffer._memory = VK_NULL_HANDLE;
+	buffer._ptr = nullptr;
+	return *this;
+}
+
+BufferVK::~BufferVK()
+{
+	release();
+}
+
+void BufferVK::release()
+{
+	if (_buffer) vkDestroyBuffer(_ctx->device, _buffer, nullptr);
+	if (_memory) vkFreeMemory(_ctx->device, _memory, nullptr);
+	_buffer = VK_NULL_HANDLE;
+	_memory = VK_NULL_HANDLE;
+	_ptr = nullptr;
+}
+
+VkBuffer BufferVK::getBuffer() const
+{
+	return _buffer;
+}
+
+VkDeviceSize BufferVK::getSize() const
+{
+	return _size;
+}
+
+uint8_t *BufferVK::getPtr() const
+{
+	return _ptr;
+}
+
+void BufferVK::write(const VkDeviceSize offset, const VkDeviceSize size,
+	const void *data)
+{
+	if (size == 0) return;
+	if (_ptr)
+	{
+		memcpy(_ptr+offset, data, size);
+		return;
+	}
+	BufferVK staging(*_ctx, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	memcpy(staging.getPtr(), data, size);
+	_ctx->submitNow([&](VkCommandBuffer cmd){
+		VkBufferCopy region{0, offset, size};
+		vkCmdCopyBuffer(cmd, staging.getBuffer(), _buffer, 1, &region);
+	});
+}
+
+ImageVK::ImageVK(ContextVK &ctx, const Info &info) :
+	_ctx{&ctx},
+	_info(info)
+{
+	const bool oneDimension = (info.viewType == VK_IMAGE_VIEW_TYPE_1D);
+	const uint32_t families[] = {ctx.graphicsFamily, ctx.transferFamily};
+	VkImageCreateInfo imageInfo{};
+	imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+	imageInfo.imageType = oneDimension?VK_IMAGE_TYPE_1D:VK_IMAGE_TYPE_2D;
+	imageInfo.format = info.format;
+	imageInfo.extent = {info.width, oneDimension?1:info.height, 1};
+	imageInfo.mipLevels = info.levels;
+	imageInfo.arrayLayers = 1;
+	imageInfo.samples = info.samples;
+	imageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+	imageInfo.usage = info.usage;
+	imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	// Streamed textures are written by the transfer queue and sampled by
+	// the graphics queue, without ownership transfers
+	if (info.shared && ctx.transferFamily != ctx.graphicsFamily)
+	{
+		imageInfo.sharingMode = VK_SHARING_MODE_CONCURRENT;
+		imageInfo.queueFamilyIndexCount = 2;
+		imageInfo.pQueueFamilyIndices = families;
+	}
+	else
+	{
+		imageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	}
+	checkVK(vkCreateImage(ctx.device, &imageInfo, nullptr, &_image), "image creation");
+
+	VkMemoryRequirements requirements;
+	vkGetImageMemoryRequirements(ctx.device, _image, &requirements);
+	VkMemoryAllocateInfo allocInfo{};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = requirements.size;
+	allocInfo.memoryTypeIndex = ctx.findMemoryType(requirements.memoryTypeBits,
+		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+	checkVK(vkAllocateMemory(ctx.device, &allocInfo, nullptr, &_memory),
+		"image memory allocation");
+	vkBindImageMemory(ctx.device, _image, _memory, 0);
+
+	VkImageViewCreateInfo viewInfo{};
+	viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+	viewInfo.image = _image;
+	viewInfo.viewType = info.viewType;
+	viewInfo.format = info.format;
+	viewInfo.subresourceRange = {info.aspect, 0, info.levels, 0, 1};
+	checkVK(vkCreateImageView(ctx.device, &viewInfo, nullptr, &_view),
+		"image view creation");
+}
+
+ImageVK::ImageVK(ImageVK &&image) :
+	_ctx{image._ctx},
+	_info(image._info),
+	_image{image._image},
+	_memory{image._memory},
+	_view{image._view}
+{
+	image._image = VK_NULL_HANDLE;
+	image._memory = VK_NULL_HANDLE;
+	image._view = VK_NULL_HANDLE;
+}
+
+ImageVK &ImageVK::operator=(ImageVK &&image)
+{
+	if (this == &image) return *this;
+	release();
+	_ctx = image._ctx;
+	_info = image._info;
+	_image = image._image;
+	_memory = image._memory;
+	_view = image._view;
+	image._image = VK_NULL_HANDLE;
+	image._memory = VK_NULL_HANDLE;
+	image._view = VK_NULL_HANDLE;
+	return *this;
+}
+
+ImageVK::~ImageVK()
+{
+	release();
+}
+
+void ImageVK::release()
+{
+	if (_view) vkDestroyImageView(_ctx->device, _view, nullptr);
+	if (_image) vkDestroyImage(_ctx->device, _image, nullptr);
+	if (_memory) vkFreeMemory(_ctx->device, _memory, nullptr);
+	_view = VK_NULL_HANDLE;
+	_image = VK_NULL_HANDLE;
+	_memory = VK_NULL_HANDLE;
+}
+
+VkImage ImageVK::getImage() const
+{
+	return _image;
+}
+
+VkImageView ImageVK::getView() const
+{
+	return _view;
+}
+
+const ImageVK::Info &ImageVK::getInfo() const
+{
+	return _info;
+}
+
+void ImageVK::upload(const void *data, const VkDeviceSize size,
+	const bool generateMips, const vector<VkDeviceSize> &levelSizes)
+{
+	BufferVK staging(*_ctx, size, VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+		VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT|VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+	memcpy(staging.getPtr(), data, size);
+
+	// Blits are only filtered if the format allows it
+	VkFormatProperties formatProperties;
+	vkGetPhysicalDeviceFormatProperties(_ctx->physicalDevice, _info.format,
+		&formatProperties);
+	const VkFilter filter = (formatProperties.optimalTilingFeatures &
+		VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT)?
+		VK_FILTER_LINEAR:VK_FILTER_NEAREST;
+
+	const bool oneDimension = (_info.viewType == VK_IMAGE_VIEW_TYPE_1D);
+	auto levelExtent = [&](const uint32_t level){
+		return VkExtent3D{std::max(1u, _info.width>>level),
+			oneDimension?1:std::max(1u, _info.height>>level), 1};
+	};
+
+	_ctx->submitNow([&](VkCommandBuffer cmd){
+		imageBarrierVK(cmd, _image, _info.aspect,
+			VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+			VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, 0,
+			VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT);
+
+		const uint32_t copiedLevels = generateMips?1:_info.levels;
+		VkDeviceSize offset = 0;
+		for (uint32_t level=0;level<copiedLevels;++level)
+		{
+			VkBufferImageCopy region{};
+			region.bufferOffset = offset;
+			region.imageSubresource = {_info.aspect, level, 0, 1};
+			region.imageExtent = levelExtent(level);
+			vkCmdCopyBufferToImage(cmd, staging.getBuffer(), _image,
+				VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &region);
+			if (!generateMips) offset += levelSizes.at(level);
+		}
+
+		for (uint32_t level=1;generateMips && level<_info.levels;++level)
+		{
+			// Previous level written, read by the blit
+			VkImageMemoryBarrier barrier{};
+			barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+			barrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+			barrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = _image;
+			barrier.subresourceRange = {_info.aspect, level-1, 1, 0, 1};
+			vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+				VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 1, &barrier);
+
+			const VkExtent3D src = levelExtent(level-1);
+			const VkExtent3D dst = levelExtent(level);
+			VkImageBlit blit{};
+			blit.srcSubresource = {_info.aspect, level-1, 0, 1};
+			blit.srcOffsets[1] = {(int32_t)src.width, (int32_t)src.height, 1};
+			blit.dstSubresource = {_info.aspect, level, 0, 1};
+			blit.dstOffsets[1] = {(int32_t)dst.width, (int32_t)dst.height, 1};
+			vkCmdBlitImage(cmd,
+				_image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+				_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+				1, &blit, filter);
+		}
+
+		// Levels blitted from are in TRANSFER_SRC, the last one in TRANSFER_DST
+		VkImageMemoryBarrier barriers[2]{};
+		for (VkImageMemoryBarrier &barrier : barriers)
+		{
+			barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+			barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+			barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+			barrier.newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+			barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+			barrier.image = _image;
+		}
+		const uint32_t lastLevel = generateMips?_info.levels-1:0;
+		barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+		barriers[0].subresourceRange = {_info.aspect, lastLevel,
+			generateMips?1:_info.levels, 0, 1};
+		barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+		barriers[1].subresourceRange = {_info.aspect, 0, lastLevel, 0, 1};
+		vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT,
+			VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, 0, 0, nullptr, 0, nullptr,
+			(lastLevel > 0)?2:1, barriers);
+	});
+}
+
+void imageBarrierVK(VkCommandBuffer cmd, VkImage image, const VkImageAspectFlags aspect,
+	const VkImageLayout oldLayout, const VkImageLayout newLayout,
+	const VkPipelineStageFlags srcStage, const VkAccessFlags srcAccess,
+	const VkPipelineStageFlags dstStage, const VkAccessFlags dstAccess)
+{
+	VkImageMemoryBarrier barrier{};
+	barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barrier.srcAccessMask = srcAccess;
+	barrier.dstAccessMask = dstAccess;
+	barrier.oldLayout = oldLayout;
+	barrier.newLayout = newLayout;
+	barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barrier.image = image;
+	barrier.subresourceRange = {aspect, 0, VK_REMAINING_MIP_LEVELS, 0, 1};
+	vkCmdPipelineBarrier(cmd, srcStage, dstStage, 0,
+		0, nullptr, 0, nullptr, 1, &barrier);
+}
+
+VkShaderModule loadShaderModuleVK(VkDevice device, const string &filename)
+{
+	ifstream file(filename.c_str(), ios::binary|ios::ate);
+	if (!file)
+		throw runtime_error("Can't open SPIR-V shader " + filename);
+	const size_t size = file.tellg();
+	if (size == 0 || size%4 != 0)
+		throw runtime_error("Invalid SPIR-V shader " + filename);
+	vector<uint32_t> code(size/4);
+	file.seekg(0);
+	file.read((char*)code.data(), size);
+
+	VkShaderModuleCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+	info.codeSize = size;
+	info.pCode = code.data();
+	VkShaderModule module;
+	checkVK(vkCreateShaderModule(device, &info, nullptr, &module),
+		"shader module creation of " + filename);
+	return module;
+}
+
+VkPipeline createPipelineVK(VkDevice device, const PipelineStateVK &state,
+	VkPipelineLayout layout, VkRenderPass renderPass)
+{
+	vector<VkPipelineShaderStageCreateInfo> stages;
+	for (const auto &shader : state.shaders)
+	{
+		VkPipelineShaderStageCreateInfo stage{};
+		stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+		stage.stage = shader.first;
+		stage.module = loadShaderModuleVK(device, shader.second);
+		stage.pName = "main";
+		stages.push_back(stage);
+	}
+
+	VkPipelineVertexInputStateCreateInfo vertexInput{};
+	vertexInput.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+	vertexInput.vertexBindingDescriptionCount = state.bindings.size();
+	vertexInput.pVertexBindingDescriptions = state.bindings.data();
+	vertexInput.vertexAttributeDescriptionCount = state.attributes.size();
+	vertexInput.pVertexAttributeDescriptions = state.attributes.data();
+
+	VkPipelineInputAssemblyStateCreateInfo inputAssembly{};
+	inputAssembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+	inputAssembly.topology = state.topology;
+
+	VkPipelineTessellationStateCreateInfo tessellation{};
+	tessellation.sType = VK_STRUCTURE_TYPE_PIPELINE_TESSELLATION_STATE_CREATE_INFO;
+	tessellation.patchControlPoints = state.patchControlPoints;
+
+	VkPipelineViewportStateCreateInfo viewport{};
+	viewport.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+	viewport.viewportCount = 1;
+	viewport.scissorCount = 1;
+
+	// Viewports are flipped to keep the GL orientation
+	VkPipelineRasterizationStateCreateInfo rasterization{};
+	rasterization.sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+	rasterization.polygonMode = state.polygonMode;
+	rasterization.cullMode = state.cullMode;
+	rasterization.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	rasterization.lineWidth = 1.f;
+
+	VkPipelineMultisampleStateCreateInfo multisample{};
+	multisample.sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+	multisample.rasterizationSamples = state.samples;
+
+	VkPipelineDepthStencilStateCreateInfo depthStencil{};
+	depthStencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+	depthStencil.depthTestEnable = state.depthTest;
+	depthStencil.depthWriteEnable = state.depthWrite;
+	depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
+
+	VkPipelineColorBlendAttachmentState blendAttachment{};
+	blendAttachment.blendEnable = state.blend;
+	blendAttachment.srcColorBlendFactor = state.srcFactor;
+	blendAttachment.dstColorBlendFactor = state.dstFactor;
+	blendAttachment.colorBlendOp = VK_BLEND_OP_ADD;
+	blendAttachment.srcAlphaBlendFactor = state.srcFactor;
+	blendAttachment.dstAlphaBlendFactor = state.dstFactor;
+	blendAttachment.alphaBlendOp = VK_BLEND_OP_ADD;
+	blendAttachment.colorWriteMask = VK_COLOR_COMPONENT_R_BIT|
+		VK_COLOR_COMPONENT_G_BIT|VK_COLOR_COMPONENT_B_BIT|VK_COLOR_COMPONENT_A_BIT;
+	VkPipelineColorBlendStateCreateInfo colorBlend{};
+	colorBlend.sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+	colorBlend.attachmentCount = 1;
+	colorBlend.pAttachments = &blendAttachment;
+
+	const VkDynamicState dynamicStates[] = {
+		VK_DYNAMIC_STATE_VIEWPORT, VK_DYNAMIC_STATE_SCISSOR};
+	VkPipelineDynamicStateCreateInfo dynamic{};
+	dynamic.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+	dynamic.dynamicStateCount = 2;
+	dynamic.pDynamicStates = dynamicStates;
+
+	VkGraphicsPipelineCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+	info.stageCount = stages.size();
+	info.pStages = stages.data();
+	info.pVertexInputState = &vertexInput;
+	info.pInputAssemblyState = &inputAssembly;
+	info.pTessellationState = state.patchControlPoints?&tessellation:nullptr;
+	info.pViewportState = &viewport;
+	info.pRasterizationState = &rasterization;
+	info.pMultisampleState = &multisample;
+	info.pDepthStencilState = &depthStencil;
+	info.pColorBlendState = &colorBlend;
+	info.pDynamicState = &dynamic;
+	info.layout = layout;
+	info.renderPass = renderPass;
+	info.subpass = 0;
+	VkPipeline pipeline;
+	const VkResult result = vkCreateGraphicsPipelines(device, VK_NULL_HANDLE,
+		1, &info, nullptr, &pipeline);
+	for (const auto &stage : stages)
+		vkDestroyShaderModule(device, stage.module, nullptr);
+	checkVK(result, "pipeline creation with " + state.shaders.front().second);
+	return pipeline;
+}
+
+VkSampler createSamplerVK(const ContextVK &ctx, const bool mipmaps,
+	const VkSamplerAddressMode addressU, const VkSamplerAddressMode addressV,
+	const float anisotropy)
+{
+	VkSamplerCreateInfo info{};
+	info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	info.magFilter = VK_FILTER_LINEAR;
+	info.minFilter = VK_FILTER_LINEAR;
+	info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+	info.addressModeU = addressU;
+	info.addressModeV = addressV;
+	info.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+	info.maxLod = mipmaps?VK_LOD_CLAMP_NONE:0.f;
+	if (anisotropy > 0 && ctx.features.samplerAnisotropy)
+	{
+		info.anisotropyEnable = VK_TRUE;
+		info.maxAnisotropy = std::min(anisotropy,
+			ctx.properties.limits.maxSamplerAnisotropy);
+	}
+	VkSampler sampler;
+	checkVK(vkCreateSampler(ctx.device, &info, nullptr, &sampler), "sampler creation");
+	return sampler;
+}
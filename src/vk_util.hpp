@@ -0,0 +1,248 @@
+#pragma once
+
+#include <vulkan/vulkan.h>
+
+#include <vector>
+#include <string>
+#include <functional>
+#include <cstdint>
+
+#include "ddsloader.hpp"
+
+/**
+ * Throws a runtime_error if a Vulkan call failed
+ * @param result result of the call
+ * @param what description of the call, for the error message
+ */
+void checkVK(VkResult result, const std::string &what);
+
+/**
+ * Transforms a DDSLoader::Format to the corresponding Vulkan format
+ * @param format DDSLoader format
+ * @return Vulkan format
+ */
+VkFormat DDSFormatToVK(DDSLoader::Format format);
+
+/** Computes the number of mips of a complete chain, same as mipmapCount()
+ * @param size largest dimension of texture
+ * @returns number of mips
+ */
+uint32_t mipLevelsVK(uint32_t size);
+
+/**
+ * Device and queues shared by the objects of the Vulkan renderer, created
+ * and destroyed by it
+ */
+struct ContextVK
+{
+	VkInstance instance = VK_NULL_HANDLE;
+	VkPhysicalDevice physicalDevice = VK_NULL_HANDLE;
+	VkDevice device = VK_NULL_HANDLE;
+	VkPhysicalDeviceProperties properties{};
+	/// Features enabled on the device
+	VkPhysicalDeviceFeatures features{};
+	VkPhysicalDeviceMemoryProperties memoryProperties{};
+	/// Queue family of graphicsQueue, also used for compute and present
+	uint32_t graphicsFamily = 0;
+	VkQueue graphicsQueue = VK_NULL_HANDLE;
+	/// Queue family of transferQueue, graphicsFamily without a dedicated one
+	uint32_t transferFamily = 0;
+	/// Queue texture tiles are uploaded on
+	VkQueue transferQueue = VK_NULL_HANDLE;
+	/// Whether VK_EXT_calibrated_timestamps is enabled
+	bool calibratedTimestamps = false;
+	/// Pool of the command buffers of submitNow()
+	VkCommandPool uploadPool = VK_NULL_HANDLE;
+
+	/**
+	 * Returns the index of a memory type
+	 * @param typeBits memory types allowed by the resource
+	 * @param flags properties the memory type must have
+	 * @return memory type index, throws if none fits
+	 */
+	uint32_t findMemoryType(uint32_t typeBits, VkMemoryPropertyFlags flags) const;
+	/**
+	 * Records commands in a one time command buffer, submits it to the
+	 * graphics queue and waits for it to be done (only for initialization)
+	 * @param record function recording the commands
+	 */
+	void submitNow(const std::function<void(VkCommandBuffer)> &record);
+	/// Destroys the device and instance, once all other objects are
+	void destroy();
+};
+
+/**
+ * Buffer with its own memory, persistently mapped if host visible
+ */
+class BufferVK
+{
+public:
+	BufferVK() = default;
+	/**
+	 * @param ctx context the buffer is created with
+	 * @param size size in bytes
+	 * @param usage Vulkan buffer usage
+	 * @param memory memory properties, host visible ones are mapped
+	 */
+	BufferVK(ContextVK &ctx, VkDeviceSize size, VkBufferUsageFlags usage,
+		VkMemoryPropertyFlags memory);
+	BufferVK(const BufferVK &) = delete;
+	BufferVK &operator=(const BufferVK &) = delete;
+	BufferVK(BufferVK &&buffer);
+	BufferVK &operator=(BufferVK &&buffer);
+	~BufferVK();
+
+	VkBuffer getBuffer() const;
+	VkDeviceSize getSize() const;
+	/// Returns the persistent mapping, nullptr if not host visible
+	uint8_t *getPtr() const;
+	/**
+	 * Writes data to the buffer, through a staging buffer if it isn't host
+	 * visible (waits for the copy)
+	 * @param offset offset in bytes in the buffer
+	 * @param size size in bytes of data
+	 * @param data data to write
+	 */
+	void write(VkDeviceSize offset, VkDeviceSize size, const void *data);
+
+private:
+	void release();
+
+	ContextVK *_ctx = nullptr;
+	VkBuffer _buffer = VK_NULL_HANDLE;
+	VkDeviceMemory _memory = VK_NULL_HANDLE;
+	VkDeviceSize _size = 0;
+	uint8_t *_ptr = nullptr;
+};
+
+/**
+ * Image with its own memory and a view of all its levels
+ */
+class ImageVK
+{
+public:
+	struct Info
+	{
+		VkImageViewType viewType = VK_IMAGE_VIEW_TYPE_2D;
+		VkFormat format = VK_FORMAT_R8G8B8A8_UNORM;
+		uint32_t width = 1;
+		uint32_t height = 1;
+		uint32_t levels = 1;
+		VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+		VkImageUsageFlags usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+		VkImageAspectFlags aspect = VK_IMAGE_ASPECT_COLOR_BIT;
+		/// Accessed by both the graphics and the transfer queue families
+		bool shared = false;
+	};
+
+	ImageVK() = default;
+	/**
+	 * @param ctx context the image is created with
+	 * @param info image parameters
+	 */
+	ImageVK(ContextVK &ctx, const Info &info);
+	ImageVK(const ImageVK &) = delete;
+	ImageVK &operator=(const ImageVK &) = delete;
+	ImageVK(ImageVK &&image);
+	ImageVK &operator=(ImageVK &&image);
+	~ImageVK();
+
+	VkImage getImage() const;
+	VkImageView getView() const;
+	const Info &getInfo() const;
+	/**
+	 * Uploads the texels of the first level and leaves the image ready to be
+	 * sampled, waiting for the upload (only for initialization)
+	 * @param data tightly packed texels of level 0, or all levels if not
+	 * generateMips
+	 * @param size size in bytes of data
+	 * @param generateMips whether the other levels are blitted from level 0
+	 * @param levelSizes size in bytes of each level when not generateMips
+	 */
+	void upload(const void *data, VkDeviceSize size, bool generateMips,
+		const std::vector<VkDeviceSize> &levelSizes={});
+
+private:
+	void release();
+
+	ContextVK *_ctx = nullptr;
+	Info _info{};
+	VkImage _image = VK_NULL_HANDLE;
+	VkDeviceMemory _memory = VK_NULL_HANDLE;
+	VkImageView _view = VK_NULL_HANDLE;
+};
+
+/**
+ * Records an image layout transition of all levels
+ * @param cmd command buffer
+ * @param image image to transition
+ * @param aspect aspect of the image
+ * @param oldLayout current layout (UNDEFINED discards the contents)
+ * @param newLayout layout after the barrier
+ * @param srcStage stages of the accesses before
+ * @param srcAccess accesses before
+ * @param dstStage stages of the accesses after
+ * @param dstAccess accesses after
+ */
+void imageBarrierVK(VkCommandBuffer cmd, VkImage image, VkImageAspectFlags aspect,
+	VkImageLayout oldLayout, VkImageLayout newLayout,
+	VkPipelineStageFlags srcStage, VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage, VkAccessFlags dstAccess);
+
+/**
+ * Loads a SPIR-V module compiled by cmake/CompileSPIRV.cmake
+ * @param device device to create the module on
+ * @param filename .spv file
+ * @return shader module
+ */
+VkShaderModule loadShaderModuleVK(VkDevice device, const std::string &filename);
+
+/**
+ * Fixed function state and shaders of a graphics pipeline, viewport and
+ * scissor being dynamic
+ */
+struct PipelineStateVK
+{
+	/// Stages and SPIR-V files
+	std::vector<std::pair<VkShaderStageFlagBits, std::string>> shaders;
+	std::vector<VkVertexInputBindingDescription> bindings;
+	std::vector<VkVertexInputAttributeDescription> attributes;
+	VkPrimitiveTopology topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	/// Control points of patches, with tessellation shaders
+	uint32_t patchControlPoints = 0;
+	VkPolygonMode polygonMode = VK_POLYGON_MODE_FILL;
+	VkCullModeFlags cullMode = VK_CULL_MODE_NONE;
+	VkSampleCountFlagBits samples = VK_SAMPLE_COUNT_1_BIT;
+	bool depthTest = false;
+	bool depthWrite = false;
+	/// Whether the color attachment is blended with srcFactor and dstFactor
+	bool blend = false;
+	VkBlendFactor srcFactor = VK_BLEND_FACTOR_ONE;
+	VkBlendFactor dstFactor = VK_BLEND_FACTOR_ZERO;
+};
+
+/**
+ * Creates a graphics pipeline, for the first subpass of a render pass with a
+ * single color attachment
+ * @param device device to create the pipeline on
+ * @param state pipeline state
+ * @param layout pipeline layout
+ * @param renderPass compatible render pass
+ * @return graphics pipeline
+ */
+VkPipeline createPipelineVK(VkDevice device, const PipelineStateVK &state,
+	VkPipelineLayout layout, VkRenderPass renderPass);
+
+/**
+ * Creates a sampler, clamped to edge unless addressed otherwise
+ * @param ctx context, anisotropy is ignored if not enabled
+ * @param mipmaps whether levels are linearly interpolated, or only level 0 sampled
+ * @param addressU address mode of u
+ * @param addressV address mode of v
+ * @param anisotropy max anisotropy, 0 to disable it
+ * @return sampler
+ */
+VkSampler createSamplerVK(const ContextVK &ctx, bool mipmaps,
+	VkSamplerAddressMode addressU=VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+	VkSamplerAddressMode addressV=VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+	float anisotropy=0.f);